@@ -0,0 +1,125 @@
+﻿/**
+ * @file load_generator.cpp
+ * @brief 推論サーバーの負荷生成クライアント
+ *
+ * 使い方: BitNetLoadGen [--socket PATH] [--connections N] [--requests N] [--inflight N] [--seed SEED]
+ * 接続ごとに--requests件のランダムな入力を，応答待ちが--inflight件を超えないように送り続け，
+ * クライアント側で測った往復レイテンシの分布とスループットを表示する。
+ */
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../src/inference/inference_client.h"
+#include "../src/util/latency_histogram.h"
+
+namespace
+{
+	using namespace bitnet;
+	using Clock = std::chrono::steady_clock;
+
+	void RunConnection(const std::string &socketPath, int numRequests, int inflight, unsigned int seed, LatencyHistogram *latency)
+	{
+		InferenceClient client(socketPath);
+		std::mt19937 rng(seed);
+		std::vector<BitBlock> inputs((size_t)numRequests * client.InputBlocks(), 0);
+		for (int r = 0; r < numRequests; r++)
+		{
+			for (int i = 0; i < client.InputBits(); i++)
+			{
+				inputs[(size_t)r * client.InputBlocks() + GetBlockIndex(i)] |= (BitBlock)(rng() & 1) << GetBitIndexInBlock(i);
+			}
+		}
+
+		std::vector<Clock::time_point> sentAt(numRequests);
+		std::mutex mutex;
+		std::condition_variable slotFree;
+		int outstanding = 0;
+
+		std::thread receiver([&]
+							 {
+								 std::vector<char> output((size_t)client.OutputDim() * client.OutputBytes());
+								 uint64_t id;
+								 for (int r = 0; r < numRequests && client.Receive(&id, output.data()); r++)
+								 {
+									 latency->Record(Clock::now() - sentAt[id]);
+									 std::lock_guard<std::mutex> lock(mutex);
+									 --outstanding;
+									 slotFree.notify_one();
+								 } });
+
+		for (int r = 0; r < numRequests; r++)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				slotFree.wait(lock, [&]
+							  { return outstanding < inflight; });
+				++outstanding;
+			}
+			sentAt[r] = Clock::now();
+			if (!client.Send(r, &inputs[(size_t)r * client.InputBlocks()]))
+			{
+				break;
+			}
+		}
+		client.CloseSend();
+		receiver.join();
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::string socketPath = "/tmp/bitnet.sock";
+	int numConnections = 4;
+	int numRequests = 100000;
+	int inflight = 8;
+	int seed = 1;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		const std::string key = argv[i];
+		const int value = (key == "--socket") ? 0 : std::stoi(argv[i + 1]);
+		if (key == "--socket")
+			socketPath = argv[i + 1];
+		else if (key == "--connections")
+			numConnections = value;
+		else if (key == "--requests")
+			numRequests = value;
+		else if (key == "--inflight")
+			inflight = value;
+		else if (key == "--seed")
+			seed = value;
+		else
+		{
+			std::cerr << "unknown option: " << key << std::endl;
+			return 1;
+		}
+	}
+
+	std::vector<std::unique_ptr<LatencyHistogram>> latencies;
+	std::vector<std::thread> connections;
+	const Clock::time_point start = Clock::now();
+	for (int c = 0; c < numConnections; c++)
+	{
+		latencies.emplace_back(new LatencyHistogram());
+		connections.emplace_back(RunConnection, socketPath, numRequests, inflight, seed + c, latencies.back().get());
+	}
+	for (auto &connection : connections)
+	{
+		connection.join();
+	}
+	const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+	LatencyHistogram total;
+	for (auto &latency : latencies)
+	{
+		total.Merge(*latency);
+	}
+	std::cout << "requests=" << total.Count() << " throughput=" << total.Count() / seconds << "/s" << std::endl;
+	std::cout << "latency " << total.Summary() << std::endl;
+	return 0;
+}
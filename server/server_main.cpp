@@ -0,0 +1,112 @@
+﻿/**
+ * @file server_main.cpp
+ * @brief BitNetworkの動的バッチング推論サーバー
+ *
+ * 使い方: BitNetServer [--socket PATH] [--model FILE] [--max-batch N] [--max-delay-us US]
+ *                      [--workers N] [--report-sec SEC] [--seed SEED] [--cache-entries N]
+ * --modelを省略した場合はseedで初期化した重みを使う。SIGINT/SIGTERMで終了し，レイテンシの分布を表示する。
+ * --cache-entriesを指定すると同一入力の推論結果をキャッシュする。
+ */
+#include <csignal>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include "../src/inference/batching_server.h"
+#include "../src/train.h"
+#include "../src/util/random_util.h"
+
+int main(int argc, char **argv)
+{
+	using namespace bitnet;
+
+	BatchingConfig config;
+	config.socketPath = "/tmp/bitnet.sock";
+	std::string modelPath;
+	int reportSec = 0;
+	int seed = 42;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		const std::string key = argv[i];
+		const std::string value = argv[i + 1];
+		if (key == "--socket")
+			config.socketPath = value;
+		else if (key == "--model")
+			modelPath = value;
+		else if (key == "--max-batch")
+			config.maxBatch = std::stoi(value);
+		else if (key == "--max-delay-us")
+			config.maxDelay = std::chrono::microseconds(std::stoi(value));
+		else if (key == "--workers")
+			config.numWorkers = std::stoi(value);
+		else if (key == "--report-sec")
+			reportSec = std::stoi(value);
+		else if (key == "--seed")
+			seed = std::stoi(value);
+		else if (key == "--cache-entries")
+			config.cacheEntries = std::stoull(value);
+		else
+		{
+			std::cerr << "unknown option: " << key << std::endl;
+			return 1;
+		}
+	}
+
+	// 終了シグナルはメインスレッドで待つ（以降に作るスレッドにもマスクが引き継がれる）
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+	std::unique_ptr<BitNetwork> net(new BitNetwork());
+	net->Init();
+	if (modelPath.empty())
+	{
+		Random::Seed(seed);
+		net->ResetWeight();
+	}
+	else
+	{
+		std::ifstream ifs(modelPath, std::ios::binary);
+		if (!ifs)
+		{
+			std::cerr << "failed to open model: " << modelPath << std::endl;
+			return 1;
+		}
+		net->Load(ifs);
+	}
+
+	BatchingServer<BitNetwork> server(*net, config);
+	server.Start();
+	std::cout << "listening on " << config.socketPath
+			  << " (max-batch=" << config.maxBatch << ", max-delay=" << config.maxDelay.count()
+			  << "us, workers=" << config.numWorkers << ", kernels=" << Kernels().name << ")" << std::endl;
+
+	while (true)
+	{
+		if (reportSec <= 0)
+		{
+			int sig;
+			sigwait(&signals, &sig);
+			break;
+		}
+		timespec timeout{reportSec, 0};
+		if (sigtimedwait(&signals, nullptr, &timeout) > 0)
+		{
+			break;
+		}
+		std::cout << server.Latency().Summary() << std::endl;
+	}
+
+	server.Stop();
+	std::cout << "latency " << server.Latency().Summary() << std::endl;
+	if (server.Cache() != nullptr)
+	{
+		std::cout << "cache hits=" << server.Cache()->Hits() << " misses=" << server.Cache()->Misses()
+				  << " hit-rate=" << server.Cache()->HitRate() << std::endl;
+	}
+	return 0;
+}
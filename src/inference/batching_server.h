@@ -0,0 +1,416 @@
+﻿/**
+ * @file batching_server.h
+ * @author Daichi Sato
+ * @brief 同時に届いたリクエストをまとめて推論する動的バッチングサーバー
+ * @version 0.1
+ * @date 2021-12-16
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * Unixドメインソケットで受けたリクエストを1つのキューに集め，
+ * 各ワーカーが「maxBatch件そろう」か「先頭のリクエストの待ち時間がmaxDelayに達する」まで待ってから
+ * ForwardBatchでまとめて推論する。ForwardBatchは層の出力バッファを書き換えるので，
+ * ワーカーはそれぞれネットワークの複製を持つ（複製には推論に使う値だけをコピーする）。
+ * 受信から応答の送信までの時間をヒストグラムに記録する。
+ * cacheEntriesを指定すると，受信したスレッドで推論結果キャッシュを引き，当たればキューに入れずに応答する。
+ *
+ */
+
+#ifndef BATCHING_SERVER_H_INCLUDED_
+#define BATCHING_SERVER_H_INCLUDED_
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "../net_common.h"
+#include "../util/latency_histogram.h"
+#include "inference_cache.h"
+#include "socket_io.h"
+
+namespace bitnet
+{
+    struct BatchingConfig
+    {
+        std::string socketPath;
+        // 1回の推論にまとめる最大件数(<= BATCH_SIZE)
+        int maxBatch = BATCH_SIZE;
+        // 先頭のリクエストを待たせる最大時間
+        std::chrono::microseconds maxDelay{200};
+        int numWorkers = 1;
+        // 推論結果キャッシュのエントリ数（0なら使わない）
+        size_t cacheEntries = 0;
+    };
+
+    template <typename Net_t>
+    class BatchingServer
+    {
+    public:
+        using OutputType = std::remove_cv_t<std::remove_pointer_t<decltype(std::declval<Net_t &>().Forward(nullptr))>>;
+        using InputLayer_t = std::remove_reference_t<decltype(std::declval<Net_t &>().InputLayer())>;
+        static constexpr int INPUT_BITS = InputLayer_t::COMPRESS_OUT_DIM;
+        static constexpr int INPUT_BLOCKS = InputLayer_t::PADDED_OUT_BLOCKS;
+        static constexpr int OUTPUT_DIM = Net_t::COMPRESS_OUT_DIM;
+        using Cache_t = InferenceCache<INPUT_BLOCKS, OutputType, OUTPUT_DIM>;
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        struct Connection
+        {
+            int fd;
+            std::mutex writeMutex;
+
+            // キューに残ったリクエストが参照している間は応答先として開いておく
+            ~Connection()
+            {
+                close(fd);
+            }
+        };
+
+        struct Reader
+        {
+            std::shared_ptr<Connection> connection;
+            std::thread thread;
+            // 受信を終えたら立てる（_connectionMutexで保護）. Acceptで回収する
+            bool finished = false;
+        };
+
+        struct Pending
+        {
+            std::shared_ptr<Connection> connection;
+            uint64_t id;
+            uint64_t hash;
+            Clock::time_point arrival;
+            std::array<BitBlock, INPUT_BLOCKS> input;
+        };
+
+        BatchingConfig _config;
+        std::vector<std::unique_ptr<Net_t>> _replicas;
+        LatencyHistogram _latency;
+        // ワーカーの複製は同じ重みを持つので全体で1つ共有する（重みは構築後に変わらない）
+        std::unique_ptr<Cache_t> _cache;
+
+        int _listenFd = -1;
+        // ワーカーの停止フラグ（_queueMutexで保護）と接続受け付けの停止フラグ（_connectionMutexで保護）
+        bool _stopping = false;
+        bool _closing = false;
+        std::mutex _queueMutex;
+        std::condition_variable _queueReady;
+        std::deque<Pending> _queue;
+
+        std::thread _acceptor;
+        std::vector<std::thread> _workers;
+        std::mutex _connectionMutex;
+        std::list<Reader> _readers;
+
+        /**
+         * @brief 受信を終えた（クライアントが切断した）接続のスレッドを回収する. _connectionMutexを取った状態で呼ぶ
+         */
+        void ReapReaders()
+        {
+            for (auto it = _readers.begin(); it != _readers.end();)
+            {
+                if (it->finished)
+                {
+                    it->thread.join();
+                    it = _readers.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+        }
+
+        void Accept()
+        {
+            while (true)
+            {
+                const int fd = accept(_listenFd, nullptr, nullptr);
+                if (fd < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    // Stopでリスニングソケットが閉じられた
+                    return;
+                }
+
+                socket_io::ServerHello hello{socket_io::HELLO_MAGIC, INPUT_BITS, INPUT_BLOCKS, OUTPUT_DIM, sizeof(OutputType)};
+                if (!socket_io::WriteAll(fd, &hello, sizeof(hello)))
+                {
+                    close(fd);
+                    continue;
+                }
+
+                auto connection = std::make_shared<Connection>();
+                connection->fd = fd;
+                std::lock_guard<std::mutex> lock(_connectionMutex);
+                if (_closing)
+                {
+                    return;
+                }
+                ReapReaders();
+                Reader &reader = _readers.emplace_back();
+                reader.connection = connection;
+                reader.thread = std::thread(&BatchingServer::Read, this, &reader);
+            }
+        }
+
+        void Respond(const Pending &pending, const OutputType *output, std::vector<char> &response)
+        {
+            memcpy(response.data(), &pending.id, sizeof(uint64_t));
+            memcpy(response.data() + sizeof(uint64_t), output, sizeof(OutputType) * OUTPUT_DIM);
+            {
+                std::lock_guard<std::mutex> lock(pending.connection->writeMutex);
+                socket_io::WriteAll(pending.connection->fd, response.data(), response.size());
+            }
+            _latency.Record(Clock::now() - pending.arrival);
+        }
+
+        void Read(Reader *reader)
+        {
+            const std::shared_ptr<Connection> connection = reader->connection;
+            Pending pending;
+            pending.connection = connection;
+            std::vector<char> response(sizeof(uint64_t) + sizeof(OutputType) * OUTPUT_DIM);
+            OutputType cached[OUTPUT_DIM];
+            while (socket_io::ReadAll(connection->fd, &pending.id, sizeof(pending.id)) &&
+                   socket_io::ReadAll(connection->fd, pending.input.data(), sizeof(BitBlock) * INPUT_BLOCKS))
+            {
+                pending.arrival = Clock::now();
+                if (_cache)
+                {
+                    pending.hash = Cache_t::Hash(pending.input.data());
+                    if (_cache->Lookup(pending.input.data(), pending.hash, cached))
+                    {
+                        Respond(pending, cached, response);
+                        continue;
+                    }
+                }
+                {
+                    std::lock_guard<std::mutex> lock(_queueMutex);
+                    _queue.push_back(pending);
+                }
+                _queueReady.notify_one();
+            }
+            // 切断された. ソケットは応答待ちのリクエストがなくなった時点で閉じる
+            std::lock_guard<std::mutex> lock(_connectionMutex);
+            reader->connection.reset();
+            reader->finished = true;
+        }
+
+        void Work(int workerIdx)
+        {
+            Net_t &net = *_replicas[workerIdx];
+            alignas(32) BitBlock batchInput[BATCH_SIZE * INPUT_BLOCKS];
+            std::vector<Pending> batch;
+            batch.reserve(_config.maxBatch);
+            std::vector<char> response(sizeof(uint64_t) + sizeof(OutputType) * OUTPUT_DIM);
+
+            while (true)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(_queueMutex);
+                    _queueReady.wait(lock, [&]
+                                     { return _stopping || !_queue.empty(); });
+                    if (_stopping)
+                    {
+                        return;
+                    }
+                    // 件数がそろうか，先頭の締め切りまで待つ
+                    const Clock::time_point deadline = _queue.front().arrival + _config.maxDelay;
+                    _queueReady.wait_until(lock, deadline, [&]
+                                           { return _stopping || _queue.empty() || (int)_queue.size() >= _config.maxBatch; });
+                    if (_stopping)
+                    {
+                        return;
+                    }
+                    const int n = std::min((int)_queue.size(), _config.maxBatch);
+                    for (int i = 0; i < n; i++)
+                    {
+                        batch.push_back(std::move(_queue.front()));
+                        _queue.pop_front();
+                    }
+                }
+                if (batch.empty())
+                {
+                    // 他のワーカーが先に取り出した
+                    continue;
+                }
+
+                const int n = (int)batch.size();
+                for (int b = 0; b < n; b++)
+                {
+                    memcpy(&batchInput[b * INPUT_BLOCKS], batch[b].input.data(), sizeof(BitBlock) * INPUT_BLOCKS);
+                }
+                const uint32_t generation = _cache ? _cache->Generation() : 0;
+                const OutputType *output = net.ForwardBatch(batchInput, n);
+
+                for (int b = 0; b < n; b++)
+                {
+                    Respond(batch[b], &output[b * OUTPUT_DIM], response);
+                    if (_cache)
+                    {
+                        _cache->Insert(batch[b].input.data(), batch[b].hash, &output[b * OUTPUT_DIM], generation);
+                    }
+                }
+                batch.clear();
+            }
+        }
+
+    public:
+        /**
+         * @param master 推論に使うネットワーク（推論用の値をワーカーごとに複製するので構築後は破棄してよい）
+         */
+        BatchingServer(const Net_t &master, const BatchingConfig &config) : _config(config)
+        {
+            if (_config.maxBatch < 1 || _config.maxBatch > BATCH_SIZE)
+            {
+                throw std::runtime_error("maxBatch must be in [1, " + std::to_string(BATCH_SIZE) + "]");
+            }
+            for (int w = 0; w < std::max(1, _config.numWorkers); w++)
+            {
+                _replicas.emplace_back(new Net_t());
+                // 学習用の実数値重みやオプティマイザの状態は推論に使わないのでコピーしない
+                _replicas.back()->CopyInferenceParams(master);
+            }
+            if (_config.cacheEntries > 0)
+            {
+                _cache.reset(new Cache_t(_config.cacheEntries));
+            }
+        }
+
+        ~BatchingServer()
+        {
+            Stop();
+        }
+
+        BatchingServer(const BatchingServer &) = delete;
+        BatchingServer &operator=(const BatchingServer &) = delete;
+
+        /**
+         * @brief ソケットを作成して受け付けを開始する
+         */
+        void Start()
+        {
+            _listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+            const sockaddr_un addr = socket_io::MakeAddress(_config.socketPath);
+            unlink(_config.socketPath.c_str());
+            if (_listenFd < 0 ||
+                bind(_listenFd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0 ||
+                listen(_listenFd, SOMAXCONN) != 0)
+            {
+                const std::string reason = strerror(errno);
+                if (_listenFd >= 0)
+                {
+                    close(_listenFd);
+                    _listenFd = -1;
+                }
+                throw std::runtime_error("Failed to listen: " + _config.socketPath + " (" + reason + ")");
+            }
+
+            for (int w = 0; w < (int)_replicas.size(); w++)
+            {
+                _workers.emplace_back(&BatchingServer::Work, this, w);
+            }
+            _acceptor = std::thread(&BatchingServer::Accept, this);
+        }
+
+        /**
+         * @brief 受け付けを止め，全スレッドを終了する（キューに残ったリクエストには応答しない）
+         */
+        void Stop()
+        {
+            if (_listenFd < 0)
+            {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(_queueMutex);
+                _stopping = true;
+            }
+            _queueReady.notify_all();
+
+            shutdown(_listenFd, SHUT_RDWR);
+            close(_listenFd);
+            _listenFd = -1;
+            if (_acceptor.joinable())
+            {
+                _acceptor.join();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(_connectionMutex);
+                _closing = true;
+                for (auto &reader : _readers)
+                {
+                    if (reader.connection)
+                    {
+                        shutdown(reader.connection->fd, SHUT_RDWR);
+                    }
+                }
+            }
+            for (auto &reader : _readers)
+            {
+                if (reader.thread.joinable())
+                {
+                    reader.thread.join();
+                }
+            }
+            _readers.clear();
+            for (auto &worker : _workers)
+            {
+                if (worker.joinable())
+                {
+                    worker.join();
+                }
+            }
+            unlink(_config.socketPath.c_str());
+        }
+
+        /**
+         * @brief 切断された接続を回収したうえで，受信スレッドを持つ接続の数
+         */
+        size_t ConnectionCount()
+        {
+            std::lock_guard<std::mutex> lock(_connectionMutex);
+            ReapReaders();
+            return _readers.size();
+        }
+
+        /**
+         * @brief 受信から応答送信までのレイテンシ
+         */
+        const LatencyHistogram &Latency() const
+        {
+            return _latency;
+        }
+
+        /**
+         * @brief 推論結果キャッシュ（cacheEntries == 0ならnullptr）
+         */
+        const Cache_t *Cache() const
+        {
+            return _cache.get();
+        }
+    };
+}
+
+#endif
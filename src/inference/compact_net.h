@@ -0,0 +1,354 @@
+﻿/**
+ * @file compact_net.h
+ * @author Daichi Sato
+ * @brief 次元を実行時に持つ，枝刈り後の全結合ネットワークの推論エンジン
+ * @version 0.1
+ * @date 2021-12-30
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * 層の次元がテンプレート引数で決まるBitDenseLayerと違い，枝刈りで幅が変わったモデルをそのまま読み込める。
+ * 1層は入力ビットxの整数係数の線形式 pre = offset + slope * Σ C[r] * x[r] で，
+ * 隠れ層は (pre > threshold) ^ flip を次の層の入力ビットにし，出力層はpreをそのまま出力する。
+ *
+ * 係数C[r]は列rにまとめた元のニューロンの数M[r]と同じ偶奇を持つので，U = (C + M) / 2（0 <= U <= M）を
+ * ビットプレーンに分けて持ち， Σ C * x = 2 * Σ_k 2^k popcount(x & U_k) - Σ_k 2^k popcount(x & M_k) で求める。
+ * まとめていない列だけならU_0は元の2値重みそのもので，1行あたりのpopcountは元の層と同じ1回になる。
+ *
+ */
+
+#ifndef COMPACT_NET_H_INCLUDED_
+#define COMPACT_NET_H_INCLUDED_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "../net_common.h"
+#include "../util/bit_helper.h"
+
+namespace bitnet
+{
+    /**
+     * @brief 実行時の次元を持つ全結合層（BitDenseLayer + BitSignActivation 1組分）
+     */
+    struct CompactLayer
+    {
+        int inDim = 0;
+        int outDim = 0;
+        bool isOutputLayer = false;
+        // 1行あたりの係数のビットプレーン数と，列ごとのまとめた数M[r]のビットプレーン数
+        int numPlanes = 0;
+        int numSharedPlanes = 0;
+        int32_t slope = 1;
+        // planes[(i_out * numPlanes + k) * Words() + word]: 係数U[i_out][r]の第kビット（popcntの幅で詰める）
+        std::vector<uint64_t> planes;
+        // sharedPlanes[k * Words() + word]: M[r]の第kビット
+        std::vector<uint64_t> sharedPlanes;
+        std::vector<int32_t> offset;
+        std::vector<int32_t> threshold;
+        std::vector<uint8_t> flip;
+
+        int Words() const
+        {
+            return (inDim + POPCNT_BIT_WIDTH - 1) / POPCNT_BIT_WIDTH;
+        }
+
+        /**
+         * @brief 整数係数から層を組み立てる
+         *
+         * @param coefs coefs[i_out * inDim + r]: 係数C（|C| <= multiplicity[r]，偶奇も一致すること）
+         * @param multiplicity 列ごとにまとめた元のニューロンの数M
+         */
+        void SetCoefficients(const std::vector<int32_t> &coefs, const std::vector<int32_t> &multiplicity)
+        {
+            int32_t maxMultiplicity = 1;
+            for (int r = 0; r < inDim; r++)
+            {
+                maxMultiplicity = std::max(maxMultiplicity, multiplicity[r]);
+            }
+            numSharedPlanes = 0;
+            while ((maxMultiplicity >> numSharedPlanes) != 0)
+            {
+                numSharedPlanes++;
+            }
+            numPlanes = numSharedPlanes;
+
+            const int words = Words();
+            sharedPlanes.assign(numSharedPlanes * words, 0);
+            planes.assign(outDim * numPlanes * words, 0);
+            for (int r = 0; r < inDim; r++)
+            {
+                const int word = r / POPCNT_BIT_WIDTH;
+                const uint64_t bit = uint64_t(1) << (r % POPCNT_BIT_WIDTH);
+                for (int k = 0; k < numSharedPlanes; k++)
+                {
+                    if ((multiplicity[r] >> k) & 1)
+                    {
+                        sharedPlanes[k * words + word] |= bit;
+                    }
+                }
+                for (int i_out = 0; i_out < outDim; i_out++)
+                {
+                    const int32_t c = coefs[i_out * inDim + r];
+                    if (std::abs(c) > multiplicity[r] || ((c + multiplicity[r]) & 1))
+                    {
+                        throw std::runtime_error("CompactLayer: coefficient does not match column multiplicity: " + std::to_string(c));
+                    }
+                    const int32_t u = (c + multiplicity[r]) / 2;
+                    for (int k = 0; k < numPlanes; k++)
+                    {
+                        if ((u >> k) & 1)
+                        {
+                            planes[(i_out * numPlanes + k) * words + word] |= bit;
+                        }
+                    }
+                }
+            }
+        }
+
+        /**
+         * @brief Σ_k 2^k popcount(x & plane_k)
+         */
+        static int32_t WeightedPopcount(const uint64_t *x, const uint64_t *planes, int numPlanes, int words)
+        {
+            int32_t sum = 0;
+            for (int k = 0; k < numPlanes; k++)
+            {
+                int32_t pop = 0;
+                for (int word = 0; word < words; word++)
+                {
+                    pop += static_cast<int32_t>(_mm_popcnt_u64(x[word] & planes[k * words + word]));
+                }
+                sum += pop << k;
+            }
+            return sum;
+        }
+
+        /**
+         * @brief 隠れ層ならoutputBitsに，出力層ならoutputSumsに書き出す
+         */
+        void Forward(const uint64_t *x, uint64_t *outputBits, int32_t *outputSums) const
+        {
+            const int words = Words();
+            const int32_t shared = WeightedPopcount(x, sharedPlanes.data(), numSharedPlanes, words);
+            if (!isOutputLayer)
+            {
+                memset(outputBits, 0, sizeof(uint64_t) * ((outDim + POPCNT_BIT_WIDTH - 1) / POPCNT_BIT_WIDTH));
+            }
+            for (int i_out = 0; i_out < outDim; i_out++)
+            {
+                const int32_t dot = 2 * WeightedPopcount(x, &planes[i_out * numPlanes * words], numPlanes, words) - shared;
+                const int32_t pre = offset[i_out] + slope * dot;
+                if (isOutputLayer)
+                {
+                    outputSums[i_out] = pre;
+                }
+                else if ((pre > threshold[i_out]) ^ flip[i_out])
+                {
+                    outputBits[i_out / POPCNT_BIT_WIDTH] |= uint64_t(1) << (i_out % POPCNT_BIT_WIDTH);
+                }
+            }
+        }
+    };
+
+    /**
+     * @brief 実行時の次元を持つ層の列. 最後の層が出力層
+     */
+    class CompactNet
+    {
+        static constexpr uint32_t MAGIC = 0x504D4342; // "BCMP"
+
+        std::vector<CompactLayer> _layers;
+        // 層の入出力ビット列（隠れ層の出力を交互に置く）
+        std::vector<uint64_t> _bits[2];
+        std::vector<int32_t> _output;
+
+        template <typename T>
+        static void WriteVector(std::ostream &fs, const std::vector<T> &values)
+        {
+            const uint64_t size = values.size();
+            fs.write(reinterpret_cast<const char *>(&size), sizeof(size));
+            fs.write(reinterpret_cast<const char *>(values.data()), sizeof(T) * size);
+        }
+
+        /**
+         * @brief 長さ付きの列を読む. 長さはファイルの値を信用せず，層の次元から求めたexpectedと一致しなければruntime_error.
+         * 途中で切れたファイルで大きな領域を確保しないよう，読めた分だけ少しずつ広げる
+         */
+        template <typename T>
+        static void ReadVector(std::istream &fs, std::vector<T> &values, uint64_t expected)
+        {
+            constexpr uint64_t CHUNK = (uint64_t(1) << 20) / sizeof(T);
+            uint64_t size = 0;
+            fs.read(reinterpret_cast<char *>(&size), sizeof(size));
+            if (!fs || size != expected)
+            {
+                throw std::runtime_error("CompactNet: invalid vector size " + std::to_string(size) + " (expected " + std::to_string(expected) + ")");
+            }
+            values.clear();
+            while (values.size() < size)
+            {
+                const size_t begin = values.size();
+                const size_t count = static_cast<size_t>(std::min(CHUNK, size - begin));
+                values.resize(begin + count);
+                fs.read(reinterpret_cast<char *>(values.data() + begin), sizeof(T) * count);
+                if (!fs)
+                {
+                    throw std::runtime_error("CompactNet: truncated model");
+                }
+            }
+        }
+
+        void Validate() const
+        {
+            if (_layers.empty() || !_layers.back().isOutputLayer)
+            {
+                throw std::runtime_error("CompactNet: the last layer must be the output layer");
+            }
+            for (size_t l = 0; l < _layers.size(); l++)
+            {
+                const CompactLayer &layer = _layers[l];
+                const size_t words = layer.Words();
+                if ((l + 1 < _layers.size() && (layer.isOutputLayer || _layers[l + 1].inDim != layer.outDim)) ||
+                    layer.planes.size() != layer.outDim * layer.numPlanes * words ||
+                    layer.sharedPlanes.size() != layer.numSharedPlanes * words ||
+                    layer.offset.size() != static_cast<size_t>(layer.outDim) ||
+                    layer.threshold.size() != static_cast<size_t>(layer.outDim) ||
+                    layer.flip.size() != static_cast<size_t>(layer.outDim))
+                {
+                    throw std::runtime_error("CompactNet: invalid layer " + std::to_string(l));
+                }
+            }
+        }
+
+        void AllocateBuffers()
+        {
+            size_t maxWords = 0;
+            for (const CompactLayer &layer : _layers)
+            {
+                maxWords = std::max<size_t>(maxWords, layer.Words());
+            }
+            _bits[0].assign(maxWords, 0);
+            _bits[1].assign(maxWords, 0);
+            _output.assign(_layers.back().outDim, 0);
+        }
+
+    public:
+        CompactNet() = default;
+
+        explicit CompactNet(std::vector<CompactLayer> layers) : _layers(std::move(layers))
+        {
+            Validate();
+            AllocateBuffers();
+        }
+
+        int InputBits() const
+        {
+            return _layers.front().inDim;
+        }
+
+        int OutputDim() const
+        {
+            return _layers.back().outDim;
+        }
+
+        const std::vector<CompactLayer> &Layers() const
+        {
+            return _layers;
+        }
+
+        /**
+         * @brief 推論する. 入力は先頭からInputBits()ビット分を読む. 戻り値は次のForwardまで有効
+         */
+        const int32_t *Forward(const BitBlock *netInput)
+        {
+            // 入力のブロック列をpopcntの幅の語に詰め直し，InputBits()より後ろのビットを落とす
+            const CompactLayer &first = _layers.front();
+            std::fill(_bits[0].begin(), _bits[0].end(), 0);
+            memcpy(_bits[0].data(), netInput, sizeof(BitBlock) * BitToBlockCount(first.inDim));
+            if (first.inDim % POPCNT_BIT_WIDTH != 0)
+            {
+                _bits[0][first.Words() - 1] &= (uint64_t(1) << (first.inDim % POPCNT_BIT_WIDTH)) - 1;
+            }
+
+            int current = 0;
+            for (const CompactLayer &layer : _layers)
+            {
+                layer.Forward(_bits[current].data(), _bits[1 - current].data(), _output.data());
+                current = 1 - current;
+            }
+            return _output.data();
+        }
+
+        void Save(std::ostream &fs) const
+        {
+            const uint32_t magic = MAGIC;
+            const uint32_t numLayers = static_cast<uint32_t>(_layers.size());
+            fs.write(reinterpret_cast<const char *>(&magic), sizeof(magic));
+            fs.write(reinterpret_cast<const char *>(&numLayers), sizeof(numLayers));
+            for (const CompactLayer &layer : _layers)
+            {
+                const int32_t header[6] = {layer.inDim, layer.outDim, layer.isOutputLayer, layer.numPlanes, layer.numSharedPlanes, layer.slope};
+                fs.write(reinterpret_cast<const char *>(header), sizeof(header));
+                WriteVector(fs, layer.planes);
+                WriteVector(fs, layer.sharedPlanes);
+                WriteVector(fs, layer.offset);
+                WriteVector(fs, layer.threshold);
+                WriteVector(fs, layer.flip);
+            }
+        }
+
+        void Load(std::istream &fs)
+        {
+            uint32_t magic = 0;
+            uint32_t numLayers = 0;
+            fs.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+            fs.read(reinterpret_cast<char *>(&numLayers), sizeof(numLayers));
+            if (!fs || magic != MAGIC)
+            {
+                throw std::runtime_error("CompactNet: not a compact model");
+            }
+            // 層の数もファイルの値なので，読めた層だけを積む
+            std::vector<CompactLayer> layers;
+            for (uint32_t l = 0; l < numLayers; l++)
+            {
+                CompactLayer &layer = layers.emplace_back();
+                int32_t header[6];
+                fs.read(reinterpret_cast<char *>(header), sizeof(header));
+                layer.inDim = header[0];
+                layer.outDim = header[1];
+                layer.isOutputLayer = header[2] != 0;
+                layer.numPlanes = header[3];
+                layer.numSharedPlanes = header[4];
+                layer.slope = header[5];
+                // 列の長さは読み込んだ次元から決まる（係数のビットプレーンはint32の幅まで）
+                if (!fs || layer.inDim <= 0 || layer.outDim <= 0 ||
+                    layer.numPlanes < 0 || layer.numPlanes > 32 || layer.numSharedPlanes < 0 || layer.numSharedPlanes > 32)
+                {
+                    throw std::runtime_error("CompactNet: invalid layer header");
+                }
+                const uint64_t words = layer.Words();
+                const uint64_t outDim = layer.outDim;
+                ReadVector(fs, layer.planes, outDim * layer.numPlanes * words);
+                ReadVector(fs, layer.sharedPlanes, layer.numSharedPlanes * words);
+                ReadVector(fs, layer.offset, outDim);
+                ReadVector(fs, layer.threshold, outDim);
+                ReadVector(fs, layer.flip, outDim);
+            }
+            if (!fs)
+            {
+                throw std::runtime_error("CompactNet: truncated model");
+            }
+            _layers = std::move(layers);
+            Validate();
+            AllocateBuffers();
+        }
+    };
+}
+
+#endif
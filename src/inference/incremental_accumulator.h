@@ -0,0 +1,214 @@
+﻿/**
+ * @file incremental_accumulator.h
+ * @author Daichi Sato
+ * @brief 入力が数ビットずつ変わる系列のための，第1層の差分推論
+ * @version 0.1
+ * @date 2021-12-20
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * 探索中の局面のように，直前の入力から数ビットしか変わらない入力を連続して推論する場合，
+ * 第1全結合層のpopcountを毎回数え直す必要はない。
+ * ニューロンごとのpopcountを保持しておき，入力ビットiが0→1になったら重みの列iに応じて±1する。
+ * 重みは列優先（入力ビットごとにニューロン方向へ連続）に並べ直して持ち，
+ * 1ビットの変化を出力次元分のint16加算で反映する。これで第1層はO(入力×出力)からO(変化数×出力)になる。
+ * 探索木を辿れるように，popcountはPush/Popで積むスタックに持つ。
+ *
+ * 第2層以降は通常どおりForwardStepで計算する。
+ * ネットワークの重みを変えた（学習・Load）後はRefresh()で列を作り直すこと。
+ *
+ */
+
+#ifndef INCREMENTAL_ACCUMULATOR_H_INCLUDED_
+#define INCREMENTAL_ACCUMULATOR_H_INCLUDED_
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include "../net_common.h"
+#include "../util/bit_helper.h"
+#include "../layers/sequential.h"
+
+namespace bitnet
+{
+    /**
+     * @brief 第1全結合層のpopcountを差分更新で保持し，残りの層だけを計算して推論する
+     *
+     * @tparam Net_t ネットワークの型（第1層がBitDenseLayerであること）
+     * @tparam MaxDepth Pushできる最大の深さ
+     */
+    template <typename Net_t, int MaxDepth = 64>
+    class IncrementalAccumulator
+    {
+    public:
+        using FirstLayer = typename sequential_detail::FirstLayer<Net_t>::type;
+        using OutputType = sequential_detail::ForwardOutput_t<Net_t>;
+        static constexpr int INPUT_BITS = FirstLayer::COMPRESS_IN_DIM;
+        static constexpr int ACC_DIM = FirstLayer::COMPRESS_OUT_DIM;
+        // AVX2で16ニューロンずつ加算するための幅
+        static constexpr int ACC_STRIDE = (ACC_DIM + 15) / 16 * 16;
+        static_assert(FirstLayer::PADDED_IN_BITS <= INT16_MAX, "popcount must fit in int16");
+
+    private:
+        using Plan = sequential_detail::ActivationPlan<Net_t>;
+
+        Net_t &_net;
+        // _columns[i_in][i_out]: 入力ビットi_inが0→1になったときのpopcountの変化量
+        alignas(32) int16_t _columns[INPUT_BITS][ACC_STRIDE];
+        alignas(32) int16_t _stack[MaxDepth + 1][ACC_STRIDE];
+        alignas(32) uint8_t _arena[2][Plan::MAX_BYTES];
+        int _depth = 0;
+
+        FirstLayer &First()
+        {
+            return First(_net);
+        }
+
+        template <typename Layer_t>
+        FirstLayer &First(Layer_t &layer)
+        {
+            if constexpr (std::is_same_v<Layer_t, FirstLayer>)
+            {
+                return layer;
+            }
+            else
+            {
+                return First(layer.PrevLayer());
+            }
+        }
+
+        /**
+         * @brief 第1層はスタック先頭のpopcountから，それより後ろの層はForwardStepで計算する
+         */
+        template <typename Layer_t>
+        auto RunForward(Layer_t &layer)
+        {
+            using LayerOutput = sequential_detail::ForwardOutput_t<Layer_t>;
+            LayerOutput *output = reinterpret_cast<LayerOutput *>(_arena[sequential_detail::ActivationPlan<Layer_t>::ARENA]);
+            if constexpr (std::is_same_v<Layer_t, FirstLayer>)
+            {
+                return layer.ForwardFromCounts(_stack[_depth], output);
+            }
+            else
+            {
+                return layer.ForwardStep(RunForward(layer.PrevLayer()), output);
+            }
+        }
+
+        void CheckBit(int bit) const
+        {
+            if (bit < 0 || bit >= INPUT_BITS)
+            {
+                throw std::runtime_error("IncrementalAccumulator: input bit out of range: " + std::to_string(bit));
+            }
+        }
+
+    public:
+        explicit IncrementalAccumulator(Net_t &net) : _net(net)
+        {
+            memset(_arena, 0, sizeof(_arena));
+            memset(_stack, 0, sizeof(_stack));
+            Refresh();
+        }
+
+        /**
+         * @brief ネットワークの2値重みから列優先の重みを作り直す. 保持しているpopcountは無効になる
+         */
+        void Refresh()
+        {
+            memset(_columns, 0, sizeof(_columns));
+            First().ExportColumnDeltas(&_columns[0][0], ACC_STRIDE);
+            _depth = 0;
+        }
+
+        /**
+         * @brief スタックを空にし，入力全体からpopcountを数え直す
+         */
+        void Reset(const BitBlock *netInput)
+        {
+            _depth = 0;
+            alignas(32) BitBlock input[FirstLayer::PADDED_IN_BLOCKS];
+            First().PrevLayer().ForwardStep(netInput, input);
+            First().CountAllMatches(input, _stack[0]);
+        }
+
+        /**
+         * @brief 現在のpopcountを複製して1段積む. 以降のApplyDeltaはPopで取り消せる
+         */
+        void Push()
+        {
+            if (_depth >= MaxDepth)
+            {
+                throw std::runtime_error("IncrementalAccumulator: stack overflow (MaxDepth=" + std::to_string(MaxDepth) + ")");
+            }
+            memcpy(_stack[_depth + 1], _stack[_depth], sizeof(_stack[0]));
+            _depth++;
+        }
+
+        void Pop()
+        {
+            if (_depth == 0)
+            {
+                throw std::runtime_error("IncrementalAccumulator: Pop on empty stack");
+            }
+            _depth--;
+        }
+
+        int Depth() const
+        {
+            return _depth;
+        }
+
+        /**
+         * @brief 入力ビットの変化を現在のpopcountに反映する.
+         * addedは0→1になったビット，removedは1→0になったビットの番号（変化前の状態と矛盾しないこと）
+         */
+        void ApplyDelta(const int *added, int numAdded, const int *removed, int numRemoved)
+        {
+            for (int i = 0; i < numAdded; i++)
+            {
+                CheckBit(added[i]);
+            }
+            for (int i = 0; i < numRemoved; i++)
+            {
+                CheckBit(removed[i]);
+            }
+
+            int16_t *acc = _stack[_depth];
+            // 16ニューロン分をレジスタに置いたまま，変化した全ビットの列を足し引きする
+            for (int i_out = 0; i_out < ACC_STRIDE; i_out += 16)
+            {
+                __m256i sum = _mm256_load_si256(reinterpret_cast<const __m256i *>(&acc[i_out]));
+                for (int i = 0; i < numAdded; i++)
+                {
+                    sum = _mm256_add_epi16(sum, _mm256_load_si256(reinterpret_cast<const __m256i *>(&_columns[added[i]][i_out])));
+                }
+                for (int i = 0; i < numRemoved; i++)
+                {
+                    sum = _mm256_sub_epi16(sum, _mm256_load_si256(reinterpret_cast<const __m256i *>(&_columns[removed[i]][i_out])));
+                }
+                _mm256_store_si256(reinterpret_cast<__m256i *>(&acc[i_out]), sum);
+            }
+        }
+
+        /**
+         * @brief 現在のpopcountでネットワーク全体を推論する. 戻り値は次のForwardまで有効
+         */
+        const OutputType *Forward()
+        {
+            return RunForward(_net);
+        }
+
+        /**
+         * @brief 第1層のニューロンごとのpopcount（パディング分も含む）
+         */
+        const int16_t *Counts() const
+        {
+            return _stack[_depth];
+        }
+    };
+}
+
+#endif
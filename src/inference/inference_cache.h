@@ -0,0 +1,222 @@
+﻿/**
+ * @file inference_cache.h
+ * @author Daichi Sato
+ * @brief 入力ビット列をキーにした，スレッド間で共有する推論結果キャッシュ
+ * @version 0.1
+ * @date 2021-12-21
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * 入力が2値なので，同一入力の判定はパディング込みの入力行の比較で済む。
+ * 置換表と同じく固定サイズのセットアソシアティブ表で，ハッシュ値の下位ビットでセットを選び，
+ * セット内のWays個のエントリを順に調べる。ロックは取らない。
+ * 各エントリはシーケンス番号で保護し（奇数なら書き込み中），読み手は読む前後で番号が変わっていなければ採用する。
+ * 書き手はシーケンス番号のCASに失敗したら（他のスレッドが書き込み中なら）登録をあきらめる。
+ *
+ * 無効化の規則: キャッシュは世代番号を持ち，エントリは登録時の世代でしか当たらない。
+ * 重みを変えたら（学習・Load・モデルの差し替え）Invalidate()を呼ぶ。
+ * 推論の前にGeneration()で世代を取っておき，Insertに渡す。推論中に無効化されていれば登録されないので，
+ * 古い重みで計算した結果が新しい世代に紛れ込むことはない。
+ *
+ */
+
+#ifndef INFERENCE_CACHE_H_INCLUDED_
+#define INFERENCE_CACHE_H_INCLUDED_
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include "../net_common.h"
+#include "../util/bit_helper.h"
+
+namespace bitnet
+{
+    /**
+     * @brief 推論結果キャッシュ
+     *
+     * @tparam InputBlocks パディング込みの入力行のブロック数
+     * @tparam Output_t 出力の型
+     * @tparam OutputDim 出力次元数
+     * @tparam Ways 1セットあたりのエントリ数
+     */
+    template <int InputBlocks, typename Output_t, int OutputDim, int Ways = 4>
+    class InferenceCache
+    {
+        static_assert(std::is_trivially_copyable_v<Output_t>);
+
+        struct alignas(64) Entry
+        {
+            std::atomic<uint32_t> sequence{0};
+            // 0は未使用（世代番号は1から始まる）
+            uint32_t generation = 0;
+            uint64_t hash = 0;
+            BitBlock input[InputBlocks];
+            Output_t output[OutputDim];
+        };
+
+        std::unique_ptr<Entry[]> _entries;
+        uint64_t _setMask;
+        alignas(64) std::atomic<uint32_t> _generation{1};
+        // 各スレッドが頻繁に更新するので別のキャッシュラインに置く
+        alignas(64) std::atomic<uint64_t> _hits{0};
+        alignas(64) std::atomic<uint64_t> _misses{0};
+
+        Entry *Set(uint64_t hash) const
+        {
+            return &_entries[(hash & _setMask) * Ways];
+        }
+
+    public:
+        /**
+         * @param numEntries エントリ数の目安（セット数が2のべき乗になるよう切り上げる）
+         */
+        explicit InferenceCache(size_t numEntries)
+        {
+            if (numEntries == 0)
+            {
+                throw std::runtime_error("InferenceCache: numEntries must be positive");
+            }
+            size_t numSets = 1;
+            while (numSets * Ways < numEntries)
+            {
+                numSets *= 2;
+            }
+            _setMask = numSets - 1;
+            _entries.reset(new Entry[numSets * Ways]);
+        }
+
+        InferenceCache(const InferenceCache &) = delete;
+        InferenceCache &operator=(const InferenceCache &) = delete;
+
+        static uint64_t Hash(const BitBlock *input)
+        {
+            return HashBits(input, InputBlocks);
+        }
+
+        /**
+         * @brief 入力に対応する出力があればoutputにコピーしてtrueを返す
+         */
+        bool Lookup(const BitBlock *input, uint64_t hash, Output_t *output)
+        {
+            const uint32_t generation = _generation.load(std::memory_order_acquire);
+            Entry *set = Set(hash);
+            for (int way = 0; way < Ways; way++)
+            {
+                Entry &entry = set[way];
+                const uint32_t before = entry.sequence.load(std::memory_order_acquire);
+                if ((before & 1) || entry.generation != generation || entry.hash != hash ||
+                    memcmp(entry.input, input, sizeof(entry.input)) != 0)
+                {
+                    continue;
+                }
+                memcpy(output, entry.output, sizeof(entry.output));
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (entry.sequence.load(std::memory_order_relaxed) == before)
+                {
+                    _hits.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+            _misses.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        bool Lookup(const BitBlock *input, Output_t *output)
+        {
+            return Lookup(input, Hash(input), output);
+        }
+
+        /**
+         * @brief 推論結果を登録する. 他のスレッドが同じエントリに書き込み中なら何もしない
+         *
+         * @param generation 推論前にGeneration()で取得した世代. 現在の世代と異なれば登録しない
+         */
+        void Insert(const BitBlock *input, uint64_t hash, const Output_t *output, uint32_t generation)
+        {
+            if (generation != _generation.load(std::memory_order_acquire))
+            {
+                return;
+            }
+            // 同じ入力 > 未使用・古い世代 > ハッシュの上位ビットで選んだエントリ の順に置き換える
+            Entry *set = Set(hash);
+            Entry *victim = &set[(hash >> 56) % Ways];
+            for (int way = 0; way < Ways; way++)
+            {
+                Entry &entry = set[way];
+                if (entry.hash == hash && entry.generation == generation)
+                {
+                    victim = &entry;
+                    break;
+                }
+                if (entry.generation != generation)
+                {
+                    victim = &entry;
+                }
+            }
+
+            uint32_t sequence = victim->sequence.load(std::memory_order_relaxed);
+            if ((sequence & 1) || !victim->sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_acquire))
+            {
+                return;
+            }
+            std::atomic_thread_fence(std::memory_order_release);
+            victim->generation = generation;
+            victim->hash = hash;
+            memcpy(victim->input, input, sizeof(victim->input));
+            memcpy(victim->output, output, sizeof(victim->output));
+            victim->sequence.store(sequence + 2, std::memory_order_release);
+        }
+
+        void Insert(const BitBlock *input, const Output_t *output, uint32_t generation)
+        {
+            Insert(input, Hash(input), output, generation);
+        }
+
+        uint32_t Generation() const
+        {
+            return _generation.load(std::memory_order_acquire);
+        }
+
+        /**
+         * @brief 登録済みのエントリをすべて無効にする（重みを変えた後に呼ぶ）
+         */
+        void Invalidate()
+        {
+            uint32_t next = _generation.fetch_add(1, std::memory_order_acq_rel) + 1;
+            // 0は未使用エントリの印なので飛ばす
+            if (next == 0)
+            {
+                _generation.compare_exchange_strong(next, 1, std::memory_order_acq_rel);
+            }
+        }
+
+        size_t Capacity() const
+        {
+            return (_setMask + 1) * Ways;
+        }
+
+        uint64_t Hits() const
+        {
+            return _hits.load(std::memory_order_relaxed);
+        }
+
+        uint64_t Misses() const
+        {
+            return _misses.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief 命中率（参照が無ければ0）
+         */
+        double HitRate() const
+        {
+            const uint64_t hits = Hits(), total = hits + Misses();
+            return total == 0 ? 0.0 : (double)hits / total;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,91 @@
+﻿/**
+ * @file inference_client.h
+ * @author Daichi Sato
+ * @brief 動的バッチングサーバーのクライアント
+ * @version 0.1
+ * @date 2021-12-16
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * 送信と受信は独立しており，応答を待たずに複数のリクエストを送れる。
+ * Sendを呼ぶスレッドとReceiveを呼ぶスレッドはそれぞれ1つまで。
+ *
+ */
+
+#ifndef INFERENCE_CLIENT_H_INCLUDED_
+#define INFERENCE_CLIENT_H_INCLUDED_
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../net_common.h"
+#include "socket_io.h"
+
+namespace bitnet
+{
+    class InferenceClient
+    {
+        int _fd;
+        socket_io::ServerHello _hello;
+
+    public:
+        explicit InferenceClient(const std::string &socketPath) : _fd(socket_io::Connect(socketPath))
+        {
+            if (!socket_io::ReadAll(_fd, &_hello, sizeof(_hello)) || _hello.magic != socket_io::HELLO_MAGIC)
+            {
+                close(_fd);
+                throw std::runtime_error("Invalid server hello: " + socketPath);
+            }
+        }
+
+        ~InferenceClient()
+        {
+            close(_fd);
+        }
+
+        InferenceClient(const InferenceClient &) = delete;
+        InferenceClient &operator=(const InferenceClient &) = delete;
+
+        int InputBits() const { return _hello.inputBits; }
+        int InputBlocks() const { return _hello.inputBlocks; }
+        int OutputDim() const { return _hello.outputDim; }
+        int OutputBytes() const { return _hello.outputBytes; }
+
+        /**
+         * @brief リクエストを送る
+         *
+         * @param id 応答との対応付けに使う番号
+         * @param input 入力 [InputBlocks()]
+         */
+        bool Send(uint64_t id, const BitBlock *input)
+        {
+            return socket_io::WriteAll(_fd, &id, sizeof(id)) &&
+                   socket_io::WriteAll(_fd, input, sizeof(BitBlock) * _hello.inputBlocks);
+        }
+
+        /**
+         * @brief 応答を1つ受け取る
+         *
+         * @param id 応答したリクエストの番号
+         * @param output 出力の格納先 [OutputDim() * OutputBytes()バイト]
+         * @return 切断されたらfalse
+         */
+        bool Receive(uint64_t *id, void *output)
+        {
+            return socket_io::ReadAll(_fd, id, sizeof(uint64_t)) &&
+                   socket_io::ReadAll(_fd, output, (size_t)_hello.outputDim * _hello.outputBytes);
+        }
+
+        /**
+         * @brief 送信側を閉じる（サーバーは残りの応答を返した後に切断を検知する）
+         */
+        void CloseSend()
+        {
+            shutdown(_fd, SHUT_WR);
+        }
+    };
+}
+
+#endif
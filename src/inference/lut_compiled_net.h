@@ -0,0 +1,141 @@
+﻿/**
+ * @file lut_compiled_net.h
+ * @author Daichi Sato
+ * @brief 入力が16ビット以下のネットワークの先頭の層を表引きに置き換える推論
+ * @version 0.1
+ * @date 2021-12-29
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * 入力がnビットなら，入力側のどの層の出力も2^n通りしかない。
+ * 入力層から表にする層（TableLayer_t）までを全入力について計算しておき，
+ * 推論時は入力ビットをそのまま添字にして表の1行を読む。行は表にした層の出力（パディング込み）そのものなので，
+ * 第1全結合層なら0/1の出力かint32の和，その後ろの符号アクティベーションまで含めれば詰めたビット列になる。
+ * 表にした層より後ろは通常どおりForwardStepで計算する。
+ * ネットワークの重みを変えた（学習・Load）後はCompile()で表を作り直すこと。
+ *
+ */
+
+#ifndef LUT_COMPILED_NET_H_INCLUDED_
+#define LUT_COMPILED_NET_H_INCLUDED_
+
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+#include "../net_common.h"
+#include "../layers/sequential.h"
+
+namespace bitnet
+{
+    /**
+     * @brief 入力側の層を2^n行の表に置き換えて推論する
+     *
+     * @tparam Net_t ネットワークの型（入力層が16ビット以下の密なビット入力であること）
+     * @tparam TableLayer_t 表にする最後の層(default:第1層)
+     */
+    template <typename Net_t, typename TableLayer_t = typename sequential_detail::FirstLayer<Net_t>::type>
+    class LutCompiledNet
+    {
+    public:
+        using OutputType = sequential_detail::ForwardOutput_t<Net_t>;
+        using TableOutput = sequential_detail::ForwardOutput_t<TableLayer_t>;
+        using InputLayer_t = std::remove_reference_t<decltype(std::declval<Net_t &>().InputLayer())>;
+        static constexpr int MAX_INPUT_BITS = 16;
+        static constexpr int INPUT_BITS = InputLayer_t::COMPRESS_OUT_DIM;
+        static_assert(INPUT_BITS <= MAX_INPUT_BITS, "lookup tables are limited to 16 input bits");
+        static_assert(!SparseIndexInput<InputLayer_t>::value, "lookup tables need a dense bit input");
+        static constexpr int NUM_ROWS = 1 << INPUT_BITS;
+        // 添字に使う入力の先頭ブロック数
+        static constexpr int INDEX_BLOCKS = BitToBlockCount(INPUT_BITS);
+        static constexpr int ROW_ELEMENTS = TableLayer_t::PADDED_OUT_BLOCKS;
+
+    private:
+        struct alignas(32) Row
+        {
+            TableOutput values[ROW_ELEMENTS];
+        };
+
+        const Net_t &_net;
+        std::vector<Row> _table;
+        sequential_detail::ForwardArena<Net_t> _arena;
+
+        template <typename Layer_t>
+        const TableLayer_t &Table(const Layer_t &layer) const
+        {
+            if constexpr (std::is_same_v<Layer_t, TableLayer_t>)
+            {
+                return layer;
+            }
+            else
+            {
+                return Table(layer.PrevLayer());
+            }
+        }
+
+        /**
+         * @brief 表にした層は表の行を返し，それより後ろの層はForwardStepで計算する
+         */
+        template <typename Layer_t>
+        auto RunForward(const Layer_t &layer, int row)
+        {
+            if constexpr (std::is_same_v<Layer_t, TableLayer_t>)
+            {
+                return static_cast<const TableOutput *>(_table[row].values);
+            }
+            else
+            {
+                using LayerOutput = sequential_detail::ForwardOutput_t<Layer_t>;
+                LayerOutput *output = reinterpret_cast<LayerOutput *>(_arena.bytes[sequential_detail::ActivationPlan<Layer_t>::ARENA]);
+                return layer.ForwardStep(RunForward(layer.PrevLayer(), row), output);
+            }
+        }
+
+    public:
+        explicit LutCompiledNet(const Net_t &net) : _net(net), _table(NUM_ROWS)
+        {
+            Compile();
+        }
+
+        /**
+         * @brief 全入力について表にする層までを推論し，表を作り直す
+         */
+        void Compile()
+        {
+            const TableLayer_t &table = Table(_net);
+            alignas(32) BitBlock input[InputLayer_t::PADDED_OUT_BLOCKS] = {0};
+            for (int row = 0; row < NUM_ROWS; row++)
+            {
+                for (int block = 0; block < INDEX_BLOCKS; block++)
+                {
+                    input[block] = static_cast<BitBlock>(row >> (block * BYTE_BIT_WIDTH));
+                }
+                const TableOutput *output = sequential_detail::RunForward(table, input, _arena);
+                memcpy(_table[row].values, output, sizeof(TableOutput) * ROW_ELEMENTS);
+            }
+        }
+
+        /**
+         * @brief 推論する. 入力の先頭INPUT_BITSビットを表の添字にする. 戻り値は次のForwardまで有効
+         */
+        const OutputType *Forward(const BitBlock *netInput)
+        {
+            int row = 0;
+            for (int block = 0; block < INDEX_BLOCKS; block++)
+            {
+                row |= static_cast<int>(netInput[block]) << (block * BYTE_BIT_WIDTH);
+            }
+            return RunForward(_net, row & (NUM_ROWS - 1));
+        }
+
+        /**
+         * @brief 表の大きさ（バイト）
+         */
+        size_t TableBytes() const
+        {
+            return sizeof(Row) * _table.size();
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,428 @@
+﻿/**
+ * @file neuron_pruner.h
+ * @author Daichi Sato
+ * @brief 校正用データで定数・重複・反転ニューロンを見つけ，次の層に畳み込んで幅を縮めたモデルを作る
+ * @version 0.1
+ * @date 2021-12-30
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * 校正用の入力をすべて推論し，各BitSignActivationの出力をニューロンごとのビット列（サンプル方向）として集める。
+ * - 全サンプルで同じ値を出すニューロン（定数）は，次の層の定数項に畳み込んで取り除く
+ * - 他のニューロンと同じ，またはすべて反転した値を出すニューロン（重複・反転）は，代表の列の係数にまとめる
+ * - まとめた結果，次の層のどの行からも係数が0になった代表（不要）も取り除く
+ * 畳み込みは校正用データ上で厳密なので，縮めたモデル（CompactNet）は校正用データに対して元のネットワークと同じ出力を返す。
+ *
+ * 対象は BitInputLayer -> (BitDenseLayer -> BitSignActivation)* -> BitDenseLayer（出力層）の形のネットワーク。
+ *
+ */
+
+#ifndef NEURON_PRUNER_H_INCLUDED_
+#define NEURON_PRUNER_H_INCLUDED_
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "../net_common.h"
+#include "../layers/sequential.h"
+#include "compact_net.h"
+
+namespace bitnet
+{
+    /**
+     * @brief 隠れ層ごとの枝刈りの内訳
+     */
+    struct PruneReport
+    {
+        struct Layer
+        {
+            int neurons = 0;
+            int constant = 0;
+            int duplicate = 0;
+            int complement = 0;
+            int dead = 0;
+            int kept = 0;
+        };
+        std::vector<Layer> hidden;
+
+        std::string Summary() const
+        {
+            std::ostringstream ss;
+            for (size_t h = 0; h < hidden.size(); h++)
+            {
+                const Layer &layer = hidden[h];
+                ss << (h == 0 ? "" : " ") << "hidden" << h << "=" << layer.neurons << "->" << layer.kept
+                   << "(const=" << layer.constant << " dup=" << layer.duplicate << " neg=" << layer.complement << " dead=" << layer.dead << ")";
+            }
+            return ss.str();
+        }
+    };
+
+    namespace pruner_detail
+    {
+        template <typename Layer_t>
+        struct IsBitDense : std::false_type
+        {
+        };
+
+        template <typename PreviousLayer_t, int OutputBits, bool isOutputLayer, typename Optimizer_t>
+        struct IsBitDense<BitDenseLayer<PreviousLayer_t, OutputBits, isOutputLayer, Optimizer_t>> : std::true_type
+        {
+        };
+
+        template <typename Layer_t>
+        struct IsBitSign : std::false_type
+        {
+        };
+
+        template <typename PreviousLayer_t>
+        struct IsBitSign<BitSignActivation<PreviousLayer_t>> : std::true_type
+        {
+        };
+
+        /**
+         * @brief 層までに含まれるBitSignActivationの数
+         */
+        template <typename Layer_t, typename PreviousLayer_t = typename Layer_t::PreviousLayer>
+        struct SignCount
+        {
+            static constexpr int value = SignCount<PreviousLayer_t>::value + (IsBitSign<Layer_t>::value ? 1 : 0);
+        };
+
+        template <typename Layer_t>
+        struct SignCount<Layer_t, void>
+        {
+            static constexpr int value = 0;
+        };
+
+        /**
+         * @brief 全結合層の出力の求め方. popcount = zeroPop + Σ columns * x
+         */
+        struct DenseRule
+        {
+            int inDim = 0;
+            int outDim = 0;
+            bool isOutputLayer = false;
+            int32_t slope = 1;
+            // columns[i_in * outDim + i_out]: 入力ビットi_inが1のときのpopcountの変化量(±1)
+            std::vector<int32_t> columns;
+            // 隠れ層は入力0のときのpopcount，出力層は入力0のときの出力
+            std::vector<int32_t> base;
+            std::vector<int32_t> threshold;
+            std::vector<uint8_t> flip;
+        };
+    }
+
+    /**
+     * @brief 全結合ネットワークのニューロンを校正用データで枝刈りする
+     *
+     * @tparam Net_t ネットワークの型
+     */
+    template <typename Net_t>
+    class NeuronPruner
+    {
+    public:
+        using InputLayer_t = std::remove_reference_t<decltype(std::declval<Net_t &>().InputLayer())>;
+        static constexpr int INPUT_BLOCKS = InputLayer_t::PADDED_OUT_BLOCKS;
+        static constexpr int NUM_HIDDEN = pruner_detail::SignCount<Net_t>::value;
+        static_assert(pruner_detail::IsBitDense<Net_t>::value && std::is_same_v<typename Net_t::OutputType, int32_t>,
+                      "the network must end with an output BitDenseLayer");
+
+    private:
+        using DenseRule = pruner_detail::DenseRule;
+
+        const Net_t &_net;
+        // 入力側から順の全結合層
+        std::vector<DenseRule> _dense;
+        sequential_detail::ForwardArena<Net_t> _arena;
+        // _signs[h][sample * neurons + i]: 隠れ層hのニューロンiの出力
+        std::vector<std::vector<uint8_t>> _signs;
+
+        template <typename Layer_t>
+        void Export(const Layer_t &layer)
+        {
+            if constexpr (!std::is_void_v<typename Layer_t::PreviousLayer>)
+            {
+                Export(layer.PrevLayer());
+            }
+            if constexpr (pruner_detail::IsBitDense<Layer_t>::value)
+            {
+                using Prev = typename Layer_t::PreviousLayer;
+                static_assert(std::is_void_v<typename Prev::PreviousLayer> || pruner_detail::IsBitSign<Prev>::value,
+                              "a dense layer must follow the input layer or BitSignActivation");
+                DenseRule rule;
+                rule.inDim = Layer_t::COMPRESS_IN_DIM;
+                rule.outDim = Layer_t::COMPRESS_OUT_DIM;
+                rule.isOutputLayer = std::is_same_v<typename Layer_t::OutputType, int32_t>;
+                rule.columns.resize(rule.inDim * rule.outDim);
+                layer.ExportColumnDeltas(rule.columns.data(), rule.outDim);
+                std::vector<int32_t> zeroPop(rule.outDim), offset(rule.outDim);
+                rule.threshold.resize(rule.outDim);
+                rule.flip.resize(rule.outDim);
+                const int32_t slope = layer.ExportOutputRule(zeroPop.data(), offset.data(), rule.threshold.data(), rule.flip.data());
+                rule.slope = rule.isOutputLayer ? slope : 1;
+                rule.base = rule.isOutputLayer ? offset : zeroPop;
+                _dense.push_back(std::move(rule));
+            }
+            else if constexpr (pruner_detail::IsBitSign<Layer_t>::value)
+            {
+                static_assert(pruner_detail::IsBitDense<typename Layer_t::PreviousLayer>::value, "BitSignActivation must follow a dense layer");
+            }
+            else
+            {
+                static_assert(std::is_void_v<typename Layer_t::PreviousLayer>, "only dense layers and BitSignActivation can be pruned");
+            }
+        }
+
+        /**
+         * @brief 推論しながら各BitSignActivationの出力を記録する
+         */
+        template <typename Layer_t>
+        auto Record(const Layer_t &layer, const BitBlock *netInput)
+        {
+            using LayerOutput = sequential_detail::ForwardOutput_t<Layer_t>;
+            LayerOutput *output = reinterpret_cast<LayerOutput *>(_arena.bytes[sequential_detail::ActivationPlan<Layer_t>::ARENA]);
+            if constexpr (std::is_void_v<typename Layer_t::PreviousLayer>)
+            {
+                return layer.ForwardStep(netInput, output);
+            }
+            else
+            {
+                const auto *result = layer.ForwardStep(Record(layer.PrevLayer(), netInput), output);
+                if constexpr (pruner_detail::IsBitSign<Layer_t>::value)
+                {
+                    std::vector<uint8_t> &signs = _signs[pruner_detail::SignCount<Layer_t>::value - 1];
+                    for (int i = 0; i < Layer_t::COMPRESS_OUT_DIM; i++)
+                    {
+                        signs.push_back((result[GetBlockIndex(i)] >> GetBitIndexInBlock(i)) & 1);
+                    }
+                }
+                return result;
+            }
+        }
+
+        /**
+         * @brief 隠れ層のニューロンを，校正用データ上の出力が同じ（または反転）の組に分ける
+         */
+        struct Groups
+        {
+            // 代表のニューロン（定数なら-1）
+            std::vector<int> representative;
+            // 代表を反転した値を出すなら1
+            std::vector<uint8_t> negated;
+            // 定数ニューロンの値
+            std::vector<uint8_t> constant;
+            std::vector<int32_t> size;
+        };
+
+        Groups Group(int h, int numSamples, PruneReport::Layer &stats) const
+        {
+            const int neurons = _dense[h].outDim;
+            const std::vector<uint8_t> &signs = _signs[h];
+            Groups groups;
+            groups.representative.assign(neurons, -1);
+            groups.negated.assign(neurons, 0);
+            groups.constant.assign(neurons, 0);
+            groups.size.assign(neurons, 0);
+
+            std::map<std::vector<uint64_t>, int> seen;
+            std::vector<uint64_t> signature((numSamples + 63) / 64);
+            for (int i = 0; i < neurons; i++)
+            {
+                // 先頭サンプルの出力が0になる向きにそろえる
+                const uint8_t first = signs[i];
+                std::fill(signature.begin(), signature.end(), 0);
+                bool varies = false;
+                for (int s = 0; s < numSamples; s++)
+                {
+                    const uint8_t bit = signs[s * neurons + i] ^ first;
+                    signature[s / 64] |= uint64_t(bit) << (s % 64);
+                    varies = varies || bit;
+                }
+                if (!varies)
+                {
+                    groups.constant[i] = first;
+                    stats.constant++;
+                    continue;
+                }
+                const auto found = seen.emplace(signature, i);
+                const int rep = found.first->second;
+                groups.representative[i] = rep;
+                groups.negated[i] = first ^ signs[rep];
+                groups.size[rep]++;
+                if (rep != i)
+                {
+                    (groups.negated[i] ? stats.complement : stats.duplicate)++;
+                }
+            }
+            return groups;
+        }
+
+        /**
+         * @brief 全結合層の入力を代表の列にまとめた係数を求める
+         *
+         * @param rule 元の層
+         * @param rows 残す行（出力ニューロン）
+         * @param groups 入力側の隠れ層の組分け（入力層の直後ならnullptr）
+         * @param columns 残す列（代表のニューロン）
+         * @param constPops 行ごとの，取り除いた入力の寄与（popcount単位）の出力先
+         * @return std::vector<int32_t> coefs[j * columns.size() + r]
+         */
+        static std::vector<int32_t> Fold(const DenseRule &rule, const std::vector<int> &rows, const Groups *groups, const std::vector<int> &columns,
+                                         std::vector<int32_t> &constPops)
+        {
+            const int numColumns = static_cast<int>(columns.size());
+            std::vector<int> columnOf(rule.inDim, -1);
+            for (int r = 0; r < numColumns; r++)
+            {
+                columnOf[columns[r]] = r;
+            }
+
+            std::vector<int32_t> coefs(rows.size() * numColumns, 0);
+            constPops.assign(rows.size(), 0);
+            for (size_t j = 0; j < rows.size(); j++)
+            {
+                for (int i = 0; i < rule.inDim; i++)
+                {
+                    const int32_t delta = rule.columns[i * rule.outDim + rows[j]];
+                    const int rep = groups ? groups->representative[i] : i;
+                    if (rep < 0)
+                    {
+                        constPops[j] += delta * groups->constant[i];
+                        continue;
+                    }
+                    // 反転なら x_i = 1 - x_rep
+                    const bool negated = groups && groups->negated[i];
+                    if (negated)
+                    {
+                        constPops[j] += delta;
+                    }
+                    if (columnOf[rep] >= 0)
+                    {
+                        coefs[j * numColumns + columnOf[rep]] += negated ? -delta : delta;
+                    }
+                }
+            }
+            return coefs;
+        }
+
+        /**
+         * @brief 全結合層の指定した行と列から縮めた層を作る（引数はFoldと同じ）
+         */
+        static CompactLayer Compact(const DenseRule &rule, const std::vector<int> &rows, const Groups *groups, const std::vector<int> &columns)
+        {
+            CompactLayer layer;
+            layer.inDim = static_cast<int>(columns.size());
+            layer.outDim = static_cast<int>(rows.size());
+            layer.isOutputLayer = rule.isOutputLayer;
+            layer.slope = rule.slope;
+
+            std::vector<int32_t> multiplicity(layer.inDim, 1);
+            for (int r = 0; groups && r < layer.inDim; r++)
+            {
+                multiplicity[r] = groups->size[columns[r]];
+            }
+            std::vector<int32_t> constPops;
+            const std::vector<int32_t> coefs = Fold(rule, rows, groups, columns, constPops);
+            for (int j = 0; j < layer.outDim; j++)
+            {
+                layer.offset.push_back(rule.base[rows[j]] + rule.slope * constPops[j]);
+                layer.threshold.push_back(rule.threshold[rows[j]]);
+                layer.flip.push_back(rule.flip[rows[j]]);
+            }
+            layer.SetCoefficients(coefs, multiplicity);
+            return layer;
+        }
+
+    public:
+        explicit NeuronPruner(const Net_t &net) : _net(net)
+        {
+            Export(_net);
+        }
+
+        /**
+         * @brief 校正用データで枝刈りしたモデルを作る
+         *
+         * @param inputs 校正用の入力（1サンプルINPUT_BLOCKSブロック）
+         * @param numSamples サンプル数
+         * @param report 隠れ層ごとの内訳の出力先（nullptr可）
+         */
+        CompactNet Prune(const BitBlock *inputs, int numSamples, PruneReport *report = nullptr)
+        {
+            if (numSamples <= 0)
+            {
+                throw std::runtime_error("NeuronPruner: calibration set is empty");
+            }
+            _signs.assign(NUM_HIDDEN, {});
+            for (int s = 0; s < numSamples; s++)
+            {
+                Record(_net, &inputs[s * INPUT_BLOCKS]);
+            }
+
+            PruneReport localReport;
+            PruneReport &stats = report ? *report : localReport;
+            stats.hidden.assign(NUM_HIDDEN, {});
+            std::vector<Groups> groups;
+            for (int h = 0; h < NUM_HIDDEN; h++)
+            {
+                stats.hidden[h].neurons = _dense[h].outDim;
+                groups.push_back(Group(h, numSamples, stats.hidden[h]));
+            }
+
+            // 出力側から，次の層の残す行に対して係数が0でない代表だけを残す
+            std::vector<std::vector<int>> kept(NUM_HIDDEN + 1);
+            for (int i = 0; i < _dense.back().outDim; i++)
+            {
+                kept[NUM_HIDDEN].push_back(i);
+            }
+            std::vector<CompactLayer> layers(NUM_HIDDEN + 1);
+            for (int h = NUM_HIDDEN - 1; h >= 0; h--)
+            {
+                const DenseRule &next = _dense[h + 1];
+                std::vector<int> representatives;
+                for (int i = 0; i < next.inDim; i++)
+                {
+                    if (groups[h].representative[i] == i)
+                    {
+                        representatives.push_back(i);
+                    }
+                }
+                std::vector<int32_t> constPops;
+                const std::vector<int32_t> coefs = Fold(next, kept[h + 1], &groups[h], representatives, constPops);
+                for (size_t r = 0; r < representatives.size(); r++)
+                {
+                    bool used = false;
+                    for (size_t j = 0; j < kept[h + 1].size() && !used; j++)
+                    {
+                        used = coefs[j * representatives.size() + r] != 0;
+                    }
+                    if (used)
+                    {
+                        kept[h].push_back(representatives[r]);
+                    }
+                    else
+                    {
+                        stats.hidden[h].dead++;
+                    }
+                }
+                stats.hidden[h].kept = static_cast<int>(kept[h].size());
+                layers[h + 1] = Compact(next, kept[h + 1], &groups[h], kept[h]);
+            }
+
+            std::vector<int> inputs0;
+            for (int i = 0; i < _dense[0].inDim; i++)
+            {
+                inputs0.push_back(i);
+            }
+            layers[0] = Compact(_dense[0], kept[0], nullptr, inputs0);
+            return CompactNet(std::move(layers));
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,222 @@
+﻿/**
+ * @file numa_inference_pool.h
+ * @author Daichi Sato
+ * @brief NUMAノードごとに重みを複製して推論するワーカープール
+ * @version 0.1
+ * @date 2021-12-14
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * ノードごとに，そのノードに確保した領域へネットワークを構築し，推論に使う値（2値重み・バイアス・閾値）だけをコピーする。
+ * 構築とコピーはそのノードのCPUに固定したスレッドで行うので，mbindが使えない環境でもfirst-touchでノードローカルなページに載る
+ * （mbindを設定できたかはNodeBoundで分かる）。
+ * ワーカースレッドはノードのCPUに固定し，ノードの複製を読み取り専用で共有する
+ * （各層の出力はワーカーごとのアリーナに置く）。
+ * リクエストは投入したスレッドが動いているノードのキューに入れ，そのノードのワーカーが処理する。
+ *
+ */
+
+#ifndef NUMA_INFERENCE_POOL_H_INCLUDED_
+#define NUMA_INFERENCE_POOL_H_INCLUDED_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "../layers/sequential.h"
+#include "../net_common.h"
+#include "../util/numa.h"
+
+namespace bitnet
+{
+    /**
+     * @brief NUMA対応の推論ワーカープール
+     *
+     * @tparam Net_t ネットワークの型（ビット演算層からなるもの）
+     */
+    template <typename Net_t>
+    class NumaInferencePool
+    {
+    public:
+        using OutputType = std::remove_cv_t<std::remove_pointer_t<decltype(std::declval<Net_t &>().Forward(nullptr))>>;
+        using Result = std::vector<OutputType>;
+        // 入力1サンプル分のブロック数（入力層のパディング込み）
+        static constexpr int INPUT_BLOCKS = std::remove_reference_t<decltype(std::declval<Net_t &>().InputLayer())>::PADDED_OUT_BLOCKS;
+        static constexpr int OUTPUT_DIM = Net_t::COMPRESS_OUT_DIM;
+
+    private:
+        using Arena = sequential_detail::ForwardArena<Net_t>;
+
+        struct Request
+        {
+            std::vector<BitBlock> input;
+            std::promise<Result> result;
+        };
+
+        struct NodeQueue
+        {
+            std::mutex mutex;
+            std::condition_variable ready;
+            std::deque<Request> requests;
+        };
+
+        std::vector<numa::Node> _nodes;
+        std::vector<std::unique_ptr<NodeQueue>> _queues;
+        // ノードごとの推論用の複製（AllocOnNodeの領域にplacement newで構築する）と，mbindを設定できたか
+        std::vector<Net_t *> _replicas;
+        std::vector<bool> _bound;
+        // CPU番号 -> _nodesの添字
+        std::vector<int> _cpuToNode;
+        std::vector<std::thread> _workers;
+        // 各キューのmutexの下で書き込まれ，全ワーカーが読む
+        std::atomic<bool> _stopping{false};
+
+        void RunWorker(int nodeIdx, int cpu)
+        {
+            numa::PinCurrentThread({cpu});
+            const Net_t &replica = *_replicas[nodeIdx];
+            // 固定した後に確保し，ノードローカルなページに載せる
+            std::unique_ptr<Arena> arena(new Arena());
+
+            NodeQueue &queue = *_queues[nodeIdx];
+            while (true)
+            {
+                Request request;
+                {
+                    std::unique_lock<std::mutex> lock(queue.mutex);
+                    queue.ready.wait(lock, [&]
+                                     { return _stopping.load() || !queue.requests.empty(); });
+                    if (queue.requests.empty())
+                    {
+                        break;
+                    }
+                    request = std::move(queue.requests.front());
+                    queue.requests.pop_front();
+                }
+                const OutputType *output = sequential_detail::RunForward(replica, request.input.data(), *arena);
+                request.result.set_value(Result(output, output + OUTPUT_DIM));
+            }
+        }
+
+    public:
+        /**
+         * @param master 複製元のネットワーク（構築が終われば破棄してよい）
+         * @param workersPerNode ノードあたりのワーカー数（0ならノードのCPU数）
+         */
+        explicit NumaInferencePool(const Net_t &master, int workersPerNode = 0)
+            : _nodes(numa::GetNodes())
+        {
+            std::vector<std::pair<int, int>> placements;
+            for (int n = 0; n < (int)_nodes.size(); n++)
+            {
+                _queues.emplace_back(new NodeQueue());
+                bool bound;
+                void *memory = numa::AllocOnNode(sizeof(Net_t), _nodes[n].id, &bound);
+                Net_t *replica = nullptr;
+                // ノードに固定したスレッドで書き込み，ポリシーが効かなくてもfirst-touchでノードローカルにする
+                std::thread([&]
+                            {
+                                numa::PinCurrentThread(_nodes[n].cpus);
+                                replica = new (memory) Net_t();
+                                // 推論は推論用の値しか読まないので，それだけをコピーすれば複製になる
+                                replica->CopyInferenceParams(master); })
+                    .join();
+                _replicas.push_back(replica);
+                _bound.push_back(bound);
+                const std::vector<int> &cpus = _nodes[n].cpus;
+                for (int cpu : cpus)
+                {
+                    if (cpu >= (int)_cpuToNode.size())
+                    {
+                        _cpuToNode.resize(cpu + 1, 0);
+                    }
+                    _cpuToNode[cpu] = n;
+                }
+                const int numWorkers = (workersPerNode > 0) ? workersPerNode : (int)cpus.size();
+                for (int w = 0; w < numWorkers; w++)
+                {
+                    placements.emplace_back(n, cpus[w % cpus.size()]);
+                }
+            }
+
+            for (const auto &placement : placements)
+            {
+                _workers.emplace_back(&NumaInferencePool::RunWorker, this, placement.first, placement.second);
+            }
+        }
+
+        ~NumaInferencePool()
+        {
+            for (auto &queue : _queues)
+            {
+                std::lock_guard<std::mutex> lock(queue->mutex);
+                _stopping.store(true);
+            }
+            for (auto &queue : _queues)
+            {
+                queue->ready.notify_all();
+            }
+            for (auto &worker : _workers)
+            {
+                worker.join();
+            }
+            for (Net_t *replica : _replicas)
+            {
+                replica->~Net_t();
+                numa::FreeOnNode(replica, sizeof(Net_t));
+            }
+        }
+
+        NumaInferencePool(const NumaInferencePool &) = delete;
+        NumaInferencePool &operator=(const NumaInferencePool &) = delete;
+
+        const std::vector<numa::Node> &Nodes() const
+        {
+            return _nodes;
+        }
+
+        /**
+         * @brief ノードnodeIdxの複製の領域にmbindでノードを指定できたか（falseならfirst-touchのみに頼っている）
+         */
+        bool NodeBound(int nodeIdx) const
+        {
+            return _bound[nodeIdx];
+        }
+
+        /**
+         * @brief 1サンプルの推論を投入する
+         *
+         * @param input 入力 [INPUT_BLOCKS]
+         * @param nodeIdx 処理するノード（Nodes()の添字）。負なら呼び出したスレッドが動いているノード
+         * @return std::future<Result> 出力 [OUTPUT_DIM]
+         */
+        std::future<Result> Submit(const BitBlock *input, int nodeIdx = -1)
+        {
+            if (nodeIdx < 0)
+            {
+                const int cpu = numa::CurrentCpu();
+                nodeIdx = (cpu >= 0 && cpu < (int)_cpuToNode.size()) ? _cpuToNode[cpu] : 0;
+            }
+
+            Request request;
+            request.input.assign(input, input + INPUT_BLOCKS);
+            std::future<Result> result = request.result.get_future();
+            NodeQueue &queue = *_queues[nodeIdx];
+            {
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                queue.requests.push_back(std::move(request));
+            }
+            queue.ready.notify_one();
+            return result;
+        }
+    };
+}
+
+#endif
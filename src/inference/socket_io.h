@@ -0,0 +1,124 @@
+﻿/**
+ * @file socket_io.h
+ * @author Daichi Sato
+ * @brief 推論サーバーとクライアントが共有するUnixドメインソケットの通信形式
+ * @version 0.1
+ * @date 2021-12-16
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * 接続直後にサーバーがServerHelloを送り，以降は固定長のフレームをやり取りする。
+ *   リクエスト: uint64_t id, BitBlock input[inputBlocks]
+ *   レスポンス: uint64_t id, 出力[outputDim] (1要素outputBytesバイト)
+ * レスポンスの順序はリクエストの順序と一致しないことがあるため，idで対応を取る。
+ *
+ */
+
+#ifndef SOCKET_IO_H_INCLUDED_
+#define SOCKET_IO_H_INCLUDED_
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace bitnet
+{
+    namespace socket_io
+    {
+        constexpr uint32_t HELLO_MAGIC = 0x4269744e; // "BitN"
+
+        struct ServerHello
+        {
+            uint32_t magic;
+            // 入力のビット数と，パディング込みのブロック数（パディングビットは0にする）
+            uint32_t inputBits;
+            uint32_t inputBlocks;
+            uint32_t outputDim;
+            uint32_t outputBytes;
+        };
+
+        /**
+         * @brief lengthバイトを読み切る
+         * @return 相手が切断したらfalse
+         */
+        inline bool ReadAll(int fd, void *buffer, size_t length)
+        {
+            char *p = static_cast<char *>(buffer);
+            while (length > 0)
+            {
+                const ssize_t n = recv(fd, p, length, 0);
+                if (n == 0 || (n < 0 && errno != EINTR))
+                {
+                    return false;
+                }
+                if (n > 0)
+                {
+                    p += n;
+                    length -= n;
+                }
+            }
+            return true;
+        }
+
+        /**
+         * @brief lengthバイトを書き切る
+         * @return 書き込めなければfalse
+         */
+        inline bool WriteAll(int fd, const void *buffer, size_t length)
+        {
+            const char *p = static_cast<const char *>(buffer);
+            while (length > 0)
+            {
+                const ssize_t n = send(fd, p, length, MSG_NOSIGNAL);
+                if (n < 0 && errno != EINTR)
+                {
+                    return false;
+                }
+                if (n > 0)
+                {
+                    p += n;
+                    length -= n;
+                }
+            }
+            return true;
+        }
+
+        inline sockaddr_un MakeAddress(const std::string &path)
+        {
+            sockaddr_un addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(addr.sun_path))
+            {
+                throw std::runtime_error("Socket path too long: " + path);
+            }
+            strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+            return addr;
+        }
+
+        /**
+         * @brief サーバーに接続する
+         */
+        inline int Connect(const std::string &path)
+        {
+            const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            const sockaddr_un addr = MakeAddress(path);
+            if (fd < 0 || connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0)
+            {
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+                throw std::runtime_error("Failed to connect: " + path + " (" + strerror(errno) + ")");
+            }
+            return fd;
+        }
+    }
+}
+
+#endif
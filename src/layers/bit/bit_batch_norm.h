@@ -0,0 +1,303 @@
+﻿/**
+ * @file bit_batch_norm.h
+ * @author Daichi Sato
+ * @brief ビット演算全結合層用のバッチ正規化層
+ * @version 0.1
+ * @date 2021-12-05
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * BitDenseLayerとBitSignActivationの間に挟んで使う。
+ * 学習時は前の層の積和をバッチ正規化して符号層に渡す。
+ * 推論時は平均・分散・スケール・シフトを前の層のpopcount閾値と符号反転ビットに畳み込むため，
+ * この層自体は何も計算しない。
+ *
+ */
+#ifndef BIT_BATCH_NORM_H_
+#define BIT_BATCH_NORM_H_
+
+#include "../../net_common.h"
+#include "../../optimizer/optimizer.h"
+#include "../../util/bit_helper.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+namespace bitnet
+{
+	/**
+	 * @brief バッチ正規化層
+	 *
+	 * @tparam PreviousLayer_t 前のレイヤー型（BitDenseLayer）
+	 */
+	template <typename PreviousLayer_t>
+	class BitBatchNorm
+	{
+	public:
+		using OutputType = int8_t;
+		using PreviousLayer = PreviousLayer_t;
+		// 推論では前の層の出力をそのまま返す（Sequentialは出力用のバッファを割り当てない）
+		static constexpr bool FORWARD_IN_PLACE = true;
+		// 出力次元数
+		static constexpr int COMPRESS_OUT_DIM = PreviousLayer_t::COMPRESS_OUT_DIM;
+		static constexpr int PADDED_OUT_BLOCKS = PreviousLayer_t::PADDED_OUT_BLOCKS;
+		// 入力次元数
+		static constexpr int COMPRESS_IN_DIM = COMPRESS_OUT_DIM;
+
+		// 移動平均の係数
+		static constexpr double MOMENTUM = 0.9;
+		static constexpr double EPSILON = 1e-5;
+
+	private:
+		// バッチ学習版出力バッファ（正規化後の値を丸めたもの
+		alignas(32) OutputType _outputBatchBuffer[BATCH_SIZE * PADDED_OUT_BLOCKS] = {0};
+		// 前の層
+		PreviousLayer_t _prevLayer;
+		// スケールとシフト
+		double _gamma[COMPRESS_OUT_DIM] = {0};
+		double _beta[COMPRESS_OUT_DIM] = {0};
+		// 推論用の平均と分散（移動平均
+		double _runningMean[COMPRESS_OUT_DIM] = {0};
+		double _runningVar[COMPRESS_OUT_DIM] = {0};
+
+#pragma region Train
+		// 前の層に伝播する勾配
+		GradientType _gradsToPrev[BATCH_SIZE * COMPRESS_IN_DIM] = {0};
+		// 正規化後（スケール・シフト前）の値
+		float _normalized[BATCH_SIZE * COMPRESS_OUT_DIM] = {0};
+		// バッチの標準偏差の逆数
+		double _invStd[COMPRESS_OUT_DIM] = {0};
+#pragma endregion
+
+		/**
+		 * @brief 正規化を前の層の符号判定閾値に畳み込む
+		 */
+		void Fold()
+		{
+			double tau[COMPRESS_OUT_DIM];
+			bool negative[COMPRESS_OUT_DIM];
+			for (int i = 0; i < COMPRESS_OUT_DIM; i++)
+			{
+				// gamma * (s - mean) / std + beta > 0 <=> s > mean - beta * std / gamma (gamma < 0なら不等号反転)
+				const double std = std::sqrt(_runningVar[i] + EPSILON);
+				if (_gamma[i] != 0)
+				{
+					tau[i] = _runningMean[i] - _beta[i] * std / _gamma[i];
+					negative[i] = _gamma[i] < 0;
+				}
+				else
+				{
+					// 入力によらず出力はbetaの符号で一定
+					tau[i] = (_beta[i] > 0) ? -std::numeric_limits<double>::infinity() : std::numeric_limits<double>::infinity();
+					negative[i] = false;
+				}
+			}
+			_prevLayer.FoldSignThreshold(tau, negative);
+		}
+
+	public:
+		void Init()
+		{
+			memset(_outputBatchBuffer, 0, sizeof(OutputType) * BATCH_SIZE * PADDED_OUT_BLOCKS);
+			_prevLayer.Init();
+		}
+
+		void Save(std::ostream &fs)
+		{
+			int dim = COMPRESS_OUT_DIM;
+			fs.write(reinterpret_cast<char *>(&dim), sizeof(int));
+			fs.write(reinterpret_cast<char *>(_gamma), sizeof(double) * COMPRESS_OUT_DIM);
+			fs.write(reinterpret_cast<char *>(_beta), sizeof(double) * COMPRESS_OUT_DIM);
+			fs.write(reinterpret_cast<char *>(_runningMean), sizeof(double) * COMPRESS_OUT_DIM);
+			fs.write(reinterpret_cast<char *>(_runningVar), sizeof(double) * COMPRESS_OUT_DIM);
+
+			_prevLayer.Save(fs);
+		}
+
+		void Load(std::istream &fs)
+		{
+			int dim;
+			fs.read(reinterpret_cast<char *>(&dim), sizeof(int));
+
+			if (dim != COMPRESS_OUT_DIM)
+			{
+				throw std::runtime_error("Invalid Model   code dim:" + std::to_string(COMPRESS_OUT_DIM) + "load dim:" + std::to_string(dim));
+			}
+
+			fs.read(reinterpret_cast<char *>(_gamma), sizeof(double) * COMPRESS_OUT_DIM);
+			fs.read(reinterpret_cast<char *>(_beta), sizeof(double) * COMPRESS_OUT_DIM);
+			fs.read(reinterpret_cast<char *>(_runningMean), sizeof(double) * COMPRESS_OUT_DIM);
+			fs.read(reinterpret_cast<char *>(_runningVar), sizeof(double) * COMPRESS_OUT_DIM);
+
+			_prevLayer.Load(fs);
+			// 前の層の2値化後に閾値を上書きする
+			Fold();
+		}
+
+		void SaveOptimizer(std::ostream &fs) { _prevLayer.SaveOptimizer(fs); }
+		void LoadOptimizer(std::istream &fs) { _prevLayer.LoadOptimizer(fs); }
+
+		/**
+		 * @brief 推論時の正規化は前の層の閾値に畳み込み済みなので，前の層の値だけをコピーする
+		 */
+		void CopyInferenceParams(const BitBatchNorm &src) { _prevLayer.CopyInferenceParams(src._prevLayer); }
+		void SetOptimizerParams(const OptimizerParams &params) { _prevLayer.SetOptimizerParams(params); }
+
+		const OutputType *Forward(const BitBlock *netInput)
+		{
+			// 正規化は前の層の閾値に畳み込み済み
+			return _prevLayer.Forward(netInput);
+		}
+
+		const OutputType *ForwardBatch(const BitBlock *netInput, int n)
+		{
+			return _prevLayer.ForwardBatch(netInput, n);
+		}
+
+		const OutputType *ForwardStep(const OutputType *input, OutputType *output) const
+		{
+			return input;
+		}
+
+		void ResetWeight()
+		{
+			for (int i = 0; i < COMPRESS_OUT_DIM; i++)
+			{
+				_gamma[i] = 1;
+				_beta[i] = 0;
+				_runningMean[i] = 0;
+				_runningVar[i] = 1;
+			}
+			_prevLayer.ResetWeight();
+			Fold();
+		}
+
+		/**
+		 * @brief 現在の統計量とスケール・シフトを前の層の閾値に畳み込む（エクスポート用）
+		 */
+		void Binarize()
+		{
+			Fold();
+		}
+
+		int SignFlipCount() const
+		{
+			return _prevLayer.SignFlipCount();
+		}
+
+		/**
+		 * @brief 最も入力側の層（パイプライン学習でステージ境界の勾配を取り出すのに使う）
+		 */
+		auto &InputLayer()
+		{
+			return _prevLayer.InputLayer();
+		}
+
+		PreviousLayer_t &PrevLayer()
+		{
+			return _prevLayer;
+		}
+
+		const PreviousLayer_t &PrevLayer() const
+		{
+			return _prevLayer;
+		}
+
+#pragma region Train
+		/**
+		 * @brief 学習時の順伝播で書き込み，逆伝播で参照するバッファをfunc(ptr, bytes)に渡す（この層以前）.
+		 * 移動平均は順伝播のたびに更新するものなので含めない
+		 */
+		template <typename Func_t>
+		void ForEachTrainBuffer(Func_t &&func)
+		{
+			func(_outputBatchBuffer, sizeof(_outputBatchBuffer));
+			func(_normalized, sizeof(_normalized));
+			func(_invStd, sizeof(_invStd));
+			_prevLayer.ForEachTrainBuffer(func);
+		}
+
+		OutputType *TrainForward(const BitBlock *netInput)
+		{
+			_prevLayer.TrainForward(netInput);
+			const int32_t *sums = _prevLayer.GetBatchSums();
+
+			for (int i = 0; i < COMPRESS_OUT_DIM; i++)
+			{
+				double mean = 0;
+				for (int b = 0; b < BATCH_SIZE; b++)
+				{
+					mean += sums[b * COMPRESS_OUT_DIM + i];
+				}
+				mean /= BATCH_SIZE;
+
+				double var = 0;
+				for (int b = 0; b < BATCH_SIZE; b++)
+				{
+					const double diff = sums[b * COMPRESS_OUT_DIM + i] - mean;
+					var += diff * diff;
+				}
+				var /= BATCH_SIZE;
+
+				_runningMean[i] = MOMENTUM * _runningMean[i] + (1 - MOMENTUM) * mean;
+				_runningVar[i] = MOMENTUM * _runningVar[i] + (1 - MOMENTUM) * var;
+				_invStd[i] = 1.0 / std::sqrt(var + EPSILON);
+
+				for (int b = 0; b < BATCH_SIZE; b++)
+				{
+					const double normalized = (sums[b * COMPRESS_OUT_DIM + i] - mean) * _invStd[i];
+					_normalized[b * COMPRESS_OUT_DIM + i] = normalized;
+					// 次のsign層は整数のhard-tanhで確率的に2値化する
+					const double y = std::round(_gamma[i] * normalized + _beta[i]);
+					_outputBatchBuffer[b * PADDED_OUT_BLOCKS + i] = static_cast<OutputType>(std::max(-128.0, std::min(127.0, y)));
+				}
+			}
+			return _outputBatchBuffer;
+		}
+
+		void TrainBackward(const GradientType *nextGrad)
+		{
+			for (int i = 0; i < COMPRESS_OUT_DIM; i++)
+			{
+				double gradSum = 0;
+				double gradDotNormalized = 0;
+				for (int b = 0; b < BATCH_SIZE; b++)
+				{
+					const GradientType g = nextGrad[b * COMPRESS_OUT_DIM + i];
+					gradSum += g;
+					gradDotNormalized += g * _normalized[b * COMPRESS_OUT_DIM + i];
+				}
+
+				// 勾配は更新方向(lr込み)で渡ってくるのでそのまま加算する
+				const double scale = _gamma[i] * _invStd[i] / BATCH_SIZE;
+				for (int b = 0; b < BATCH_SIZE; b++)
+				{
+					const int idx = b * COMPRESS_OUT_DIM + i;
+					_gradsToPrev[idx] = scale * (BATCH_SIZE * nextGrad[idx] - gradSum - _normalized[idx] * gradDotNormalized);
+				}
+				_gamma[i] += gradDotNormalized;
+				_beta[i] += gradSum;
+			}
+
+			_prevLayer.TrainBackward(_gradsToPrev);
+			// 前の層の2値化で閾値がバイアスのみに戻るので畳み込み直す
+			Fold();
+		}
+
+		/**
+		 * @brief 正規化の逆伝播では勾配がバッチ全体に広がるため，生きている組のリストは使わない
+		 */
+		template <typename LiveList_t>
+		void TrainBackward(const GradientType *nextGrad, const LiveList_t &)
+		{
+			TrainBackward(nextGrad);
+		}
+#pragma endregion
+	};
+}
+
+#endif
@@ -0,0 +1,455 @@
+﻿/**
+ * @file bit_conv2d.h
+ * @author Daichi Sato
+ * @brief ビット演算2次元畳み込み層の定義
+ * @version 0.1
+ * @date 2021-12-04
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * 入出力は画素ごとにチャネルを詰めたビット列(HWC順)として扱う。
+ * カーネル1行分(K画素×入力チャネル)は入力ビット列上で連続しているため，
+ * im2colを作らずに行単位で切り出してXNOR-popcountを計算する。
+ *
+ */
+
+#ifndef BIT_CONV2D_H_INCLUDED_
+#define BIT_CONV2D_H_INCLUDED_
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include "../../util/random_util.h"
+#include "../../net_common.h"
+#include "../../optimizer/optimizer.h"
+#include "../../util/bit_helper.h"
+
+namespace bitnet
+{
+	/**
+	 * @brief ビット演算2次元畳み込み層（パディング無し）。bitBlock入力int8出力
+	 *
+	 * @tparam PreviousLayer_t 前の層の型
+	 * @tparam Height 入力の高さ
+	 * @tparam Width 入力の幅
+	 * @tparam InChannels 入力チャネル数
+	 * @tparam OutChannels 出力チャネル数（フィルタ数
+	 * @tparam KernelSize カーネルの一辺の長さ
+	 * @tparam Stride ストライド(default:1)
+	 */
+	template <typename PreviousLayer_t, int Height, int Width, int InChannels, int OutChannels, int KernelSize, int Stride = 1>
+	class BitConv2D
+	{
+	public:
+		using OutputType = int8_t;
+		using PreviousLayer = PreviousLayer_t;
+		// 入力次元（前の層のニューロン）の数
+		static constexpr int COMPRESS_IN_DIM = PreviousLayer_t::COMPRESS_OUT_DIM;
+		static constexpr int PADDED_IN_BITS = AddPaddingToBitSize(COMPRESS_IN_DIM);
+		static constexpr int PADDED_IN_BLOCKS = BitToBlockCount(PADDED_IN_BITS);
+		static_assert(COMPRESS_IN_DIM == Height * Width * InChannels, "previous layer output must be Height x Width x InChannels");
+
+		// 出力の形状
+		static constexpr int OUT_HEIGHT = (Height - KernelSize) / Stride + 1;
+		static constexpr int OUT_WIDTH = (Width - KernelSize) / Stride + 1;
+		static constexpr int OUT_CHANNELS = OutChannels;
+		static_assert(OUT_HEIGHT > 0 && OUT_WIDTH > 0, "kernel is larger than input");
+
+		// 出力次元（ニューロン）の数
+		static constexpr int COMPRESS_OUT_DIM = OUT_HEIGHT * OUT_WIDTH * OutChannels;
+		static constexpr int PADDED_OUT_BLOCKS = AddPaddingToBytes(COMPRESS_OUT_DIM);
+
+		// カーネル1行分（K画素×入力チャネル）のビット数
+		static constexpr int KERNEL_ROW_BITS = KernelSize * InChannels;
+		// popcnt単位(64bit)にパディングしたカーネル1行分のワード数
+		static constexpr int KERNEL_ROW_WORDS = (KERNEL_ROW_BITS + POPCNT_BIT_WIDTH - 1) / POPCNT_BIT_WIDTH;
+		static constexpr int KERNEL_ROW_PADDING_BITS = KERNEL_ROW_WORDS * POPCNT_BIT_WIDTH - KERNEL_ROW_BITS;
+		// フィルタ1枚分の重み数
+		static constexpr int KERNEL_DIM = KernelSize * KERNEL_ROW_BITS;
+
+	private:
+#pragma region Train
+		// 勾配法用の実数値重み [出力チャネル][ky][kx][入力チャネル]
+		alignas(32) float _realWeight[OutChannels][KERNEL_DIM] = {0};
+		// バッチ学習版出力バッファ（学習時はこちらのバッファを使用する
+		alignas(32) OutputType _outputBatchBuffer[BATCH_SIZE * PADDED_OUT_BLOCKS] = {0};
+#pragma endregion
+		// 出力バッファ（次の層が参照する
+		alignas(32) OutputType _outputBuffer[PADDED_OUT_BLOCKS] = {0};
+		// 2値重み(-1 or 1) [出力チャネル][ky][64bitワード]。パディング部は0
+		alignas(32) uint64_t _weight[OutChannels][KernelSize][KERNEL_ROW_WORDS] = {0};
+		// 前の層
+		PreviousLayer_t _prevLayer;
+		// バイアス
+		int _bias[OutChannels] = {0};
+
+#pragma region Train
+		// 前の層に伝播する勾配
+		GradientType _gradsToPrev[BATCH_SIZE * COMPRESS_IN_DIM] = {0};
+		// 勾配法用の実数値バイアス
+		double _realBias[OutChannels] = {0};
+		// 勾配計算用の入力バッファ（実態は前の層の出力バッファを参照するポインタ
+		BitBlock *_inputBatchBuffer;
+		// 直前の学習ステップで符号が反転した実数値重みの数
+		int _signFlipCount = 0;
+#pragma endregion
+
+		// 入力ビット列上での受容野の行(ky)の先頭ビット位置
+		static constexpr int ReceptiveRowOffset(int oy, int ox, int ky)
+		{
+			return ((oy * Stride + ky) * Width + ox * Stride) * InChannels;
+		}
+
+		/**
+		 * @brief 1出力画素分の受容野をカーネル行単位で切り出す（パディング部は0）
+		 */
+		void GatherReceptiveField(const BitBlock *input, int oy, int ox, uint64_t patch[KernelSize][KERNEL_ROW_WORDS]) const
+		{
+			for (int ky = 0; ky < KernelSize; ky++)
+			{
+				const int rowOffset = ReceptiveRowOffset(oy, ox, ky);
+				for (int word = 0; word < KERNEL_ROW_WORDS; word++)
+				{
+					const int bitLength = std::min(POPCNT_BIT_WIDTH, KERNEL_ROW_BITS - word * POPCNT_BIT_WIDTH);
+					patch[ky][word] = LoadBits64(input, rowOffset + word * POPCNT_BIT_WIDTH, bitLength);
+				}
+			}
+		}
+
+		/**
+		 * @brief 受容野とフィルタの±1積和にバイアスを加えた値を計算する
+		 */
+		int32_t ConvolvePatch(const uint64_t patch[KernelSize][KERNEL_ROW_WORDS], int outChannel) const
+		{
+			int32_t pop = 0;
+			for (int ky = 0; ky < KernelSize; ky++)
+			{
+				for (int word = 0; word < KERNEL_ROW_WORDS; word++)
+				{
+					pop += _mm_popcnt_u64(~(patch[ky][word] ^ _weight[outChannel][ky][word]));
+				}
+			}
+			// パディングビットは入力・重みとも0なのでXNORで1として数えられている
+			pop -= KernelSize * KERNEL_ROW_PADDING_BITS;
+			return 2 * pop - KERNEL_DIM + _bias[outChannel];
+		}
+
+	public:
+		void Init()
+		{
+			memset(_outputBatchBuffer, 0, sizeof(OutputType) * BATCH_SIZE * PADDED_OUT_BLOCKS);
+			memset(_outputBuffer, 0, sizeof(OutputType) * PADDED_OUT_BLOCKS);
+			memset(_weight, 0, sizeof(_weight));
+			_prevLayer.Init();
+		}
+
+		void Save(std::ostream &fs)
+		{
+			int dim = COMPRESS_OUT_DIM;
+			fs.write(reinterpret_cast<char *>(&dim), sizeof(int));
+			fs.write(reinterpret_cast<char *>(_realBias), sizeof(double) * OutChannels);
+			fs.write(reinterpret_cast<char *>(_realWeight), sizeof(float) * OutChannels * KERNEL_DIM);
+
+			_prevLayer.Save(fs);
+		}
+
+		void Load(std::istream &fs)
+		{
+			int dim;
+			fs.read(reinterpret_cast<char *>(&dim), sizeof(int));
+
+			if (dim != COMPRESS_OUT_DIM)
+			{
+				throw std::runtime_error("Invalid Model   code dim:" + std::to_string(COMPRESS_OUT_DIM) + "load dim:" + std::to_string(dim));
+			}
+
+			fs.read(reinterpret_cast<char *>(_realBias), sizeof(double) * OutChannels);
+			fs.read(reinterpret_cast<char *>(_realWeight), sizeof(float) * OutChannels * KERNEL_DIM);
+
+			// ロードした重みをforward用に2値化して適用
+			Binarize();
+
+			_prevLayer.Load(fs);
+		}
+
+		void SaveOptimizer(std::ostream &fs) { _prevLayer.SaveOptimizer(fs); }
+		void LoadOptimizer(std::istream &fs) { _prevLayer.LoadOptimizer(fs); }
+
+		/**
+		 * @brief 推論に使う値（2値フィルタとバイアス）だけをsrcからコピーする
+		 */
+		void CopyInferenceParams(const BitConv2D &src)
+		{
+			memcpy(_weight, src._weight, sizeof(_weight));
+			memcpy(_bias, src._bias, sizeof(_bias));
+			_prevLayer.CopyInferenceParams(src._prevLayer);
+		}
+
+		// 重みの更新はSGD固定
+		void SetOptimizerParams(const OptimizerParams &params) { _prevLayer.SetOptimizerParams(params); }
+
+		const OutputType *Forward(const BitBlock *netInput)
+		{
+			return ForwardStep(_prevLayer.Forward(netInput), _outputBuffer);
+		}
+
+		/**
+		 * @brief この層だけの推論. outputにはパディングまで書き込む（Sequentialのバッファ共有用）
+		 */
+		const OutputType *ForwardStep(const BitBlock *input, OutputType *output) const
+		{
+			uint64_t patch[KernelSize][KERNEL_ROW_WORDS];
+			for (int oy = 0; oy < OUT_HEIGHT; oy++)
+			{
+				for (int ox = 0; ox < OUT_WIDTH; ox++)
+				{
+					GatherReceptiveField(input, oy, ox, patch);
+					const int pixelShift = (oy * OUT_WIDTH + ox) * OutChannels;
+					for (int co = 0; co < OutChannels; co++)
+					{
+						const int32_t result = ConvolvePatch(patch, co);
+						// 次のsign層で符号ビットが分かればいい
+						output[pixelShift + co] = static_cast<OutputType>(result > 0);
+					}
+				}
+			}
+			memset(&output[COMPRESS_OUT_DIM], 0, sizeof(OutputType) * (PADDED_OUT_BLOCKS - COMPRESS_OUT_DIM));
+
+			return output;
+		}
+
+		const OutputType *ForwardBatch(const BitBlock *netInput, int n)
+		{
+			const BitBlock *input = _prevLayer.ForwardBatch(netInput, n);
+
+			uint64_t patch[KernelSize][KERNEL_ROW_WORDS];
+			for (int b = 0; b < n; b++)
+			{
+				for (int oy = 0; oy < OUT_HEIGHT; oy++)
+				{
+					for (int ox = 0; ox < OUT_WIDTH; ox++)
+					{
+						GatherReceptiveField(&input[b * PADDED_IN_BLOCKS], oy, ox, patch);
+						const int pixelShift = b * PADDED_OUT_BLOCKS + (oy * OUT_WIDTH + ox) * OutChannels;
+						for (int co = 0; co < OutChannels; co++)
+						{
+							_outputBatchBuffer[pixelShift + co] = static_cast<OutputType>(ConvolvePatch(patch, co) > 0);
+						}
+					}
+				}
+			}
+
+			return _outputBatchBuffer;
+		}
+
+		void ResetWeight()
+		{
+			for (int co = 0; co < OutChannels; co++)
+			{
+				_realBias[co] = 0;
+				for (int i = 0; i < KERNEL_DIM; i++)
+				{
+					_realWeight[co][i] = Random::GetReal01() * 2 - 1;
+				}
+			}
+			Binarize();
+
+			_prevLayer.ResetWeight();
+		}
+
+		void Binarize()
+		{
+			for (int co = 0; co < OutChannels; co++)
+			{
+				_bias[co] = _realBias[co];
+				for (int ky = 0; ky < KernelSize; ky++)
+				{
+					float *const realRow = &_realWeight[co][ky * KERNEL_ROW_BITS];
+					uint64_t *const bitRow = _weight[co][ky];
+					std::fill(bitRow, bitRow + KERNEL_ROW_WORDS, 0);
+					for (int i = 0; i < KERNEL_ROW_BITS; i++)
+					{
+						// Clipping
+						const float tmp_w = std::max(-1.0f, std::min(1.0f, realRow[i]));
+						realRow[i] = tmp_w;
+						bitRow[i / POPCNT_BIT_WIDTH] |= static_cast<uint64_t>(tmp_w > 0) << (i % POPCNT_BIT_WIDTH);
+					}
+				}
+			}
+		}
+
+		/**
+		 * @brief 直前の学習ステップで符号が反転した実数値重みの数（この層以前の合計）
+		 */
+		int SignFlipCount() const
+		{
+			return _signFlipCount + _prevLayer.SignFlipCount();
+		}
+
+		/**
+		 * @brief 最も入力側の層（パイプライン学習でステージ境界の勾配を取り出すのに使う）
+		 */
+		auto &InputLayer()
+		{
+			return _prevLayer.InputLayer();
+		}
+
+		PreviousLayer_t &PrevLayer()
+		{
+			return _prevLayer;
+		}
+
+		const PreviousLayer_t &PrevLayer() const
+		{
+			return _prevLayer;
+		}
+
+#pragma region Train
+		/**
+		 * @brief 学習時の順伝播で書き込み，逆伝播で参照するバッファをfunc(ptr, bytes)に渡す（この層以前）
+		 */
+		template <typename Func_t>
+		void ForEachTrainBuffer(Func_t &&func)
+		{
+			func(_outputBatchBuffer, sizeof(_outputBatchBuffer));
+			_prevLayer.ForEachTrainBuffer(func);
+		}
+
+		OutputType *TrainForward(const BitBlock *netInput)
+		{
+			_inputBatchBuffer = _prevLayer.TrainForward(netInput);
+
+			uint64_t patch[KernelSize][KERNEL_ROW_WORDS];
+			for (int b = 0; b < BATCH_SIZE; b++)
+			{
+				const BitBlock *input = &_inputBatchBuffer[b * PADDED_IN_BLOCKS];
+				const int batchShiftOut = b * PADDED_OUT_BLOCKS;
+				for (int oy = 0; oy < OUT_HEIGHT; oy++)
+				{
+					for (int ox = 0; ox < OUT_WIDTH; ox++)
+					{
+						GatherReceptiveField(input, oy, ox, patch);
+						const int pixelShift = batchShiftOut + (oy * OUT_WIDTH + ox) * OutChannels;
+						for (int co = 0; co < OutChannels; co++)
+						{
+							const int32_t result = ConvolvePatch(patch, co);
+							// 全結合層と同じく，次のsign層で符号と-1/0/1の区別が付くよう詰める
+							constexpr int32_t MSB32 = 1 << 31;
+							_outputBatchBuffer[pixelShift + co] = static_cast<OutputType>((result & MSB32) >> 24 | result);
+						}
+					}
+				}
+			}
+
+			return _outputBatchBuffer;
+		}
+
+		void TrainBackward(const GradientType *nextGrad)
+		{
+			// 勾配更新
+			UpdateGrad(nextGrad);
+
+			UpdateWeights(nextGrad);
+
+			// 2値化
+			Binarize();
+
+			_prevLayer.TrainBackward(_gradsToPrev);
+		}
+
+		/**
+		 * @brief 出力の各画素が重みを共有するため，生きている組のリストは使わずに密に逆伝播する
+		 */
+		template <typename LiveList_t>
+		void TrainBackward(const GradientType *nextGrad, const LiveList_t &)
+		{
+			TrainBackward(nextGrad);
+		}
+
+		void UpdateGrad(const GradientType *nextGrad)
+		{
+			std::fill(_gradsToPrev, _gradsToPrev + BATCH_SIZE * COMPRESS_IN_DIM, 0.0f);
+			for (int b = 0; b < BATCH_SIZE; b++)
+			{
+				GradientType *const grads = &_gradsToPrev[b * COMPRESS_IN_DIM];
+				const int batchShiftOut = b * COMPRESS_OUT_DIM;
+				for (int oy = 0; oy < OUT_HEIGHT; oy++)
+				{
+					for (int ox = 0; ox < OUT_WIDTH; ox++)
+					{
+						const int pixelShift = batchShiftOut + (oy * OUT_WIDTH + ox) * OutChannels;
+						for (int co = 0; co < OutChannels; co++)
+						{
+							const GradientType g = nextGrad[pixelShift + co];
+							if (g == 0)
+							{
+								continue;
+							}
+							for (int ky = 0; ky < KernelSize; ky++)
+							{
+								// 受容野の1行は入力上で連続している
+								GradientType *const gradRow = &grads[ReceptiveRowOffset(oy, ox, ky)];
+								const float *const realRow = &_realWeight[co][ky * KERNEL_ROW_BITS];
+								for (int i = 0; i < KERNEL_ROW_BITS; i++)
+								{
+									gradRow[i] += g * sgn(realRow[i]);
+								}
+							}
+						}
+					}
+				}
+			}
+		}
+
+		void UpdateWeights(const GradientType *nextGrad)
+		{
+			_signFlipCount = 0;
+			for (int b = 0; b < BATCH_SIZE; b++)
+			{
+				const BitBlock *input = &_inputBatchBuffer[b * PADDED_IN_BLOCKS];
+				const int batchShiftOut = b * COMPRESS_OUT_DIM;
+				for (int oy = 0; oy < OUT_HEIGHT; oy++)
+				{
+					for (int ox = 0; ox < OUT_WIDTH; ox++)
+					{
+						const int pixelShift = batchShiftOut + (oy * OUT_WIDTH + ox) * OutChannels;
+						for (int co = 0; co < OutChannels; co++)
+						{
+							const GradientType g = nextGrad[pixelShift + co];
+							if (g == 0)
+							{
+								continue;
+							}
+
+							_realBias[co] += g;
+							for (int ky = 0; ky < KernelSize; ky++)
+							{
+								const int rowOffset = ReceptiveRowOffset(oy, ox, ky);
+								float *const realRow = &_realWeight[co][ky * KERNEL_ROW_BITS];
+								for (int i = 0; i < KERNEL_ROW_BITS; i++)
+								{
+									const int bitIndex = rowOffset + i;
+									const float before = realRow[i];
+									if ((input[GetBlockIndex(bitIndex)] >> GetBitIndexInBlock(bitIndex)) & 1)
+									{
+										realRow[i] += g;
+									}
+									else
+									{
+										realRow[i] -= g;
+									}
+									_signFlipCount += (before > 0) != (realRow[i] > 0);
+								}
+							}
+						}
+					}
+				}
+			}
+		}
+
+#pragma endregion
+	};
+}
+#endif
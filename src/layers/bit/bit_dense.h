@@ -21,29 +21,90 @@
 #include <fstream>
 #include <stdexcept>
 #include <string>
+#include <vector>
 #include "../../util/random_util.h"
 #include "../../net_common.h"
 #include "../../util/bit_helper.h"
+#include "../../util/live_grad_list.h"
+#include "../../optimizer/optimizer.h"
+#include "../../loss/loss.h"
 
 namespace bitnet
 {
+	/**
+	 * @brief 2値重み(-1, +1)の表現。符号ビット列だけを持つ（マスクの引数は使わない）
+	 */
+	struct BinaryWeight
+	{
+		static constexpr bool TERNARY = false;
+
+		/**
+		 * @brief 入力と重みの1ブロック分の一致ビット
+		 */
+		static BitBlock Matches(BitBlock input, BitBlock sign, BitBlock)
+		{
+			return ~(input ^ sign);
+		}
+
+		template <int Length>
+		static int32_t CountMatches(const BitBlock *input, const BitBlock *signs, const BitBlock *)
+		{
+			return MaddPopcntDispatched<Length>(input, signs);
+		}
+
+		/**
+		 * @brief 1行分の実数値重みをクリッピングして詰める
+		 * @return int 値が変わった重みの数
+		 */
+		static int PackRow(float *weights, BitBlock *signs, BitBlock *, int length)
+		{
+			return ClipAndPackSigns(weights, signs, length);
+		}
+
+		/**
+		 * @brief 重みの値(±1)を係数としてgradを加算する（前の層への勾配）
+		 */
+		template <int Length>
+		static void AddGrad(float *dst, float grad, const BitBlock *signs, const BitBlock *)
+		{
+			AddSignedGrad<Length>(dst, grad, signs);
+		}
+	};
+
 	/**
 	 * @brief ビット演算全結合層。bitBlock入力double出力
 	 * 
 	 * @tparam PreviousLayer_t 前の層の型
 	 * @tparam OutputBits 出力次元数（ニューロン数
 	 * @tparam isOutputLayer 出力層ならtrue(default:false)
+	 * @tparam Optimizer_t 実数値重みの更新則(default:SGD)
+	 * @tparam Weight_t 重みの表現(default:BinaryWeight。3値ならTernaryWeight)
 	 */
-	template <typename PreviousLayer_t, int OutputBits, bool isOutputLayer = false>
+	template <typename PreviousLayer_t, int OutputBits, bool isOutputLayer = false, typename Optimizer_t = SGD, typename Weight_t = BinaryWeight>
 	class BitDenseLayer
 	{
 	public:
 		using OutputType = typename std::conditional<isOutputLayer, int32_t, int8_t>::type;
+		using PreviousLayer = PreviousLayer_t;
 		// 入力次元（前の層のニューロン）の数
 		static constexpr int COMPRESS_IN_DIM = PreviousLayer_t::COMPRESS_OUT_DIM;
 		static constexpr int PADDED_IN_BITS = AddPaddingToBitSize(COMPRESS_IN_DIM);
 		static constexpr int PADDED_IN_BLOCKS = BitToBlockCount(PADDED_IN_BITS);
 		static constexpr int PADDING_BITS = PADDED_IN_BITS - COMPRESS_IN_DIM;
+		// 入力1要素あたりのビットプレーン数（多ビット活性化の後ろなら2以上）と1サンプル分の入力ブロック数
+		static constexpr int INPUT_PLANES = ActivationPlanes<PreviousLayer_t>::value;
+		// 入力が有効な特徴の添字リスト（SparseBitInputLayer）なら，重みの列優先コピーから有効な列だけを集計する
+		static constexpr bool SPARSE_INDEX_INPUT = SparseIndexInput<PreviousLayer_t>::value;
+		static constexpr int INPUT_STRIDE_BLOCKS = SPARSE_INDEX_INPUT ? PreviousLayer_t::PADDED_OUT_BLOCKS : PADDED_IN_BLOCKS * INPUT_PLANES;
+		// 潜在重みと逆伝播を固定小数点(int16)で扱う学習モード（FixedPointSGD）
+		static constexpr bool FIXED_POINT = FixedPointOptimizer<Optimizer_t>::value;
+		static_assert(!FIXED_POINT || (INPUT_PLANES == 1 && !SPARSE_INDEX_INPUT), "fixed-point training supports 1-bit dense inputs only");
+		using LatentWeight = typename std::conditional<FIXED_POINT, int16_t, float>::type;
+		// 3値重みは符号ビット列に非ゼロのビット列（マスク）を重ねて持つ
+		static constexpr bool TERNARY_WEIGHT = Weight_t::TERNARY;
+		static_assert(!TERNARY_WEIGHT || (INPUT_PLANES == 1 && !SPARSE_INDEX_INPUT && !FIXED_POINT), "ternary weights support 1-bit dense inputs with float latent weights only");
+		// プレーンjを重み2^jで合成した入力値の最大絶対値
+		static constexpr int INPUT_SCALE = (1 << INPUT_PLANES) - 1;
 
 		// 出力次元（ニューロン）の数
 		static constexpr int COMPRESS_OUT_DIM = OutputBits;
@@ -51,50 +112,420 @@ namespace bitnet
 
 	private:
 #pragma region Train
-		// 勾配法用の実数値重み
-		alignas(32) float _realWeight[COMPRESS_OUT_DIM][COMPRESS_IN_DIM] = {0};
+		// 勾配法用の実数値重み（固定小数点モードではFixedOne()を1.0とするint16）
+		alignas(32) LatentWeight _realWeight[COMPRESS_OUT_DIM][COMPRESS_IN_DIM] = {0};
 		// バッチ学習版出力バッファ（学習時はこちらのバッファを使用する
 		alignas(32) OutputType _outputBatchBuffer[BATCH_SIZE * PADDED_OUT_BLOCKS] = {0};
 #pragma endregion
 		// 出力バッファ（次の層が参照する
 		alignas(32) OutputType _outputBuffer[PADDED_OUT_BLOCKS] = {0};
-		// 2値重み(-1 or 1)
+		// 2値重み(-1 or 1)。3値重みでは非ゼロの重みの符号
 		alignas(32) BitWeight _weight[COMPRESS_OUT_DIM][PADDED_IN_BLOCKS] = {0};
+		// 3値重みが0でないなら1（パディング部分は0）と行ごとの非ゼロ重みの数
+		static constexpr int MASK_ROWS = TERNARY_WEIGHT ? COMPRESS_OUT_DIM : 1;
+		alignas(32) BitWeight _mask[MASK_ROWS][PADDED_IN_BLOCKS] = {0};
+		int32_t _nonZero[MASK_ROWS] = {0};
+		// 疎入力用の2値重みの列優先コピー（入力i_inが1のときのニューロンi_outへの寄与±1）。2値化のたびに同期する
+		static constexpr int COLUMN_STRIDE = AddPaddingToBytes(COMPRESS_OUT_DIM);
+		alignas(32) int8_t _columns[SPARSE_INDEX_INPUT ? COMPRESS_IN_DIM : 1][COLUMN_STRIDE] = {0};
 		// 前の層
 		PreviousLayer_t _prevLayer;
 		// バイアス
 		int _bias[COMPRESS_OUT_DIM] = {0};
+		// 推論時の符号判定用閾値（popcount > threshold なら1。バイアスや後段の正規化を畳み込んだもの
+		int32_t _threshold[COMPRESS_OUT_DIM] = {0};
+		// 符号反転フラグ（1なら閾値判定の結果を反転する
+		BitBlock _flip[COMPRESS_OUT_DIM] = {0};
 
 #pragma region Train
-		// 前の層に伝播する勾配
-		GradientType _gradsToPrev[BATCH_SIZE * COMPRESS_IN_DIM] = {0};
+		// 前の層に伝播する勾配（疎入力の前は入力層なので計算しない）
+		static constexpr int GRADS_TO_PREV_DIM = SPARSE_INDEX_INPUT ? 1 : COMPRESS_IN_DIM;
+		GradientType _gradsToPrev[BATCH_SIZE * GRADS_TO_PREV_DIM] = {0};
 		// 勾配法用の実数値バイアス
 		double _realBias[COMPRESS_OUT_DIM] = {0};
+		// バッチ学習時のバイアス込みの積和（後段の正規化層が参照する
+		int32_t _sumBatchBuffer[BATCH_SIZE * COMPRESS_OUT_DIM] = {0};
 		// TODO 整数化
 		// 勾配計算用の入力バッファ（実態は前の層の出力バッファを参照するポインタ
 		BitBlock *_inputBatchBuffer;
+		// 前回の2値化以降に符号の変化（またはクリッピングが必要な値）が生じた行
+		BitBlock _rowDirty[COMPRESS_OUT_DIM] = {0};
+		// 直前の学習ステップで符号が反転した実数値重みの数
+		int _signFlipCount = 0;
+		// UpdateRowでその場で2値化した重みのうち符号が反転した数（疎入力のSGD用）
+		int _pendingSignFlips = 0;
+		// オプティマイザの状態（モーメントなど）
+		typename Optimizer_t::template State<COMPRESS_OUT_DIM, COMPRESS_IN_DIM> _optimizerState;
+		// バッチ分の勾配を蓄積し，StepOptimizerで更新・クリッピング・2値化を1パスで行うか。
+		// SGDも密な入力では蓄積してStepAndPackRowを通す（疎入力のSGDと固定小数点はUpdateRowでその場で更新する）
+		static constexpr bool ACCUMULATE_GRAD = Optimizer_t::ACCUMULATE_GRAD || (!SPARSE_INDEX_INPUT && !FIXED_POINT);
+		// バッチ分の勾配の蓄積先（勾配を蓄積しない場合は使わないため1行だけ確保）
+		static constexpr int GRAD_ROWS = ACCUMULATE_GRAD ? COMPRESS_OUT_DIM : 1;
+		alignas(32) float _weightGrad[GRAD_ROWS][COMPRESS_IN_DIM] = {0};
+		double _biasGrad[COMPRESS_OUT_DIM] = {0};
+		// 疎入力で前回のStepOptimizer以降に勾配を受けた列（入力）。オプティマイザはこの列だけを更新する
+		static constexpr bool LAZY_COLUMN_STEP = SPARSE_INDEX_INPUT && ACCUMULATE_GRAD;
+		static constexpr int TOUCHED_COLUMNS = LAZY_COLUMN_STEP ? COMPRESS_IN_DIM : 1;
+		int32_t _touchedColumns[TOUCHED_COLUMNS] = {0};
+		BitBlock _columnTouched[TOUCHED_COLUMNS] = {0};
+		int _numTouched = 0;
 #pragma endregion
 
+		/**
+		 * @brief 1行分の実数値重みを[-1,1]にクリッピングし，2値化して詰める
+		 * @return int 符号が反転した重みの数
+		 */
+		int BinarizeRow(int i_out)
+		{
+			int flips;
+			if constexpr (FIXED_POINT)
+			{
+				flips = ClipAndPackSignsInt16(_realWeight[i_out], _weight[i_out], COMPRESS_IN_DIM, FixedOne());
+			}
+			else
+			{
+				flips = Weight_t::PackRow(_realWeight[i_out], _weight[i_out], MaskRow(i_out), COMPRESS_IN_DIM);
+			}
+			if constexpr (TERNARY_WEIGHT)
+			{
+				int32_t nonZero = 0;
+				for (int block = 0; block < PADDED_IN_BLOCKS; block++)
+				{
+					nonZero += _mm_popcnt_u64(_mask[i_out][block]);
+				}
+				_nonZero[i_out] = nonZero;
+			}
+			SyncColumns(i_out);
+			return flips;
+		}
+
+		/**
+		 * @brief 3値重みのマスク行（2値重みでは使われないダミー行）
+		 */
+		BitWeight *MaskRow(int i_out)
+		{
+			return _mask[TERNARY_WEIGHT ? i_out : 0];
+		}
+
+		const BitWeight *MaskRow(int i_out) const
+		{
+			return _mask[TERNARY_WEIGHT ? i_out : 0];
+		}
+
+		/**
+		 * @brief 固定小数点の潜在重みで1.0に相当する値
+		 */
+		static constexpr int FixedOne()
+		{
+			if constexpr (FIXED_POINT)
+			{
+				return 1 << Optimizer_t::WEIGHT_SHIFT;
+			}
+			else
+			{
+				return 1;
+			}
+		}
+
+		/**
+		 * @brief xを隣り合う整数のどちらかに確率的に丸め，int16の範囲に収める（期待値はx）
+		 */
+		static int16_t StochasticRoundInt16(double x)
+		{
+			const double lower = std::floor(x);
+			const double rounded = lower + (Random::GetReal01() < x - lower ? 1 : 0);
+			return static_cast<int16_t>(std::max(-32767.0, std::min(32767.0, rounded)));
+		}
+
+		/**
+		 * @brief 疎入力用の列優先コピーに重み行i_outを反映する
+		 */
+		void SyncColumns(int i_out)
+		{
+			if constexpr (SPARSE_INDEX_INPUT)
+			{
+				for (int i_in = 0; i_in < COMPRESS_IN_DIM; i_in++)
+				{
+					const bool bit = (_weight[i_out][GetBlockIndex(i_in)] >> GetBitIndexInBlock(i_in)) & 1;
+					_columns[i_in][i_out] = bit ? 1 : -1;
+				}
+			}
+		}
+
+		/**
+		 * @brief 疎入力の1行について全ニューロンの積和（有効な列の和）をpop[COLUMN_STRIDE]に書き出す
+		 */
+		void SumActiveColumns(const BitBlock *input, int32_t *pop) const
+		{
+			SumSparseColumns(&_columns[0][0], COLUMN_STRIDE, PreviousLayer_t::Indices(input), PreviousLayer_t::ActiveCount(input), pop);
+		}
+
+		/**
+		 * @brief 1プレーン分の入力と重み行i_outのXNORのpopcount（パディング分も含む）
+		 */
+		int32_t CountPlaneMatches(const BitBlock *input, int i_out) const
+		{
+			// パディング分も含めて±1積和演算
+			if (USE_AVX_MADD)
+			{
+				return Weight_t::template CountMatches<PADDED_IN_BITS>(input, _weight[i_out], MaskRow(i_out));
+			}
+			int32_t pop = 0;
+			for (int block = 0; block < PADDED_IN_BLOCKS; block++)
+			{
+				const BitBlock xnor = Weight_t::Matches(input[block], _weight[i_out][block], MaskRow(i_out)[block]);
+				pop += _mm_popcnt_u64(xnor);
+			}
+			return pop;
+		}
+
+		/**
+		 * @brief 入力と重み行i_outのXNORのpopcount. 多ビット入力ではプレーンごとのpopcountを2^jで合成する
+		 */
+		int32_t CountMatches(const BitBlock *input, int i_out) const
+		{
+			if constexpr (SPARSE_INDEX_INPUT)
+			{
+				// 疎入力では有効な列の重み(±1)の和（まとめて求めるならSumActiveColumns）
+				const int32_t *indices = PreviousLayer_t::Indices(input);
+				const int count = PreviousLayer_t::ActiveCount(input);
+				int32_t pop = 0;
+				for (int k = 0; k < count; k++)
+				{
+					pop += _columns[indices[k]][i_out];
+				}
+				return pop;
+			}
+			else if constexpr (INPUT_PLANES == 1)
+			{
+				return CountPlaneMatches(input, i_out);
+			}
+			else
+			{
+				int32_t pop = 0;
+				for (int plane = 0; plane < INPUT_PLANES; plane++)
+				{
+					pop += CountPlaneMatches(&input[plane * PADDED_IN_BLOCKS], i_out) << plane;
+				}
+				return pop;
+			}
+		}
+
+		// SumFromPopのpopに対する傾き（スコアの大小比較用）
+		static constexpr int32_t POP_WEIGHT = SPARSE_INDEX_INPUT ? 1 : 2;
+
+		/**
+		 * @brief 積和 = POP_WEIGHT * pop - PopOffset(i_out) となる定数項
+		 */
+		int32_t PopOffset(int i_out) const
+		{
+			if constexpr (SPARSE_INDEX_INPUT)
+			{
+				// 無効な入力は0なので，有効な列の和がそのまま積和
+				return 0;
+			}
+			else if constexpr (TERNARY_WEIGHT)
+			{
+				// 非ゼロの重みだけの±1の合計値（2x[一致数] - [非ゼロ数]）
+				return _nonZero[i_out];
+			}
+			else
+			{
+				// 1,-1の合計値に（[plus] - (bitWidth - [minus]) => 2x[1の数] - bitWidth)
+				return 2 * PADDING_BITS * INPUT_SCALE + COMPRESS_IN_DIM * INPUT_SCALE;
+			}
+		}
+
+		/**
+		 * @brief popcountからバイアスを除いた積和を求める
+		 */
+		int32_t SumFromPop(int32_t pop, int i_out) const
+		{
+			return POP_WEIGHT * pop - PopOffset(i_out);
+		}
+
+		/**
+		 * @brief popcount（疎入力なら有効な列の和）が取り得る最大値
+		 */
+		static constexpr int PopLimit()
+		{
+			if constexpr (SPARSE_INDEX_INPUT)
+			{
+				return PreviousLayer_t::MAX_ACTIVE;
+			}
+			else
+			{
+				return PADDED_IN_BITS * INPUT_SCALE;
+			}
+		}
+
+		/**
+		 * @brief popcountからニューロンi_outの出力を求める
+		 */
+		OutputType OutputFromPop(int32_t pop, int i_out) const
+		{
+			if (isOutputLayer)
+			{
+				// 出力層ではパディングの必要がない
+				return static_cast<OutputType>(SumFromPop(pop, i_out) + _bias[i_out]);
+			}
+			// 次のsign層で符号ビットが分かればいい（バイアス・正規化は閾値に畳み込み済み）
+			return static_cast<OutputType>((pop > _threshold[i_out]) ^ _flip[i_out]);
+		}
+
+		/**
+		 * @brief UpdateWeightsで変化のあった行だけを2値化する
+		 */
+		void BinarizeDirtyRows()
+		{
+			_signFlipCount = _pendingSignFlips;
+			_pendingSignFlips = 0;
+			for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
+			{
+				_bias[i_out] = _realBias[i_out];
+				if (_rowDirty[i_out])
+				{
+					_signFlipCount += BinarizeRow(i_out);
+					_rowDirty[i_out] = 0;
+				}
+			}
+			UpdateThreshold();
+		}
+
+		/**
+		 * @brief 蓄積した勾配をオプティマイザで適用し，クリッピングと2値化まで行単位で済ませる
+		 */
+		void StepOptimizer()
+		{
+			_optimizerState.BeginStep();
+			_signFlipCount = 0;
+			if constexpr (LAZY_COLUMN_STEP)
+			{
+				StepTouchedColumns();
+				UpdateThreshold();
+				return;
+			}
+			for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
+			{
+				_realBias[i_out] = _optimizerState.StepBias(i_out, _realBias[i_out], _biasGrad[i_out]);
+				_biasGrad[i_out] = 0;
+				_bias[i_out] = _realBias[i_out];
+				if constexpr (TERNARY_WEIGHT)
+				{
+					// StepAndPackRowの符号ビットは使わず，3値化し直す
+					alignas(32) BitBlock signs[PADDED_IN_BLOCKS] = {0};
+					StepAndPackRow(_optimizerState, i_out, _realWeight[i_out], _weightGrad[i_out], signs, COMPRESS_IN_DIM);
+					_signFlipCount += BinarizeRow(i_out);
+				}
+				else
+				{
+					_signFlipCount += StepAndPackRow(_optimizerState, i_out, _realWeight[i_out], _weightGrad[i_out], _weight[i_out], COMPRESS_IN_DIM);
+					SyncColumns(i_out);
+				}
+			}
+			UpdateThreshold();
+		}
+
+		/**
+		 * @brief 疎入力で勾配を受けた列だけをオプティマイザで更新し，2値重みと列優先コピーに反映する.
+		 * 勾配を受けていない列のモーメントは次に勾配を受けるまで適用を遅らせる（O(出力数 x 更新された列数)）
+		 */
+		void StepTouchedColumns()
+		{
+			for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
+			{
+				_realBias[i_out] = _optimizerState.StepBias(i_out, _realBias[i_out], _biasGrad[i_out]);
+				_biasGrad[i_out] = 0;
+				_bias[i_out] = _realBias[i_out];
+				for (int k = 0; k < _numTouched; k++)
+				{
+					const int i_in = _touchedColumns[k];
+					const float after = std::max(-1.0f, std::min(1.0f, _optimizerState.Step(i_out, i_in, _realWeight[i_out][i_in], _weightGrad[i_out][i_in])));
+					_realWeight[i_out][i_in] = after;
+					_weightGrad[i_out][i_in] = 0;
+					const int blockIdx = GetBlockIndex(i_in);
+					const int bitShift = GetBitIndexInBlock(i_in);
+					const BitBlock newBit = (BitBlock)(after > 0 ? 1 : 0);
+					if (((_weight[i_out][blockIdx] >> bitShift) & 1) != newBit)
+					{
+						_weight[i_out][blockIdx] ^= (BitBlock)(1 << bitShift);
+						_columns[i_in][i_out] = newBit ? 1 : -1;
+						_signFlipCount++;
+					}
+				}
+			}
+			for (int k = 0; k < _numTouched; k++)
+			{
+				_columnTouched[_touchedColumns[k]] = 0;
+			}
+			_numTouched = 0;
+		}
+
+		/**
+		 * @brief バイアスのみから符号判定用の閾値を求める（sum + bias > 0）
+		 */
+		void UpdateThreshold()
+		{
+			for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
+			{
+				SetThreshold(i_out, 0, false);
+			}
+		}
+
+		/**
+		 * @brief 「sum + bias > tau（negativeなら < tau）」をpopcountの閾値判定に変換して設定する
+		 */
+		void SetThreshold(int i_out, double tau, bool negative)
+		{
+			// sum = SumFromPop(pop, i_out) より，境界となるpopcount
+			const double popBoundary = (tau - _bias[i_out] + PopOffset(i_out)) / (double)POP_WEIGHT;
+			// pop > floor(q) <=> pop > q,  pop < q <=> !(pop > ceil(q) - 1)
+			double threshold = negative ? std::ceil(popBoundary) - 1 : std::floor(popBoundary);
+			// 疎入力では有効な列の和は[-PopLimit, PopLimit]
+			const double popMin = SPARSE_INDEX_INPUT ? -PopLimit() : 0;
+			threshold = std::max(popMin - 1, std::min((double)PopLimit(), threshold));
+			_threshold[i_out] = static_cast<int32_t>(threshold);
+			_flip[i_out] = negative ? 1 : 0;
+		}
+
 	public:
 		void Init()
 		{
 			memset(_outputBatchBuffer, 0, sizeof(OutputType) * BATCH_SIZE * PADDED_OUT_BLOCKS);
 			memset(_outputBuffer, 0, sizeof(OutputType) * PADDED_OUT_BLOCKS);
 			memset(_weight, 0, sizeof(BitWeight) * COMPRESS_OUT_DIM * PADDED_IN_BLOCKS);
+			memset(_mask, 0, sizeof(_mask));
+			memset(_nonZero, 0, sizeof(_nonZero));
 			_prevLayer.Init();
 		}
 
-		void Save(std::ofstream &fs)
+		void Save(std::ostream &fs)
 		{
 			int dim = COMPRESS_OUT_DIM;
 			fs.write(reinterpret_cast<char *>(&dim), sizeof(int));
 			fs.write(reinterpret_cast<char *>(_realBias), sizeof(double) * COMPRESS_OUT_DIM);
-			fs.write(reinterpret_cast<char *>(_realWeight), sizeof(float) * COMPRESS_OUT_DIM * COMPRESS_IN_DIM);
+			if constexpr (FIXED_POINT)
+			{
+				// 保存形式は浮動小数点モードと共通
+				std::vector<float> row(COMPRESS_IN_DIM);
+				for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
+				{
+					for (int i_in = 0; i_in < COMPRESS_IN_DIM; i_in++)
+					{
+						row[i_in] = _realWeight[i_out][i_in] / (float)FixedOne();
+					}
+					fs.write(reinterpret_cast<char *>(row.data()), sizeof(float) * COMPRESS_IN_DIM);
+				}
+			}
+			else
+			{
+				fs.write(reinterpret_cast<char *>(_realWeight), sizeof(float) * COMPRESS_OUT_DIM * COMPRESS_IN_DIM);
+			}
 
 			_prevLayer.Save(fs);
 		}
 
-		void Load(std::ifstream &fs)
+		void Load(std::istream &fs)
 		{
 			int dim;
 			fs.read(reinterpret_cast<char *>(&dim), sizeof(int));
@@ -105,52 +536,279 @@ namespace bitnet
 			}
 
 			fs.read(reinterpret_cast<char *>(_realBias), sizeof(double) * COMPRESS_OUT_DIM);
-			fs.read(reinterpret_cast<char *>(_realWeight), sizeof(float) * COMPRESS_OUT_DIM * COMPRESS_IN_DIM);
+			if constexpr (FIXED_POINT)
+			{
+				std::vector<float> row(COMPRESS_IN_DIM);
+				for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
+				{
+					fs.read(reinterpret_cast<char *>(row.data()), sizeof(float) * COMPRESS_IN_DIM);
+					for (int i_in = 0; i_in < COMPRESS_IN_DIM; i_in++)
+					{
+						const float clipped = std::max(-1.0f, std::min(1.0f, row[i_in]));
+						_realWeight[i_out][i_in] = static_cast<int16_t>(std::lround(clipped * FixedOne()));
+					}
+				}
+			}
+			else
+			{
+				fs.read(reinterpret_cast<char *>(_realWeight), sizeof(float) * COMPRESS_OUT_DIM * COMPRESS_IN_DIM);
+			}
 
 			// ロードした重みをforward用に2値化して適用
 			Binarize();
+			ResetOptimizer();
 
 			_prevLayer.Load(fs);
 		}
 
+		/**
+		 * @brief オプティマイザの状態（モーメント等）を保存する. 形式はSaveと同じく出力側の層から順
+		 */
+		void SaveOptimizer(std::ostream &fs)
+		{
+			using State_t = decltype(_optimizerState);
+			static_assert(std::is_trivially_copyable_v<State_t>, "optimizer state must be trivially copyable");
+			if constexpr (!std::is_empty_v<State_t>)
+			{
+				fs.write(reinterpret_cast<const char *>(&_optimizerState), sizeof(State_t));
+			}
+			_prevLayer.SaveOptimizer(fs);
+		}
+
+		void LoadOptimizer(std::istream &fs)
+		{
+			using State_t = decltype(_optimizerState);
+			if constexpr (!std::is_empty_v<State_t>)
+			{
+				fs.read(reinterpret_cast<char *>(&_optimizerState), sizeof(State_t));
+			}
+			_prevLayer.LoadOptimizer(fs);
+		}
+
+		/**
+		 * @brief 推論に使う値（2値重み・3値重みのマスク・バイアス・閾値・反転フラグ）だけをsrcからコピーする
+		 */
+		void CopyInferenceParams(const BitDenseLayer &src)
+		{
+			memcpy(_weight, src._weight, sizeof(_weight));
+			memcpy(_mask, src._mask, sizeof(_mask));
+			memcpy(_nonZero, src._nonZero, sizeof(_nonZero));
+			memcpy(_columns, src._columns, sizeof(_columns));
+			memcpy(_bias, src._bias, sizeof(_bias));
+			memcpy(_threshold, src._threshold, sizeof(_threshold));
+			memcpy(_flip, src._flip, sizeof(_flip));
+			_prevLayer.CopyInferenceParams(src._prevLayer);
+		}
+
+		/**
+		 * @brief この層以前の全層のオプティマイザのハイパーパラメータを設定する
+		 */
+		void SetOptimizerParams(const OptimizerParams &params)
+		{
+			_optimizerState.SetParams(params);
+			_prevLayer.SetOptimizerParams(params);
+		}
+
+		/**
+		 * @brief この層だけのオプティマイザのハイパーパラメータを設定する
+		 */
+		void SetLayerOptimizerParams(const OptimizerParams &params)
+		{
+			_optimizerState.SetParams(params);
+		}
+
 		const OutputType *Forward(const BitBlock *netInput)
 		{
-			const BitBlock *input = _prevLayer.Forward(netInput);
+			return ForwardStep(_prevLayer.Forward(netInput), _outputBuffer);
+		}
 
+		/**
+		 * @brief この層だけの推論. outputにはパディングまで書き込む（Sequentialのバッファ共有用）
+		 */
+		const OutputType *ForwardStep(const BitBlock *input, OutputType *output) const
+		{
+			if constexpr (SPARSE_INDEX_INPUT)
+			{
+				alignas(32) int32_t pop[COLUMN_STRIDE];
+				SumActiveColumns(input, pop);
+				return ForwardFromCounts(pop, output);
+			}
+			for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
+			{
+				output[i_out] = OutputFromPop(CountMatches(input, i_out), i_out);
+			}
+			memset(&output[COMPRESS_OUT_DIM], 0, sizeof(OutputType) * (PADDED_OUT_BLOCKS - COMPRESS_OUT_DIM));
+
+			return output;
+		}
+
+		/**
+		 * @brief 全ニューロンのpopcount（パディング分も含む）をpopに書き出す（差分推論の初期化用）
+		 */
+		template <typename Count_t>
+		void CountAllMatches(const BitBlock *input, Count_t *pop) const
+		{
+			if constexpr (SPARSE_INDEX_INPUT)
+			{
+				alignas(32) int32_t sums[COLUMN_STRIDE];
+				SumActiveColumns(input, sums);
+				std::copy(sums, sums + COMPRESS_OUT_DIM, pop);
+				return;
+			}
+			for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
+			{
+				pop[i_out] = static_cast<Count_t>(CountMatches(input, i_out));
+			}
+		}
+
+		/**
+		 * @brief 外部で保持したpopcountからこの層の出力を求める. outputにはパディングまで書き込む
+		 */
+		template <typename Count_t>
+		const OutputType *ForwardFromCounts(const Count_t *pop, OutputType *output) const
+		{
 			for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
 			{
-				int32_t pop;
-				// パディング分も含めて±1積和演算
-				if (USE_AVX_MADD)
+				output[i_out] = OutputFromPop(pop[i_out], i_out);
+			}
+			memset(&output[COMPRESS_OUT_DIM], 0, sizeof(OutputType) * (PADDED_OUT_BLOCKS - COMPRESS_OUT_DIM));
+
+			return output;
+		}
+
+		/**
+		 * @brief 重みを列優先で書き出す. 入力ビットi_inが0から1になったときのpopcountの変化量
+		 * （重みが1なら+1，0なら-1）をcolumns[i_in * stride + i_out]に書く
+		 */
+		template <typename Count_t>
+		void ExportColumnDeltas(Count_t *columns, int stride) const
+		{
+			static_assert(INPUT_PLANES == 1 && !SPARSE_INDEX_INPUT, "column deltas are defined for 1-bit inputs only");
+			static_assert(!TERNARY_WEIGHT, "column deltas are defined for binary weights only");
+			for (int i_in = 0; i_in < COMPRESS_IN_DIM; i_in++)
+			{
+				const int blockIdx = GetBlockIndex(i_in);
+				const int bitShift = GetBitIndexInBlock(i_in);
+				for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
 				{
-					pop = MaddPopcnt2(input, _weight[i_out], PADDED_IN_BITS);
+					const bool bit = (_weight[i_out][blockIdx] >> bitShift) & 1;
+					columns[i_in * stride + i_out] = static_cast<Count_t>(bit ? 1 : -1);
 				}
-				else
+			}
+		}
+
+		/**
+		 * @brief 入力がすべて0のときのpopcountを基準に，出力の求め方を書き出す（ニューロンの枝刈り用）.
+		 * popcountの入力ビットごとの変化量はExportColumnDeltasで得られる。
+		 * 出力層: 出力 = offset + 戻り値 * (pop - zeroPop)，隠れ層: 出力 = (pop > threshold) ^ flip
+		 * @return int32_t 出力層の出力のpopcountに対する傾き
+		 */
+		int32_t ExportOutputRule(int32_t *zeroPop, int32_t *offset, int32_t *threshold, uint8_t *flip) const
+		{
+			static_assert(INPUT_PLANES == 1 && !SPARSE_INDEX_INPUT, "output rules are defined for 1-bit inputs only");
+			static_assert(!TERNARY_WEIGHT, "output rules are defined for binary weights only");
+			alignas(32) BitBlock zeros[PADDED_IN_BLOCKS] = {0};
+			for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
+			{
+				zeroPop[i_out] = CountMatches(zeros, i_out);
+				offset[i_out] = SumFromPop(zeroPop[i_out], i_out) + _bias[i_out];
+				threshold[i_out] = _threshold[i_out];
+				flip[i_out] = static_cast<uint8_t>(_flip[i_out]);
+			}
+			return POP_WEIGHT;
+		}
+
+		/**
+		 * @brief 出力層で最大スコアのクラスだけを求める（クラスごとの出力は書き出さない）
+		 */
+		int ForwardArgmax(const BitBlock *netInput)
+		{
+			return ArgmaxStep(_prevLayer.Forward(netInput));
+		}
+
+		int ArgmaxStep(const BitBlock *input) const
+		{
+			static_assert(isOutputLayer, "ArgmaxStep is only for the output layer");
+			alignas(32) int32_t pop[COLUMN_STRIDE];
+			CountAllMatches(input, pop);
+			int best = 0;
+			int32_t bestScore = SumFromPop(pop[0], 0) + _bias[0];
+			for (int i_out = 1; i_out < COMPRESS_OUT_DIM; i_out++)
+			{
+				const int32_t score = SumFromPop(pop[i_out], i_out) + _bias[i_out];
+				if (score > bestScore)
 				{
-					pop = 0;
-					for (int block = 0; block < PADDED_IN_BLOCKS; block++)
-					{
-						const BitBlock xnor = ~(input[block] ^ _weight[i_out][block]);
-						pop += __popcnt64(xnor);
-					}
+					bestScore = score;
+					best = i_out;
 				}
+			}
+			return best;
+		}
 
-				// 1,-1の合計値に（[plus] - (bitWidth - [minus]) => 2x[1の数] - bitWidth)
-				const int32_t sum = 2 * (pop - PADDING_BITS) - COMPRESS_IN_DIM;
-				const int32_t result = sum + _bias[i_out];
-				if (isOutputLayer)
+		/**
+		 * @brief 出力層でスコアの高い順にk個のクラスを求める
+		 */
+		void ForwardTopK(const BitBlock *netInput, int k, int *classesOut)
+		{
+			TopKStep(_prevLayer.Forward(netInput), k, classesOut);
+		}
+
+		void TopKStep(const BitBlock *input, int k, int *classesOut) const
+		{
+			static_assert(isOutputLayer, "TopKStep is only for the output layer");
+			alignas(32) int32_t pop[COLUMN_STRIDE];
+			CountAllMatches(input, pop);
+			int32_t scores[COMPRESS_OUT_DIM];
+			for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
+			{
+				scores[i_out] = SumFromPop(pop[i_out], i_out) + _bias[i_out];
+			}
+			// 同点の扱いを損失側と揃えるため，選び方はTopKに任せる
+			TopK(scores, COMPRESS_OUT_DIM, k, classesOut);
+		}
+
+		/**
+		 * @brief n(<= BATCH_SIZE)サンプルをまとめて推論する.
+		 * 重み1行をn個のサンプルに続けて適用し，重みの読み出しをサンプル間で共有する。
+		 * 出力は学習用のバッファ（TrainForwardと同じ並び）に書くため，学習中には呼ばないこと。
+		 */
+		const OutputType *ForwardBatch(const BitBlock *netInput, int n)
+		{
+			const BitBlock *input = _prevLayer.ForwardBatch(netInput, n);
+
+			if constexpr (SPARSE_INDEX_INPUT)
+			{
+				// 列優先コピーは全ニューロン分をまとめて集計する
+				for (int b = 0; b < n; b++)
 				{
-					// 出力層ではパディングの必要がない
-					_outputBuffer[i_out] = static_cast<OutputType>(result);
+					const int stride = isOutputLayer ? COMPRESS_OUT_DIM : PADDED_OUT_BLOCKS;
+					alignas(32) int32_t pop[COLUMN_STRIDE];
+					SumActiveColumns(&input[b * INPUT_STRIDE_BLOCKS], pop);
+					for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
+					{
+						_outputBatchBuffer[b * stride + i_out] = OutputFromPop(pop[i_out], i_out);
+					}
 				}
-				else
+				return _outputBatchBuffer;
+			}
+
+			for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
+			{
+				for (int b = 0; b < n; b++)
 				{
-					// 次のsign層で符号ビットが分かればいい（32bitのMSBが8bitMSBに来るようにシフト）
-					_outputBuffer[i_out] = static_cast<OutputType>(result > 0);
+					const int32_t pop = CountMatches(&input[b * INPUT_STRIDE_BLOCKS], i_out);
+					if (isOutputLayer)
+					{
+						_outputBatchBuffer[b * COMPRESS_OUT_DIM + i_out] = static_cast<OutputType>(SumFromPop(pop, i_out) + _bias[i_out]);
+					}
+					else
+					{
+						_outputBatchBuffer[b * PADDED_OUT_BLOCKS + i_out] = static_cast<OutputType>((pop > _threshold[i_out]) ^ _flip[i_out]);
+					}
 				}
 			}
 
-			return _outputBuffer;
+			return _outputBatchBuffer;
 		}
 
 		void ClearWeight()
@@ -170,83 +828,118 @@ namespace bitnet
 					int bitShift = GetBitIndexInBlock(i_in);
 					// Clipping
 					double tmp_w = Random::GetReal01() * 2 - 1;
-					_realWeight[i_out][i_in] = tmp_w;
+					if constexpr (FIXED_POINT)
+					{
+						_realWeight[i_out][i_in] = static_cast<int16_t>(std::lround(tmp_w * FixedOne()));
+					}
+					else
+					{
+						_realWeight[i_out][i_in] = tmp_w;
+					}
 
 					BitBlock block = _weight[i_out][blockIdx];
 					BitBlock mask = ~(1 << bitShift);
 					BitBlock newBit = (BitBlock)(tmp_w > 0 ? 1 : 0) << bitShift;
 					_weight[i_out][blockIdx] = (block & mask) | newBit;
 				}
+				if constexpr (TERNARY_WEIGHT)
+				{
+					BinarizeRow(i_out);
+				}
+				SyncColumns(i_out);
 			}
+			UpdateThreshold();
+			ResetOptimizer();
 
 			_prevLayer.ResetWeight();
 		}
 
+		/**
+		 * @brief オプティマイザの状態と蓄積中の勾配を破棄する
+		 */
+		void ResetOptimizer()
+		{
+			_optimizerState.Reset();
+			memset(_weightGrad, 0, sizeof(_weightGrad));
+			memset(_biasGrad, 0, sizeof(_biasGrad));
+			memset(_columnTouched, 0, sizeof(_columnTouched));
+			_numTouched = 0;
+		}
+
 		void Binarize()
 		{
 			for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
 			{
 				_bias[i_out] = _realBias[i_out];
-				if (COMPRESS_IN_DIM % BYTE_BIT_WIDTH == 0)
-				{
-					// float-8個分のMSBを読み8bitに詰めてweightにセット
-					int cursor = 0;
-					for (int i_in = 0; i_in < COMPRESS_IN_DIM; i_in += BYTE_BIT_WIDTH)
-					{
-						float8 packed = _mm256_load_ps(&(_realWeight[i_out][i_in]));
-						_weight[i_out][cursor] = ~_mm256_movemask_ps(packed);
-						++cursor;
-					}
-				}
-				else
-				{
-					for (int i_in = 0; i_in < COMPRESS_IN_DIM; i_in++)
-					{
-						// Clipping
-						const double tmp_w = std::max(-1.0, std::min(1.0, (double)_realWeight[i_out][i_in]));
-						_realWeight[i_out][i_in] = tmp_w;
+				BinarizeRow(i_out);
+				_rowDirty[i_out] = 0;
+			}
+			UpdateThreshold();
+		}
 
-						const int blockIdx = GetBlockIndex(i_in);
-						const int bitShift = GetBitIndexInBlock(i_in);
-						const BitBlock block = _weight[i_out][blockIdx];
-						const BitBlock mask = ~(1 << bitShift);
-						const BitBlock newBit = ((uint8_t)(tmp_w > 0)) << bitShift;
-						_weight[i_out][blockIdx] = (block & mask) | newBit;
-					}
-				}
+		/**
+		 * @brief 後段の正規化などを畳み込んだ符号判定条件を設定する.
+		 * ニューロンi_outの出力は「sum + bias > tau[i_out]」（negative[i_out]なら「< tau[i_out]」）で1となる.
+		 * Binarize()を呼ぶとバイアスのみの閾値に戻る.
+		 *
+		 * @param tau 境界値
+		 * @param negative 不等号を反転するならtrue
+		 */
+		void FoldSignThreshold(const double *tau, const bool *negative)
+		{
+			for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
+			{
+				SetThreshold(i_out, tau[i_out], negative[i_out]);
 			}
 		}
 
+		/**
+		 * @brief 0でない3値重みの割合
+		 */
+		double Density() const
+		{
+			static_assert(TERNARY_WEIGHT, "Density is defined for ternary weights only");
+			int64_t nonZero = 0;
+			for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
+			{
+				nonZero += _nonZero[i_out];
+			}
+			return (double)nonZero / ((int64_t)COMPRESS_OUT_DIM * COMPRESS_IN_DIM);
+		}
+
 #pragma region Train
+		/**
+		 * @brief 学習時の順伝播で書き込み，逆伝播で参照するバッファをfunc(ptr, bytes)に渡す（この層以前）.
+		 * パイプライン学習で，ミニバッチごとの順伝播の状態を保存・復元するのに使う
+		 */
+		template <typename Func_t>
+		void ForEachTrainBuffer(Func_t &&func)
+		{
+			func(_outputBatchBuffer, sizeof(_outputBatchBuffer));
+			func(_sumBatchBuffer, sizeof(_sumBatchBuffer));
+			_prevLayer.ForEachTrainBuffer(func);
+		}
+
 		OutputType *TrainForward(const BitBlock *netInput)
 		{
 			_inputBatchBuffer = _prevLayer.TrainForward(netInput);
 
 			for (int b = 0; b < BATCH_SIZE; b++)
 			{
-				int batchShiftInBlock = b * PADDED_IN_BLOCKS;
+				int batchShiftInBlock = b * INPUT_STRIDE_BLOCKS;
 				int batchShiftOut = b * PADDED_OUT_BLOCKS;
+				// 疎入力では全ニューロン分の和をまとめて求めておく
+				alignas(32) int32_t sparsePop[SPARSE_INDEX_INPUT ? COLUMN_STRIDE : 1];
+				if constexpr (SPARSE_INDEX_INPUT)
+				{
+					SumActiveColumns(&_inputBatchBuffer[batchShiftInBlock], sparsePop);
+				}
 				for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
 				{
-					int32_t pop;
-					// パディング分も含めて±1積和演算
-					if (USE_AVX_MADD)
-					{
-						pop = MaddPopcnt2(&_inputBatchBuffer[batchShiftInBlock], _weight[i_out], PADDED_IN_BITS);
-					}
-					else
-					{
-						pop = 0;
-						for (int block = 0; block < PADDED_IN_BLOCKS; block++)
-						{
-							const BitBlock xnor = ~(_inputBatchBuffer[batchShiftInBlock + block] ^ _weight[i_out][block]);
-							pop += __popcnt64(xnor);
-						}
-					}
+					const int32_t pop = SPARSE_INDEX_INPUT ? sparsePop[i_out] : CountMatches(&_inputBatchBuffer[batchShiftInBlock], i_out);
 
-					// 1,-1の合計値に（[plus] - (bitWidth - [minus]) => 2x[1の数] - bitWidth)
-					const int32_t sum = 2 * (pop - PADDING_BITS) - COMPRESS_IN_DIM;
-					const int32_t result = sum + _bias[i_out];
+					const int32_t result = SumFromPop(pop, i_out) + _bias[i_out];
+					_sumBatchBuffer[b * COMPRESS_OUT_DIM + i_out] = result;
 					if (isOutputLayer)
 					{
 						// 出力層ではパディングの必要がない
@@ -267,33 +960,137 @@ namespace bitnet
 			return _outputBatchBuffer;
 		}
 
+		/**
+		 * @brief 直前の学習ステップで符号が反転した実数値重みの数（この層以前の合計）
+		 */
+		int SignFlipCount() const
+		{
+			return _signFlipCount + _prevLayer.SignFlipCount();
+		}
+
+		/**
+		 * @brief 最も入力側の層（パイプライン学習でステージ境界の勾配を取り出すのに使う）
+		 */
+		auto &InputLayer()
+		{
+			return _prevLayer.InputLayer();
+		}
+
+		PreviousLayer_t &PrevLayer()
+		{
+			return _prevLayer;
+		}
+
+		const PreviousLayer_t &PrevLayer() const
+		{
+			return _prevLayer;
+		}
+
+		/**
+		 * @brief 直前のTrainForwardでのバイアス込みの積和 [BATCH_SIZE][COMPRESS_OUT_DIM]
+		 */
+		const int32_t *GetBatchSums() const
+		{
+			return _sumBatchBuffer;
+		}
+
 		void TrainBackward(const GradientType *nextGrad)
 		{
 			// 勾配更新
-			UpdateGrad(nextGrad);
+			if constexpr (!SPARSE_INDEX_INPUT)
+			{
+				UpdateGrad(nextGrad);
+			}
 
 			UpdateWeights(nextGrad);
 
-			// 2値化
-			Binarize();
+			ApplyUpdates();
+
+			_prevLayer.TrainBackward(_gradsToPrev);
+		}
+
+		/**
+		 * @brief 後段のsign層で勾配が0にならなかった組だけを走査して逆伝播する
+		 *
+		 * @param nextGrad 次の層からの勾配（リストにない組は0）
+		 * @param live 勾配が流れる(サンプル, ニューロン)の組
+		 */
+		void TrainBackward(const GradientType *nextGrad, const LiveGradList<COMPRESS_OUT_DIM> &live)
+		{
+			if constexpr (!SPARSE_INDEX_INPUT)
+			{
+				UpdateGrad(nextGrad, live);
+			}
+
+			UpdateWeights(nextGrad, live);
+
+			ApplyUpdates();
 
 			_prevLayer.TrainBackward(_gradsToPrev);
 		}
 
+		/**
+		 * @brief UpdateWeightsの結果を2値重みに反映する
+		 */
+		void ApplyUpdates()
+		{
+			if constexpr (ACCUMULATE_GRAD)
+			{
+				// 更新・クリッピング・2値化をまとめて適用
+				StepOptimizer();
+			}
+			else
+			{
+				// 符号が変化した行のみ2値化
+				BinarizeDirtyRows();
+			}
+		}
+
 		void UpdateGrad(const GradientType *nextGrad)
 		{
+			if constexpr (FIXED_POINT)
+			{
+				UpdateGradFixed(nextGrad, nullptr);
+				return;
+			}
+			// 順伝播で使う重み（2値なら±1，3値なら0の重みからは伝播しない）を係数とする。
+			// 生きている組だけを走査する版と同じ係数にするため，実数値重みの符号（0で0になる）は使わない
 			for (int b = 0; b < BATCH_SIZE; b++)
 			{
-				int batchShiftIn = b * COMPRESS_IN_DIM;
-				int batchShiftOut = b * COMPRESS_OUT_DIM;
-				for (int i_in = 0; i_in < COMPRESS_IN_DIM; i_in++)
+				GradientType *const grads = &_gradsToPrev[b * COMPRESS_IN_DIM];
+				const int batchShiftOut = b * COMPRESS_OUT_DIM;
+				memset(grads, 0, sizeof(GradientType) * COMPRESS_IN_DIM);
+				for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
 				{
-					GradientType sum = 0;
-					for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
+					const GradientType grad = nextGrad[batchShiftOut + i_out];
+					if (grad != 0)
+					{
+						Weight_t::template AddGrad<COMPRESS_IN_DIM>(grads, grad, _weight[i_out], MaskRow(i_out));
+					}
+				}
+			}
+		}
+
+		void UpdateGrad(const GradientType *nextGrad, const LiveGradList<COMPRESS_OUT_DIM> &live)
+		{
+			if constexpr (FIXED_POINT)
+			{
+				UpdateGradFixed(nextGrad, &live);
+				return;
+			}
+			for (int b = 0; b < BATCH_SIZE; b++)
+			{
+				GradientType *const grads = &_gradsToPrev[b * COMPRESS_IN_DIM];
+				const int batchShiftOut = b * COMPRESS_OUT_DIM;
+				memset(grads, 0, sizeof(GradientType) * COMPRESS_IN_DIM);
+				// 生きている行ごとに，2値重みのビットに応じて±gradを加算
+				for (const int *it = live.Begin(b); it != live.End(b); ++it)
+				{
+					const GradientType grad = nextGrad[batchShiftOut + *it];
+					if (grad != 0)
 					{
-						sum += nextGrad[batchShiftOut + i_out] * sgn(_realWeight[i_out][i_in]);
+						Weight_t::template AddGrad<COMPRESS_IN_DIM>(grads, grad, _weight[*it], MaskRow(*it));
 					}
-					_gradsToPrev[batchShiftIn + i_in] = sum;
 				}
 			}
 		}
@@ -302,35 +1099,170 @@ namespace bitnet
 		{
 			for (int b = 0; b < BATCH_SIZE; b++)
 			{
-				const int batchShiftInBlock = b * PADDED_IN_BLOCKS;
+				const int batchShiftInBlock = b * INPUT_STRIDE_BLOCKS;
 				const int batchShiftOut = b * COMPRESS_OUT_DIM;
 				// 重み調整
 				for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
 				{
-					float grad = nextGrad[batchShiftOut + i_out];
-					if (grad == 0)
+					UpdateRow(&_inputBatchBuffer[batchShiftInBlock], i_out, nextGrad[batchShiftOut + i_out]);
+				}
+			}
+		}
+
+		void UpdateWeights(const GradientType *nextGrad, const LiveGradList<COMPRESS_OUT_DIM> &live)
+		{
+			for (int b = 0; b < BATCH_SIZE; b++)
+			{
+				const int batchShiftInBlock = b * INPUT_STRIDE_BLOCKS;
+				const int batchShiftOut = b * COMPRESS_OUT_DIM;
+				for (const int *it = live.Begin(b); it != live.End(b); ++it)
+				{
+					UpdateRow(&_inputBatchBuffer[batchShiftInBlock], *it, nextGrad[batchShiftOut + *it]);
+				}
+			}
+		}
+
+	private:
+		/**
+		 * @brief 前の層への勾配をint16で集計する（固定小数点モード）.
+		 * 勾配は層全体で共通の2のべき乗スケールで確率的に丸め，1サンプル分の|勾配|の和がint16に収まるようにする
+		 *
+		 * @param live 勾配が流れる組（nullptrなら全ニューロン）
+		 */
+		void UpdateGradFixed(const GradientType *nextGrad, const LiveGradList<COMPRESS_OUT_DIM> *live)
+		{
+			double maxAbsSum = 0;
+			for (int b = 0; b < BATCH_SIZE; b++)
+			{
+				double absSum = 0;
+				for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
+				{
+					absSum += std::abs(nextGrad[b * COMPRESS_OUT_DIM + i_out]);
+				}
+				maxAbsSum = std::max(maxAbsSum, absSum);
+			}
+			if (maxAbsSum == 0)
+			{
+				memset(_gradsToPrev, 0, sizeof(_gradsToPrev));
+				return;
+			}
+			// maxAbsSum < 2^exponent なので，scale倍した和は2^14未満（丸めの余裕を残す）
+			int exponent;
+			std::frexp(maxAbsSum, &exponent);
+			const double scale = std::ldexp(1.0, 14 - exponent);
+
+			alignas(32) int16_t acc[COMPRESS_IN_DIM];
+			for (int b = 0; b < BATCH_SIZE; b++)
+			{
+				const int batchShiftOut = b * COMPRESS_OUT_DIM;
+				memset(acc, 0, sizeof(acc));
+				auto addRow = [&](int i_out)
+				{
+					const GradientType grad = nextGrad[batchShiftOut + i_out];
+					if (grad != 0)
 					{
-						continue;
+						const int16_t quantized = StochasticRoundInt16(grad * scale);
+						if (quantized != 0)
+						{
+							AddSignedGradInt16<COMPRESS_IN_DIM>(acc, quantized, _weight[i_out]);
+						}
 					}
+				};
+				if (live != nullptr)
+				{
+					for (const int *it = live->Begin(b); it != live->End(b); ++it)
+					{
+						addRow(*it);
+					}
+				}
+				else
+				{
+					for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
+					{
+						addRow(i_out);
+					}
+				}
+				ScaleInt16ToFloat(acc, static_cast<float>(1.0 / scale), &_gradsToPrev[b * COMPRESS_IN_DIM], COMPRESS_IN_DIM);
+			}
+		}
 
-					_realBias[i_out] += grad;
-					// NegateAddFloats(_realWeight[i_out], grad, &_inputBatchBuffer[batchShiftInBlock], COMPRESS_IN_DIM);
-					float *const realWeight = _realWeight[i_out];
-					for (int i_in = 0; i_in < COMPRESS_IN_DIM; i_in++)
+		/**
+		 * @brief 1サンプル分の勾配を1行分の重みに適用する（勾配を蓄積するオプティマイザでは蓄積のみ）
+		 */
+		void UpdateRow(const BitBlock *input, int i_out, float grad)
+		{
+			if (grad == 0)
+			{
+				return;
+			}
+
+			if constexpr (SPARSE_INDEX_INPUT)
+			{
+				// 無効な入力は0なので，有効な列の重みにだけ+gradが流れる
+				const int32_t *indices = PreviousLayer_t::Indices(input);
+				const int count = PreviousLayer_t::ActiveCount(input);
+				if constexpr (ACCUMULATE_GRAD)
+				{
+					_biasGrad[i_out] += grad;
+					for (int k = 0; k < count; k++)
 					{
-						int blockIdx = GetBlockIndex(i_in);
-						int bitShift = GetBitIndexInBlock(i_in);
-						if ((_inputBatchBuffer[batchShiftInBlock + blockIdx] >> bitShift) & 1)
+						const int i_in = indices[k];
+						_weightGrad[i_out][i_in] += grad;
+						if (!_columnTouched[i_in])
 						{
-							realWeight[i_in] += grad;
+							_columnTouched[i_in] = 1;
+							_touchedColumns[_numTouched++] = i_in;
 						}
-						else
+					}
+				}
+				else
+				{
+					_realBias[i_out] += grad;
+					// 行全体を2値化し直さないよう，更新した重みだけをその場でクリッピング・2値化する
+					float *const realWeight = _realWeight[i_out];
+					for (int k = 0; k < count; k++)
+					{
+						const int i_in = indices[k];
+						const float after = std::max(-1.0f, std::min(1.0f, realWeight[i_in] + grad));
+						realWeight[i_in] = after;
+						const int blockIdx = GetBlockIndex(i_in);
+						const int bitShift = GetBitIndexInBlock(i_in);
+						const BitBlock newBit = (BitBlock)(after > 0 ? 1 : 0);
+						if (((_weight[i_out][blockIdx] >> bitShift) & 1) != newBit)
 						{
-							realWeight[i_in] -= grad;
+							_weight[i_out][blockIdx] ^= (BitBlock)(1 << bitShift);
+							_columns[i_in][i_out] = newBit ? 1 : -1;
+							_pendingSignFlips++;
 						}
 					}
 				}
 			}
+			else if constexpr (INPUT_PLANES > 1)
+			{
+				// 多ビット入力: 入力値/INPUT_SCALE（[-1,1]）を係数として，プレーンjに2^j/INPUT_SCALEの重みで加算
+				for (int plane = 0; plane < INPUT_PLANES; plane++)
+				{
+					AddSignedGrad<COMPRESS_IN_DIM>(_weightGrad[i_out], grad * (1 << plane) / INPUT_SCALE, &input[plane * PADDED_IN_BLOCKS]);
+				}
+				_biasGrad[i_out] += grad;
+			}
+			else if constexpr (FIXED_POINT)
+			{
+				_realBias[i_out] += grad;
+				// 降下量を潜在重みの刻みに確率的に丸める（学習率が小さく1刻みに満たなくても期待値では失われない）
+				const int16_t delta = StochasticRoundInt16((double)grad * FixedOne());
+				if (delta != 0)
+				{
+					AddSignedGradInt16<COMPRESS_IN_DIM>(_realWeight[i_out], delta, input);
+					_rowDirty[i_out] = 1;
+				}
+			}
+			else
+			{
+				// 適用はStepOptimizerで行う（SGDも更新・クリッピング・2値化を1パスで済ませる）
+				_biasGrad[i_out] += grad;
+				AddSignedGrad<COMPRESS_IN_DIM>(_weightGrad[i_out], grad, input);
+			}
 		}
 
 #pragma endregion
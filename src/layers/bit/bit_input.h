@@ -14,6 +14,7 @@
 #define BIT_INPUT_H_
 
 #include "../../net_common.h"
+#include "../../optimizer/optimizer.h"
 #include "../../util/bit_helper.h"
 #include <fstream>
 
@@ -29,6 +30,8 @@ namespace bitnet
     class BitInputLayer
     {
     public:
+        // 連鎖の終端
+        using PreviousLayer = void;
         // 出力次元数
         static constexpr int COMPRESS_OUT_DIM = InputBits;
         static constexpr int COMPRESS_OUT_BITS = InputBits;
@@ -48,8 +51,12 @@ namespace bitnet
             memset(_outputBatchBuffer, 0, sizeof(BitBlock) * BATCH_SIZE * PADDED_OUT_BLOCKS);
         }
 
-        void Save(std::ofstream &fs) {} // 終端
-        void Load(std::ifstream &fs) {} // 終端
+        void Save(std::ostream &fs) {} // 終端
+        void Load(std::istream &fs) {} // 終端
+        void SaveOptimizer(std::ostream &fs) {} // 終端
+        void LoadOptimizer(std::istream &fs) {} // 終端
+        void CopyInferenceParams(const BitInputLayer &) {} // 終端
+        void SetOptimizerParams(const OptimizerParams &) {} // 終端
 
         const BitBlock *Forward(const BitBlock *netInput)
         {
@@ -61,11 +68,51 @@ namespace bitnet
             return _outputBuffer;
         }
 
+        /**
+         * @brief 入力をoutputに詰める. パディングは0で埋める（Sequentialのバッファ共有用）
+         */
+        const BitBlock *ForwardStep(const BitBlock *netInput, BitBlock *output) const
+        {
+            memcpy(output, netInput, sizeof(BitBlock) * COMPRESS_OUT_BLOCKS);
+            memset(&output[COMPRESS_OUT_BLOCKS], 0, sizeof(BitBlock) * (PADDED_OUT_BLOCKS - COMPRESS_OUT_BLOCKS));
+            return output;
+        }
+
+        const BitBlock *ForwardBatch(const BitBlock *netInput, int n)
+        {
+            for (int b = 0; b < n; b++)
+            {
+                const int batchShift = b * PADDED_OUT_BLOCKS;
+                for (int i_out = 0; i_out < COMPRESS_OUT_BLOCKS; i_out++)
+                {
+                    _outputBatchBuffer[batchShift + i_out] = netInput[batchShift + i_out];
+                }
+            }
+            return _outputBatchBuffer;
+        }
+
         void ResetWeight()
         {
         }
 
+        int SignFlipCount() const
+        {
+            return 0;
+        }
+
+        BitInputLayer &InputLayer()
+        {
+            return *this;
+        }
+
 #pragma region Train
+        // 入力を詰めたバッファ（パイプライン学習で順伝播の状態を保存・復元する）. 終端
+        template <typename Func_t>
+        void ForEachTrainBuffer(Func_t &&func)
+        {
+            func(_outputBatchBuffer, sizeof(_outputBatchBuffer));
+        }
+
         BitBlock *TrainForward(const BitBlock *netInput)
         {
             // バッファに入力を詰める
@@ -0,0 +1,218 @@
+﻿/**
+ * @file bit_max_pool2d.h
+ * @author Daichi Sato
+ * @brief ビット列に対する2次元maxプーリング層
+ * @version 0.1
+ * @date 2021-12-04
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * -1/1を0/1で表したビット列のmaxはORで求まる。
+ * 入出力は画素ごとにチャネルを詰めたビット列(HWC順)として扱う。
+ *
+ */
+#ifndef BIT_MAX_POOL2D_H_
+#define BIT_MAX_POOL2D_H_
+
+#include "../../net_common.h"
+#include "../../optimizer/optimizer.h"
+#include "../../util/bit_helper.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+namespace bitnet
+{
+	/**
+	 * @brief ビット列maxプーリング層（ウィンドウとストライドは同じ）
+	 *
+	 * @tparam PreviousLayer_t 前のレイヤー型（ビット列を出力する層）
+	 * @tparam Height 入力の高さ
+	 * @tparam Width 入力の幅
+	 * @tparam Channels チャネル数
+	 * @tparam PoolSize プーリングウィンドウの一辺の長さ
+	 */
+	template <typename PreviousLayer_t, int Height, int Width, int Channels, int PoolSize>
+	class BitMaxPool2D
+	{
+	public:
+		using PreviousLayer = PreviousLayer_t;
+		// 入力次元数
+		static constexpr int COMPRESS_IN_DIM = PreviousLayer_t::COMPRESS_OUT_DIM;
+		static constexpr int PADDED_IN_BLOCKS = PreviousLayer_t::PADDED_OUT_BLOCKS;
+		static_assert(COMPRESS_IN_DIM == Height * Width * Channels, "previous layer output must be Height x Width x Channels");
+
+		// 出力の形状
+		static constexpr int OUT_HEIGHT = Height / PoolSize;
+		static constexpr int OUT_WIDTH = Width / PoolSize;
+		static constexpr int OUT_CHANNELS = Channels;
+
+		// 出力次元数
+		static constexpr int COMPRESS_OUT_DIM = OUT_HEIGHT * OUT_WIDTH * Channels;
+		static constexpr int COMPRESS_OUT_BITS = COMPRESS_OUT_DIM;
+		static constexpr int COMPRESS_OUT_BLOCKS = BitToBlockCount(COMPRESS_OUT_DIM);
+		static constexpr int PADDED_OUT_BITS = AddPaddingToBitSize(COMPRESS_OUT_BITS);
+		static constexpr int PADDED_OUT_BLOCKS = BitToBlockCount(PADDED_OUT_BITS);
+
+	private:
+		// 出力バッファ（次の層が参照する
+		alignas(32) BitBlock _outputBuffer[PADDED_OUT_BLOCKS] = {0};
+		alignas(32) BitBlock _outputBatchBuffer[BATCH_SIZE * PADDED_OUT_BLOCKS] = {0};
+		// 前の層
+		PreviousLayer_t _prevLayer;
+		// 前の層に伝播する勾配
+		GradientType _gradsToPrev[BATCH_SIZE * COMPRESS_IN_DIM] = {0};
+		// 出力ごとに値を採用した入力のインデックス（勾配の伝播先
+		int _argmax[BATCH_SIZE * COMPRESS_OUT_DIM] = {0};
+
+		/**
+		 * @brief 1サンプル分のプーリング。argmaxがnullptrでなければ採用した入力位置を記録する
+		 */
+		static void Pool(const BitBlock *input, BitBlock *output, int *argmax)
+		{
+			memset(output, 0, sizeof(BitBlock) * PADDED_OUT_BLOCKS);
+			for (int oy = 0; oy < OUT_HEIGHT; oy++)
+			{
+				for (int ox = 0; ox < OUT_WIDTH; ox++)
+				{
+					const int outPixel = (oy * OUT_WIDTH + ox) * Channels;
+					for (int c = 0; c < Channels; c += POPCNT_BIT_WIDTH)
+					{
+						const int numBits = std::min(POPCNT_BIT_WIDTH, Channels - c);
+						const uint64_t validMask = (numBits < POPCNT_BIT_WIDTH) ? ((1ULL << numBits) - 1) : ~0ULL;
+						// いずれかが1になった位置
+						uint64_t pooled = 0;
+						for (int py = 0; py < PoolSize; py++)
+						{
+							for (int px = 0; px < PoolSize; px++)
+							{
+								const int inPixel = ((oy * PoolSize + py) * Width + ox * PoolSize + px) * Channels;
+								const uint64_t bits = LoadBits64(input, inPixel + c, numBits);
+								if (argmax != nullptr)
+								{
+									// 最初の窓位置，または新たに1が見つかったチャネルで勾配の伝播先を更新する
+									uint64_t update = (py == 0 && px == 0) ? validMask : (bits & ~pooled);
+									for (; update != 0; update &= update - 1)
+									{
+										const int bit = CountTrailingZeros64(update);
+										argmax[outPixel + c + bit] = inPixel + c + bit;
+									}
+								}
+								pooled |= bits;
+							}
+						}
+						StoreBits64(output, outPixel + c, pooled, numBits);
+					}
+				}
+			}
+		}
+
+	public:
+		void Init()
+		{
+			memset(_outputBuffer, 0, sizeof(BitBlock) * PADDED_OUT_BLOCKS);
+			memset(_outputBatchBuffer, 0, sizeof(BitBlock) * BATCH_SIZE * PADDED_OUT_BLOCKS);
+			_prevLayer.Init();
+		}
+
+		void Save(std::ostream &fs) { _prevLayer.Save(fs); }
+		void Load(std::istream &fs) { _prevLayer.Load(fs); }
+		void SaveOptimizer(std::ostream &fs) { _prevLayer.SaveOptimizer(fs); }
+		void LoadOptimizer(std::istream &fs) { _prevLayer.LoadOptimizer(fs); }
+		void CopyInferenceParams(const BitMaxPool2D &src) { _prevLayer.CopyInferenceParams(src._prevLayer); }
+		void SetOptimizerParams(const OptimizerParams &params) { _prevLayer.SetOptimizerParams(params); }
+
+		const BitBlock *Forward(const BitBlock *netInput)
+		{
+			return ForwardStep(_prevLayer.Forward(netInput), _outputBuffer);
+		}
+
+		/**
+		 * @brief この層だけの推論（Sequentialのバッファ共有用）
+		 */
+		const BitBlock *ForwardStep(const BitBlock *input, BitBlock *output) const
+		{
+			Pool(input, output, nullptr);
+			return output;
+		}
+
+		const BitBlock *ForwardBatch(const BitBlock *netInput, int n)
+		{
+			const BitBlock *input = _prevLayer.ForwardBatch(netInput, n);
+			for (int b = 0; b < n; b++)
+			{
+				Pool(&input[b * PADDED_IN_BLOCKS], &_outputBatchBuffer[b * PADDED_OUT_BLOCKS], nullptr);
+			}
+			return _outputBatchBuffer;
+		}
+
+		void ResetWeight()
+		{
+			_prevLayer.ResetWeight();
+		}
+
+		int SignFlipCount() const
+		{
+			return _prevLayer.SignFlipCount();
+		}
+
+		/**
+		 * @brief 最も入力側の層（パイプライン学習でステージ境界の勾配を取り出すのに使う）
+		 */
+		auto &InputLayer()
+		{
+			return _prevLayer.InputLayer();
+		}
+
+		PreviousLayer_t &PrevLayer()
+		{
+			return _prevLayer;
+		}
+
+		const PreviousLayer_t &PrevLayer() const
+		{
+			return _prevLayer;
+		}
+
+#pragma region Train
+		/**
+		 * @brief 学習時の順伝播で書き込み，逆伝播で参照するバッファ（出力と最大値の位置）をfunc(ptr, bytes)に渡す（この層以前）
+		 */
+		template <typename Func_t>
+		void ForEachTrainBuffer(Func_t &&func)
+		{
+			func(_outputBatchBuffer, sizeof(_outputBatchBuffer));
+			func(_argmax, sizeof(_argmax));
+			_prevLayer.ForEachTrainBuffer(func);
+		}
+
+		BitBlock *TrainForward(const BitBlock *netInput)
+		{
+			const BitBlock *input = _prevLayer.TrainForward(netInput);
+			for (int b = 0; b < BATCH_SIZE; b++)
+			{
+				Pool(&input[b * PADDED_IN_BLOCKS], &_outputBatchBuffer[b * PADDED_OUT_BLOCKS], &_argmax[b * COMPRESS_OUT_DIM]);
+			}
+			return _outputBatchBuffer;
+		}
+
+		void TrainBackward(const GradientType *nextGrad)
+		{
+			// 勾配は値を採用した入力にのみ伝播する
+			std::fill(_gradsToPrev, _gradsToPrev + BATCH_SIZE * COMPRESS_IN_DIM, 0.0f);
+			for (int b = 0; b < BATCH_SIZE; b++)
+			{
+				const int batchShiftIn = b * COMPRESS_IN_DIM;
+				const int batchShiftOut = b * COMPRESS_OUT_DIM;
+				for (int i = 0; i < COMPRESS_OUT_DIM; i++)
+				{
+					_gradsToPrev[batchShiftIn + _argmax[batchShiftOut + i]] += nextGrad[batchShiftOut + i];
+				}
+			}
+			_prevLayer.TrainBackward(_gradsToPrev);
+		}
+#pragma endregion
+	};
+}
+
+#endif
@@ -0,0 +1,266 @@
+﻿/**
+ * @file bit_quant_activation.h
+ * @author Daichi Sato
+ * @brief 多ビット(2~4bit)量子化アクティベーション層
+ * @version 0.1
+ * @date 2021-12-23
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * 前の全結合層の積和sを Bits ビットの値 q (0 <= q <= 2^Bits - 1) に量子化し，Bits 枚のビットプレーンで出力する。
+ * 次の全結合層はプレーンjのビットを±1とみなし，プレーンごとのXNOR-popcountを2^jで合成するので，
+ * 入力値は v = Σ 2^j (2 b_j - 1) = 2q - (2^Bits - 1)，すなわち {-(2^Bits - 1), ..., -1, 1, ..., 2^Bits - 1} の奇数となる。
+ * v ≒ s / STEP となるよう量子化する（STEPは2のべき乗）。
+ * 1bit(BitSignActivation)とint(IntDenseLayer)の中間の精度を，ビット演算のまま得るための層。
+ *
+ * 前の層は積和をそのまま出す全結合層（isOutputLayer = true）とする。
+ * 学習時は確率的に丸め，逆伝播はクリップ範囲内だけ勾配を 1/STEP 倍して通す（straight-through estimator）。
+ *
+ */
+#ifndef BIT_QUANT_ACTIVATION_H_
+#define BIT_QUANT_ACTIVATION_H_
+
+#include "../../net_common.h"
+#include "../../optimizer/optimizer.h"
+#include "../../util/random_util.h"
+#include "../../util/bit_helper.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <type_traits>
+#include <utility>
+
+namespace bitnet
+{
+	/**
+	 * @brief 多ビット量子化アクティベーション層
+	 *
+	 * @tparam PreviousLayer_t 前のレイヤー型（int32の積和を出力する全結合層）
+	 * @tparam Bits 活性のビット数(1~4)
+	 * @tparam StepSize 量子化幅（2のべき乗. 0なら前の層の入力次元から決める）
+	 */
+	template <typename PreviousLayer_t, int Bits, int StepSize = 0>
+	class BitQuantActivation
+	{
+		static_assert(1 <= Bits && Bits <= 4, "Bits must be in [1, 4]");
+		static_assert(std::is_same_v<std::remove_cv_t<std::remove_pointer_t<decltype(std::declval<PreviousLayer_t &>().Forward(nullptr))>>, int32_t>,
+					  "BitQuantActivation needs raw sums (use a dense layer with isOutputLayer = true)");
+		static_assert(StepSize >= 0 && (StepSize & (StepSize - 1)) == 0, "StepSize must be a power of two");
+
+		static constexpr int Log2Floor(int x)
+		{
+			int log = 0;
+			while ((2 << log) <= x)
+			{
+				log++;
+			}
+			return log;
+		}
+
+		static constexpr int ISqrt(int x)
+		{
+			int r = 0;
+			while ((r + 1) * (r + 1) <= x)
+			{
+				r++;
+			}
+			return r;
+		}
+
+	public:
+		using PreviousLayer = PreviousLayer_t;
+		static constexpr int ACTIVATION_PLANES = Bits;
+		// 出力次元数
+		static constexpr int COMPRESS_OUT_DIM = PreviousLayer_t::COMPRESS_OUT_DIM;
+		static constexpr int PLANE_BITS = AddPaddingToBitSize(COMPRESS_OUT_DIM);
+		static constexpr int PLANE_BLOCKS = BitToBlockCount(PLANE_BITS);
+		// 1サンプル分の出力（Bits枚のプレーン）
+		static constexpr int PADDED_OUT_BLOCKS = PLANE_BLOCKS * Bits;
+		// 入力次元数（前の層の出力はサンプルごとにCOMPRESS_IN_DIM個ずつ並ぶ）
+		static constexpr int COMPRESS_IN_DIM = PreviousLayer_t::COMPRESS_OUT_DIM;
+
+		static constexpr int MAX_LEVEL = (1 << Bits) - 1;
+		// 前の層の積和の標準偏差を√(入力次元)とみなし，±2σが量子化範囲に収まる幅
+		static constexpr int STEP = StepSize > 0 ? StepSize : (1 << Log2Floor(std::max(1, 2 * ISqrt(PreviousLayer_t::COMPRESS_IN_DIM) / MAX_LEVEL)));
+		static constexpr int STEP_SHIFT = Log2Floor(2 * STEP);
+
+	private:
+		// 出力バッファ（次の層が参照する
+		alignas(32) BitBlock _outputBuffer[PADDED_OUT_BLOCKS] = {0};
+		alignas(32) BitBlock _outputBatchBuffer[BATCH_SIZE * PADDED_OUT_BLOCKS] = {0};
+		// 前の層
+		PreviousLayer_t _prevLayer;
+		// 前の層に伝播する勾配
+		GradientType _gradsToPrev[BATCH_SIZE * COMPRESS_IN_DIM] = {0};
+		int32_t *_inputBatchBuffer;
+
+		/**
+		 * @brief 積和を量子化レベル q に変換する（v = 2q - MAX_LEVEL ≒ s / STEP）
+		 */
+		static int32_t Quantize(int32_t sum)
+		{
+			const int32_t shifted = sum + STEP * (MAX_LEVEL + 1);
+			return std::min(MAX_LEVEL, std::max(0, shifted) >> STEP_SHIFT);
+		}
+
+		/**
+		 * @brief 1サンプル分の積和を量子化してプレーンに詰める. 8ニューロンずつ量子化し，各プレーンの1バイトをmovemaskで作る
+		 */
+		static void PackPlanes(const int32_t *input, BitBlock *output)
+		{
+			memset(output, 0, sizeof(BitBlock) * PADDED_OUT_BLOCKS);
+			const vector32 offset = _mm256_set1_epi32(STEP * (MAX_LEVEL + 1));
+			const vector32 zero = _mm256_setzero_si256();
+			const vector32 maxLevel = _mm256_set1_epi32(MAX_LEVEL);
+			for (int i = 0; i < COMPRESS_OUT_DIM; i += BYTE_BIT_WIDTH)
+			{
+				// 末尾の端数分は入力の後ろを読むが，結果はマスクで捨てる
+				vector32 q = _mm256_add_epi32(_mm256_loadu_si256((const vector32 *)&input[i]), offset);
+				q = _mm256_min_epi32(maxLevel, _mm256_srai_epi32(_mm256_max_epi32(zero, q), STEP_SHIFT));
+				const int rest = COMPRESS_OUT_DIM - i;
+				const BitBlock valid = rest >= BYTE_BIT_WIDTH ? 0xff : static_cast<BitBlock>((1 << rest) - 1);
+				for (int plane = 0; plane < Bits; plane++)
+				{
+					// プレーンのビットを各レーンの最上位に移して集める
+					const vector32 bit = _mm256_sll_epi32(q, _mm_cvtsi32_si128(31 - plane));
+					output[plane * PLANE_BLOCKS + GetBlockIndex(i)] = static_cast<BitBlock>(_mm256_movemask_ps(_mm256_castsi256_ps(bit))) & valid;
+				}
+			}
+		}
+
+	public:
+		void Init()
+		{
+			memset(_outputBuffer, 0, sizeof(BitBlock) * PADDED_OUT_BLOCKS);
+			memset(_outputBatchBuffer, 0, sizeof(BitBlock) * BATCH_SIZE * PADDED_OUT_BLOCKS);
+			_prevLayer.Init();
+		}
+
+		void Save(std::ostream &fs) { _prevLayer.Save(fs); }
+		void Load(std::istream &fs) { _prevLayer.Load(fs); }
+		void SaveOptimizer(std::ostream &fs) { _prevLayer.SaveOptimizer(fs); }
+		void LoadOptimizer(std::istream &fs) { _prevLayer.LoadOptimizer(fs); }
+		void CopyInferenceParams(const BitQuantActivation &src) { _prevLayer.CopyInferenceParams(src._prevLayer); }
+		void SetOptimizerParams(const OptimizerParams &params) { _prevLayer.SetOptimizerParams(params); }
+
+		const BitBlock *Forward(const BitBlock *netInput)
+		{
+			return ForwardStep(_prevLayer.Forward(netInput), _outputBuffer);
+		}
+
+		/**
+		 * @brief この層だけの推論. outputにはパディングまで書き込む（Sequentialのバッファ共有用）
+		 */
+		const BitBlock *ForwardStep(const int32_t *input, BitBlock *output) const
+		{
+			PackPlanes(input, output);
+			return output;
+		}
+
+		const BitBlock *ForwardBatch(const BitBlock *netInput, int n)
+		{
+			const int32_t *input = _prevLayer.ForwardBatch(netInput, n);
+			for (int b = 0; b < n; b++)
+			{
+				PackPlanes(&input[b * COMPRESS_IN_DIM], &_outputBatchBuffer[b * PADDED_OUT_BLOCKS]);
+			}
+			return _outputBatchBuffer;
+		}
+
+		void ResetWeight()
+		{
+			_prevLayer.ResetWeight();
+		}
+
+		int SignFlipCount() const
+		{
+			return _prevLayer.SignFlipCount();
+		}
+
+		/**
+		 * @brief 最も入力側の層（パイプライン学習でステージ境界の勾配を取り出すのに使う）
+		 */
+		auto &InputLayer()
+		{
+			return _prevLayer.InputLayer();
+		}
+
+		PreviousLayer_t &PrevLayer()
+		{
+			return _prevLayer;
+		}
+
+		const PreviousLayer_t &PrevLayer() const
+		{
+			return _prevLayer;
+		}
+
+		/**
+		 * @brief 量子化後の値 v = 2q - MAX_LEVEL（テスト・解析用）
+		 */
+		static int32_t QuantizedValue(int32_t sum)
+		{
+			return 2 * Quantize(sum) - MAX_LEVEL;
+		}
+
+#pragma region Train
+
+		/**
+		 * @brief 学習時の順伝播で書き込み，逆伝播で参照するバッファをfunc(ptr, bytes)に渡す（この層以前）
+		 */
+		template <typename Func_t>
+		void ForEachTrainBuffer(Func_t &&func)
+		{
+			func(_outputBatchBuffer, sizeof(_outputBatchBuffer));
+			_prevLayer.ForEachTrainBuffer(func);
+		}
+
+		BitBlock *TrainForward(const BitBlock *netInput)
+		{
+			_inputBatchBuffer = _prevLayer.TrainForward(netInput);
+			memset(_outputBatchBuffer, 0, sizeof(_outputBatchBuffer));
+
+			for (int b = 0; b < BATCH_SIZE; b++)
+			{
+				const int batchShiftIn = b * COMPRESS_IN_DIM;
+				BitBlock *const output = &_outputBatchBuffer[b * PADDED_OUT_BLOCKS];
+				for (int i_in = 0; i_in < COMPRESS_IN_DIM; i_in++)
+				{
+					// 隣り合うレベルの間を確率的に丸める
+					const double level = (double)(_inputBatchBuffer[batchShiftIn + i_in] + STEP * MAX_LEVEL) / (2 * STEP);
+					const double lower = std::floor(level);
+					const int q = std::max(0, std::min(MAX_LEVEL, (int)lower + (Random::GetReal01() < level - lower ? 1 : 0)));
+
+					const int blockIdx = GetBlockIndex(i_in);
+					const int bitShift = GetBitIndexInBlock(i_in);
+					for (int plane = 0; plane < Bits; plane++)
+					{
+						output[plane * PLANE_BLOCKS + blockIdx] |= static_cast<BitBlock>(((q >> plane) & 1) << bitShift);
+					}
+				}
+			}
+			return _outputBatchBuffer;
+		}
+
+		void TrainBackward(const GradientType *nextGrad)
+		{
+			// straight-through estimator: v ≒ s / STEP のクリップ範囲内だけ勾配を通す
+			constexpr int32_t limit = STEP * (MAX_LEVEL + 1);
+			constexpr GradientType scale = 1.0f / STEP;
+			for (int b = 0; b < BATCH_SIZE; b++)
+			{
+				const int batchShift = b * COMPRESS_IN_DIM;
+				for (int i_in = 0; i_in < COMPRESS_IN_DIM; i_in++)
+				{
+					const int32_t sum = _inputBatchBuffer[batchShift + i_in];
+					_gradsToPrev[batchShift + i_in] = (-limit < sum && sum < limit) ? nextGrad[batchShift + i_in] * scale : 0;
+				}
+			}
+			_prevLayer.TrainBackward(_gradsToPrev);
+		}
+
+#pragma endregion
+	};
+}
+
+#endif
@@ -15,8 +15,10 @@
 #define BIT_SIGN_ACTIVATION_H_
 
 #include "../../net_common.h"
+#include "../../optimizer/optimizer.h"
 #include "../../util/random_util.h"
 #include "../../util/bit_helper.h"
+#include "../../util/live_grad_list.h"
 #include <algorithm>
 
 namespace bitnet
@@ -31,6 +33,7 @@ namespace bitnet
 	{
 
 	public:
+		using PreviousLayer = PreviousLayer_t;
 		// 出力次元数
 		static constexpr int COMPRESS_OUT_DIM = PreviousLayer_t::COMPRESS_OUT_DIM;
 		static constexpr int COMPRESS_OUT_BITS = COMPRESS_OUT_DIM;
@@ -50,6 +53,8 @@ namespace bitnet
 		// 前の層に伝播する勾配
 		GradientType _gradsToPrev[BATCH_SIZE * COMPRESS_IN_DIM] = {0};
 		int8_t *_inputBatchBuffer;
+		// hard-tanhの微分が1となる(サンプル, ニューロン)の組
+		LiveGradList<COMPRESS_IN_DIM> _liveList;
 
 	public:
 		void Init()
@@ -59,12 +64,26 @@ namespace bitnet
 			_prevLayer.Init();
 		}
 
-		void Save(std::ofstream &fs) { _prevLayer.Save(fs); }
-		void Load(std::ifstream &fs) { _prevLayer.Load(fs); }
+		void Save(std::ostream &fs) { _prevLayer.Save(fs); }
+		void Load(std::istream &fs) { _prevLayer.Load(fs); }
+		void SaveOptimizer(std::ostream &fs) { _prevLayer.SaveOptimizer(fs); }
+		void LoadOptimizer(std::istream &fs) { _prevLayer.LoadOptimizer(fs); }
+		void CopyInferenceParams(const BitSignActivation &src) { _prevLayer.CopyInferenceParams(src._prevLayer); }
+		void SetOptimizerParams(const OptimizerParams &params) { _prevLayer.SetOptimizerParams(params); }
 
 		const BitBlock *Forward(const BitBlock *netInput)
 		{
-			const int8_t *input = _prevLayer.Forward(netInput);
+			return ForwardStep(_prevLayer.Forward(netInput), _outputBuffer);
+		}
+
+		/**
+		 * @brief この層だけの推論. outputにはパディングまで書き込む（Sequentialのバッファ共有用）
+		 */
+		const BitBlock *ForwardStep(const int8_t *input, BitBlock *output) const
+		{
+			// CollectSignBitが書くのはPADDED_IN_BLOCKSビット分なので，残りのパディングは0で埋める
+			constexpr int SIGN_BLOCKS = BitToBlockCount(PADDED_IN_BLOCKS);
+			memset(&output[SIGN_BLOCKS], 0, sizeof(BitBlock) * (PADDED_OUT_BLOCKS - SIGN_BLOCKS));
 
 			if (USE_AVX_SIGN)
 			{
@@ -80,10 +99,11 @@ namespace bitnet
 
 				// 	_outputBuffer[b] = _mm256_movemask_epi8(~x);
 				// }
-				CollectSignBit(input, reinterpret_cast<int *>(_outputBuffer), PADDED_IN_BLOCKS);
+				CollectSignBit(input, reinterpret_cast<int *>(output), PADDED_IN_BLOCKS);
 			}
 			else
 			{
+				memset(output, 0, sizeof(BitBlock) * SIGN_BLOCKS);
 				for (int i_in = 0; i_in < COMPRESS_IN_DIM; i_in++)
 				{
 					const int8_t x = input[i_in];
@@ -91,16 +111,27 @@ namespace bitnet
 
 					const int blockIdx = GetBlockIndex(i_in);
 					const int bitShift = GetBitIndexInBlock(i_in);
-					const BitBlock block = _outputBuffer[blockIdx];
+					const BitBlock block = output[blockIdx];
 					const BitBlock mask = ~(1 << bitShift);
 					const BitBlock newBit = isPositive << bitShift;
 					const BitBlock result = (block & mask) | newBit;
 
-					_outputBuffer[blockIdx] = result;
+					output[blockIdx] = result;
 				}
 			}
 
-			return _outputBuffer;
+			return output;
+		}
+
+		const BitBlock *ForwardBatch(const BitBlock *netInput, int n)
+		{
+			const int8_t *input = _prevLayer.ForwardBatch(netInput, n);
+			for (int b = 0; b < n; b++)
+			{
+				// 推論時は確率的な2値化は行わない
+				CollectSignBit(&input[b * PADDED_IN_BLOCKS], reinterpret_cast<int *>(&_outputBatchBuffer[b * PADDED_OUT_BLOCKS]), PADDED_IN_BLOCKS);
+			}
+			return _outputBatchBuffer;
 		}
 
 		void ResetWeight()
@@ -108,9 +139,42 @@ namespace bitnet
 			_prevLayer.ResetWeight();
 		}
 
+		int SignFlipCount() const
+		{
+			return _prevLayer.SignFlipCount();
+		}
+
+		/**
+		 * @brief 最も入力側の層（パイプライン学習でステージ境界の勾配を取り出すのに使う）
+		 */
+		auto &InputLayer()
+		{
+			return _prevLayer.InputLayer();
+		}
+
+		PreviousLayer_t &PrevLayer()
+		{
+			return _prevLayer;
+		}
+
+		const PreviousLayer_t &PrevLayer() const
+		{
+			return _prevLayer;
+		}
+
 #pragma region Train
 
 		// double -> int_01
+		/**
+		 * @brief 学習時の順伝播で書き込み，逆伝播で参照するバッファをfunc(ptr, bytes)に渡す（この層以前）
+		 */
+		template <typename Func_t>
+		void ForEachTrainBuffer(Func_t &&func)
+		{
+			func(_outputBatchBuffer, sizeof(_outputBatchBuffer));
+			_prevLayer.ForEachTrainBuffer(func);
+		}
+
 		BitBlock *TrainForward(const BitBlock *netInput)
 		{
 			_inputBatchBuffer = _prevLayer.TrainForward(netInput);
@@ -143,26 +207,19 @@ namespace bitnet
 
 		void TrainBackward(const GradientType *nextGrad)
 		{
+			// d_Hard-tanh  |x| <= 1の組だけ勾配を通す
+			_liveList.CollectUnsaturated(_inputBatchBuffer, PADDED_IN_BLOCKS);
+			memset(_gradsToPrev, 0, sizeof(GradientType) * BATCH_SIZE * COMPRESS_OUT_DIM);
 			for (int b = 0; b < BATCH_SIZE; b++)
 			{
-				const int batchShiftIn = b * PADDED_IN_BLOCKS;
 				const int batchShiftOut = b * COMPRESS_OUT_DIM;
-				for (int i = 0; i < COMPRESS_OUT_DIM; i++)
+				for (const int *it = _liveList.Begin(b); it != _liveList.End(b); ++it)
 				{
-					const GradientType g = nextGrad[batchShiftOut + i];
-
-					// d_Hard-tanh
-					if (std::abs(_inputBatchBuffer[batchShiftIn + i]) <= 1)
-					{
-						_gradsToPrev[batchShiftOut + i] = g;
-					}
-					else
-					{
-						_gradsToPrev[batchShiftOut + i] = 0;
-					}
+					_gradsToPrev[batchShiftOut + *it] = nextGrad[batchShiftOut + *it];
 				}
 			}
-			_prevLayer.TrainBackward(_gradsToPrev);
+			// 前の層は生きている組だけを走査すればよい
+			_prevLayer.TrainBackward(_gradsToPrev, _liveList);
 		}
 
 #pragma endregion
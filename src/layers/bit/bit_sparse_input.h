@@ -0,0 +1,209 @@
+﻿/**
+ * @file bit_sparse_input.h
+ * @author Daichi Sato
+ * @brief 有効な特徴の添字リストを受け取る入力層
+ * @version 0.1
+ * @date 2021-12-27
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * 数万〜数十万次元のうち数十個だけが1になるone-hot的な特徴を，ビット列に展開せずに扱う。
+ * 1サンプル分の入力は[有効数, 添字0, ..., 添字MaxActive-1]のint32列（PADDED_OUT_BLOCKSバイト）で，
+ * 次の全結合層は重みの列優先コピーから有効な列だけを集計する（無効な特徴は0として寄与しない）。
+ *
+ */
+#ifndef BIT_SPARSE_INPUT_H_
+#define BIT_SPARSE_INPUT_H_
+
+#include "../../net_common.h"
+#include "../../optimizer/optimizer.h"
+#include "../../util/bit_helper.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace bitnet
+{
+    /**
+     * @brief 疎な2値入力層
+     *
+     * @tparam InputBits 入力の次元数
+     * @tparam MaxActive 1サンプルあたりの有効な特徴の最大数
+     */
+    template <int InputBits, int MaxActive>
+    class SparseBitInputLayer
+    {
+        static_assert(MaxActive > 0 && MaxActive <= 32767, "active counts are accumulated in int16");
+
+    public:
+        // 連鎖の終端
+        using PreviousLayer = void;
+        // 出力が添字リストであることを次の層に知らせる
+        static constexpr bool SPARSE_INPUT = true;
+        static constexpr int MAX_ACTIVE = MaxActive;
+        // 出力次元数（論理的な特徴数）
+        static constexpr int COMPRESS_OUT_DIM = InputBits;
+        // 1サンプル分の行: 有効数1個と添字MaxActive個
+        static constexpr int ROW_BYTES = sizeof(int32_t) * (1 + MaxActive);
+        static constexpr int PADDED_OUT_BLOCKS = AddPaddingToBytes(ROW_BYTES);
+
+    private:
+        // 出力バッファ（次の層が参照する
+        alignas(32) BitBlock _outputBuffer[PADDED_OUT_BLOCKS] = {};
+        alignas(32) BitBlock _outputBatchBuffer[BATCH_SIZE * PADDED_OUT_BLOCKS] = {};
+
+        /**
+         * @brief 1行をdstに写す. 有効数はMaxActiveで打ち切り，範囲外と重複の添字は捨てる（外部からの入力を信用しない）
+         * 重複を残すと列の集計と重みの更新が2回ずつ行われるので，添字は昇順に並べ替えて重複を除く
+         */
+        static void CopyRow(const BitBlock *src, BitBlock *dst)
+        {
+            int32_t count;
+            memcpy(&count, src, sizeof(int32_t));
+            count = std::max(0, std::min(MaxActive, count));
+            int32_t *indices = reinterpret_cast<int32_t *>(dst) + 1;
+            int32_t kept = 0;
+            for (int k = 0; k < count; k++)
+            {
+                int32_t index;
+                memcpy(&index, src + sizeof(int32_t) * (1 + k), sizeof(int32_t));
+                if (index >= 0 && index < InputBits)
+                {
+                    indices[kept++] = index;
+                }
+            }
+            std::sort(indices, indices + kept);
+            kept = static_cast<int32_t>(std::unique(indices, indices + kept) - indices);
+            reinterpret_cast<int32_t *>(dst)[0] = kept;
+            memset(&indices[kept], 0, PADDED_OUT_BLOCKS - sizeof(int32_t) * (1 + kept));
+        }
+
+    public:
+        /**
+         * @brief 有効な特徴の添字を1行分の入力に詰める
+         *
+         * @param indices 有効な特徴の添字（範囲外や重複があればruntime_error）
+         * @param count 添字の数(<= MaxActive)
+         * @param row 格納先 [PADDED_OUT_BLOCKS]
+         */
+        static void EncodeRow(const int32_t *indices, int count, BitBlock *row)
+        {
+            if (count < 0 || count > MaxActive)
+            {
+                throw std::runtime_error("too many active features: " + std::to_string(count) + " > " + std::to_string(MaxActive));
+            }
+            for (int k = 0; k < count; k++)
+            {
+                if (indices[k] < 0 || indices[k] >= InputBits)
+                {
+                    throw std::runtime_error("feature index out of range: " + std::to_string(indices[k]));
+                }
+            }
+            std::vector<int32_t> sorted(indices, indices + count);
+            std::sort(sorted.begin(), sorted.end());
+            const auto duplicate = std::adjacent_find(sorted.begin(), sorted.end());
+            if (duplicate != sorted.end())
+            {
+                throw std::runtime_error("duplicate feature index: " + std::to_string(*duplicate));
+            }
+            memset(row, 0, PADDED_OUT_BLOCKS);
+            memcpy(row, &count, sizeof(int32_t));
+            memcpy(row + sizeof(int32_t), indices, sizeof(int32_t) * count);
+        }
+
+        /**
+         * @brief この層の出力1行の有効数
+         */
+        static int ActiveCount(const BitBlock *row)
+        {
+            return reinterpret_cast<const int32_t *>(row)[0];
+        }
+
+        /**
+         * @brief この層の出力1行の添字列
+         */
+        static const int32_t *Indices(const BitBlock *row)
+        {
+            return reinterpret_cast<const int32_t *>(row) + 1;
+        }
+
+        void Init()
+        {
+            memset(_outputBuffer, 0, sizeof(BitBlock) * PADDED_OUT_BLOCKS);
+            memset(_outputBatchBuffer, 0, sizeof(BitBlock) * BATCH_SIZE * PADDED_OUT_BLOCKS);
+        }
+
+        void Save(std::ostream &fs) {} // 終端
+        void Load(std::istream &fs) {} // 終端
+        void SaveOptimizer(std::ostream &fs) {} // 終端
+        void LoadOptimizer(std::istream &fs) {} // 終端
+        void CopyInferenceParams(const SparseBitInputLayer &) {} // 終端
+        void SetOptimizerParams(const OptimizerParams &) {} // 終端
+
+        const BitBlock *Forward(const BitBlock *netInput)
+        {
+            return ForwardStep(netInput, _outputBuffer);
+        }
+
+        /**
+         * @brief 入力をoutputに詰める（Sequentialのバッファ共有用）
+         */
+        const BitBlock *ForwardStep(const BitBlock *netInput, BitBlock *output) const
+        {
+            CopyRow(netInput, output);
+            return output;
+        }
+
+        const BitBlock *ForwardBatch(const BitBlock *netInput, int n)
+        {
+            for (int b = 0; b < n; b++)
+            {
+                CopyRow(&netInput[b * PADDED_OUT_BLOCKS], &_outputBatchBuffer[b * PADDED_OUT_BLOCKS]);
+            }
+            return _outputBatchBuffer;
+        }
+
+        void ResetWeight()
+        {
+        }
+
+        int SignFlipCount() const
+        {
+            return 0;
+        }
+
+        SparseBitInputLayer &InputLayer()
+        {
+            return *this;
+        }
+
+#pragma region Train
+        // 入力を詰めたバッファ（パイプライン学習で順伝播の状態を保存・復元する）. 終端
+        template <typename Func_t>
+        void ForEachTrainBuffer(Func_t &&func)
+        {
+            func(_outputBatchBuffer, sizeof(_outputBatchBuffer));
+        }
+
+        BitBlock *TrainForward(const BitBlock *netInput)
+        {
+            // バッファに入力を詰める
+            for (int b = 0; b < BATCH_SIZE; b++)
+            {
+                CopyRow(&netInput[b * PADDED_OUT_BLOCKS], &_outputBatchBuffer[b * PADDED_OUT_BLOCKS]);
+            }
+            return _outputBatchBuffer;
+        }
+
+        void TrainBackward(const GradientType *nextGrad)
+        {
+            // 学習する要素無し（次の層も入力への勾配を計算しない）
+        }
+#pragma endregion
+    };
+}
+
+#endif
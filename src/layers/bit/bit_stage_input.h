@@ -0,0 +1,127 @@
+﻿/**
+ * @file bit_stage_input.h
+ * @author Daichi Sato
+ * @brief パイプライン学習のステージ境界に置く入力層
+ * @version 0.1
+ * @date 2021-12-12
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * 前のステージの出力ビット列を入力として受け取り，
+ * 逆伝播で受け取った勾配を前のステージへ渡すために保持する。
+ *
+ */
+#ifndef BIT_STAGE_INPUT_H_
+#define BIT_STAGE_INPUT_H_
+
+#include "../../net_common.h"
+#include "../../optimizer/optimizer.h"
+#include "../../util/bit_helper.h"
+#include <cstring>
+#include <fstream>
+
+namespace bitnet
+{
+    /**
+     * @brief ステージ境界の入力層
+     *
+     * @tparam InputBits 入力数（前のステージの出力次元数）
+     */
+    template <int InputBits>
+    class BitStageInputLayer
+    {
+    public:
+        // 連鎖の終端
+        using PreviousLayer = void;
+        // 出力次元数
+        static constexpr int COMPRESS_OUT_DIM = InputBits;
+        static constexpr int COMPRESS_OUT_BITS = InputBits;
+        static constexpr int COMPRESS_OUT_BLOCKS = BitToBlockCount(InputBits);
+        static constexpr int PADDED_OUT_BITS = AddPaddingToBitSize(COMPRESS_OUT_BITS);
+        static constexpr int PADDED_OUT_BLOCKS = BitToBlockCount(PADDED_OUT_BITS);
+
+    private:
+        // 出力バッファ（次の層が参照する
+        alignas(32) BitBlock _outputBuffer[PADDED_OUT_BLOCKS] = {};
+        alignas(32) BitBlock _outputBatchBuffer[BATCH_SIZE * PADDED_OUT_BLOCKS] = {};
+        // 次の層から受け取った勾配（前のステージへ渡す
+        GradientType _grads[BATCH_SIZE * COMPRESS_OUT_DIM] = {0};
+
+    public:
+        void Init()
+        {
+            memset(_outputBuffer, 0, sizeof(BitBlock) * PADDED_OUT_BLOCKS);
+            memset(_outputBatchBuffer, 0, sizeof(BitBlock) * BATCH_SIZE * PADDED_OUT_BLOCKS);
+        }
+
+        void Save(std::ostream &fs) {} // 終端
+        void Load(std::istream &fs) {} // 終端
+        void SaveOptimizer(std::ostream &fs) {} // 終端
+        void LoadOptimizer(std::istream &fs) {} // 終端
+        void CopyInferenceParams(const BitStageInputLayer &) {} // 終端
+        void SetOptimizerParams(const OptimizerParams &) {} // 終端
+
+        const BitBlock *Forward(const BitBlock *netInput)
+        {
+            // 前のステージの出力はパディング込みの形式なのでそのままコピー
+            memcpy(_outputBuffer, netInput, sizeof(BitBlock) * PADDED_OUT_BLOCKS);
+            return _outputBuffer;
+        }
+
+        const BitBlock *ForwardStep(const BitBlock *netInput, BitBlock *output) const
+        {
+            memcpy(output, netInput, sizeof(BitBlock) * PADDED_OUT_BLOCKS);
+            return output;
+        }
+
+        const BitBlock *ForwardBatch(const BitBlock *netInput, int n)
+        {
+            memcpy(_outputBatchBuffer, netInput, sizeof(BitBlock) * n * PADDED_OUT_BLOCKS);
+            return _outputBatchBuffer;
+        }
+
+        void ResetWeight()
+        {
+        }
+
+        int SignFlipCount() const
+        {
+            return 0;
+        }
+
+        BitStageInputLayer &InputLayer()
+        {
+            return *this;
+        }
+
+        /**
+         * @brief 直前のTrainBackwardで受け取った勾配 [BATCH_SIZE][COMPRESS_OUT_DIM]
+         */
+        const GradientType *GetGrads() const
+        {
+            return _grads;
+        }
+
+#pragma region Train
+        // 入力を詰めたバッファ（パイプライン学習で順伝播の状態を保存・復元する）. 終端
+        template <typename Func_t>
+        void ForEachTrainBuffer(Func_t &&func)
+        {
+            func(_outputBatchBuffer, sizeof(_outputBatchBuffer));
+        }
+
+        BitBlock *TrainForward(const BitBlock *netInput)
+        {
+            memcpy(_outputBatchBuffer, netInput, sizeof(BitBlock) * BATCH_SIZE * PADDED_OUT_BLOCKS);
+            return _outputBatchBuffer;
+        }
+
+        void TrainBackward(const GradientType *nextGrad)
+        {
+            memcpy(_grads, nextGrad, sizeof(GradientType) * BATCH_SIZE * COMPRESS_OUT_DIM);
+        }
+#pragma endregion
+    };
+}
+
+#endif
@@ -0,0 +1,89 @@
+﻿/**
+ * @file bit_ternary_dense.h
+ * @author Daichi Sato
+ * @brief 3値重み(-1, 0, +1)の全結合層の定義
+ * @version 0.1
+ * @date 2021-12-22
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * 重みは符号ビット列と非ゼロのビット列（マスク）の2面で持ち，
+ * 積和は popcount(mask & ~(x ^ w)) - popcount(mask & (x ^ w)) = 2 * popcount(mask & ~(x ^ w)) - popcount(mask) で求める。
+ * popcount(mask)は行ごとに前計算するので，BitDenseLayerに比べてビット演算はマスクのAND1回分だけ増える。
+ * 学習はBitDenseLayerと同じく実数値重みを持ち，|w| > TernaryWeight::THRESHOLD の重みだけを±1，それ以外を0とする。
+ * 層の実装はBitDenseLayerに重みの表現（TernaryWeight）を与えたものなので，
+ * 符号関数・正規化層やオプティマイザとの組み合わせもBitDenseLayerと同じ。
+ *
+ */
+
+#ifndef BIT_TERNARY_DENSE_H_INCLUDED_
+#define BIT_TERNARY_DENSE_H_INCLUDED_
+
+#include <cmath>
+#include "../../util/bit_helper.h"
+#include "bit_dense.h"
+
+namespace bitnet
+{
+	/**
+	 * @brief 3値重み(-1, 0, +1)の表現。符号ビット列と非ゼロのビット列（マスク）を持つ
+	 */
+	struct TernaryWeight
+	{
+		static constexpr bool TERNARY = true;
+		// 実数値重みの絶対値がこれ以下なら3値重みを0とする
+		static constexpr float THRESHOLD = 0.35f;
+
+		/**
+		 * @brief 実数値重みの3値化結果
+		 */
+		static int Level(float w)
+		{
+			return w > THRESHOLD ? 1 : (w < -THRESHOLD ? -1 : 0);
+		}
+
+		/**
+		 * @brief 入力と重みの1ブロック分の，符号が一致する非ゼロ重みのビット
+		 */
+		static BitBlock Matches(BitBlock input, BitBlock sign, BitBlock mask)
+		{
+			return ~(input ^ sign) & mask;
+		}
+
+		template <int Length>
+		static int32_t CountMatches(const BitBlock *input, const BitBlock *signs, const BitBlock *mask)
+		{
+			return MaskedMaddPopcntDispatched<Length>(input, signs, mask);
+		}
+
+		/**
+		 * @brief 1行分の実数値重みを[-1,1]にクリッピングし，3値化して詰める
+		 * @return int 値が変わった3値重みの数
+		 */
+		static int PackRow(float *weights, BitBlock *signs, BitBlock *mask, int length)
+		{
+			return ClipAndPackTernary(weights, signs, mask, length, THRESHOLD);
+		}
+
+		/**
+		 * @brief 3値重みを係数としてgradを加算する（0の重みからは伝播しない）
+		 */
+		template <int Length>
+		static void AddGrad(float *dst, float grad, const BitBlock *signs, const BitBlock *mask)
+		{
+			AddTernaryGrad(dst, grad, signs, mask, Length);
+		}
+	};
+
+	/**
+	 * @brief 3値重みの全結合層。bitBlock入力
+	 *
+	 * @tparam PreviousLayer_t 前の層の型（1bit出力）
+	 * @tparam OutputBits 出力次元数（ニューロン数
+	 * @tparam isOutputLayer 出力層ならtrue(default:false)
+	 * @tparam Optimizer_t 実数値重みの更新則(default:SGD)
+	 */
+	template <typename PreviousLayer_t, int OutputBits, bool isOutputLayer = false, typename Optimizer_t = SGD>
+	using TernaryDenseLayer = BitDenseLayer<PreviousLayer_t, OutputBits, isOutputLayer, Optimizer_t, TernaryWeight>;
+}
+#endif
\ No newline at end of file
@@ -18,6 +18,7 @@
 
 #include "../../util/random_util.h"
 #include "../../net_common.h"
+#include "../../util/bit_helper.h"
 namespace bitnet
 {
 	/**
@@ -34,22 +35,24 @@ namespace bitnet
 		static constexpr int COMPRESS_OUT_DIM = OutputBits;
 		// 入力次元（前の層のニューロン）の数
 		static constexpr int COMPRESS_IN_DIM = PreviousLayer_t::COMPRESS_OUT_DIM;
+		// SIMD用にパディングした入力次元の数（前の層の出力バッファも同じ幅でパディングされている）
+		static constexpr int PADDED_IN_DIM = PreviousLayer_t::PADDED_OUT_DIM;
 
 	private:
 		// 前の層
 		PreviousLayer_t _prevLayer;
 		// 出力バッファ（次の層が参照する
 		int32_t _outputBuffer[COMPRESS_OUT_DIM];
-		// 2値重み(-1 or 1)
-		IntBitWeight _weight[COMPRESS_OUT_DIM][COMPRESS_IN_DIM];
+		// 2値重み(-1 or 1)。パディング部は0
+		alignas(64) IntBitWeight _weight[COMPRESS_OUT_DIM][PADDED_IN_DIM];
 		// バイアス
 		BiasType _bias[COMPRESS_OUT_DIM];
 
 #pragma region Train
 		// 前の層に伝播する勾配
 		GradientType _gradsToPrev[BATCH_SIZE * COMPRESS_IN_DIM];
-		// 勾配法用の実数値重み
-		float _realWeight[COMPRESS_OUT_DIM][COMPRESS_IN_DIM] = {0};
+		// 勾配法用の実数値重み。パディング部は0
+		alignas(32) float _realWeight[COMPRESS_OUT_DIM][PADDED_IN_DIM] = {0};
 		// バッチ学習版出力バッファ（学習時はこちらのバッファを使用する
 		int32_t _outputBatchBuffer[BATCH_SIZE * COMPRESS_OUT_DIM];
 		// 勾配計算用の入力バッファ（実態は前の層の出力バッファを参照するポインタ
@@ -64,9 +67,16 @@ namespace bitnet
 			{
 				// パディング分も含めて±1積和演算
 				int sum = _bias[i_out];
-				for (int i_in = 0; i_in < COMPRESS_IN_DIM; i_in++)
+				if (USE_AVX_INT_MADD)
 				{
-					sum += input[i_in] * _weight[i_out][i_in];
+					sum += MaddInt8(input, _weight[i_out], PADDED_IN_DIM);
+				}
+				else
+				{
+					for (int i_in = 0; i_in < COMPRESS_IN_DIM; i_in++)
+					{
+						sum += input[i_in] * _weight[i_out][i_in];
+					}
 				}
 
 				_outputBuffer[i_out] = sum;
@@ -91,6 +101,12 @@ namespace bitnet
 					_realWeight[i_out][i_in] = rand;
 					_weight[i_out][i_in] = rand > 0 ? 1 : -1;
 				}
+				// パディング部は積和に影響しないよう0にしておく
+				for (int i_in = COMPRESS_IN_DIM; i_in < PADDED_IN_DIM; i_in++)
+				{
+					_realWeight[i_out][i_in] = 0;
+					_weight[i_out][i_in] = 0;
+				}
 			}
 			_prevLayer.ResetWeight();
 		}
@@ -102,15 +118,22 @@ namespace bitnet
 
 			for (int b = 0; b < BATCH_SIZE; b++)
 			{
-				int batchShiftIn = b * COMPRESS_IN_DIM;
+				int batchShiftIn = b * PADDED_IN_DIM;
 				int batchShiftOut = b * COMPRESS_OUT_DIM;
 				for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
 				{
 					// パディング分も含めて±1積和演算
 					int sum = _bias[i_out];
-					for (int i_in = 0; i_in < COMPRESS_IN_DIM; i_in++)
+					if (USE_AVX_INT_MADD)
 					{
-						sum += _inputBatchBuffer[batchShiftIn + i_in] * _weight[i_out][i_in];
+						sum += MaddInt8(&_inputBatchBuffer[batchShiftIn], _weight[i_out], PADDED_IN_DIM);
+					}
+					else
+					{
+						for (int i_in = 0; i_in < COMPRESS_IN_DIM; i_in++)
+						{
+							sum += _inputBatchBuffer[batchShiftIn + i_in] * _weight[i_out][i_in];
+						}
 					}
 
 					_outputBatchBuffer[batchShiftOut + i_out] = sum;
@@ -127,28 +150,49 @@ namespace bitnet
 			{
 				int batchShiftIn = b * COMPRESS_IN_DIM;
 				int batchShiftOut = b * COMPRESS_OUT_DIM;
-				for (int i_in = 0; i_in < COMPRESS_IN_DIM; i_in++)
+				if (USE_AVX_INT_MADD)
 				{
-					GradientType sum = 0;
+					// 重みを行方向に走査し，i_outの順に加算する（スカラー版と加算順序は同じ）
+					GradientType *const grads = &_gradsToPrev[batchShiftIn];
+					std::fill(grads, grads + COMPRESS_IN_DIM, 0.0f);
 					for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
 					{
-						sum += nextGrad[batchShiftOut + i_out] * _weight[i_out][i_in];
+						AddScaledInt8(grads, nextGrad[batchShiftOut + i_out], _weight[i_out], COMPRESS_IN_DIM);
+					}
+				}
+				else
+				{
+					for (int i_in = 0; i_in < COMPRESS_IN_DIM; i_in++)
+					{
+						GradientType sum = 0;
+						for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
+						{
+							sum += nextGrad[batchShiftOut + i_out] * _weight[i_out][i_in];
+						}
+						_gradsToPrev[batchShiftIn + i_in] = sum;
 					}
-					_gradsToPrev[batchShiftIn + i_in] = sum;
 				}
 			}
 
 			for (int b = 0; b < BATCH_SIZE; b++)
 			{
-				int batchShiftIn = b * COMPRESS_IN_DIM;
+				int batchShiftIn = b * PADDED_IN_DIM;
 				int batchShiftOut = b * COMPRESS_OUT_DIM;
 				// 重み調整
 				for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
 				{
 					_bias[i_out] += nextGrad[batchShiftOut + i_out];
-					for (int i_in = 0; i_in < COMPRESS_IN_DIM; i_in++)
+					if (USE_AVX_INT_MADD)
+					{
+						// 入力のパディング部は0なので実数値重みのパディング部も0のまま
+						AddScaledInt8(_realWeight[i_out], nextGrad[batchShiftOut + i_out], &_inputBatchBuffer[batchShiftIn], PADDED_IN_DIM);
+					}
+					else
 					{
-						_realWeight[i_out][i_in] += nextGrad[batchShiftOut + i_out] * _inputBatchBuffer[batchShiftIn + i_in];
+						for (int i_in = 0; i_in < COMPRESS_IN_DIM; i_in++)
+						{
+							_realWeight[i_out][i_in] += nextGrad[batchShiftOut + i_out] * _inputBatchBuffer[batchShiftIn + i_in];
+						}
 					}
 				}
 			}
@@ -156,13 +200,21 @@ namespace bitnet
 			// 2値化
 			for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
 			{
-				for (int i_in = 0; i_in < COMPRESS_IN_DIM; i_in++)
+				if (USE_AVX_INT_MADD)
+				{
+					// パディング部の重みは0のまま残す
+					ClipAndSignInt8(_realWeight[i_out], _weight[i_out], COMPRESS_IN_DIM);
+				}
+				else
 				{
-					// Clipping
-					double tmp_w = std::max(-1.0, std::min(1.0, (double)_realWeight[i_out][i_in]));
-					_realWeight[i_out][i_in] = tmp_w;
+					for (int i_in = 0; i_in < COMPRESS_IN_DIM; i_in++)
+					{
+						// Clipping
+						double tmp_w = std::max(-1.0, std::min(1.0, (double)_realWeight[i_out][i_in]));
+						_realWeight[i_out][i_in] = tmp_w;
 
-					_weight[i_out][i_in] = (tmp_w > 0) ? 1 : -1;
+						_weight[i_out][i_in] = (tmp_w > 0) ? 1 : -1;
+					}
 				}
 			}
 
@@ -2,6 +2,7 @@
 #define INT_INPUT_H_INCLUDED_
 
 #include "../../net_common.h"
+#include "../../util/bit_helper.h"
 namespace bitnet
 {
 
@@ -17,13 +18,15 @@ namespace bitnet
 	public:
 		// 出力次元数
 		static constexpr int COMPRESS_OUT_DIM = InputBits;
+		// SIMD用にパディングした出力次元数
+		static constexpr int PADDED_OUT_DIM = AddPaddingToBytes(COMPRESS_OUT_DIM);
 		// 入力次元数
 		static constexpr int COMPRESS_IN_DIM = InputBits;
 
 	private:
-		// 出力バッファ（次の層が参照する
-		IntBitType _outputBuffer[COMPRESS_OUT_DIM];
-		IntBitType _outputBatchBuffer[BATCH_SIZE * COMPRESS_OUT_DIM];
+		// 出力バッファ（次の層が参照する。パディング部は0
+		alignas(32) IntBitType _outputBuffer[PADDED_OUT_DIM];
+		alignas(32) IntBitType _outputBatchBuffer[BATCH_SIZE * PADDED_OUT_DIM];
 
 	public:
 		const IntBitType *Forward(const int8_t *netInput)
@@ -33,6 +36,10 @@ namespace bitnet
 			{
 				_outputBuffer[i_out] = netInput[i_out];
 			}
+			for (int i_out = COMPRESS_OUT_DIM; i_out < PADDED_OUT_DIM; i_out++)
+			{
+				_outputBuffer[i_out] = 0;
+			}
 			return _outputBuffer;
 		}
 
@@ -46,10 +53,15 @@ namespace bitnet
 			// バッファに入力を詰める
 			for (int b = 0; b < BATCH_SIZE; b++)
 			{
-				int batchShiftOut = b * COMPRESS_OUT_DIM;
+				int batchShiftIn = b * COMPRESS_IN_DIM;
+				int batchShiftOut = b * PADDED_OUT_DIM;
 				for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
 				{
-					_outputBatchBuffer[batchShiftOut + i_out] = netInput[batchShiftOut + i_out];
+					_outputBatchBuffer[batchShiftOut + i_out] = netInput[batchShiftIn + i_out];
+				}
+				for (int i_out = COMPRESS_OUT_DIM; i_out < PADDED_OUT_DIM; i_out++)
+				{
+					_outputBatchBuffer[batchShiftOut + i_out] = 0;
 				}
 			}
 			return _outputBatchBuffer;
@@ -3,6 +3,7 @@
 
 #include "../../net_common.h"
 #include "../../util/random_util.h"
+#include "../../util/bit_helper.h"
 #include <algorithm>
 
 namespace bitnet
@@ -18,6 +19,8 @@ namespace bitnet
 	public:
 		// 出力次元数
 		static constexpr int COMPRESS_OUT_DIM = PreviousLayer_t::COMPRESS_OUT_DIM;
+		// SIMD用にパディングした出力次元数
+		static constexpr int PADDED_OUT_DIM = AddPaddingToBytes(COMPRESS_OUT_DIM);
 		// 入力次元数
 		static constexpr int COMPRESS_IN_DIM = COMPRESS_OUT_DIM;
 
@@ -26,9 +29,9 @@ namespace bitnet
 		PreviousLayer_t _prevLayer;
 		// 前の層に伝播する勾配
 		GradientType _gradsToPrev[BATCH_SIZE * COMPRESS_IN_DIM];
-		// 出力バッファ（次の層が参照する
-		IntBitType _outputBuffer[COMPRESS_OUT_DIM];
-		IntBitType _outputBatchBuffer[BATCH_SIZE * COMPRESS_OUT_DIM];
+		// 出力バッファ（次の層が参照する。パディング部は0
+		alignas(32) IntBitType _outputBuffer[PADDED_OUT_DIM];
+		alignas(32) IntBitType _outputBatchBuffer[BATCH_SIZE * PADDED_OUT_DIM];
 		int32_t *_inputBatchBuffer;
 
 	public:
@@ -42,6 +45,10 @@ namespace bitnet
 
 				_outputBuffer[i_out] = isPositive ? 1 : -1;
 			}
+			for (int i_out = COMPRESS_OUT_DIM; i_out < PADDED_OUT_DIM; i_out++)
+			{
+				_outputBuffer[i_out] = 0;
+			}
 			return _outputBuffer;
 		}
 
@@ -59,16 +66,21 @@ namespace bitnet
 
 			for (int b = 0; b < BATCH_SIZE; b++)
 			{
-				int batchShiftOut = b * COMPRESS_OUT_DIM;
+				int batchShiftIn = b * COMPRESS_IN_DIM;
+				int batchShiftOut = b * PADDED_OUT_DIM;
 				for (int i_out = 0; i_out < COMPRESS_OUT_DIM; i_out++)
 				{
-					int32_t x = _inputBatchBuffer[batchShiftOut + i_out];
+					int32_t x = _inputBatchBuffer[batchShiftIn + i_out];
 					const int32_t htanh = std::max(static_cast<int32_t>(-1), std::min(static_cast<int32_t>(1), x));
 					double probPositive = (htanh + 1.0) / 2.0;
 					bool isPositive = Random::GetReal01() < probPositive;
 
 					_outputBatchBuffer[batchShiftOut + i_out] = isPositive ? 1 : -1;
 				}
+				for (int i_out = COMPRESS_OUT_DIM; i_out < PADDED_OUT_DIM; i_out++)
+				{
+					_outputBatchBuffer[batchShiftOut + i_out] = 0;
+				}
 			}
 			return _outputBatchBuffer;
 		}
@@ -2,8 +2,16 @@
 #define LAYERS_H_INCLUDED_
 
 #include "bit/bit_input.h"
+#include "bit/bit_sparse_input.h"
+#include "bit/bit_stage_input.h"
 #include "bit/bit_dense.h"
+#include "bit/bit_ternary_dense.h"
 #include "bit/bit_sign_activation.h"
+#include "bit/bit_quant_activation.h"
+#include "bit/bit_batch_norm.h"
+#include "bit/bit_conv2d.h"
+#include "bit/bit_max_pool2d.h"
+#include "sequential.h"
 
 #include "int/int_input.h"
 #include "int/int_dense.h"
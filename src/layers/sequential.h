@@ -0,0 +1,340 @@
+﻿/**
+ * @file sequential.h
+ * @author Daichi Sato
+ * @brief 層の列からネットワークを組み立てるフロントエンドと，推論用活性バッファの静的割り当て
+ * @version 0.1
+ * @date 2021-12-14
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * Sequential<BitInput<2>, BitDense<256>, BitSign, ..., BitDense<1, true>>のように宣言すると，
+ * BitDenseLayer<BitSignActivation<...>>の入れ子型を組み立てる。
+ *
+ * 推論時に同時に生きている活性は隣り合う2層分だけなので，各層の出力は2つのアリーナに交互に置く。
+ * どの層がどちらのアリーナに書くかはコンパイル時に決まり，アリーナの大きさは最も幅の広い層に合わせる。
+ * 前の層の出力をそのまま返す層（BitBatchNorm）は新しいアリーナを使わない。
+ * 学習（TrainForward/TrainBackward）は逆伝播で各層のバッファを参照するため，従来通り層ごとのバッファを使う。
+ *
+ */
+#ifndef SEQUENTIAL_H_INCLUDED_
+#define SEQUENTIAL_H_INCLUDED_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <type_traits>
+#include <utility>
+#include "../net_common.h"
+#include "../optimizer/optimizer.h"
+#include "bit/bit_input.h"
+#include "bit/bit_sparse_input.h"
+#include "bit/bit_dense.h"
+#include "bit/bit_ternary_dense.h"
+#include "bit/bit_sign_activation.h"
+#include "bit/bit_quant_activation.h"
+#include "bit/bit_batch_norm.h"
+#include "bit/bit_conv2d.h"
+#include "bit/bit_max_pool2d.h"
+
+namespace bitnet
+{
+    /**
+     * @brief 入力層の宣言
+     */
+    template <int InputBits>
+    struct BitInput
+    {
+        using Layer = BitInputLayer<InputBits>;
+    };
+
+    /**
+     * @brief 有効な特徴の添字リストを受け取る入力層の宣言
+     */
+    template <int InputBits, int MaxActive>
+    struct SparseInput
+    {
+        using Layer = SparseBitInputLayer<InputBits, MaxActive>;
+    };
+
+    /**
+     * @brief 全結合層の宣言
+     */
+    template <int OutputBits, bool isOutputLayer = false, typename Optimizer_t = SGD>
+    struct BitDense
+    {
+        template <typename PreviousLayer_t>
+        using Apply = BitDenseLayer<PreviousLayer_t, OutputBits, isOutputLayer, Optimizer_t>;
+    };
+
+    /**
+     * @brief 3値重みの全結合層の宣言
+     */
+    template <int OutputBits, bool isOutputLayer = false, typename Optimizer_t = SGD>
+    struct TernaryDense
+    {
+        template <typename PreviousLayer_t>
+        using Apply = TernaryDenseLayer<PreviousLayer_t, OutputBits, isOutputLayer, Optimizer_t>;
+    };
+
+    /**
+     * @brief 符号関数アクティベーションの宣言
+     */
+    struct BitSign
+    {
+        template <typename PreviousLayer_t>
+        using Apply = BitSignActivation<PreviousLayer_t>;
+    };
+
+    /**
+     * @brief 多ビット量子化アクティベーションの宣言（前の全結合層はisOutputLayer = trueとする）
+     */
+    template <int Bits, int StepSize = 0>
+    struct BitQuant
+    {
+        template <typename PreviousLayer_t>
+        using Apply = BitQuantActivation<PreviousLayer_t, Bits, StepSize>;
+    };
+
+    /**
+     * @brief バッチ正規化の宣言
+     */
+    struct BitNorm
+    {
+        template <typename PreviousLayer_t>
+        using Apply = BitBatchNorm<PreviousLayer_t>;
+    };
+
+    /**
+     * @brief 畳み込み層の宣言
+     */
+    template <int Height, int Width, int InChannels, int OutChannels, int KernelSize, int Stride = 1>
+    struct BitConv
+    {
+        template <typename PreviousLayer_t>
+        using Apply = BitConv2D<PreviousLayer_t, Height, Width, InChannels, OutChannels, KernelSize, Stride>;
+    };
+
+    /**
+     * @brief 最大値プーリングの宣言
+     */
+    template <int Height, int Width, int Channels, int PoolSize>
+    struct BitMaxPool
+    {
+        template <typename PreviousLayer_t>
+        using Apply = BitMaxPool2D<PreviousLayer_t, Height, Width, Channels, PoolSize>;
+    };
+
+    namespace sequential_detail
+    {
+        template <typename Layer_t, typename... Specs>
+        struct Chain
+        {
+            using type = Layer_t;
+        };
+
+        template <typename Layer_t, typename Spec, typename... Rest>
+        struct Chain<Layer_t, Spec, Rest...>
+        {
+            using type = typename Chain<typename Spec::template Apply<Layer_t>, Rest...>::type;
+        };
+
+        template <typename Layer_t, typename = void>
+        struct IsInPlace : std::false_type
+        {
+        };
+
+        template <typename Layer_t>
+        struct IsInPlace<Layer_t, std::void_t<decltype(Layer_t::FORWARD_IN_PLACE)>> : std::bool_constant<Layer_t::FORWARD_IN_PLACE>
+        {
+        };
+
+        /**
+         * @brief 入力層の直後の層（第1層）を探す
+         */
+        template <typename Layer_t, typename = void>
+        struct FirstLayer
+        {
+            using type = typename FirstLayer<typename Layer_t::PreviousLayer>::type;
+        };
+
+        template <typename Layer_t>
+        struct FirstLayer<Layer_t, std::enable_if_t<std::is_void_v<typename Layer_t::PreviousLayer::PreviousLayer>>>
+        {
+            using type = Layer_t;
+        };
+
+        template <typename Layer_t>
+        using ForwardOutput_t = std::remove_cv_t<std::remove_pointer_t<decltype(std::declval<Layer_t &>().Forward(nullptr))>>;
+
+        /**
+         * @brief 入力側から順に，各層の出力を置くアリーナ(0/1)と必要なバイト数を決める
+         */
+        template <typename Layer_t, typename PreviousLayer_t = typename Layer_t::PreviousLayer>
+        struct ActivationPlan
+        {
+            using Prev = ActivationPlan<PreviousLayer_t>;
+            static constexpr bool IN_PLACE = IsInPlace<Layer_t>::value;
+            // 入力を読みながら書くので，前の層とは別のアリーナに置く
+            static constexpr int ARENA = IN_PLACE ? Prev::ARENA : 1 - Prev::ARENA;
+            static constexpr size_t OUTPUT_BYTES = IN_PLACE ? 0 : sizeof(ForwardOutput_t<Layer_t>) * Layer_t::PADDED_OUT_BLOCKS;
+            static constexpr size_t MAX_BYTES = std::max(OUTPUT_BYTES, Prev::MAX_BYTES);
+            static constexpr size_t TOTAL_BYTES = OUTPUT_BYTES + Prev::TOTAL_BYTES;
+        };
+
+        template <typename Layer_t>
+        struct ActivationPlan<Layer_t, void>
+        {
+            static constexpr bool IN_PLACE = false;
+            static constexpr int ARENA = 0;
+            static constexpr size_t OUTPUT_BYTES = sizeof(BitBlock) * Layer_t::PADDED_OUT_BLOCKS;
+            static constexpr size_t MAX_BYTES = OUTPUT_BYTES;
+            static constexpr size_t TOTAL_BYTES = OUTPUT_BYTES;
+        };
+
+        /**
+         * @brief 推論用の2つのアリーナ. 同じ重みを複数スレッドで読むときはスレッドごとに持つ
+         */
+        template <typename Net_t>
+        struct ForwardArena
+        {
+            alignas(32) uint8_t bytes[2][ActivationPlan<Net_t>::MAX_BYTES] = {};
+        };
+
+        /**
+         * @brief 層を書き換えずに，各層の出力をarenaに置きながら推論する. 戻り値はarenaを次に使うまで有効
+         */
+        template <typename Layer_t, typename Net_t>
+        auto RunForward(const Layer_t &layer, const BitBlock *netInput, ForwardArena<Net_t> &arena)
+        {
+            using LayerOutput = ForwardOutput_t<Layer_t>;
+            LayerOutput *output = reinterpret_cast<LayerOutput *>(arena.bytes[ActivationPlan<Layer_t>::ARENA]);
+            if constexpr (std::is_void_v<typename Layer_t::PreviousLayer>)
+            {
+                return layer.ForwardStep(netInput, output);
+            }
+            else
+            {
+                return layer.ForwardStep(RunForward(layer.PrevLayer(), netInput, arena), output);
+            }
+        }
+    }
+
+    /**
+     * @brief 層の宣言の列から組み立てたネットワーク
+     *
+     * @tparam InputSpec 入力層の宣言(BitInput, SparseInput)
+     * @tparam Specs 入力側から順に並べた層の宣言
+     */
+    template <typename InputSpec, typename... Specs>
+    class Sequential
+    {
+    public:
+        using Network = typename sequential_detail::Chain<typename InputSpec::Layer, Specs...>::type;
+        using Plan = sequential_detail::ActivationPlan<Network>;
+        using OutputType = sequential_detail::ForwardOutput_t<Network>;
+
+        static constexpr int COMPRESS_OUT_DIM = Network::COMPRESS_OUT_DIM;
+        static constexpr int PADDED_OUT_BLOCKS = Network::PADDED_OUT_BLOCKS;
+        // 推論用アリーナ1つあたりのバイト数（最も幅の広い層の出力）
+        static constexpr size_t MAX_ACTIVATION_BYTES = Plan::MAX_BYTES;
+        // 層ごとにバッファを持つ場合の推論用活性の合計バイト数
+        static constexpr size_t TOTAL_ACTIVATION_BYTES = Plan::TOTAL_BYTES;
+
+    private:
+        sequential_detail::ForwardArena<Network> _arena;
+        Network _net;
+
+        template <typename Layer_t>
+        auto RunForward(const Layer_t &layer, const BitBlock *netInput)
+        {
+            return sequential_detail::RunForward(layer, netInput, _arena);
+        }
+
+    public:
+        void Init()
+        {
+            memset(_arena.bytes, 0, sizeof(_arena.bytes));
+            _net.Init();
+        }
+
+        void Save(std::ostream &fs) { _net.Save(fs); }
+        void Load(std::istream &fs) { _net.Load(fs); }
+        void SaveOptimizer(std::ostream &fs) { _net.SaveOptimizer(fs); }
+        void LoadOptimizer(std::istream &fs) { _net.LoadOptimizer(fs); }
+
+        void ResetWeight()
+        {
+            _net.ResetWeight();
+        }
+
+        void SetOptimizerParams(const OptimizerParams &params)
+        {
+            _net.SetOptimizerParams(params);
+        }
+
+        /**
+         * @brief 2つのアリーナを交互に使って推論する. 戻り値は次のForwardまで有効
+         */
+        const OutputType *Forward(const BitBlock *netInput)
+        {
+            return RunForward(_net, netInput);
+        }
+
+        /**
+         * @brief 出力層で最大スコアのクラスだけを求める
+         */
+        int ForwardArgmax(const BitBlock *netInput)
+        {
+            return _net.ArgmaxStep(RunForward(_net.PrevLayer(), netInput));
+        }
+
+        void ForwardTopK(const BitBlock *netInput, int k, int *classesOut)
+        {
+            _net.TopKStep(RunForward(_net.PrevLayer(), netInput), k, classesOut);
+        }
+
+        const OutputType *ForwardBatch(const BitBlock *netInput, int n)
+        {
+            return _net.ForwardBatch(netInput, n);
+        }
+
+        int SignFlipCount() const
+        {
+            return _net.SignFlipCount();
+        }
+
+        auto &InputLayer()
+        {
+            return _net.InputLayer();
+        }
+
+        /**
+         * @brief 組み立てた入れ子のネットワーク
+         */
+        Network &Net()
+        {
+            return _net;
+        }
+
+#pragma region Train
+        OutputType *TrainForward(const BitBlock *netInput)
+        {
+            return _net.TrainForward(netInput);
+        }
+
+        void TrainBackward(const GradientType *nextGrad)
+        {
+            _net.TrainBackward(nextGrad);
+        }
+
+        template <typename Func_t>
+        void ForEachTrainBuffer(Func_t &&func)
+        {
+            _net.ForEachTrainBuffer(func);
+        }
+#pragma endregion
+    };
+}
+
+#endif
@@ -0,0 +1,217 @@
+﻿/**
+ * @file loss.h
+ * @author Daichi Sato
+ * @brief 多クラス分類用の損失関数と，整数スコアからのクラス選択
+ * @version 0.1
+ * @date 2021-12-18
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * 出力層(isOutputLayer)のint32スコアをロジットとして，損失と勾配を1つのカーネルで求める。
+ * 勾配はCalcSquaredErrorと同じく学習率を掛けた降下方向（TrainBackwardにそのまま渡せる）。
+ * バッチ全体を1回の呼び出しで処理し，各サンプル内はクラス方向に8要素ずつAVX2で処理する。
+ *
+ */
+
+#ifndef LOSS_H_INCLUDED_
+#define LOSS_H_INCLUDED_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include "../net_common.h"
+#include "../util/bit_helper.h"
+
+namespace bitnet
+{
+	/**
+	 * @brief softmax交差エントロピー. p = softmax(logitScale * logits)
+	 */
+	struct SoftmaxCrossEntropy
+	{
+		/**
+		 * @param logits 出力層のスコア [batchSize][numClasses]
+		 * @param labels 正解クラス [batchSize]
+		 * @param logitScale スコアに掛ける係数（温度の逆数）
+		 * @param lr 学習率
+		 * @param gradOut 勾配 lr * logitScale * (onehot - p) [batchSize][numClasses]
+		 * @return double バッチ平均の損失
+		 */
+		static double Compute(const int32_t *logits, const int *labels, int batchSize, int numClasses, float logitScale, float lr, GradientType *gradOut)
+		{
+			constexpr int W = NUM_FLOAT_IN_REGISTER;
+			const float8 scale8 = _mm256_set1_ps(logitScale);
+			double totalLoss = 0;
+			for (int b = 0; b < batchSize; b++)
+			{
+				const int32_t *z = &logits[b * numClasses];
+				GradientType *grad = &gradOut[b * numClasses];
+
+				// 最大値を引いてからexpを取る
+				int32_t maxLogit = z[0];
+				int c = 0;
+				if (numClasses >= W)
+				{
+					vector32 max8 = _mm256_loadu_si256((const vector32 *)z);
+					for (c = W; c + W <= numClasses; c += W)
+					{
+						max8 = _mm256_max_epi32(max8, _mm256_loadu_si256((const vector32 *)&z[c]));
+					}
+					alignas(32) int32_t lanes[W];
+					_mm256_store_si256((vector32 *)lanes, max8);
+					maxLogit = *std::max_element(lanes, lanes + W);
+				}
+				for (; c < numClasses; c++)
+				{
+					maxLogit = std::max(maxLogit, z[c]);
+				}
+
+				const vector32 maxLogit8 = _mm256_set1_epi32(maxLogit);
+				float8 sum8 = _mm256_setzero_ps();
+				for (c = 0; c + W <= numClasses; c += W)
+				{
+					const vector32 shifted = _mm256_sub_epi32(_mm256_loadu_si256((const vector32 *)&z[c]), maxLogit8);
+					const float8 e = Exp8(_mm256_mul_ps(_mm256_cvtepi32_ps(shifted), scale8));
+					_mm256_storeu_ps(&grad[c], e);
+					sum8 = _mm256_add_ps(sum8, e);
+				}
+				float sum = HorizontalSum8(sum8);
+				for (; c < numClasses; c++)
+				{
+					grad[c] = std::exp((z[c] - maxLogit) * logitScale);
+					sum += grad[c];
+				}
+
+				// grad = lr * scale * (onehot - e / sum)
+				const float coef = -lr * logitScale / sum;
+				const float8 coef8 = _mm256_set1_ps(coef);
+				for (c = 0; c + W <= numClasses; c += W)
+				{
+					_mm256_storeu_ps(&grad[c], _mm256_mul_ps(_mm256_loadu_ps(&grad[c]), coef8));
+				}
+				for (; c < numClasses; c++)
+				{
+					grad[c] *= coef;
+				}
+				const int label = labels[b];
+				grad[label] += lr * logitScale;
+				totalLoss += std::log(sum) - (z[label] - maxLogit) * (double)logitScale;
+			}
+			return totalLoss / batchSize;
+		}
+	};
+
+	/**
+	 * @brief 多クラスヒンジ損失 sum_{c != y} max(0, margin - (z_y - z_c))
+	 */
+	struct MulticlassHinge
+	{
+		/**
+		 * @param logits 出力層のスコア [batchSize][numClasses]
+		 * @param labels 正解クラス [batchSize]
+		 * @param margin 正解クラスと他クラスのスコアに求める差
+		 * @param lr 学習率
+		 * @param gradOut 勾配. マージンを割ったクラスに-lr，正解クラスに lr * (割ったクラス数) [batchSize][numClasses]
+		 * @return double バッチ平均の損失
+		 */
+		static double Compute(const int32_t *logits, const int *labels, int batchSize, int numClasses, int32_t margin, float lr, GradientType *gradOut)
+		{
+			constexpr int W = NUM_FLOAT_IN_REGISTER;
+			const float8 minusLr8 = _mm256_set1_ps(-lr);
+			int64_t totalLoss = 0;
+			for (int b = 0; b < batchSize; b++)
+			{
+				const int32_t *z = &logits[b * numClasses];
+				GradientType *grad = &gradOut[b * numClasses];
+				const int label = labels[b];
+				// z_c > thresholdのクラスがマージンを割っている
+				const int32_t threshold = z[label] - margin;
+				const vector32 threshold8 = _mm256_set1_epi32(threshold);
+
+				int violations = 0;
+				int64_t loss = 0;
+				vector32 loss8 = _mm256_setzero_si256();
+				int c = 0;
+				for (; c + W <= numClasses; c += W)
+				{
+					const vector32 excess = _mm256_sub_epi32(_mm256_loadu_si256((const vector32 *)&z[c]), threshold8);
+					const vector32 violated = _mm256_cmpgt_epi32(excess, _mm256_setzero_si256());
+					loss8 = _mm256_add_epi32(loss8, _mm256_and_si256(excess, violated));
+					violations += _mm_popcnt_u64(_mm256_movemask_ps(_mm256_castsi256_ps(violated)));
+					_mm256_storeu_ps(&grad[c], _mm256_and_ps(minusLr8, _mm256_castsi256_ps(violated)));
+				}
+				alignas(32) int32_t lanes[W];
+				_mm256_store_si256((vector32 *)lanes, loss8);
+				for (int i = 0; i < W; i++)
+				{
+					loss += lanes[i];
+				}
+				for (; c < numClasses; c++)
+				{
+					const int32_t excess = z[c] - threshold;
+					const bool violated = excess > 0;
+					loss += violated ? excess : 0;
+					violations += violated;
+					grad[c] = violated ? -lr : 0;
+				}
+
+				// 正解クラス自身の分（margin > 0なら必ず数えられている）を除く
+				if (margin > 0)
+				{
+					loss -= margin;
+					violations -= 1;
+				}
+				grad[label] = lr * violations;
+				totalLoss += loss;
+			}
+			return (double)totalLoss / batchSize;
+		}
+	};
+
+	/**
+	 * @brief 最大スコアのクラス（同点なら添字の小さい方）
+	 */
+	inline int Argmax(const int32_t *scores, int n)
+	{
+		int best = 0;
+		for (int c = 1; c < n; c++)
+		{
+			if (scores[c] > scores[best])
+			{
+				best = c;
+			}
+		}
+		return best;
+	}
+
+	/**
+	 * @brief スコアの高い順にk個のクラスを求める
+	 *
+	 * @param classesOut 長さkの配列
+	 */
+	inline void TopK(const int32_t *scores, int n, int k, int *classesOut)
+	{
+		k = std::min(k, n);
+		int filled = 0;
+		for (int c = 0; c < n; c++)
+		{
+			// 挿入ソートでk個だけ保持する
+			int pos = filled;
+			while (pos > 0 && scores[classesOut[pos - 1]] < scores[c])
+			{
+				if (pos < k)
+				{
+					classesOut[pos] = classesOut[pos - 1];
+				}
+				pos--;
+			}
+			if (pos < k)
+			{
+				classesOut[pos] = c;
+				filled = std::min(filled + 1, k);
+			}
+		}
+	}
+}
+
+#endif
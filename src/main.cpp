@@ -2,6 +2,7 @@
 #include "layers/layers.h"
 #include "net_common.h"
 #include "train.h"
+#include "trainer/evaluator.h"
 
 int main()
 {
@@ -17,8 +18,10 @@ int main()
 		// Train<int_net::Network>(net, 100, false);
 		Train<BitNetwork>(net, 100, 16, true);
 	}
-	float diffs[25];
-	Test<BitNetwork>(net, 25, 16, true, false, diffs);
+	// 評価用データセット全体を全コアで評価する
+	const EvalSet evalSet = MakeXOREvalSet(10000, 16);
+	Evaluator<BitNetwork> evaluator;
+	std::cout << evaluator.Evaluate(net, evalSet).Summary() << std::endl;
 
 	return 0;
 }
\ No newline at end of file
@@ -3,11 +3,13 @@
 
 #include <cmath>
 #include <cstdint>
+#include <type_traits>
 
 namespace bitnet
 {
 	constexpr bool USE_AVX_MADD = true;
 	constexpr bool USE_AVX_SIGN = true;
+	constexpr bool USE_AVX_INT_MADD = true;
 	constexpr int BATCH_SIZE = 16;
 
 	typedef float GradientType;
@@ -21,6 +23,34 @@ namespace bitnet
 	typedef int IntType;
 	typedef uint8_t BitBlock;
 	typedef int8_t IntBitType;
+
+	/**
+	 * @brief 層の出力1要素あたりのビットプレーン数（多ビット活性化層はACTIVATION_PLANESを定義する）
+	 */
+	template <typename Layer_t, typename = void>
+	struct ActivationPlanes
+	{
+		static constexpr int value = 1;
+	};
+
+	template <typename Layer_t>
+	struct ActivationPlanes<Layer_t, std::void_t<decltype(Layer_t::ACTIVATION_PLANES)>>
+	{
+		static constexpr int value = Layer_t::ACTIVATION_PLANES;
+	};
+
+	/**
+	 * @brief 層の出力が有効な特徴の添字リストならtrue（疎入力層はSPARSE_INPUTを定義する）
+	 */
+	template <typename Layer_t, typename = void>
+	struct SparseIndexInput : std::false_type
+	{
+	};
+
+	template <typename Layer_t>
+	struct SparseIndexInput<Layer_t, std::void_t<decltype(Layer_t::SPARSE_INPUT)>> : std::bool_constant<Layer_t::SPARSE_INPUT>
+	{
+	};
 }
 
 #endif
\ No newline at end of file
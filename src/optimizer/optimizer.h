@@ -0,0 +1,306 @@
+﻿/**
+ * @file optimizer.h
+ * @author Daichi Sato
+ * @brief 実数値重みの更新則（オプティマイザ）の定義
+ * @version 0.1
+ * @date 2021-12-08
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * 各オプティマイザは層のテンプレート引数として与え，層ごとの状態（State）を層のメンバとして持つ。
+ * ハイパーパラメータ（OptimizerParams）も状態に含まれるので，層や集団学習のメンバーごとに変えられる。
+ * ACCUMULATE_GRADがtrueのものはバッチ分の勾配を層内に蓄積し，
+ * StepAndPackRowで「更新・[-1,1]へのクリッピング・符号ビットのパッキング」を1パスで行う。
+ * FIXED_POINTがtrueのものは層の潜在重みと逆伝播をint16で扱う。
+ *
+ */
+
+#ifndef OPTIMIZER_H_INCLUDED_
+#define OPTIMIZER_H_INCLUDED_
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <type_traits>
+#include "../net_common.h"
+#include "../util/bit_helper.h"
+
+namespace bitnet
+{
+	/**
+	 * @brief オプティマイザのハイパーパラメータ（各オプティマイザは使うものだけを参照する）
+	 */
+	struct OptimizerParams
+	{
+		// MomentumSGDの係数
+		float momentum = 0.9f;
+		// Adamの学習率（Adamは勾配のスケールに依らないため更新幅はこれで決まる）
+		float learningRate = 1e-3f;
+		float beta1 = 0.9f;
+		float beta2 = 0.999f;
+		float epsilon = 1e-8f;
+	};
+
+	/**
+	 * @brief 確率的勾配降下法 (w += g)。状態は持たない.
+	 * 密な入力の層ではバッチ分の勾配を蓄積してStepAndPackRowで適用し，疎入力の層では受け取った時点で有効な列に直接加算する
+	 */
+	struct SGD
+	{
+		static constexpr bool ACCUMULATE_GRAD = false;
+
+		template <int Rows, int Cols>
+		class State
+		{
+		public:
+			void Reset()
+			{
+			}
+
+			// 学習率は勾配に掛けて渡されるので使うハイパーパラメータはない
+			void SetParams(const OptimizerParams &) {}
+
+			void BeginStep() {}
+
+			float8 Step(int, int, const float8 &weight, const float8 &grad)
+			{
+				return _mm256_add_ps(weight, grad);
+			}
+
+			float Step(int, int, float weight, float grad)
+			{
+				return weight + grad;
+			}
+
+			double StepBias(int, double bias, double grad)
+			{
+				return bias + grad;
+			}
+		};
+	};
+
+	/**
+	 * @brief 固定小数点のSGD。潜在重みをint16（1.0 = 2^WEIGHT_SHIFT）で持ち，
+	 * 降下量はint16に確率的に丸めて飽和加算する。前の層への勾配も層ごとの2のべき乗スケールでint16に丸めて集計する
+	 */
+	struct FixedPointSGD
+	{
+		static constexpr bool ACCUMULATE_GRAD = false;
+		static constexpr bool FIXED_POINT = true;
+		// 潜在重みの小数部のビット数（[-1,1]を[-2^14, 2^14]で表す）
+		static constexpr int WEIGHT_SHIFT = 14;
+
+		template <int Rows, int Cols>
+		class State
+		{
+		public:
+			void Reset()
+			{
+			}
+
+			void SetParams(const OptimizerParams &) {}
+		};
+	};
+
+	/**
+	 * @brief 潜在重みを固定小数点で持つオプティマイザならtrue（FIXED_POINTを定義する）
+	 */
+	template <typename Optimizer_t, typename = void>
+	struct FixedPointOptimizer : std::false_type
+	{
+	};
+
+	template <typename Optimizer_t>
+	struct FixedPointOptimizer<Optimizer_t, std::void_t<decltype(Optimizer_t::FIXED_POINT)>> : std::bool_constant<Optimizer_t::FIXED_POINT>
+	{
+	};
+
+	/**
+	 * @brief モーメンタム付きSGD (v = momentum * v + g, w += v)
+	 */
+	struct MomentumSGD
+	{
+		static constexpr bool ACCUMULATE_GRAD = true;
+
+		template <int Rows, int Cols>
+		class State
+		{
+			alignas(32) float _velocity[Rows][Cols] = {0};
+			double _biasVelocity[Rows] = {0};
+			OptimizerParams _params;
+			float8 _momentum8;
+
+		public:
+			void Reset()
+			{
+				memset(_velocity, 0, sizeof(_velocity));
+				memset(_biasVelocity, 0, sizeof(_biasVelocity));
+			}
+
+			void SetParams(const OptimizerParams &params)
+			{
+				_params = params;
+			}
+
+			const OptimizerParams &Params() const
+			{
+				return _params;
+			}
+
+			void BeginStep()
+			{
+				_momentum8 = _mm256_set1_ps(_params.momentum);
+			}
+
+			float8 Step(int row, int col, const float8 &weight, const float8 &grad)
+			{
+				float8 v = _mm256_add_ps(_mm256_mul_ps(_momentum8, _mm256_loadu_ps(&_velocity[row][col])), grad);
+				_mm256_storeu_ps(&_velocity[row][col], v);
+				return _mm256_add_ps(weight, v);
+			}
+
+			float Step(int row, int col, float weight, float grad)
+			{
+				_velocity[row][col] = _params.momentum * _velocity[row][col] + grad;
+				return weight + _velocity[row][col];
+			}
+
+			double StepBias(int row, double bias, double grad)
+			{
+				_biasVelocity[row] = _params.momentum * _biasVelocity[row] + grad;
+				return bias + _biasVelocity[row];
+			}
+		};
+	};
+
+	/**
+	 * @brief Adam。受け取る勾配は学習率を掛けた降下方向であるが，Adamは勾配のスケールに依らないため
+	 * 更新幅はOptimizerParams::learningRateで決まる
+	 */
+	struct Adam
+	{
+		static constexpr bool ACCUMULATE_GRAD = true;
+
+		template <int Rows, int Cols>
+		class State
+		{
+			alignas(32) float _m[Rows][Cols] = {0};
+			alignas(32) float _v[Rows][Cols] = {0};
+			double _biasM[Rows] = {0};
+			double _biasV[Rows] = {0};
+			int _step = 0;
+			OptimizerParams _params;
+			// バイアス補正を畳み込んだ係数 (w += stepSize * m / (sqrt(v) + epsilon))
+			float _stepSize;
+			float _epsilon;
+
+		public:
+			void Reset()
+			{
+				memset(_m, 0, sizeof(_m));
+				memset(_v, 0, sizeof(_v));
+				memset(_biasM, 0, sizeof(_biasM));
+				memset(_biasV, 0, sizeof(_biasV));
+				_step = 0;
+			}
+
+			void SetParams(const OptimizerParams &params)
+			{
+				_params = params;
+			}
+
+			const OptimizerParams &Params() const
+			{
+				return _params;
+			}
+
+			void BeginStep()
+			{
+				++_step;
+				const double correction1 = 1 - std::pow((double)_params.beta1, _step);
+				const double correction2 = 1 - std::pow((double)_params.beta2, _step);
+				_stepSize = _params.learningRate * std::sqrt(correction2) / correction1;
+				_epsilon = _params.epsilon * std::sqrt(correction2);
+			}
+
+			float8 Step(int row, int col, const float8 &weight, const float8 &grad)
+			{
+				const float8 beta1 = _mm256_set1_ps(_params.beta1);
+				const float8 beta2 = _mm256_set1_ps(_params.beta2);
+				float8 m = _mm256_loadu_ps(&_m[row][col]);
+				float8 v = _mm256_loadu_ps(&_v[row][col]);
+				// m += (1 - beta1) * (g - m), v += (1 - beta2) * (g^2 - v)
+				m = _mm256_add_ps(m, _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(1.0f), beta1), _mm256_sub_ps(grad, m)));
+				v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(1.0f), beta2), _mm256_sub_ps(_mm256_mul_ps(grad, grad), v)));
+				_mm256_storeu_ps(&_m[row][col], m);
+				_mm256_storeu_ps(&_v[row][col], v);
+				float8 denom = _mm256_add_ps(_mm256_sqrt_ps(v), _mm256_set1_ps(_epsilon));
+				return _mm256_add_ps(weight, _mm256_div_ps(_mm256_mul_ps(_mm256_set1_ps(_stepSize), m), denom));
+			}
+
+			float Step(int row, int col, float weight, float grad)
+			{
+				float &m = _m[row][col];
+				float &v = _v[row][col];
+				m += (1.0f - _params.beta1) * (grad - m);
+				v += (1.0f - _params.beta2) * (grad * grad - v);
+				return weight + _stepSize * m / (std::sqrt(v) + _epsilon);
+			}
+
+			double StepBias(int row, double bias, double grad)
+			{
+				_biasM[row] += (1.0 - _params.beta1) * (grad - _biasM[row]);
+				_biasV[row] += (1.0 - _params.beta2) * (grad * grad - _biasV[row]);
+				return bias + _stepSize * _biasM[row] / (std::sqrt(_biasV[row]) + _epsilon);
+			}
+		};
+	};
+
+	/**
+	 * @brief 1行分の実数値重みに蓄積した勾配を適用し，[-1,1]へのクリッピングと符号ビットのパッキングまでを1パスで行う.
+	 * 蓄積した勾配は0に戻す.
+	 *
+	 * @param state オプティマイザの状態
+	 * @param row 行番号
+	 * @param weights 実数値重みの行
+	 * @param grads 蓄積した勾配の行
+	 * @param packed 2値重みの行
+	 * @param length 行の長さ
+	 * @return int 符号が反転した重みの数
+	 */
+	template <typename State_t>
+	inline int StepAndPackRow(State_t &state, int row, float *weights, float *grads, BitBlock *packed, const int length)
+	{
+		const float8 zero = _mm256_setzero_ps();
+		const float8 plusOne = _mm256_set1_ps(1.0f);
+		const float8 minusOne = _mm256_set1_ps(-1.0f);
+		int flips = 0;
+		int i = 0;
+		for (; i + BYTE_BIT_WIDTH <= length; i += BYTE_BIT_WIDTH)
+		{
+			float8 w = state.Step(row, i, _mm256_loadu_ps(weights + i), _mm256_loadu_ps(grads + i));
+			w = _mm256_max_ps(minusOne, _mm256_min_ps(plusOne, w));
+			_mm256_storeu_ps(weights + i, w);
+			_mm256_storeu_ps(grads + i, zero);
+			const BitBlock bits = static_cast<BitBlock>(_mm256_movemask_ps(_mm256_cmp_ps(w, zero, _CMP_GT_OQ)));
+			flips += _mm_popcnt_u64(static_cast<BitBlock>(bits ^ packed[GetBlockIndex(i)]));
+			packed[GetBlockIndex(i)] = bits;
+		}
+		if (i < length)
+		{
+			BitBlock bits = 0;
+			for (int k = 0; i + k < length; k++)
+			{
+				const float w = std::max(-1.0f, std::min(1.0f, state.Step(row, i + k, weights[i + k], grads[i + k])));
+				weights[i + k] = w;
+				grads[i + k] = 0;
+				bits |= static_cast<BitBlock>(w > 0) << k;
+			}
+			flips += _mm_popcnt_u64(static_cast<BitBlock>(bits ^ packed[GetBlockIndex(i)]));
+			packed[GetBlockIndex(i)] = bits;
+		}
+		return flips;
+	}
+}
+
+#endif
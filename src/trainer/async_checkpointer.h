@@ -0,0 +1,356 @@
+﻿/**
+ * @file async_checkpointer.h
+ * @author Daichi Sato
+ * @brief 学習を止めずにチェックポイントを書き出す非同期チェックポインタ
+ * @version 0.1
+ * @date 2021-12-15
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * 学習スレッドはステップの合間にSnapshotを呼び，潜在重みとオプティマイザの状態を
+ * メモリ上のバッファにコピーするだけで学習に戻る。
+ * ファイルへの書き出し・fsync・renameはバックグラウンドのスレッドが行う。
+ * バッファは2面あり，一方を書き出している間にもう一方へスナップショットを取れる。
+ * 書き出しが追いつかない場合は，まだ書き出していない古いスナップショットを新しいもので置き換える。
+ *
+ * ファイルの形式はSaveの出力にSaveOptimizerの出力を続けたもので，先頭部分はそのままLoadで読める。
+ *
+ */
+
+#ifndef ASYNC_CHECKPOINTER_H_INCLUDED_
+#define ASYNC_CHECKPOINTER_H_INCLUDED_
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <fstream>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace bitnet
+{
+    /**
+     * @brief 書き込みを確保済みのメモリへのコピーにするストリームバッファ（容量はスナップショット間で使い回す）
+     */
+    class SnapshotBuffer : public std::streambuf
+    {
+    private:
+        std::vector<char> _data;
+        size_t _size = 0;
+
+    protected:
+        std::streamsize xsputn(const char *s, std::streamsize n) override
+        {
+            if (_size + n > _data.size())
+            {
+                _data.resize(std::max(_data.size() * 2, _size + n));
+            }
+            memcpy(&_data[_size], s, n);
+            _size += n;
+            return n;
+        }
+
+        int_type overflow(int_type ch) override
+        {
+            if (!traits_type::eq_int_type(ch, traits_type::eof()))
+            {
+                const char c = traits_type::to_char_type(ch);
+                xsputn(&c, 1);
+            }
+            return ch;
+        }
+
+    public:
+        void Clear() { _size = 0; }
+        const char *Data() const { return _data.data(); }
+        size_t Size() const { return _size; }
+    };
+
+    /**
+     * @brief 非同期チェックポインタ
+     *
+     * @tparam Net_t ネットワークの型（Save/SaveOptimizer/Load/LoadOptimizerを持つもの）
+     */
+    template <typename Net_t>
+    class AsyncCheckpointer
+    {
+    private:
+        enum class SlotState
+        {
+            Free,
+            Filling,
+            Pending,
+            Writing,
+        };
+
+        struct Slot
+        {
+            SnapshotBuffer buffer;
+            SlotState state = SlotState::Free;
+            int64_t step = 0;
+        };
+
+        const std::string _directory;
+        const std::string _prefix;
+        const int _keepLast;
+
+        Slot _slots[2];
+        std::mutex _mutex;
+        std::condition_variable _changed;
+        bool _stopping = false;
+        std::string _error;
+        // 書き出し済みで保持しているファイル（古い順）
+        std::deque<std::string> _files;
+        uint64_t _numWritten = 0;
+        uint64_t _numDropped = 0;
+        std::thread _writer;
+
+        static void WriteFile(const std::string &path, const char *data, size_t size)
+        {
+            const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+            {
+                throw std::runtime_error("Checkpoint open failed: " + path);
+            }
+            size_t written = 0;
+            while (written < size)
+            {
+                const ssize_t n = ::write(fd, data + written, size - written);
+                if (n < 0)
+                {
+                    ::close(fd);
+                    throw std::runtime_error("Checkpoint write failed: " + path);
+                }
+                written += n;
+            }
+            const bool synced = ::fsync(fd) == 0;
+            ::close(fd);
+            if (!synced)
+            {
+                throw std::runtime_error("Checkpoint fsync failed: " + path);
+            }
+        }
+
+        void Publish(const Slot &slot)
+        {
+            const std::string path = Path(slot.step);
+            const std::string tmpPath = path + ".tmp";
+            WriteFile(tmpPath, slot.buffer.Data(), slot.buffer.Size());
+            if (::rename(tmpPath.c_str(), path.c_str()) != 0)
+            {
+                throw std::runtime_error("Checkpoint rename failed: " + path);
+            }
+            // renameを永続化する
+            const int dirFd = ::open(_directory.c_str(), O_RDONLY | O_DIRECTORY);
+            if (dirFd >= 0)
+            {
+                ::fsync(dirFd);
+                ::close(dirFd);
+            }
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_files.empty() || _files.back() != path)
+            {
+                _files.push_back(path);
+            }
+            while ((int)_files.size() > _keepLast)
+            {
+                ::unlink(_files.front().c_str());
+                _files.pop_front();
+            }
+            ++_numWritten;
+        }
+
+        void RunWriter()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (true)
+            {
+                Slot *slot = nullptr;
+                _changed.wait(lock, [&]
+                              { return (slot = PendingSlot()) != nullptr || _stopping; });
+                if (slot == nullptr)
+                {
+                    return;
+                }
+                slot->state = SlotState::Writing;
+                lock.unlock();
+
+                std::string error;
+                try
+                {
+                    Publish(*slot);
+                }
+                catch (const std::exception &e)
+                {
+                    error = e.what();
+                }
+
+                lock.lock();
+                slot->state = SlotState::Free;
+                if (!error.empty())
+                {
+                    _error = error;
+                }
+                _changed.notify_all();
+            }
+        }
+
+        Slot *PendingSlot()
+        {
+            // 2面のうち古いステップから書き出す
+            Slot *oldest = nullptr;
+            for (Slot &slot : _slots)
+            {
+                if (slot.state == SlotState::Pending && (oldest == nullptr || slot.step < oldest->step))
+                {
+                    oldest = &slot;
+                }
+            }
+            return oldest;
+        }
+
+    public:
+        /**
+         * @param directory 書き出し先のディレクトリ（存在すること）
+         * @param prefix ファイル名の接頭辞. ファイル名は"<prefix>-<step>.bin"
+         * @param keepLast 保持するチェックポイントの数
+         */
+        AsyncCheckpointer(const std::string &directory, const std::string &prefix = "checkpoint", int keepLast = 3)
+            : _directory(directory), _prefix(prefix), _keepLast(std::max(1, keepLast))
+        {
+            _writer = std::thread(&AsyncCheckpointer::RunWriter, this);
+        }
+
+        ~AsyncCheckpointer()
+        {
+            Wait();
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stopping = true;
+            }
+            _changed.notify_all();
+            _writer.join();
+        }
+
+        AsyncCheckpointer(const AsyncCheckpointer &) = delete;
+        AsyncCheckpointer &operator=(const AsyncCheckpointer &) = delete;
+
+        std::string Path(int64_t step) const
+        {
+            return _directory + "/" + _prefix + "-" + std::to_string(step) + ".bin";
+        }
+
+        /**
+         * @brief 現在の重みとオプティマイザの状態をバッファにコピーし，書き出しを予約する.
+         * 学習スレッドからステップの合間に呼ぶ。書き出しの完了は待たない。
+         * 前回までの書き出しが失敗していた場合は例外を投げる。
+         */
+        void Snapshot(Net_t &net, int64_t step)
+        {
+            Slot *slot = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (!_error.empty())
+                {
+                    const std::string error = _error;
+                    _error.clear();
+                    throw std::runtime_error(error);
+                }
+                // 書き出し中でない方を使う。未着手のスナップショットしか無ければ上書きする
+                for (Slot &candidate : _slots)
+                {
+                    if (candidate.state == SlotState::Free)
+                    {
+                        slot = &candidate;
+                        break;
+                    }
+                }
+                if (slot == nullptr)
+                {
+                    slot = PendingSlot();
+                    ++_numDropped;
+                }
+                slot->state = SlotState::Filling;
+            }
+
+            slot->buffer.Clear();
+            std::ostream os(&slot->buffer);
+            net.Save(os);
+            net.SaveOptimizer(os);
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                slot->step = step;
+                slot->state = SlotState::Pending;
+            }
+            _changed.notify_all();
+        }
+
+        /**
+         * @brief 予約済みの書き出しがすべて終わるまで待つ
+         */
+        void Wait()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _changed.wait(lock, [&]
+                          { return _slots[0].state == SlotState::Free && _slots[1].state == SlotState::Free; });
+        }
+
+        /**
+         * @brief 保持しているチェックポイントのパス（古い順）
+         */
+        std::vector<std::string> Files()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return std::vector<std::string>(_files.begin(), _files.end());
+        }
+
+        uint64_t NumWritten()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _numWritten;
+        }
+
+        /**
+         * @brief 書き出し前に新しいスナップショットで置き換えられた数
+         */
+        uint64_t NumDropped()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _numDropped;
+        }
+
+        /**
+         * @brief チェックポイントから重みとオプティマイザの状態を復元する. 途中で読めなくなった（切り詰められた）ファイルはruntime_error
+         */
+        static void Restore(Net_t &net, const std::string &path)
+        {
+            std::ifstream ifs(path, std::ios::binary);
+            if (!ifs)
+            {
+                throw std::runtime_error("Checkpoint open failed: " + path);
+            }
+            net.Load(ifs);
+            if (!ifs)
+            {
+                throw std::runtime_error("Checkpoint weights read failed: " + path);
+            }
+            net.LoadOptimizer(ifs);
+            if (!ifs)
+            {
+                throw std::runtime_error("Checkpoint optimizer read failed: " + path);
+            }
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,281 @@
+﻿/**
+ * @file evaluator.h
+ * @author Daichi Sato
+ * @brief 評価用データセット全体をバッチ推論で並列に評価するエンジン
+ * @version 0.1
+ * @date 2021-12-17
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * データセットをBATCH_SIZE単位のチャンクに分け，スレッドごとのネットワークの複製がチャンクを取り合って
+ * ForwardBatchで推論する。誤差と混同行列はスレッドごとのAVX2アキュムレータに集計し，最後に合算する。
+ * 時間は壁時計で測る。
+ *
+ * 教師はTrain()/Test()と同じくスケール済みのint8で，正負を2クラスとみなして正解率と混同行列を求める。
+ *
+ */
+
+#ifndef EVALUATOR_H_INCLUDED_
+#define EVALUATOR_H_INCLUDED_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "../net_common.h"
+#include "../util/bit_helper.h"
+#include "../util/make_data.h"
+#include "../util/thread_pool.h"
+
+namespace bitnet
+{
+    /**
+     * @brief 評価用データセット
+     */
+    struct EvalSet
+    {
+        // [numSamples][入力層のPADDED_OUT_BLOCKS]
+        std::vector<BitBlock> inputs;
+        // [numSamples] スケール済みの教師
+        std::vector<int8_t> teachers;
+        int numSamples = 0;
+    };
+
+    /**
+     * @brief 評価結果
+     */
+    struct EvalResult
+    {
+        uint64_t samples = 0;
+        double mae = 0;
+        double mse = 0;
+        double accuracy = 0;
+        // 正負を2クラスとみなした混同行列（教師の正負 x 予測の正負）
+        uint64_t truePositive = 0;
+        uint64_t falsePositive = 0;
+        uint64_t trueNegative = 0;
+        uint64_t falseNegative = 0;
+        double seconds = 0;
+
+        double SamplesPerSecond() const
+        {
+            return seconds > 0 ? samples / seconds : 0;
+        }
+
+        std::string Summary() const
+        {
+            std::ostringstream ss;
+            ss << "samples=" << samples << " mae=" << mae << " mse=" << mse << " acc=" << accuracy
+               << " tp=" << truePositive << " fp=" << falsePositive << " tn=" << trueNegative << " fn=" << falseNegative
+               << " " << SamplesPerSecond() << " samples/s";
+            return ss.str();
+        }
+    };
+
+    /**
+     * @brief XORのデータセットを作る（Random::mtを使う）
+     */
+    inline EvalSet MakeXOREvalSet(int numSamples, double scale)
+    {
+        constexpr int dataSize = 2;
+        constexpr int paddedBlocks = BitToBlockCount(AddPaddingToBitSize(dataSize));
+        EvalSet set;
+        set.numSamples = numSamples;
+        set.inputs.resize((size_t)numSamples * paddedBlocks);
+        set.teachers.resize(numSamples);
+        int8_t inputData[BATCH_SIZE * dataSize];
+        for (int s = 0; s < numSamples; s += BATCH_SIZE)
+        {
+            const int n = std::min(BATCH_SIZE, numSamples - s);
+            int8_t teacherData[BATCH_SIZE];
+            util::MakeXORBatch(BATCH_SIZE, scale, inputData, teacherData);
+            util::BinarizeInputData(n, dataSize, inputData, &set.inputs[(size_t)s * paddedBlocks]);
+            std::copy(teacherData, teacherData + n, &set.teachers[s]);
+        }
+        return set;
+    }
+
+    /**
+     * @brief 1スレッド分の集計. 8サンプルずつAVX2で集計する
+     */
+    class alignas(64) EvalAccumulator
+    {
+    private:
+        __m256d _absError = _mm256_setzero_pd();
+        __m256d _squaredError = _mm256_setzero_pd();
+        uint64_t _samples = 0;
+        uint64_t _truePositive = 0;
+        uint64_t _falsePositive = 0;
+        uint64_t _trueNegative = 0;
+        uint64_t _falseNegative = 0;
+        double _absErrorTail = 0;
+        double _squaredErrorTail = 0;
+
+        void AddErrors(__m128i diff)
+        {
+            const __m256d d = _mm256_cvtepi32_pd(diff);
+            _absError = _mm256_add_pd(_absError, _mm256_cvtepi32_pd(_mm_abs_epi32(diff)));
+            _squaredError = _mm256_add_pd(_squaredError, _mm256_mul_pd(d, d));
+        }
+
+        void AddConfusion(int predPositive, int teacherPositive, int count)
+        {
+            _truePositive += _mm_popcnt_u64(predPositive & teacherPositive);
+            _falsePositive += _mm_popcnt_u64(predPositive & ~teacherPositive);
+            _falseNegative += _mm_popcnt_u64(~predPositive & teacherPositive);
+            _trueNegative += count - _mm_popcnt_u64(predPositive | teacherPositive);
+        }
+
+    public:
+        /**
+         * @brief n個の予測と教師を集計する
+         */
+        void Add(const int32_t *preds, const int8_t *teachers, int n)
+        {
+            const vector32 zero = _mm256_setzero_si256();
+            int i = 0;
+            for (; i + NUM_FLOAT_IN_REGISTER <= n; i += NUM_FLOAT_IN_REGISTER)
+            {
+                const vector32 pred = _mm256_loadu_si256((const vector32 *)&preds[i]);
+                int64_t packedTeachers;
+                memcpy(&packedTeachers, &teachers[i], sizeof(int64_t));
+                const vector32 teacher = _mm256_cvtepi8_epi32(_mm_cvtsi64_si128(packedTeachers));
+                const vector32 diff = _mm256_sub_epi32(teacher, pred);
+                AddErrors(_mm256_castsi256_si128(diff));
+                AddErrors(_mm256_extracti128_si256(diff, 1));
+
+                const int predPositive = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(pred, zero)));
+                const int teacherPositive = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(teacher, zero)));
+                AddConfusion(predPositive, teacherPositive, NUM_FLOAT_IN_REGISTER);
+            }
+            for (; i < n; i++)
+            {
+                const double diff = (double)teachers[i] - preds[i];
+                _absErrorTail += std::abs(diff);
+                _squaredErrorTail += diff * diff;
+                AddConfusion(preds[i] > 0, teachers[i] > 0, 1);
+            }
+            _samples += n;
+        }
+
+        void Merge(const EvalAccumulator &other)
+        {
+            _absError = _mm256_add_pd(_absError, other._absError);
+            _squaredError = _mm256_add_pd(_squaredError, other._squaredError);
+            _absErrorTail += other._absErrorTail;
+            _squaredErrorTail += other._squaredErrorTail;
+            _samples += other._samples;
+            _truePositive += other._truePositive;
+            _falsePositive += other._falsePositive;
+            _trueNegative += other._trueNegative;
+            _falseNegative += other._falseNegative;
+        }
+
+        EvalResult Result() const
+        {
+            alignas(32) double absError[4];
+            alignas(32) double squaredError[4];
+            _mm256_store_pd(absError, _absError);
+            _mm256_store_pd(squaredError, _squaredError);
+
+            EvalResult result;
+            result.samples = _samples;
+            if (_samples == 0)
+            {
+                return result;
+            }
+            result.mae = (absError[0] + absError[1] + absError[2] + absError[3] + _absErrorTail) / _samples;
+            result.mse = (squaredError[0] + squaredError[1] + squaredError[2] + squaredError[3] + _squaredErrorTail) / _samples;
+            result.truePositive = _truePositive;
+            result.falsePositive = _falsePositive;
+            result.trueNegative = _trueNegative;
+            result.falseNegative = _falseNegative;
+            result.accuracy = (double)(_truePositive + _trueNegative) / _samples;
+            return result;
+        }
+    };
+
+    /**
+     * @brief 並列評価エンジン
+     *
+     * @tparam Net_t 出力1次元のネットワーク型
+     */
+    template <typename Net_t>
+    class Evaluator
+    {
+    public:
+        static constexpr int INPUT_BLOCKS = std::remove_reference_t<decltype(std::declval<Net_t &>().InputLayer())>::PADDED_OUT_BLOCKS;
+        static_assert(Net_t::COMPRESS_OUT_DIM == 1, "Evaluator expects a single output");
+
+    private:
+        ThreadPool _pool;
+        // 推論は層の出力バッファを書き換えるため，スレッドごとに複製を持つ
+        std::vector<std::unique_ptr<Net_t>> _replicas;
+
+    public:
+        /**
+         * @param numThreads スレッド数. 0ならハードウェアのスレッド数
+         */
+        explicit Evaluator(int numThreads = 0) : _pool(numThreads)
+        {
+            for (int t = 0; t < _pool.Size(); t++)
+            {
+                _replicas.emplace_back(new Net_t());
+                _replicas.back()->Init();
+            }
+        }
+
+        /**
+         * @brief 評価するネットワークの推論に使う値を各スレッドの複製にコピーする（学習で重みが変わったら呼ぶ）.
+         * 学習用の実数値重みやオプティマイザの状態はコピーしない
+         */
+        void Sync(const Net_t &net)
+        {
+            _pool.ParallelFor(static_cast<int>(_replicas.size()), [&](int t)
+                              { _replicas[t]->CopyInferenceParams(net); });
+        }
+
+        /**
+         * @brief 直前にSyncしたネットワークでデータセット全体を評価する
+         */
+        EvalResult Evaluate(const EvalSet &set)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            const int numChunks = (set.numSamples + BATCH_SIZE - 1) / BATCH_SIZE;
+            std::atomic<int> nextChunk{0};
+            std::vector<EvalAccumulator> accumulators(_replicas.size());
+            _pool.ParallelFor(static_cast<int>(_replicas.size()), [&](int t)
+                              {
+                                  Net_t &net = *_replicas[t];
+                                  for (int chunk = nextChunk++; chunk < numChunks; chunk = nextChunk++)
+                                  {
+                                      const int first = chunk * BATCH_SIZE;
+                                      const int n = std::min(BATCH_SIZE, set.numSamples - first);
+                                      const int32_t *preds = net.ForwardBatch(&set.inputs[(size_t)first * INPUT_BLOCKS], n);
+                                      accumulators[t].Add(preds, &set.teachers[first], n);
+                                  } });
+
+            EvalAccumulator total;
+            for (const auto &accumulator : accumulators)
+            {
+                total.Merge(accumulator);
+            }
+            EvalResult result = total.Result();
+            result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            return result;
+        }
+
+        EvalResult Evaluate(const Net_t &net, const EvalSet &set)
+        {
+            Sync(net);
+            return Evaluate(set);
+        }
+    };
+}
+
+#endif
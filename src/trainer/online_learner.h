@@ -0,0 +1,406 @@
+﻿/**
+ * @file online_learner.h
+ * @author Daichi Sato
+ * @brief 推論を止めずにフィードバックで学習し，重みのスナップショットをRCU方式で差し替えるオンライン学習器
+ * @version 0.1
+ * @date 2021-12-28
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * 学習スレッドは非公開のネットワークをフィードバックのミニバッチで学習し，
+ * publishEveryステップごとに推論に使う値（2値重み・閾値など）だけを複製したスナップショットを作り，atomicポインタを差し替える。
+ * 推論スレッドはReaderを1つずつ持ち，ロックを取らずに現在のスナップショットで推論する。
+ * スナップショットの重みは公開後に変わらないので，推論は自分のアリーナだけに書く（sequential_detail::RunForward）。
+ *
+ * 古いスナップショットの解放はエポック方式で行う。
+ * Readerは推論の間だけ，読み始めた時点の大域エポックを自分のスロットに書いておく（推論していない間は0）。
+ * 差し替えで外したスナップショットにはその時点のエポックを付けて保留し，
+ * 全スロットが0か，それより新しいエポックになったものから学習スレッドが解放する。
+ *
+ */
+
+#ifndef ONLINE_LEARNER_H_INCLUDED_
+#define ONLINE_LEARNER_H_INCLUDED_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "../net_common.h"
+#include "../layers/sequential.h"
+#include "../util/random_util.h"
+
+namespace bitnet
+{
+    struct OnlineLearnerConfig
+    {
+        // この数のミニバッチを学習するごとに新しいスナップショットを公開する
+        int publishEvery = 8;
+        // 損失関数を指定しない場合の二乗誤差の学習率（勾配はlr * (t - y)）
+        double learningRate = 0.0001;
+        // 学習待ちのフィードバックの最大数（超えた分は受け付けない）
+        size_t maxPending = 4096;
+        // 学習スレッドの乱数のシード
+        int seed = 0;
+    };
+
+    /**
+     * @brief 推論と並行してフィードバックで学習するオンライン学習器
+     *
+     * @tparam Net_t ネットワーク（入れ子の層の型）
+     * @tparam MaxReaders 同時に存在できるReaderの数
+     */
+    template <typename Net_t, int MaxReaders = 64>
+    class OnlineLearner
+    {
+    public:
+        using OutputType = sequential_detail::ForwardOutput_t<Net_t>;
+        using InputLayer_t = std::remove_reference_t<decltype(std::declval<Net_t &>().InputLayer())>;
+        static constexpr int INPUT_BLOCKS = InputLayer_t::PADDED_OUT_BLOCKS;
+        static constexpr int OUTPUT_DIM = Net_t::COMPRESS_OUT_DIM;
+        // BATCH_SIZE件の出力と教師信号から，出力に対する勾配（更新方向）を書き込む
+        using LossFunction = std::function<void(const OutputType *pred, const float *targets, GradientType *grads)>;
+
+    private:
+        struct Snapshot
+        {
+            Net_t net;
+            uint64_t version;
+        };
+
+        struct Retired
+        {
+            // 差し替えた時点の大域エポック. これ以下のエポックで読み始めたReaderが参照している可能性がある
+            uint64_t epoch;
+            std::unique_ptr<Snapshot> snapshot;
+        };
+
+        struct Sample
+        {
+            std::array<BitBlock, INPUT_BLOCKS> input;
+            std::array<float, OUTPUT_DIM> target;
+        };
+
+        struct alignas(64) ReaderSlot
+        {
+            // 推論中なら読み始めた時点の大域エポック，推論していなければ0
+            std::atomic<uint64_t> epoch{0};
+            std::atomic<bool> used{false};
+        };
+
+        OnlineLearnerConfig _config;
+        LossFunction _loss;
+        std::unique_ptr<Net_t> _trainee;
+
+        std::atomic<Snapshot *> _current{nullptr};
+        std::atomic<uint64_t> _globalEpoch{1};
+        ReaderSlot _slots[MaxReaders];
+        // 学習スレッド（停止後は呼び出したスレッド）だけが触る
+        std::vector<Retired> _retired;
+        std::atomic<size_t> _numRetired{0};
+        std::atomic<uint64_t> _steps{0};
+
+        std::mutex _versionMutex;
+        std::condition_variable _versionChanged;
+        uint64_t _version = 1;
+
+        // 学習スレッドの停止フラグ（_queueMutexで保護）
+        bool _stopping = false;
+        std::mutex _queueMutex;
+        std::condition_variable _queueReady;
+        std::deque<Sample> _queue;
+        std::thread _trainer;
+
+        Snapshot *CopyTrainee(uint64_t version)
+        {
+            Snapshot *snapshot = new Snapshot();
+            // 学習用の実数値重みやオプティマイザの状態は推論に使わないのでコピーしない
+            snapshot->net.CopyInferenceParams(*_trainee);
+            snapshot->version = version;
+            return snapshot;
+        }
+
+        void Publish()
+        {
+            uint64_t version;
+            {
+                std::lock_guard<std::mutex> lock(_versionMutex);
+                version = _version + 1;
+            }
+            Snapshot *previous = _current.exchange(CopyTrainee(version));
+            // 差し替えより後にエポックを進めるので，新しいエポックで読み始めたReaderは新しいスナップショットを読む
+            const uint64_t epoch = _globalEpoch.fetch_add(1);
+            _retired.push_back({epoch, std::unique_ptr<Snapshot>(previous)});
+            Reclaim();
+            {
+                std::lock_guard<std::mutex> lock(_versionMutex);
+                _version = version;
+            }
+            _versionChanged.notify_all();
+        }
+
+        void Reclaim()
+        {
+            uint64_t oldestReading = std::numeric_limits<uint64_t>::max();
+            for (const ReaderSlot &slot : _slots)
+            {
+                const uint64_t epoch = slot.epoch.load();
+                if (epoch != 0)
+                {
+                    oldestReading = std::min(oldestReading, epoch);
+                }
+            }
+            _retired.erase(std::remove_if(_retired.begin(), _retired.end(), [&](const Retired &retired)
+                                          { return retired.epoch < oldestReading; }),
+                           _retired.end());
+            _numRetired.store(_retired.size());
+        }
+
+        void SquaredError(const OutputType *pred, const float *targets, GradientType *grads) const
+        {
+            for (int i = 0; i < BATCH_SIZE * OUTPUT_DIM; i++)
+            {
+                grads[i] = _config.learningRate * (targets[i] - static_cast<double>(pred[i]));
+            }
+        }
+
+        void Train()
+        {
+            // 推論スレッドなど他のスレッドと共有の生成器には触れない
+            std::mt19937 rng(_config.seed);
+            Random::ScopedEngine engine(rng);
+            alignas(32) BitBlock input[BATCH_SIZE * INPUT_BLOCKS];
+            std::vector<float> targets(BATCH_SIZE * OUTPUT_DIM);
+            std::vector<GradientType> grads(BATCH_SIZE * OUTPUT_DIM);
+            int sincePublish = 0;
+
+            while (true)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(_queueMutex);
+                    _queueReady.wait(lock, [&]
+                                     { return _stopping || _queue.size() >= BATCH_SIZE; });
+                    if (_stopping)
+                    {
+                        break;
+                    }
+                    for (int b = 0; b < BATCH_SIZE; b++)
+                    {
+                        const Sample &sample = _queue.front();
+                        memcpy(&input[b * INPUT_BLOCKS], sample.input.data(), sizeof(BitBlock) * INPUT_BLOCKS);
+                        memcpy(&targets[b * OUTPUT_DIM], sample.target.data(), sizeof(float) * OUTPUT_DIM);
+                        _queue.pop_front();
+                    }
+                }
+
+                const OutputType *pred = _trainee->TrainForward(input);
+                if (_loss)
+                {
+                    _loss(pred, targets.data(), grads.data());
+                }
+                else
+                {
+                    SquaredError(pred, targets.data(), grads.data());
+                }
+                _trainee->TrainBackward(grads.data());
+                _steps.fetch_add(1);
+
+                if (++sincePublish >= _config.publishEvery)
+                {
+                    Publish();
+                    sincePublish = 0;
+                }
+            }
+
+            // 公開していない学習結果を残さない
+            if (sincePublish > 0)
+            {
+                Publish();
+            }
+        }
+
+    public:
+        /**
+         * @brief 推論スレッドごとに持つ読み出し口. 推論用のアリーナを持ち，ロックを取らずに推論する
+         */
+        class Reader
+        {
+            OnlineLearner &_owner;
+            ReaderSlot *_slot = nullptr;
+            uint64_t _version = 0;
+            sequential_detail::ForwardArena<Net_t> _arena;
+
+        public:
+            explicit Reader(OnlineLearner &owner) : _owner(owner)
+            {
+                for (ReaderSlot &slot : _owner._slots)
+                {
+                    bool expected = false;
+                    if (slot.used.compare_exchange_strong(expected, true))
+                    {
+                        _slot = &slot;
+                        return;
+                    }
+                }
+                throw std::runtime_error("OnlineLearner: too many readers");
+            }
+
+            ~Reader()
+            {
+                _slot->used.store(false);
+            }
+
+            Reader(const Reader &) = delete;
+            Reader &operator=(const Reader &) = delete;
+
+            /**
+             * @brief 現在公開されている重みで推論する. 戻り値は次のForwardまで有効
+             */
+            const OutputType *Forward(const BitBlock *netInput)
+            {
+                // スナップショットを読む前にエポックを公開する（学習スレッドの解放判定と順序付ける）
+                _slot->epoch.store(_owner._globalEpoch.load());
+                const Snapshot *snapshot = _owner._current.load();
+                const OutputType *output = sequential_detail::RunForward(snapshot->net, netInput, _arena);
+                _version = snapshot->version;
+                _slot->epoch.store(0, std::memory_order_release);
+                return output;
+            }
+
+            /**
+             * @brief 直前のForwardで使ったスナップショットの版
+             */
+            uint64_t Version() const
+            {
+                return _version;
+            }
+        };
+
+        /**
+         * @param initial 学習を始める重み（最初のスナップショット，版1として公開する）
+         * @param loss 出力に対する勾配を求める関数（空なら二乗誤差）
+         */
+        OnlineLearner(const Net_t &initial, OnlineLearnerConfig config, LossFunction loss = nullptr)
+            : _config(config), _loss(std::move(loss)), _trainee(new Net_t())
+        {
+            if (_config.publishEvery < 1)
+            {
+                throw std::runtime_error("OnlineLearner: publishEvery must be positive");
+            }
+            *_trainee = initial;
+            _current.store(CopyTrainee(1));
+        }
+
+        /**
+         * @brief 学習スレッドを止めてスナップショットを解放する. Readerは先に破棄しておくこと
+         */
+        ~OnlineLearner()
+        {
+            Stop();
+            _retired.clear();
+            delete _current.load();
+        }
+
+        OnlineLearner(const OnlineLearner &) = delete;
+        OnlineLearner &operator=(const OnlineLearner &) = delete;
+
+        void Start()
+        {
+            _stopping = false;
+            _trainer = std::thread(&OnlineLearner::Train, this);
+        }
+
+        /**
+         * @brief 学習スレッドを止める. 最後の公開以降に学習した分は公開し，解放できるスナップショットを解放する
+         */
+        void Stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_queueMutex);
+                _stopping = true;
+            }
+            _queueReady.notify_all();
+            if (_trainer.joinable())
+            {
+                _trainer.join();
+            }
+            Reclaim();
+        }
+
+        /**
+         * @brief 推論したサンプルの正解を学習待ちに加える. 学習待ちが一杯ならfalse
+         *
+         * @param netInput 入力（INPUT_BLOCKSブロック）
+         * @param target 出力の教師信号（OUTPUT_DIM要素）
+         */
+        bool Feedback(const BitBlock *netInput, const float *target)
+        {
+            {
+                std::lock_guard<std::mutex> lock(_queueMutex);
+                if (_queue.size() >= _config.maxPending)
+                {
+                    return false;
+                }
+                Sample &sample = _queue.emplace_back();
+                memcpy(sample.input.data(), netInput, sizeof(BitBlock) * INPUT_BLOCKS);
+                memcpy(sample.target.data(), target, sizeof(float) * OUTPUT_DIM);
+                if (_queue.size() < BATCH_SIZE)
+                {
+                    return true;
+                }
+            }
+            _queueReady.notify_one();
+            return true;
+        }
+
+        /**
+         * @brief 指定した版以降のスナップショットが公開されるまで待つ. 時間内に公開されなければfalse
+         */
+        bool WaitForVersion(uint64_t version, std::chrono::milliseconds timeout)
+        {
+            std::unique_lock<std::mutex> lock(_versionMutex);
+            return _versionChanged.wait_for(lock, timeout, [&]
+                                            { return _version >= version; });
+        }
+
+        /**
+         * @brief 公開済みの最新の版
+         */
+        uint64_t Version()
+        {
+            std::lock_guard<std::mutex> lock(_versionMutex);
+            return _version;
+        }
+
+        /**
+         * @brief 学習したミニバッチの数
+         */
+        uint64_t StepsTrained() const
+        {
+            return _steps.load();
+        }
+
+        /**
+         * @brief 差し替え済みで，まだ読んでいるReaderがいるかもしれないため解放していないスナップショットの数
+         */
+        size_t NumRetired() const
+        {
+            return _numRetired.load();
+        }
+    };
+}
+
+#endif
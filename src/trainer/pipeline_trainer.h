@@ -0,0 +1,327 @@
+﻿/**
+ * @file pipeline_trainer.h
+ * @author Daichi Sato
+ * @brief 層をステージに分けてスレッドごとに学習するパイプライン学習
+ * @version 0.1
+ * @date 2021-12-12
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * ネットワークを複数のステージ（層の組）に分け，各ステージを別スレッドで動かす。
+ * ステージ間はSPSCキューで活性と勾配を受け渡し，ミニバッチ(BATCH_SIZE)単位で1F1B順に流す。
+ * 2番目以降のステージはBitStageInputLayerを入力層とし，前のステージの出力次元と一致させる。
+ *
+ * 層は学習用のバッファを1組しか持たないので，各ステージは順伝播のたびに層のバッファ（ForEachTrainBuffer）を
+ * 処理中のミニバッチごとに保存し，間に別のミニバッチの順伝播を挟んだ逆伝播の直前に復元する
+ * （順伝播はやり直さない。重みは最新のものを使う非同期パイプライン）。
+ * 乱数はステージごとの生成器をRandom::ScopedEngineで使うので，Random::mtには触れない。
+ * ステージ1つの場合は通常の逐次学習と同じ結果になる。
+ *
+ */
+
+#ifndef PIPELINE_TRAINER_H_INCLUDED_
+#define PIPELINE_TRAINER_H_INCLUDED_
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <random>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "../net_common.h"
+#include "../layers/bit/bit_stage_input.h"
+#include "../util/random_util.h"
+#include "../util/spsc_queue.h"
+
+namespace bitnet
+{
+    /**
+     * @brief パイプライン学習器
+     *
+     * @tparam Stages 入力側から順に並べたステージの型
+     */
+    template <typename... Stages>
+    class PipelineTrainer
+    {
+    public:
+        static constexpr int NUM_STAGES = sizeof...(Stages);
+        template <int I>
+        using Stage_t = std::tuple_element_t<I, std::tuple<Stages...>>;
+        using OutputType = typename Stage_t<NUM_STAGES - 1>::OutputType;
+        // ミニバッチ番号と最終ステージの出力から，出力に対する勾配（更新方向）を書き込む
+        using LossFunction = std::function<void(int microBatch, const OutputType *pred, GradientType *grads)>;
+
+    private:
+        // 処理中のミニバッチの，順伝播直後の層のバッファ
+        struct InFlight
+        {
+            std::vector<char> buffers;
+        };
+
+        std::tuple<std::unique_ptr<Stages>...> _stages;
+        // ステージI→I+1の活性と，ステージI+1→Iの勾配
+        std::vector<std::unique_ptr<SpscQueue<std::vector<BitBlock>>>> _activations;
+        std::vector<std::unique_ptr<SpscQueue<std::vector<GradientType>>>> _grads;
+        // ステージごとの乱数生成器（学習中はそのステージのスレッドでRandom::ScopedEngineに渡す
+        std::mt19937 _rng[NUM_STAGES];
+
+        template <int I>
+        static constexpr int ActivationBlocks()
+        {
+            return BATCH_SIZE * Stage_t<I>::PADDED_OUT_BLOCKS;
+        }
+
+        template <int I>
+        static constexpr int GradientCount()
+        {
+            return BATCH_SIZE * Stage_t<I>::COMPRESS_OUT_DIM;
+        }
+
+        template <size_t... I>
+        void CreateQueues(std::index_sequence<I...>)
+        {
+            (_activations.emplace_back(new SpscQueue<std::vector<BitBlock>>(NUM_STAGES, std::vector<BitBlock>(ActivationBlocks<I>()))), ...);
+            (_grads.emplace_back(new SpscQueue<std::vector<GradientType>>(NUM_STAGES, std::vector<GradientType>(GradientCount<I>()))), ...);
+            // 後ろのステージの入力層は前のステージの出力を受け取れる必要がある
+            static_assert((std::is_same_v<std::remove_reference_t<decltype(std::declval<Stage_t<I + 1> &>().InputLayer())>,
+                                          BitStageInputLayer<Stage_t<I>::COMPRESS_OUT_DIM>> &&
+                           ...),
+                          "stage input must be BitStageInputLayer of the previous stage output");
+        }
+
+        template <int I>
+        void SendGrads()
+        {
+            if constexpr (I > 0)
+            {
+                std::vector<GradientType> &dst = _grads[I - 1]->BeginPush();
+                memcpy(dst.data(), std::get<I>(_stages)->InputLayer().GetGrads(), sizeof(GradientType) * GradientCount<I - 1>());
+                _grads[I - 1]->EndPush();
+            }
+        }
+
+        template <typename Stage>
+        static void SaveTrainBuffers(Stage &stage, std::vector<char> *dst)
+        {
+            size_t offset = 0;
+            stage.ForEachTrainBuffer([&](const void *buffer, size_t bytes)
+                                     {
+                                         if (dst->size() < offset + bytes)
+                                         {
+                                             dst->resize(offset + bytes);
+                                         }
+                                         memcpy(dst->data() + offset, buffer, bytes);
+                                         offset += bytes; });
+        }
+
+        template <typename Stage>
+        static void RestoreTrainBuffers(Stage &stage, const std::vector<char> &src)
+        {
+            size_t offset = 0;
+            stage.ForEachTrainBuffer([&](void *buffer, size_t bytes)
+                                     {
+                                         memcpy(buffer, src.data() + offset, bytes);
+                                         offset += bytes; });
+        }
+
+        template <int I>
+        void RunStage(const BitBlock *const *inputs, int numMicroBatches, const LossFunction &loss)
+        {
+            auto &stage = *std::get<I>(_stages);
+            Random::ScopedEngine engine(_rng[I]);
+
+            if constexpr (I == NUM_STAGES - 1)
+            {
+                // 最終ステージは順伝播の直後に逆伝播するので再計算は不要
+                std::vector<GradientType> grads(GradientCount<I>());
+                for (int k = 0; k < numMicroBatches; k++)
+                {
+                    const OutputType *pred;
+                    if constexpr (I == 0)
+                    {
+                        pred = stage.TrainForward(inputs[k]);
+                    }
+                    else
+                    {
+                        pred = stage.TrainForward(_activations[I - 1]->BeginPop().data());
+                        _activations[I - 1]->EndPop();
+                    }
+                    loss(k, pred, grads.data());
+                    stage.TrainBackward(grads.data());
+                    SendGrads<I>();
+                }
+            }
+            else
+            {
+                // 1F1B: 後ろのステージ数だけ先行して順伝播し，以降は順伝播と逆伝播を交互に行う
+                const int warmup = std::min(NUM_STAGES - I - 1, numMicroBatches);
+                std::vector<InFlight> ring(NUM_STAGES - I);
+                int lastForward = -1;
+
+                auto forward = [&](int k)
+                {
+                    const BitBlock *out;
+                    if constexpr (I == 0)
+                    {
+                        out = stage.TrainForward(inputs[k]);
+                    }
+                    else
+                    {
+                        out = stage.TrainForward(_activations[I - 1]->BeginPop().data());
+                        _activations[I - 1]->EndPop();
+                    }
+                    SaveTrainBuffers(stage, &ring[k % ring.size()].buffers);
+                    lastForward = k;
+
+                    std::vector<BitBlock> &dst = _activations[I]->BeginPush();
+                    memcpy(dst.data(), out, sizeof(BitBlock) * ActivationBlocks<I>());
+                    _activations[I]->EndPush();
+                };
+
+                auto backward = [&](int k)
+                {
+                    if (lastForward != k)
+                    {
+                        // 層内のバッファをミニバッチkの順伝播直後の状態に戻す
+                        RestoreTrainBuffers(stage, ring[k % ring.size()].buffers);
+                        lastForward = k;
+                    }
+                    stage.TrainBackward(_grads[I]->BeginPop().data());
+                    _grads[I]->EndPop();
+                    SendGrads<I>();
+                };
+
+                for (int k = 0; k < warmup; k++)
+                {
+                    forward(k);
+                }
+                for (int k = warmup; k < numMicroBatches; k++)
+                {
+                    forward(k);
+                    backward(k - warmup);
+                }
+                for (int k = numMicroBatches - warmup; k < numMicroBatches; k++)
+                {
+                    backward(k);
+                }
+            }
+        }
+
+        template <size_t... I>
+        void RunStages(const BitBlock *const *inputs, int numMicroBatches, const LossFunction &loss, std::index_sequence<I...>)
+        {
+            std::thread workers[] = {std::thread(&PipelineTrainer::RunStage<I>, this, inputs, numMicroBatches, std::cref(loss))...};
+            for (auto &worker : workers)
+            {
+                worker.join();
+            }
+        }
+
+        // 出力側のステージから順にfuncを適用する
+        template <int I = NUM_STAGES - 1, typename Func_t>
+        void ForEachStageFromOutput(Func_t &&func)
+        {
+            func(*std::get<I>(_stages));
+            if constexpr (I > 0)
+            {
+                ForEachStageFromOutput<I - 1>(func);
+            }
+        }
+
+        template <int I>
+        const OutputType *ForwardFrom(const BitBlock *input)
+        {
+            const auto *output = std::get<I>(_stages)->Forward(input);
+            if constexpr (I + 1 < NUM_STAGES)
+            {
+                return ForwardFrom<I + 1>(output);
+            }
+            else
+            {
+                return output;
+            }
+        }
+
+    public:
+        /**
+         * @param seed 各ステージの乱数生成器の初期値（ステージIはseed + I）
+         */
+        explicit PipelineTrainer(unsigned int seed)
+            : _stages(std::unique_ptr<Stages>(new Stages())...)
+        {
+            CreateQueues(std::make_index_sequence<NUM_STAGES - 1>());
+            for (int i = 0; i < NUM_STAGES; i++)
+            {
+                _rng[i].seed(seed + i);
+            }
+            ForEachStageFromOutput([](auto &stage)
+                                   { stage.Init(); });
+        }
+
+        template <int I>
+        Stage_t<I> &Stage()
+        {
+            return *std::get<I>(_stages);
+        }
+
+        /**
+         * @brief 重みを初期化する。出力側のステージから順に行うため，同じ構成の一体のネットワークと同じ乱数列を消費する
+         */
+        void ResetWeight()
+        {
+            ForEachStageFromOutput([](auto &stage)
+                                   { stage.ResetWeight(); });
+        }
+
+        /**
+         * @brief 出力側のステージから順に保存する（一体のネットワークのSaveと同じ形式）
+         */
+        void Save(std::ostream &fs)
+        {
+            ForEachStageFromOutput([&fs](auto &stage)
+                                   { stage.Save(fs); });
+        }
+
+        void Load(std::istream &fs)
+        {
+            ForEachStageFromOutput([&fs](auto &stage)
+                                   { stage.Load(fs); });
+        }
+
+        void SaveOptimizer(std::ostream &fs)
+        {
+            ForEachStageFromOutput([&fs](auto &stage)
+                                   { stage.SaveOptimizer(fs); });
+        }
+
+        void LoadOptimizer(std::istream &fs)
+        {
+            ForEachStageFromOutput([&fs](auto &stage)
+                                   { stage.LoadOptimizer(fs); });
+        }
+
+        const OutputType *Forward(const BitBlock *input)
+        {
+            return ForwardFrom<0>(input);
+        }
+
+        /**
+         * @brief ミニバッチ列をパイプラインに流して学習する
+         *
+         * @param inputs ミニバッチごとの入力 [numMicroBatches][BATCH_SIZE * 入力層のPADDED_OUT_BLOCKS]
+         * @param numMicroBatches ミニバッチ数
+         * @param loss 最終ステージのスレッドから呼ばれる損失関数
+         */
+        void Train(const BitBlock *const *inputs, int numMicroBatches, const LossFunction &loss)
+        {
+            RunStages(inputs, numMicroBatches, loss, std::make_index_sequence<NUM_STAGES>());
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,267 @@
+﻿/**
+ * @file population_trainer.h
+ * @author Daichi Sato
+ * @brief 学習率・シード・スケールの異なる複数のネットワークを同じデータで並行して学習する
+ * @version 0.1
+ * @date 2021-12-16
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * 1世代ぶんのバッチを一度だけ生成・2値化し，全メンバーがそれを共有して学習する。
+ * メンバーはスレッドプールに割り振り，各メンバーは自分のスレッドで世代内のバッチを順に学習する
+ * （メンバー固有の乱数生成器をRandom::ScopedEngineでそのスレッドに割り当てるので，結果はスレッド数に依存しない）。
+ * 世代ごとに評価し，下位のメンバーは上位のメンバーの重みとスケールを引き継ぎ，学習率を揺らす(exploit/explore)。
+ *
+ * 教師データは±1で生成し，メンバーごとのスケールを掛けて使う。
+ *
+ */
+
+#ifndef POPULATION_TRAINER_H_INCLUDED_
+#define POPULATION_TRAINER_H_INCLUDED_
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "../net_common.h"
+#include "../optimizer/optimizer.h"
+#include "../util/make_data.h"
+#include "../util/random_util.h"
+#include "../util/thread_pool.h"
+
+namespace bitnet
+{
+    /**
+     * @brief メンバーごとのハイパーパラメータ
+     */
+    struct MemberConfig
+    {
+        double lr = 0.0001;
+        unsigned int seed = 42;
+        // 教師データのスケール（int8に収まること）
+        double scale = 16;
+        // オプティマイザのハイパーパラメータ（学習率はexploreでlrと同じ倍率で揺らす）
+        OptimizerParams optimizer;
+    };
+
+    /**
+     * @brief 集団学習エンジン
+     *
+     * @tparam Net_t 出力1次元のネットワーク型
+     */
+    template <typename Net_t>
+    class PopulationTrainer
+    {
+    public:
+        using InputLayer_t = std::remove_reference_t<decltype(std::declval<Net_t &>().InputLayer())>;
+        static constexpr int INPUT_DIM = InputLayer_t::COMPRESS_OUT_DIM;
+        static constexpr int INPUT_BLOCKS = InputLayer_t::PADDED_OUT_BLOCKS;
+        static_assert(Net_t::COMPRESS_OUT_DIM == 1, "PopulationTrainer expects a single output");
+
+        /**
+         * @brief ±1の入力と±1の教師をbatchSize組生成する
+         */
+        using BatchMaker = std::function<void(int batchSize, int8_t *inputData, int8_t *teacherData)>;
+
+        struct Member
+        {
+            std::unique_ptr<Net_t> net;
+            MemberConfig config;
+            std::mt19937 rng;
+            // 直近の評価での平均絶対誤差（スケールで割ったもの）
+            double score = std::numeric_limits<double>::infinity();
+            // 最後に重みを引き継いだメンバー（-1なら引き継いでいない）
+            int parent = -1;
+        };
+
+    private:
+        struct Batches
+        {
+            std::vector<BitBlock> inputs;
+            std::vector<int8_t> teachers;
+            int count = 0;
+        };
+
+        std::vector<Member> _members;
+        ThreadPool _pool;
+        // データ生成とexploit/exploreに使う乱数
+        std::mt19937 _rng;
+        BatchMaker _makeBatch;
+
+        void MakeBatches(int count, Batches *batches)
+        {
+            int8_t inputData[BATCH_SIZE * INPUT_DIM];
+            batches->inputs.assign((size_t)count * BATCH_SIZE * INPUT_BLOCKS, 0);
+            batches->teachers.resize((size_t)count * BATCH_SIZE);
+            batches->count = count;
+
+            Random::ScopedEngine engine(_rng);
+            for (int i = 0; i < count; i++)
+            {
+                _makeBatch(BATCH_SIZE, inputData, &batches->teachers[(size_t)i * BATCH_SIZE]);
+                util::BinarizeInputData(BATCH_SIZE, INPUT_DIM, inputData, &batches->inputs[(size_t)i * BATCH_SIZE * INPUT_BLOCKS]);
+            }
+        }
+
+        void TrainMember(Member &member, const Batches &batches)
+        {
+            int8_t teacherData[BATCH_SIZE];
+            GradientType diffs[BATCH_SIZE];
+            Random::ScopedEngine engine(member.rng);
+            for (int i = 0; i < batches.count; i++)
+            {
+                for (int b = 0; b < BATCH_SIZE; b++)
+                {
+                    teacherData[b] = static_cast<int8_t>(batches.teachers[(size_t)i * BATCH_SIZE + b] * member.config.scale);
+                }
+                const int32_t *pred = member.net->TrainForward(&batches.inputs[(size_t)i * BATCH_SIZE * INPUT_BLOCKS]);
+                double mae;
+                const double mse = util::CalcSquaredError(BATCH_SIZE, 1, member.config.scale, member.config.lr, pred, teacherData, diffs, &mae);
+                if (mse != 0)
+                {
+                    member.net->TrainBackward(diffs);
+                }
+            }
+        }
+
+        double EvaluateMember(Member &member, const Batches &batches)
+        {
+            double totalError = 0;
+            for (int i = 0; i < batches.count; i++)
+            {
+                const int32_t *pred = member.net->ForwardBatch(&batches.inputs[(size_t)i * BATCH_SIZE * INPUT_BLOCKS], BATCH_SIZE);
+                for (int b = 0; b < BATCH_SIZE; b++)
+                {
+                    totalError += std::abs(pred[b] / member.config.scale - batches.teachers[(size_t)i * BATCH_SIZE + b]);
+                }
+            }
+            return totalError / (batches.count * BATCH_SIZE);
+        }
+
+    public:
+        /**
+         * @param configs メンバーごとの設定
+         * @param seed データ生成とexploit/exploreに使うシード
+         * @param numThreads スレッド数. 0ならハードウェアのスレッド数
+         * @param makeBatch バッチ生成関数. 省略時はXOR
+         */
+        PopulationTrainer(const std::vector<MemberConfig> &configs, unsigned int seed = 1, int numThreads = 0, BatchMaker makeBatch = nullptr)
+            : _members(configs.size()), _pool(numThreads), _rng(seed), _makeBatch(std::move(makeBatch))
+        {
+            if (!_makeBatch)
+            {
+                _makeBatch = [](int batchSize, int8_t *inputData, int8_t *teacherData)
+                { util::MakeXORBatch(batchSize, 1, inputData, teacherData); };
+            }
+            _pool.ParallelFor(static_cast<int>(_members.size()), [&](int m)
+                              {
+                                  Member &member = _members[m];
+                                  member.config = configs[m];
+                                  member.rng.seed(member.config.seed);
+                                  member.net.reset(new Net_t());
+                                  Random::ScopedEngine engine(member.rng);
+                                  member.net->Init();
+                                  member.net->ResetWeight();
+                                  member.net->SetOptimizerParams(member.config.optimizer); });
+        }
+
+        /**
+         * @brief numBatches個のバッチを一度だけ生成し，全メンバーで学習する
+         */
+        void Train(int numBatches)
+        {
+            Batches batches;
+            MakeBatches(numBatches, &batches);
+            _pool.ParallelFor(static_cast<int>(_members.size()), [&](int m)
+                              { TrainMember(_members[m], batches); });
+        }
+
+        /**
+         * @brief 共通の評価用バッチで全メンバーのスコアを更新する
+         */
+        void Evaluate(int numBatches)
+        {
+            Batches batches;
+            MakeBatches(numBatches, &batches);
+            _pool.ParallelFor(static_cast<int>(_members.size()), [&](int m)
+                              { _members[m].score = EvaluateMember(_members[m], batches); });
+        }
+
+        /**
+         * @brief スコア下位truncationの割合のメンバーを，上位の同じ割合からランダムに選んだメンバーで置き換え，学習率を揺らす
+         *
+         * @return int 置き換えたメンバー数
+         */
+        int ExploitExplore(double truncation = 0.25, double perturbation = 1.25)
+        {
+            std::vector<int> order(_members.size());
+            std::iota(order.begin(), order.end(), 0);
+            std::stable_sort(order.begin(), order.end(), [&](int a, int b)
+                             { return _members[a].score < _members[b].score; });
+
+            const int numReplaced = static_cast<int>(_members.size() * truncation);
+            for (int i = 0; i < numReplaced; i++)
+            {
+                Member &loser = _members[order[order.size() - 1 - i]];
+                const int parentIdx = order[_rng() % numReplaced];
+                const Member &parent = _members[parentIdx];
+
+                *loser.net = *parent.net;
+                loser.config.scale = parent.config.scale;
+                const double factor = (_rng() % 2) ? perturbation : 1 / perturbation;
+                loser.config.lr = parent.config.lr * factor;
+                loser.config.optimizer = parent.config.optimizer;
+                loser.config.optimizer.learningRate = static_cast<float>(parent.config.optimizer.learningRate * factor);
+                // 重みと一緒に親のハイパーパラメータも複製されたので上書きする
+                loser.net->SetOptimizerParams(loser.config.optimizer);
+                loser.score = parent.score;
+                loser.parent = parentIdx;
+            }
+            return numReplaced;
+        }
+
+        /**
+         * @brief 学習・評価・exploit/exploreを世代数だけ繰り返す（最後の世代は置き換えない）
+         *
+         * @return int 最後の評価で最良のメンバーの添字
+         */
+        int Run(int generations, int trainBatches, int evalBatches, double truncation = 0.25)
+        {
+            for (int g = 0; g < generations; g++)
+            {
+                Train(trainBatches);
+                Evaluate(evalBatches);
+                if (g + 1 < generations)
+                {
+                    ExploitExplore(truncation);
+                }
+            }
+            return Best();
+        }
+
+        int Best() const
+        {
+            return static_cast<int>(std::min_element(_members.begin(), _members.end(), [](const Member &a, const Member &b)
+                                                     { return a.score < b.score; }) -
+                                    _members.begin());
+        }
+
+        const std::vector<Member> &Members() const
+        {
+            return _members;
+        }
+
+        Net_t &Net(int idx)
+        {
+            return *_members[idx].net;
+        }
+    };
+}
+
+#endif
@@ -1 +1,308 @@
 ﻿#include "bit_helper.h"
+#include <stdexcept>
+
+#ifdef _MSC_VER
+#define BITNET_TARGET_AVX2
+#define BITNET_TARGET_AVX512
+#else
+#include <cpuid.h>
+// 命令セットごとのカーネルだけを上位の命令でコンパイルする（ビルド全体のフラグは上げない）
+#define BITNET_TARGET_AVX2 __attribute__((target("avx2,fma,popcnt")))
+#define BITNET_TARGET_AVX512 __attribute__((target("avx2,fma,popcnt,avx512f,avx512bw,avx512vl,avx512vpopcntdq,avx512vnni")))
+#endif
+
+namespace bitnet
+{
+    namespace
+    {
+        struct CpuidRegs
+        {
+            uint32_t eax, ebx, ecx, edx;
+        };
+
+        CpuidRegs Cpuid(uint32_t leaf, uint32_t subleaf)
+        {
+            CpuidRegs r{};
+#ifdef _MSC_VER
+            int regs[4];
+            __cpuidex(regs, static_cast<int>(leaf), static_cast<int>(subleaf));
+            r = {static_cast<uint32_t>(regs[0]), static_cast<uint32_t>(regs[1]), static_cast<uint32_t>(regs[2]), static_cast<uint32_t>(regs[3])};
+#else
+            if (leaf <= __get_cpuid_max(0, nullptr))
+            {
+                __cpuid_count(leaf, subleaf, r.eax, r.ebx, r.ecx, r.edx);
+            }
+#endif
+            return r;
+        }
+
+        // OSがどのレジスタ状態を保存するか(XCR0)
+        uint64_t ReadXcr0()
+        {
+#ifdef _MSC_VER
+            return _xgetbv(0);
+#else
+            uint32_t lo, hi;
+            __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+            return (static_cast<uint64_t>(hi) << 32) | lo;
+#endif
+        }
+
+        bool HasBit(uint32_t reg, int bit)
+        {
+            return (reg >> bit) & 1;
+        }
+
+        namespace avx2
+        {
+            BITNET_TARGET_AVX2 int MaddPopcnt(const uint8_t *bitBlocks, const uint8_t *weightBlocks, int length)
+            {
+                // 複数スレッドから呼ばれるためstaticにしない
+                alignas(__m256i) uint64_t TempMaddBuffer[4];
+                const int blocks = length / SIMD_BIT_WIDTH;
+                int sum = 0;
+                for (int b = 0; b < blocks; b++)
+                {
+                    vector32 x = _mm256_load_si256((vector32 *)&(bitBlocks[b * NUM_BYTES_IN_REGISTER]));
+                    vector32 w = _mm256_load_si256((vector32 *)&(weightBlocks[b * NUM_BYTES_IN_REGISTER]));
+                    vector32 mul = ~_mm256_xor_si256(x, w);
+
+                    _mm256_store_si256((__m256i *)TempMaddBuffer, mul);
+                    // 256bitのpopcntはAVX2まででは存在しないので64bitずつカウント
+                    for (int i = 0; i < (SIMD_BIT_WIDTH / POPCNT_BIT_WIDTH); i++)
+                    {
+                        sum += _mm_popcnt_u64(TempMaddBuffer[i]);
+                    }
+                }
+                // 64/128bitにパディングされた狭い層の端数は64bitずつ
+                for (int i = blocks * SIMD_BIT_WIDTH; i < length; i += POPCNT_BIT_WIDTH)
+                {
+                    uint64_t x, w;
+                    memcpy(&x, bitBlocks + GetBlockIndex(i), sizeof(uint64_t));
+                    memcpy(&w, weightBlocks + GetBlockIndex(i), sizeof(uint64_t));
+                    sum += _mm_popcnt_u64(~(x ^ w));
+                }
+                return sum;
+            }
+
+            BITNET_TARGET_AVX2 int MaskedMaddPopcnt(const uint8_t *bitBlocks, const uint8_t *weightBlocks, const uint8_t *maskBlocks, int length)
+            {
+                int sum = 0;
+                int i = 0;
+                for (; i + SIMD_BIT_WIDTH <= length; i += SIMD_BIT_WIDTH)
+                {
+                    sum += MaskedXnorPopcnt256(bitBlocks + GetBlockIndex(i), weightBlocks + GetBlockIndex(i), maskBlocks + GetBlockIndex(i));
+                }
+                for (; i < length; i += POPCNT_BIT_WIDTH)
+                {
+                    sum += MaskedXnorPopcnt64(bitBlocks + GetBlockIndex(i), weightBlocks + GetBlockIndex(i), maskBlocks + GetBlockIndex(i));
+                }
+                return sum;
+            }
+
+            BITNET_TARGET_AVX2 void PackPositive(const int8_t *inputs, BitBlock *dst, int length)
+            {
+                const vector32 zero = _mm256_setzero_si256();
+                int i = 0;
+                for (; i + NUM_BYTES_IN_REGISTER <= length; i += NUM_BYTES_IN_REGISTER)
+                {
+                    vector32 x = _mm256_loadu_si256((const vector32 *)(inputs + i));
+                    const int packed = _mm256_movemask_epi8(_mm256_cmpgt_epi8(x, zero));
+                    memcpy(dst + GetBlockIndex(i), &packed, sizeof(int));
+                }
+                for (; i < length; i++)
+                {
+                    if (GetBitIndexInBlock(i) == 0)
+                    {
+                        dst[GetBlockIndex(i)] = 0;
+                    }
+                    dst[GetBlockIndex(i)] |= static_cast<BitBlock>(inputs[i] > 0) << GetBitIndexInBlock(i);
+                }
+            }
+
+            BITNET_TARGET_AVX2 int ClipAndPackSigns(float *weights, BitBlock *dst, int length)
+            {
+                const float8 zero = _mm256_setzero_ps();
+                const float8 plusOne = _mm256_set1_ps(1.0f);
+                const float8 minusOne = _mm256_set1_ps(-1.0f);
+                int changed = 0;
+                int i = 0;
+                for (; i + BYTE_BIT_WIDTH <= length; i += BYTE_BIT_WIDTH)
+                {
+                    float8 clipped = _mm256_max_ps(minusOne, _mm256_min_ps(plusOne, _mm256_loadu_ps(weights + i)));
+                    _mm256_storeu_ps(weights + i, clipped);
+                    const BitBlock packed = static_cast<BitBlock>(_mm256_movemask_ps(_mm256_cmp_ps(clipped, zero, _CMP_GT_OQ)));
+                    changed += _mm_popcnt_u64(static_cast<BitBlock>(packed ^ dst[GetBlockIndex(i)]));
+                    dst[GetBlockIndex(i)] = packed;
+                }
+                if (i < length)
+                {
+                    BitBlock packed = 0;
+                    for (int k = 0; i + k < length; k++)
+                    {
+                        const double tmp_w = std::max(-1.0, std::min(1.0, (double)weights[i + k]));
+                        weights[i + k] = tmp_w;
+                        packed |= static_cast<BitBlock>(tmp_w > 0) << k;
+                    }
+                    changed += _mm_popcnt_u64(static_cast<BitBlock>(packed ^ dst[GetBlockIndex(i)]));
+                    dst[GetBlockIndex(i)] = packed;
+                }
+                return changed;
+            }
+
+            BITNET_TARGET_AVX2 int MaddInt8(const int8_t *x, const int8_t *w, int length)
+            {
+                const vector32 ones16 = _mm256_set1_epi16(1);
+                vector32 acc = _mm256_setzero_si256();
+                for (int b = 0; b < length; b += NUM_BYTES_IN_REGISTER)
+                {
+                    vector32 xv = _mm256_loadu_si256((const vector32 *)(x + b));
+                    vector32 wv = _mm256_loadu_si256((const vector32 *)(w + b));
+                    vector32 mul16 = _mm256_maddubs_epi16(_mm256_sign_epi8(xv, xv), _mm256_sign_epi8(wv, xv));
+                    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mul16, ones16));
+                }
+                vector16 acc128 = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+                acc128 = _mm_add_epi32(acc128, _mm_shuffle_epi32(acc128, _MM_SHUFFLE(1, 0, 3, 2)));
+                acc128 = _mm_add_epi32(acc128, _mm_shuffle_epi32(acc128, _MM_SHUFFLE(2, 3, 0, 1)));
+                return _mm_cvtsi128_si32(acc128);
+            }
+        }
+
+        // 512bit単位で処理し，端数はAVX2版に任せる
+        namespace avx512
+        {
+            constexpr int NUM_BYTES_IN_REGISTER512 = 64;
+            constexpr int NUM_FLOAT_IN_REGISTER512 = 16;
+
+            BITNET_TARGET_AVX512 int MaddPopcnt(const uint8_t *bitBlocks, const uint8_t *weightBlocks, int length)
+            {
+                const int blocks = length / (NUM_BYTES_IN_REGISTER512 * BYTE_BIT_WIDTH);
+                // 一致数 = ビット数 - 不一致数
+                __m512i mismatches = _mm512_setzero_si512();
+                for (int b = 0; b < blocks; b++)
+                {
+                    __m512i x = _mm512_loadu_si512(bitBlocks + b * NUM_BYTES_IN_REGISTER512);
+                    __m512i w = _mm512_loadu_si512(weightBlocks + b * NUM_BYTES_IN_REGISTER512);
+                    mismatches = _mm512_add_epi64(mismatches, _mm512_popcnt_epi64(_mm512_xor_si512(x, w)));
+                }
+                const int done = blocks * NUM_BYTES_IN_REGISTER512 * BYTE_BIT_WIDTH;
+                const int sum = done - static_cast<int>(_mm512_reduce_add_epi64(mismatches));
+                const int doneBytes = done / BYTE_BIT_WIDTH;
+                return sum + avx2::MaddPopcnt(bitBlocks + doneBytes, weightBlocks + doneBytes, length - done);
+            }
+
+            BITNET_TARGET_AVX512 int MaskedMaddPopcnt(const uint8_t *bitBlocks, const uint8_t *weightBlocks, const uint8_t *maskBlocks, int length)
+            {
+                const int blocks = length / (NUM_BYTES_IN_REGISTER512 * BYTE_BIT_WIDTH);
+                __m512i matches = _mm512_setzero_si512();
+                for (int b = 0; b < blocks; b++)
+                {
+                    __m512i x = _mm512_loadu_si512(bitBlocks + b * NUM_BYTES_IN_REGISTER512);
+                    __m512i w = _mm512_loadu_si512(weightBlocks + b * NUM_BYTES_IN_REGISTER512);
+                    __m512i m = _mm512_loadu_si512(maskBlocks + b * NUM_BYTES_IN_REGISTER512);
+                    // m & ~(x ^ w)
+                    matches = _mm512_add_epi64(matches, _mm512_popcnt_epi64(_mm512_andnot_si512(_mm512_xor_si512(x, w), m)));
+                }
+                const int doneBytes = blocks * NUM_BYTES_IN_REGISTER512;
+                return static_cast<int>(_mm512_reduce_add_epi64(matches)) +
+                       avx2::MaskedMaddPopcnt(bitBlocks + doneBytes, weightBlocks + doneBytes, maskBlocks + doneBytes, length - doneBytes * BYTE_BIT_WIDTH);
+            }
+
+            BITNET_TARGET_AVX512 void PackPositive(const int8_t *inputs, BitBlock *dst, int length)
+            {
+                const __m512i zero = _mm512_setzero_si512();
+                int i = 0;
+                for (; i + NUM_BYTES_IN_REGISTER512 <= length; i += NUM_BYTES_IN_REGISTER512)
+                {
+                    const __mmask64 packed = _mm512_cmpgt_epi8_mask(_mm512_loadu_si512(inputs + i), zero);
+                    memcpy(dst + GetBlockIndex(i), &packed, sizeof(packed));
+                }
+                avx2::PackPositive(inputs + i, dst + GetBlockIndex(i), length - i);
+            }
+
+            BITNET_TARGET_AVX512 int ClipAndPackSigns(float *weights, BitBlock *dst, int length)
+            {
+                const __m512 zero = _mm512_setzero_ps();
+                const __m512 plusOne = _mm512_set1_ps(1.0f);
+                const __m512 minusOne = _mm512_set1_ps(-1.0f);
+                int changed = 0;
+                int i = 0;
+                for (; i + NUM_FLOAT_IN_REGISTER512 <= length; i += NUM_FLOAT_IN_REGISTER512)
+                {
+                    __m512 clipped = _mm512_max_ps(minusOne, _mm512_min_ps(plusOne, _mm512_loadu_ps(weights + i)));
+                    _mm512_storeu_ps(weights + i, clipped);
+                    const uint16_t packed = _mm512_cmp_ps_mask(clipped, zero, _CMP_GT_OQ);
+                    uint16_t before;
+                    memcpy(&before, dst + GetBlockIndex(i), sizeof(before));
+                    changed += _mm_popcnt_u32(packed ^ before);
+                    memcpy(dst + GetBlockIndex(i), &packed, sizeof(packed));
+                }
+                return changed + avx2::ClipAndPackSigns(weights + i, dst + GetBlockIndex(i), length - i);
+            }
+
+            BITNET_TARGET_AVX512 int MaddInt8(const int8_t *x, const int8_t *w, int length)
+            {
+                __m512i acc = _mm512_setzero_si512();
+                int b = 0;
+                for (; b + NUM_BYTES_IN_REGISTER512 <= length; b += NUM_BYTES_IN_REGISTER512)
+                {
+                    __m512i xv = _mm512_loadu_si512(x + b);
+                    __m512i wv = _mm512_loadu_si512(w + b);
+                    // x<0の位置ではwの符号を反転
+                    __mmask64 negative = _mm512_movepi8_mask(xv);
+                    __m512i signedW = _mm512_mask_sub_epi8(wv, negative, _mm512_setzero_si512(), wv);
+                    acc = _mm512_dpbusd_epi32(acc, _mm512_abs_epi8(xv), signedW);
+                }
+                return _mm512_reduce_add_epi32(acc) + avx2::MaddInt8(x + b, w + b, length - b);
+            }
+        }
+
+        constexpr KernelTable AVX2_KERNELS = {IsaLevel::AVX2, "avx2", avx2::MaddPopcnt, avx2::MaskedMaddPopcnt, avx2::PackPositive, avx2::ClipAndPackSigns, avx2::MaddInt8};
+        constexpr KernelTable AVX512_KERNELS = {IsaLevel::AVX512, "avx512", avx512::MaddPopcnt, avx512::MaskedMaddPopcnt, avx512::PackPositive, avx512::ClipAndPackSigns, avx512::MaddInt8};
+
+        bool Supports(IsaLevel level)
+        {
+            const CpuidRegs leaf1 = Cpuid(1, 0);
+            const CpuidRegs leaf7 = Cpuid(7, 0);
+            // XSAVEが有効でないとXCR0を読めない
+            if (!HasBit(leaf1.ecx, 27))
+            {
+                return false;
+            }
+            const uint64_t xcr0 = ReadXcr0();
+            // SSE/AVXの状態(bit1,2)
+            const bool avxState = (xcr0 & 0x6) == 0x6;
+            const bool avx2 = avxState && HasBit(leaf1.ecx, 23) /*POPCNT*/ && HasBit(leaf1.ecx, 12) /*FMA*/ && HasBit(leaf7.ebx, 5) /*AVX2*/;
+            if (level == IsaLevel::AVX2)
+            {
+                return avx2;
+            }
+            // opmask/ZMMの状態(bit5,6,7)
+            const bool avx512State = (xcr0 & 0xe6) == 0xe6;
+            return avx2 && avx512State && HasBit(leaf7.ebx, 16) /*F*/ && HasBit(leaf7.ebx, 30) /*BW*/ && HasBit(leaf7.ebx, 31) /*VL*/ &&
+                   HasBit(leaf7.ecx, 14) /*VPOPCNTDQ*/ && HasBit(leaf7.ecx, 11) /*VNNI*/;
+        }
+    }
+
+    IsaLevel DetectIsaLevel()
+    {
+        if (Supports(IsaLevel::AVX512))
+        {
+            return IsaLevel::AVX512;
+        }
+        if (Supports(IsaLevel::AVX2))
+        {
+            return IsaLevel::AVX2;
+        }
+        throw std::runtime_error("this build requires a CPU with AVX2, FMA and POPCNT");
+    }
+
+    const KernelTable *GetKernelTable(IsaLevel level)
+    {
+        if (!Supports(level))
+        {
+            return nullptr;
+        }
+        return level == IsaLevel::AVX512 ? &AVX512_KERNELS : &AVX2_KERNELS;
+    }
+}
@@ -12,9 +12,17 @@
 #ifndef BIT_HELPER_H_
 #define BIT_HELPER_H_
 
+#ifdef _MSC_VER
 #include <intrin.h>
+#else
+#include <immintrin.h>
+#endif
 #include <cstdint>
 #include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <utility>
+#include "../net_common.h"
 
 namespace bitnet
 {
@@ -40,8 +48,21 @@ namespace bitnet
         return std::ceil(byteSize / (double)(NUM_BYTES_IN_REGISTER)) * NUM_BYTES_IN_REGISTER;
     }
 
+    /**
+     * @brief ビット列のパディング後の長さ.
+     * 64bit, 128bitに収まる狭い層はその長さに，それ以上はSIMDレジスタ幅(256bit)の倍数に揃える
+     * （MaddPopcntFixedが長さに応じたカーネルを選ぶ）
+     */
     constexpr int AddPaddingToBitSize(int bitSize)
     {
+        if (bitSize <= POPCNT_BIT_WIDTH)
+        {
+            return POPCNT_BIT_WIDTH;
+        }
+        if (bitSize <= 2 * POPCNT_BIT_WIDTH)
+        {
+            return 2 * POPCNT_BIT_WIDTH;
+        }
         return std::ceil(bitSize / (double)SIMD_BIT_WIDTH) * SIMD_BIT_WIDTH;
     }
 
@@ -50,6 +71,50 @@ namespace bitnet
         return std::ceil(bitSize / (float)BYTE_BIT_WIDTH);
     }
 
+    /**
+     * @brief 実行時にCPUIDで選ぶ可変長カーネルの命令セット
+     */
+    enum class IsaLevel
+    {
+        // ビルドのベースライン（ヘッダー内のテンプレートカーネルもこの命令セットでコンパイルされる）
+        AVX2,
+        // AVX-512 F/BW/VL/VPOPCNTDQ/VNNI（Ice Lake以降）
+        AVX512,
+    };
+
+    /**
+     * @brief 命令セットごとにコンパイルした可変長カーネルの関数表（実体はbit_helper.cpp）
+     */
+    struct KernelTable
+    {
+        IsaLevel level;
+        const char *name;
+        int (*maddPopcnt)(const uint8_t *bitBlocks, const uint8_t *weightBlocks, int length);
+        int (*maskedMaddPopcnt)(const uint8_t *bitBlocks, const uint8_t *weightBlocks, const uint8_t *maskBlocks, int length);
+        void (*packPositive)(const int8_t *inputs, BitBlock *dst, int length);
+        int (*clipAndPackSigns)(float *weights, BitBlock *dst, int length);
+        int (*maddInt8)(const int8_t *x, const int8_t *w, int length);
+    };
+
+    /**
+     * @brief このCPUとOSで使える最上位の命令セット. ベースラインを満たさなければruntime_error
+     */
+    IsaLevel DetectIsaLevel();
+
+    /**
+     * @brief 指定した命令セットの関数表. このCPUで実行できなければnullptr
+     */
+    const KernelTable *GetKernelTable(IsaLevel level);
+
+    /**
+     * @brief 最初の呼び出しで一度だけ選んだ関数表
+     */
+    inline const KernelTable &Kernels()
+    {
+        static const KernelTable &table = *GetKernelTable(DetectIsaLevel());
+        return table;
+    }
+
     inline int GetBlockIndex(int bitIndex)
     {
         return bitIndex / BYTE_BIT_WIDTH;
@@ -60,6 +125,28 @@ namespace bitnet
         return bitIndex % BYTE_BIT_WIDTH;
     }
 
+    inline int CountTrailingZeros64(uint64_t bits)
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward64(&index, bits);
+        return static_cast<int>(index);
+#else
+        return __builtin_ctzll(bits);
+#endif
+    }
+
+    inline int CountLeadingZeros64(uint64_t bits)
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanReverse64(&index, bits);
+        return 63 - static_cast<int>(index);
+#else
+        return __builtin_clzll(bits);
+#endif
+    }
+
     inline double sgn(double val)
     {
         return (double(0) < val) - (val < double(0));
@@ -329,23 +416,151 @@ namespace bitnet
      */
     inline int MaddPopcnt2(const uint8_t *bitBlocks, const uint8_t *weightBlocks, const int length)
     {
-        alignas(__m256i) static uint64_t TempMaddBuffer[4];
-        const int blocks = length / SIMD_BIT_WIDTH;
-        int sum = 0;
-        for (int b = 0; b < blocks; b++)
+        return Kernels().maddPopcnt(bitBlocks, weightBlocks, length);
+    }
+
+    inline int XnorPopcnt64(const uint8_t *bitBlocks, const uint8_t *weightBlocks)
+    {
+        uint64_t x, w;
+        memcpy(&x, bitBlocks, sizeof(uint64_t));
+        memcpy(&w, weightBlocks, sizeof(uint64_t));
+        return static_cast<int>(_mm_popcnt_u64(~(x ^ w)));
+    }
+
+    inline int XnorPopcnt256(const uint8_t *bitBlocks, const uint8_t *weightBlocks)
+    {
+        vector32 x = _mm256_load_si256((const vector32 *)bitBlocks);
+        vector32 w = _mm256_load_si256((const vector32 *)weightBlocks);
+        vector32 mul = ~_mm256_xor_si256(x, w);
+        return static_cast<int>(_mm_popcnt_u64(_mm256_extract_epi64(mul, 0)) + _mm_popcnt_u64(_mm256_extract_epi64(mul, 1)) +
+                                _mm_popcnt_u64(_mm256_extract_epi64(mul, 2)) + _mm_popcnt_u64(_mm256_extract_epi64(mul, 3)));
+    }
+
+    template <size_t... Words>
+    inline int MaddPopcnt64Unrolled(const uint8_t *bitBlocks, const uint8_t *weightBlocks, std::index_sequence<Words...>)
+    {
+        return (0 + ... + XnorPopcnt64(bitBlocks + Words * sizeof(uint64_t), weightBlocks + Words * sizeof(uint64_t)));
+    }
+
+    template <size_t... Blocks>
+    inline int MaddPopcnt256Unrolled(const uint8_t *bitBlocks, const uint8_t *weightBlocks, std::index_sequence<Blocks...>)
+    {
+        return (0 + ... + XnorPopcnt256(bitBlocks + Blocks * NUM_BYTES_IN_REGISTER, weightBlocks + Blocks * NUM_BYTES_IN_REGISTER));
+    }
+
+    /**
+     * @brief 長さがコンパイル時に決まるMaddPopcnt2.
+     * 64/128bitの狭い層は64bit単位のpopcnt，それ以上は256bit単位で，いずれもループを完全に展開する.
+     *
+     * @tparam Length パディング込みのビット列の長さ（AddPaddingToBitSizeの戻り値）
+     */
+    template <int Length>
+    inline int MaddPopcntFixed(const uint8_t *bitBlocks, const uint8_t *weightBlocks)
+    {
+        static_assert(Length == AddPaddingToBitSize(Length), "Length must be padded by AddPaddingToBitSize");
+        if constexpr (Length < SIMD_BIT_WIDTH)
+        {
+            return MaddPopcnt64Unrolled(bitBlocks, weightBlocks, std::make_index_sequence<Length / POPCNT_BIT_WIDTH>());
+        }
+        else
         {
-            vector32 x = _mm256_load_si256((vector32 *)&(bitBlocks[b * NUM_BYTES_IN_REGISTER]));
-            vector32 w = _mm256_load_si256((vector32 *)&(weightBlocks[b * NUM_BYTES_IN_REGISTER]));
-            vector32 mul = ~_mm256_xor_si256(x, w);
+            return MaddPopcnt256Unrolled(bitBlocks, weightBlocks, std::make_index_sequence<Length / SIMD_BIT_WIDTH>());
+        }
+    }
+
+    /**
+     * @brief 3値重み用. マスクのビットが立った位置だけでXNORのpopcountを取る
+     */
+    inline int MaskedXnorPopcnt64(const uint8_t *bitBlocks, const uint8_t *weightBlocks, const uint8_t *maskBlocks)
+    {
+        uint64_t x, w, m;
+        memcpy(&x, bitBlocks, sizeof(uint64_t));
+        memcpy(&w, weightBlocks, sizeof(uint64_t));
+        memcpy(&m, maskBlocks, sizeof(uint64_t));
+        return static_cast<int>(_mm_popcnt_u64(m & ~(x ^ w)));
+    }
+
+    inline int MaskedXnorPopcnt256(const uint8_t *bitBlocks, const uint8_t *weightBlocks, const uint8_t *maskBlocks)
+    {
+        vector32 x = _mm256_load_si256((const vector32 *)bitBlocks);
+        vector32 w = _mm256_load_si256((const vector32 *)weightBlocks);
+        vector32 m = _mm256_load_si256((const vector32 *)maskBlocks);
+        // m & ~(x ^ w)
+        vector32 mul = _mm256_andnot_si256(_mm256_xor_si256(x, w), m);
+        return static_cast<int>(_mm_popcnt_u64(_mm256_extract_epi64(mul, 0)) + _mm_popcnt_u64(_mm256_extract_epi64(mul, 1)) +
+                                _mm_popcnt_u64(_mm256_extract_epi64(mul, 2)) + _mm_popcnt_u64(_mm256_extract_epi64(mul, 3)));
+    }
 
-            _mm256_store_si256((__m256i *)TempMaddBuffer, mul);
-            // 256bitのpopcntはAVX2まででは存在しないので64bitずつカウント
-            for (int i = 0; i < (SIMD_BIT_WIDTH / POPCNT_BIT_WIDTH); i++)
+    template <size_t... Words>
+    inline int MaskedMaddPopcnt64Unrolled(const uint8_t *bitBlocks, const uint8_t *weightBlocks, const uint8_t *maskBlocks, std::index_sequence<Words...>)
+    {
+        return (0 + ... + MaskedXnorPopcnt64(bitBlocks + Words * sizeof(uint64_t), weightBlocks + Words * sizeof(uint64_t), maskBlocks + Words * sizeof(uint64_t)));
+    }
+
+    template <size_t... Blocks>
+    inline int MaskedMaddPopcnt256Unrolled(const uint8_t *bitBlocks, const uint8_t *weightBlocks, const uint8_t *maskBlocks, std::index_sequence<Blocks...>)
+    {
+        return (0 + ... + MaskedXnorPopcnt256(bitBlocks + Blocks * NUM_BYTES_IN_REGISTER, weightBlocks + Blocks * NUM_BYTES_IN_REGISTER, maskBlocks + Blocks * NUM_BYTES_IN_REGISTER));
+    }
+
+    /**
+     * @brief MaddPopcntFixedの3値重み版. 符号が一致し，かつマスクが立っているビットの数を数える.
+     * 積和は 2 * (戻り値) - popcount(mask) となる.
+     *
+     * @tparam Length パディング込みのビット列の長さ（AddPaddingToBitSizeの戻り値）
+     */
+    template <int Length>
+    inline int MaskedMaddPopcntFixed(const uint8_t *bitBlocks, const uint8_t *weightBlocks, const uint8_t *maskBlocks)
+    {
+        static_assert(Length == AddPaddingToBitSize(Length), "Length must be padded by AddPaddingToBitSize");
+        if constexpr (Length < SIMD_BIT_WIDTH)
+        {
+            return MaskedMaddPopcnt64Unrolled(bitBlocks, weightBlocks, maskBlocks, std::make_index_sequence<Length / POPCNT_BIT_WIDTH>());
+        }
+        else
+        {
+            return MaskedMaddPopcnt256Unrolled(bitBlocks, weightBlocks, maskBlocks, std::make_index_sequence<Length / SIMD_BIT_WIDTH>());
+        }
+    }
+
+    // これ以上の長さの行は，AVX-512が使えれば512bit単位の可変長カーネルのほうが速い
+    constexpr int DISPATCH_MIN_BIT_WIDTH = 2 * SIMD_BIT_WIDTH;
+
+    /**
+     * @brief 層の推論で使う長さ固定の積和. 長い行はKernels()の選んだ命令セットのカーネルで，
+     * 短い行（とAVX2のみのCPU）は展開済みのMaddPopcntFixedで計算する（間接呼び出しのほうが高くつくため）
+     *
+     * @tparam Length パディング込みのビット列の長さ（AddPaddingToBitSizeの戻り値）
+     */
+    template <int Length>
+    inline int MaddPopcntDispatched(const uint8_t *bitBlocks, const uint8_t *weightBlocks)
+    {
+        if constexpr (Length >= DISPATCH_MIN_BIT_WIDTH)
+        {
+            const KernelTable &kernels = Kernels();
+            if (kernels.level != IsaLevel::AVX2)
+            {
+                return kernels.maddPopcnt(bitBlocks, weightBlocks, Length);
+            }
+        }
+        return MaddPopcntFixed<Length>(bitBlocks, weightBlocks);
+    }
+
+    /**
+     * @brief MaddPopcntDispatchedの3値重み版
+     */
+    template <int Length>
+    inline int MaskedMaddPopcntDispatched(const uint8_t *bitBlocks, const uint8_t *weightBlocks, const uint8_t *maskBlocks)
+    {
+        if constexpr (Length >= DISPATCH_MIN_BIT_WIDTH)
+        {
+            const KernelTable &kernels = Kernels();
+            if (kernels.level != IsaLevel::AVX2)
             {
-                sum += _mm_popcnt_u64(TempMaddBuffer[i]);
+                return kernels.maskedMaddPopcnt(bitBlocks, weightBlocks, maskBlocks, Length);
             }
         }
-        return sum;
+        return MaskedMaddPopcntFixed<Length>(bitBlocks, weightBlocks, maskBlocks);
     }
 
     /**
@@ -357,18 +572,546 @@ namespace bitnet
      */
     inline void CollectSignBit(const int8_t *inputs, int *dst, const int byteLength)
     {
-        const int blocks = byteLength / NUM_BYTES_IN_REGISTER;
-        for (int b = 0; b < blocks; b++)
+        Kernels().packPositive(inputs, reinterpret_cast<BitBlock *>(dst), byteLength);
+    }
+
+    /**
+     * @brief 正の要素を1とするビット列に詰める（入力データの2値化用）.
+     * 書き込んだ末尾の端数ブロックのうちlength以降のビットは0になる.
+     *
+     * @param inputs 入力バイト列（アラインメント・パディング不要）
+     * @param dst ビット列の格納先
+     * @param length 入力バイト数
+     */
+    inline void PackPositiveBits(const int8_t *inputs, BitBlock *dst, const int length)
+    {
+        Kernels().packPositive(inputs, dst, length);
+    }
+
+    /**
+     * @brief 任意のビット位置から最大64bitを読み出す.
+     * 読み出し範囲外のバイトにはアクセスしない.
+     *
+     * @param src ビット列
+     * @param bitOffset 読み出し開始ビット位置
+     * @param bitLength 読み出すビット数(1~64)
+     * @return uint64_t 下位ビットから詰めた値（範囲外のビットは0）
+     */
+    inline uint64_t LoadBits64(const BitBlock *src, const int bitOffset, const int bitLength)
+    {
+        const int blockIdx = GetBlockIndex(bitOffset);
+        const int bitShift = GetBitIndexInBlock(bitOffset);
+        const int numBlocks = BitToBlockCount(bitShift + bitLength);
+
+        uint64_t lo = 0;
+        memcpy(&lo, src + blockIdx, std::min(numBlocks, POPCNT_BIT_WIDTH / BYTE_BIT_WIDTH));
+        uint64_t bits = lo >> bitShift;
+        if (numBlocks > POPCNT_BIT_WIDTH / BYTE_BIT_WIDTH)
+        {
+            bits |= static_cast<uint64_t>(src[blockIdx + POPCNT_BIT_WIDTH / BYTE_BIT_WIDTH]) << (POPCNT_BIT_WIDTH - bitShift);
+        }
+        if (bitLength < POPCNT_BIT_WIDTH)
+        {
+            bits &= (1ULL << bitLength) - 1;
+        }
+        return bits;
+    }
+
+    /**
+     * @brief 任意のビット位置へ最大64bitを書き込む（範囲外のビットは保持）
+     *
+     * @param dst 書き込み先ビット列
+     * @param bitOffset 書き込み開始ビット位置
+     * @param bits 下位ビットから詰めた値
+     * @param bitLength 書き込むビット数(1~64)
+     */
+    inline void StoreBits64(BitBlock *dst, const int bitOffset, const uint64_t bits, const int bitLength)
+    {
+        for (int i = 0; i < bitLength;)
+        {
+            const int blockIdx = GetBlockIndex(bitOffset + i);
+            const int bitShift = GetBitIndexInBlock(bitOffset + i);
+            const int numBits = std::min(BYTE_BIT_WIDTH - bitShift, bitLength - i);
+            const BitBlock mask = static_cast<BitBlock>(((1 << numBits) - 1) << bitShift);
+            const BitBlock newBits = static_cast<BitBlock>(((bits >> i) << bitShift) & mask);
+            dst[blockIdx] = (dst[blockIdx] & ~mask) | newBits;
+            i += numBits;
+        }
+    }
+
+    /**
+     * @brief -1/0/1を表すint8列同士の積和を計算する.
+     * 入力列はSIMD用にパディング済み(32byte単位)である必要がある.
+     * maddubsは符号なし×符号付きのため，xの絶対値とxの符号を移したwの積として計算する.
+     *
+     * @param x 入力列
+     * @param w 重み列
+     * @param length 列の長さ(32の倍数)
+     * @return int 積和
+     */
+    inline int MaddInt8(const int8_t *x, const int8_t *w, const int length)
+    {
+        return Kernels().maddInt8(x, w, length);
+    }
+
+    /**
+     * @brief float列にint8列のscale倍を加算する(dst += scale * src)
+     *
+     * @param dst 加算先のfloat列
+     * @param scale 係数
+     * @param src int8列
+     * @param length 列の長さ
+     */
+    inline void AddScaledInt8(float *dst, const float scale, const int8_t *src, const int length)
+    {
+        const float8 scale8 = _mm256_set1_ps(scale);
+        int i = 0;
+        for (; i + NUM_FLOAT_IN_REGISTER <= length; i += NUM_FLOAT_IN_REGISTER)
+        {
+            vector32 src32 = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const vector16 *)(src + i)));
+            float8 mul = _mm256_mul_ps(scale8, _mm256_cvtepi32_ps(src32));
+            _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), mul));
+        }
+        for (; i < length; i++)
+        {
+            dst[i] += scale * src[i];
+        }
+    }
+
+    /**
+     * @brief float列を[-1,1]にクリッピングし，符号を-1/1のint8列として書き出す
+     *
+     * @param weights クリッピング対象のfloat列（上書きされる）
+     * @param dst 符号の格納先
+     * @param length 列の長さ
+     */
+    inline void ClipAndSignInt8(float *weights, int8_t *dst, const int length)
+    {
+        const float8 zero = _mm256_setzero_ps();
+        const float8 plusOne = _mm256_set1_ps(1.0f);
+        const float8 minusOne = _mm256_set1_ps(-1.0f);
+        const vector32 one32 = _mm256_set1_epi32(1);
+        const vector32 two32 = _mm256_set1_epi32(2);
+        // packsによるレーン内インターリーブを元の順序に戻す
+        const vector32 laneOrder = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+        int i = 0;
+        for (; i + NUM_BYTES_IN_REGISTER <= length; i += NUM_BYTES_IN_REGISTER)
+        {
+            vector32 signs[4];
+            for (int k = 0; k < 4; k++)
+            {
+                float *w = weights + i + k * NUM_FLOAT_IN_REGISTER;
+                float8 clipped = _mm256_max_ps(minusOne, _mm256_min_ps(plusOne, _mm256_loadu_ps(w)));
+                _mm256_storeu_ps(w, clipped);
+                // 正なら(-1 & 2) - 1 = 1, それ以外は0 - 1 = -1
+                vector32 positive = _mm256_castps_si256(_mm256_cmp_ps(clipped, zero, _CMP_GT_OQ));
+                signs[k] = _mm256_sub_epi32(_mm256_and_si256(positive, two32), one32);
+            }
+            vector32 packed16a = _mm256_packs_epi32(signs[0], signs[1]);
+            vector32 packed16b = _mm256_packs_epi32(signs[2], signs[3]);
+            vector32 packed8 = _mm256_permutevar8x32_epi32(_mm256_packs_epi16(packed16a, packed16b), laneOrder);
+            _mm256_storeu_si256((vector32 *)(dst + i), packed8);
+        }
+        for (; i < length; i++)
+        {
+            const double tmp_w = std::max(-1.0, std::min(1.0, (double)weights[i]));
+            weights[i] = tmp_w;
+            dst[i] = (tmp_w > 0) ? 1 : -1;
+        }
+    }
+
+    /**
+     * @brief 1byte分(8要素)のfloatにビットに応じてplusかminusを加算する
+     */
+    inline void AddSignedGradByte(float *dst, const float8 plus, const float8 minus, const BitBlock bits)
+    {
+        const vector32 bitMask = _mm256_setr_epi32(1 << 0, 1 << 1, 1 << 2, 1 << 3, 1 << 4, 1 << 5, 1 << 6, 1 << 7);
+        // 1byteを8レーンに展開し，各レーンの担当ビットが立っているかを判定
+        const vector32 expanded = _mm256_and_si256(_mm256_set1_epi32(bits), bitMask);
+        const float8 isOne = _mm256_castsi256_ps(_mm256_cmpeq_epi32(expanded, bitMask));
+        const float8 diff = _mm256_blendv_ps(minus, plus, isOne);
+        _mm256_storeu_ps(dst, _mm256_add_ps(_mm256_loadu_ps(dst), diff));
+    }
+
+    /**
+     * @brief float列に入力ビットに応じた±gradを加算する(bitが1なら+grad, 0なら-grad)
+     *
+     * @param dst 加算先のfloat列
+     * @param grad 勾配
+     * @param bits 入力ビット列
+     * @param length 列の長さ(ビット数)
+     */
+    inline void AddSignedGrad(float *dst, const float grad, const BitBlock *bits, const int length)
+    {
+        const float8 plus = _mm256_set1_ps(grad);
+        const float8 minus = _mm256_set1_ps(-grad);
+        const int bodyLength = length / BYTE_BIT_WIDTH * BYTE_BIT_WIDTH;
+        for (int i = 0; i < bodyLength; i += BYTE_BIT_WIDTH)
+        {
+            AddSignedGradByte(dst + i, plus, minus, bits[GetBlockIndex(i)]);
+        }
+        for (int i = bodyLength; i < length; i++)
+        {
+            dst[i] += ((bits[GetBlockIndex(i)] >> GetBitIndexInBlock(i)) & 1) ? grad : -grad;
+        }
+    }
+
+    /**
+     * @brief AddSignedGradの長さをコンパイル時に決めた版（層の入力次元用）. 端数がなければ末尾のループを生成しない
+     */
+    template <int Length>
+    inline void AddSignedGrad(float *dst, const float grad, const BitBlock *bits)
+    {
+        const float8 plus = _mm256_set1_ps(grad);
+        const float8 minus = _mm256_set1_ps(-grad);
+        constexpr int BODY_LENGTH = Length / BYTE_BIT_WIDTH * BYTE_BIT_WIDTH;
+        for (int i = 0; i < BODY_LENGTH; i += BYTE_BIT_WIDTH)
+        {
+            AddSignedGradByte(dst + i, plus, minus, bits[i / BYTE_BIT_WIDTH]);
+        }
+        if constexpr (BODY_LENGTH != Length)
+        {
+            const BitBlock last = bits[BODY_LENGTH / BYTE_BIT_WIDTH];
+            for (int i = 0; i < Length - BODY_LENGTH; i++)
+            {
+                dst[BODY_LENGTH + i] += ((last >> i) & 1) ? grad : -grad;
+            }
+        }
+    }
+
+    constexpr int NUM_INT16_IN_REGISTER = 16;
+
+    /**
+     * @brief 2byte分(16要素)のint16にビットに応じてplusかminusを飽和加算する
+     */
+    inline void AddSignedGradInt16Word(int16_t *dst, const vector32 plus, const vector32 minus, const BitBlock *bits)
+    {
+        const vector32 bitMask = _mm256_setr_epi16(1 << 0, 1 << 1, 1 << 2, 1 << 3, 1 << 4, 1 << 5, 1 << 6, 1 << 7,
+                                                   1 << 8, 1 << 9, 1 << 10, 1 << 11, 1 << 12, 1 << 13, 1 << 14, static_cast<int16_t>(1 << 15));
+        // 2byteを16レーンに展開し，各レーンの担当ビットが立っているかを判定
+        uint16_t word;
+        memcpy(&word, bits, sizeof(word));
+        const vector32 expanded = _mm256_and_si256(_mm256_set1_epi16(static_cast<int16_t>(word)), bitMask);
+        const vector32 diff = _mm256_blendv_epi8(minus, plus, _mm256_cmpeq_epi16(expanded, bitMask));
+        _mm256_storeu_si256((vector32 *)dst, _mm256_adds_epi16(_mm256_loadu_si256((const vector32 *)dst), diff));
+    }
+
+    /**
+     * @brief int16列に入力ビットに応じた±gradを飽和加算する(bitが1なら+grad, 0なら-grad). 固定小数点学習用
+     *
+     * @param dst 加算先のint16列
+     * @param grad 勾配(-32767~32767)
+     * @param bits 入力ビット列
+     * @param length 列の長さ(ビット数)
+     */
+    inline void AddSignedGradInt16(int16_t *dst, const int16_t grad, const BitBlock *bits, const int length)
+    {
+        const vector32 plus = _mm256_set1_epi16(grad);
+        const vector32 minus = _mm256_set1_epi16(static_cast<int16_t>(-grad));
+        const int bodyLength = length / NUM_INT16_IN_REGISTER * NUM_INT16_IN_REGISTER;
+        for (int i = 0; i < bodyLength; i += NUM_INT16_IN_REGISTER)
         {
-            const int blockShift = b * NUM_BYTES_IN_REGISTER;
-            vector32 x = _mm256_load_si256((vector32 *)(inputs + blockShift));
+            AddSignedGradInt16Word(dst + i, plus, minus, bits + GetBlockIndex(i));
+        }
+        for (int i = bodyLength; i < length; i++)
+        {
+            const int diff = ((bits[GetBlockIndex(i)] >> GetBitIndexInBlock(i)) & 1) ? grad : -grad;
+            dst[i] = static_cast<int16_t>(std::max(-32768, std::min(32767, dst[i] + diff)));
+        }
+    }
+
+    /**
+     * @brief AddSignedGradInt16の長さをコンパイル時に決めた版（層の入力次元用）
+     */
+    template <int Length>
+    inline void AddSignedGradInt16(int16_t *dst, const int16_t grad, const BitBlock *bits)
+    {
+        const vector32 plus = _mm256_set1_epi16(grad);
+        const vector32 minus = _mm256_set1_epi16(static_cast<int16_t>(-grad));
+        constexpr int BODY_LENGTH = Length / NUM_INT16_IN_REGISTER * NUM_INT16_IN_REGISTER;
+        for (int i = 0; i < BODY_LENGTH; i += NUM_INT16_IN_REGISTER)
+        {
+            AddSignedGradInt16Word(dst + i, plus, minus, bits + i / BYTE_BIT_WIDTH);
+        }
+        if constexpr (BODY_LENGTH != Length)
+        {
+            for (int i = 0; i < Length - BODY_LENGTH; i++)
+            {
+                const int bit = BODY_LENGTH + i;
+                const int diff = ((bits[bit / BYTE_BIT_WIDTH] >> (bit % BYTE_BIT_WIDTH)) & 1) ? grad : -grad;
+                dst[bit] = static_cast<int16_t>(std::max(-32768, std::min(32767, dst[bit] + diff)));
+            }
+        }
+    }
 
-            // 要素が0のバイトの最上位ビットが1になるよう調整
-            vector32 zero = _mm256_setzero_si256();
-            x = _mm256_or_si256(x, _mm256_cmpeq_epi8(x, zero));
+    /**
+     * @brief int16列を[-limit,limit]にクリッピングし，正なら1となるビット列に詰める（ClipAndPackSignsの固定小数点版）.
+     * 末尾の端数ブロックのうちlength以降のビットは0になる.
+     *
+     * @param weights クリッピング対象のint16列（上書きされる）
+     * @param dst ビット列の格納先
+     * @param length 列の長さ
+     * @param limit 1.0に相当する値
+     * @return int 詰める前の値から変化したビットの数
+     */
+    inline int ClipAndPackSignsInt16(int16_t *weights, BitBlock *dst, const int length, const int16_t limit)
+    {
+        const vector32 zero = _mm256_setzero_si256();
+        const vector32 plusLimit = _mm256_set1_epi16(limit);
+        const vector32 minusLimit = _mm256_set1_epi16(static_cast<int16_t>(-limit));
+        int changed = 0;
+        int i = 0;
+        for (; i + NUM_INT16_IN_REGISTER <= length; i += NUM_INT16_IN_REGISTER)
+        {
+            vector32 w = _mm256_max_epi16(minusLimit, _mm256_min_epi16(plusLimit, _mm256_loadu_si256((const vector32 *)(weights + i))));
+            _mm256_storeu_si256((vector32 *)(weights + i), w);
+            // packsはレーン内で詰めるので，movemaskの0~7bitと16~23bitが各レーンの符号になる
+            const uint32_t mask = _mm256_movemask_epi8(_mm256_packs_epi16(_mm256_cmpgt_epi16(w, zero), zero));
+            const uint16_t packed = static_cast<uint16_t>((mask & 0xff) | ((mask >> 8) & 0xff00));
+            uint16_t before;
+            memcpy(&before, dst + GetBlockIndex(i), sizeof(before));
+            changed += _mm_popcnt_u32(packed ^ before);
+            memcpy(dst + GetBlockIndex(i), &packed, sizeof(packed));
+        }
+        for (; i < length; i += BYTE_BIT_WIDTH)
+        {
+            BitBlock packed = 0;
+            for (int k = 0; k < BYTE_BIT_WIDTH && i + k < length; k++)
+            {
+                const int16_t w = std::max<int16_t>(-limit, std::min<int16_t>(limit, weights[i + k]));
+                weights[i + k] = w;
+                packed |= static_cast<BitBlock>(w > 0) << k;
+            }
+            changed += _mm_popcnt_u32(static_cast<BitBlock>(packed ^ dst[GetBlockIndex(i)]));
+            dst[GetBlockIndex(i)] = packed;
+        }
+        return changed;
+    }
 
-            dst[b] = _mm256_movemask_epi8(~x);
+    /**
+     * @brief int16列をscale倍したfloat列に変換する
+     */
+    inline void ScaleInt16ToFloat(const int16_t *src, const float scale, float *dst, const int length)
+    {
+        const float8 scale8 = _mm256_set1_ps(scale);
+        int i = 0;
+        for (; i + NUM_FLOAT_IN_REGISTER <= length; i += NUM_FLOAT_IN_REGISTER)
+        {
+            vector32 src32 = _mm256_cvtepi16_epi32(_mm_loadu_si128((const vector16 *)(src + i)));
+            _mm256_storeu_ps(dst + i, _mm256_mul_ps(scale8, _mm256_cvtepi32_ps(src32)));
+        }
+        for (; i < length; i++)
+        {
+            dst[i] = scale * src[i];
+        }
+    }
+
+    /**
+     * @brief float列に3値重みに応じた±gradを加算する(符号ビットが1なら+grad, 0なら-grad, マスクが0なら加算しない)
+     *
+     * @param dst 加算先のfloat列
+     * @param grad 勾配
+     * @param signs 符号ビット列
+     * @param mask 非ゼロのビット列
+     * @param length 列の長さ(ビット数)
+     */
+    inline void AddTernaryGrad(float *dst, const float grad, const BitBlock *signs, const BitBlock *mask, const int length)
+    {
+        const float8 plus = _mm256_set1_ps(grad);
+        const float8 minus = _mm256_set1_ps(-grad);
+        const vector32 bitMask = _mm256_setr_epi32(1 << 0, 1 << 1, 1 << 2, 1 << 3, 1 << 4, 1 << 5, 1 << 6, 1 << 7);
+        int i = 0;
+        for (; i + BYTE_BIT_WIDTH <= length; i += BYTE_BIT_WIDTH)
+        {
+            vector32 expandedSigns = _mm256_and_si256(_mm256_set1_epi32(signs[GetBlockIndex(i)]), bitMask);
+            vector32 expandedMask = _mm256_and_si256(_mm256_set1_epi32(mask[GetBlockIndex(i)]), bitMask);
+            float8 isPlus = _mm256_castsi256_ps(_mm256_cmpeq_epi32(expandedSigns, bitMask));
+            float8 isNonZero = _mm256_castsi256_ps(_mm256_cmpeq_epi32(expandedMask, bitMask));
+            float8 diff = _mm256_and_ps(_mm256_blendv_ps(minus, plus, isPlus), isNonZero);
+            _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), diff));
+        }
+        for (; i < length; i++)
+        {
+            const int blockIdx = GetBlockIndex(i);
+            const int bitShift = GetBitIndexInBlock(i);
+            if ((mask[blockIdx] >> bitShift) & 1)
+            {
+                dst[i] += ((signs[blockIdx] >> bitShift) & 1) ? grad : -grad;
+            }
+        }
+    }
+
+    /**
+     * @brief float列を[-1,1]にクリッピングし，閾値で3値化して符号ビット列と非ゼロのビット列に詰める.
+     * w > thresholdなら+1(sign=1, mask=1)，w < -thresholdなら-1(sign=0, mask=1)，それ以外は0(sign=0, mask=0).
+     * 末尾の端数ブロックのうちlength以降のビットは0になる.
+     *
+     * @return int 詰める前の値から変化した3値重みの数
+     */
+    inline int ClipAndPackTernary(float *weights, BitBlock *signs, BitBlock *mask, const int length, const float threshold)
+    {
+        const float8 plusOne = _mm256_set1_ps(1.0f);
+        const float8 minusOne = _mm256_set1_ps(-1.0f);
+        const float8 plusThreshold = _mm256_set1_ps(threshold);
+        const float8 minusThreshold = _mm256_set1_ps(-threshold);
+        int changed = 0;
+        int i = 0;
+        for (; i + BYTE_BIT_WIDTH <= length; i += BYTE_BIT_WIDTH)
+        {
+            float8 clipped = _mm256_max_ps(minusOne, _mm256_min_ps(plusOne, _mm256_loadu_ps(weights + i)));
+            _mm256_storeu_ps(weights + i, clipped);
+            const BitBlock plus = static_cast<BitBlock>(_mm256_movemask_ps(_mm256_cmp_ps(clipped, plusThreshold, _CMP_GT_OQ)));
+            const BitBlock minus = static_cast<BitBlock>(_mm256_movemask_ps(_mm256_cmp_ps(clipped, minusThreshold, _CMP_LT_OQ)));
+            const int block = GetBlockIndex(i);
+            changed += _mm_popcnt_u64(static_cast<BitBlock>((plus ^ signs[block]) | ((plus | minus) ^ mask[block])));
+            signs[block] = plus;
+            mask[block] = plus | minus;
+        }
+        if (i < length)
+        {
+            BitBlock plus = 0, minus = 0;
+            for (int k = 0; i + k < length; k++)
+            {
+                const float w = std::max(-1.0f, std::min(1.0f, weights[i + k]));
+                weights[i + k] = w;
+                plus |= static_cast<BitBlock>(w > threshold) << k;
+                minus |= static_cast<BitBlock>(w < -threshold) << k;
+            }
+            const int block = GetBlockIndex(i);
+            changed += _mm_popcnt_u64(static_cast<BitBlock>((plus ^ signs[block]) | ((plus | minus) ^ mask[block])));
+            signs[block] = plus;
+            mask[block] = plus | minus;
+        }
+        return changed;
+    }
+
+    /**
+     * @brief float列を[-1,1]にクリッピングし，正なら1となるビット列に詰める.
+     * 末尾の端数ブロックのうちlength以降のビットは0になる.
+     *
+     * @param weights クリッピング対象のfloat列（上書きされる）
+     * @param dst ビット列の格納先
+     * @param length 列の長さ
+     * @return int 詰める前の値から変化したビットの数
+     */
+    inline int ClipAndPackSigns(float *weights, BitBlock *dst, const int length)
+    {
+        return Kernels().clipAndPackSigns(weights, dst, length);
+    }
+
+    /**
+     * @brief 列優先のint8行列から指定した列を集めて足し合わせる(dst[j] = Σ_k columns[indices[k] * stride + j])
+     *
+     * @param columns 列優先の行列（1列stride要素）
+     * @param stride 1列の要素数(32の倍数)
+     * @param indices 足し合わせる列の添字
+     * @param count 添字の数（int16で集計するため32767以下）
+     * @param dst 格納先 [stride]
+     */
+    inline void SumSparseColumns(const int8_t *columns, const int stride, const int32_t *indices, const int count, int32_t *dst)
+    {
+        for (int j = 0; j < stride; j += NUM_BYTES_IN_REGISTER)
+        {
+            // 32列分を2本のint16アキュムレータに広げて集計
+            vector32 accLow = _mm256_setzero_si256();
+            vector32 accHigh = _mm256_setzero_si256();
+            for (int k = 0; k < count; k++)
+            {
+                const vector32 column = _mm256_load_si256((const vector32 *)(columns + (size_t)indices[k] * stride + j));
+                accLow = _mm256_add_epi16(accLow, _mm256_cvtepi8_epi16(_mm256_castsi256_si128(column)));
+                accHigh = _mm256_add_epi16(accHigh, _mm256_cvtepi8_epi16(_mm256_extracti128_si256(column, 1)));
+            }
+            _mm256_storeu_si256((vector32 *)(dst + j), _mm256_cvtepi16_epi32(_mm256_castsi256_si128(accLow)));
+            _mm256_storeu_si256((vector32 *)(dst + j + 8), _mm256_cvtepi16_epi32(_mm256_extracti128_si256(accLow, 1)));
+            _mm256_storeu_si256((vector32 *)(dst + j + 16), _mm256_cvtepi16_epi32(_mm256_castsi256_si128(accHigh)));
+            _mm256_storeu_si256((vector32 *)(dst + j + 24), _mm256_cvtepi16_epi32(_mm256_extracti128_si256(accHigh, 1)));
+        }
+    }
+
+    /**
+     * @brief 8要素のexp. 2^n * exp(r) (|r| <= ln2/2)に分解し，exp(r)を多項式で近似する（相対誤差 約2e-7）
+     * 入力は[-87, 88]にクランプする.
+     */
+    inline float8 Exp8(float8 x)
+    {
+        x = _mm256_min_ps(_mm256_set1_ps(88.0f), _mm256_max_ps(_mm256_set1_ps(-87.0f), x));
+        const float8 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        // r = x - n * ln2 (ln2を上位・下位に分けて誤差を抑える)
+        float8 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+        r = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), r);
+
+        float8 p = _mm256_set1_ps(1.9875691500e-4f);
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+        p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+
+        // 2^nを指数部に直接組み立てる
+        const vector32 pow2n = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+        return _mm256_mul_ps(p, _mm256_castsi256_ps(pow2n));
+    }
+
+    /**
+     * @brief 8要素の水平方向の和
+     */
+    inline float HorizontalSum8(float8 x)
+    {
+        float4 sum = _mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+        return _mm_cvtss_f32(sum);
+    }
+
+    /**
+     * @brief 64bit値の攪拌（MurmurHash3の最終処理）
+     */
+    inline uint64_t Mix64(uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    /**
+     * @brief ビット列のハッシュ値. 32バイトずつ，鍵とXORした値の上下32bitの積を64bitレーンに足し込む（xxh3風）.
+     * 鍵はブロックごとにずらすので，ブロックを入れ替えた入力は別の値になる
+     */
+    inline uint64_t HashBits(const BitBlock *bits, const int numBlocks)
+    {
+        vector32 key = _mm256_set_epi64x(0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x7e9e5d9f3c3e4e4bULL, 0xbe4ba423396cfeb8ULL);
+        const vector32 keyStep = _mm256_set1_epi64x(0x9e3779b97f4a7c15ULL);
+        vector32 acc = _mm256_set_epi64x(0x165667b19e3779f9ULL, 0x85ebca77c2b2ae63ULL, 0x27d4eb2f165667c5ULL, 0x9e3779b185ebca87ULL);
+
+        int block = 0;
+        for (; block + 32 <= numBlocks; block += 32)
+        {
+            const vector32 data = _mm256_loadu_si256(reinterpret_cast<const vector32 *>(&bits[block]));
+            const vector32 mixed = _mm256_xor_si256(data, key);
+            const vector32 product = _mm256_mul_epu32(mixed, _mm256_srli_epi64(mixed, 32));
+            acc = _mm256_add_epi64(acc, _mm256_add_epi64(product, _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2))));
+            key = _mm256_add_epi64(key, keyStep);
+        }
+
+        alignas(32) uint64_t lanes[4];
+        _mm256_store_si256(reinterpret_cast<vector32 *>(lanes), acc);
+        uint64_t h = static_cast<uint64_t>(numBlocks) * 0x9e3779b97f4a7c15ULL;
+        for (int i = 0; i < 4; i++)
+        {
+            h = Mix64(h ^ lanes[i]) + 0x85ebca77c2b2ae63ULL;
+        }
+        // 32バイトに満たない残り（パディング後は8バイト単位）
+        for (; block < numBlocks; block += 8)
+        {
+            uint64_t word = 0;
+            memcpy(&word, &bits[block], std::min(8, numBlocks - block));
+            h = Mix64(h ^ word) + 0x27d4eb2f165667c5ULL;
         }
+        return Mix64(h);
     }
 }
 
@@ -0,0 +1,147 @@
+﻿/**
+ * @file latency_histogram.h
+ * @author Daichi Sato
+ * @brief レイテンシ分布を記録する対数バケットのヒストグラム
+ * @version 0.1
+ * @date 2021-12-16
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * 値(ns)を2のべき乗ごとに32分割したバケットで数える（相対誤差は約3%以内）。
+ * 記録はロックフリーで，複数スレッドから同時に呼んでよい。
+ *
+ */
+
+#ifndef LATENCY_HISTOGRAM_H_INCLUDED_
+#define LATENCY_HISTOGRAM_H_INCLUDED_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include "bit_helper.h"
+
+namespace bitnet
+{
+    class LatencyHistogram
+    {
+        // 2のべき乗区間あたりのバケット数
+        static constexpr int SUB_BUCKET_BITS = 5;
+        static constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+        // [0, 2 * SUB_BUCKETS)は1ns刻みでそのまま数える
+        static constexpr int LINEAR_BUCKETS = 2 * SUB_BUCKETS;
+        static constexpr int NUM_BUCKETS = LINEAR_BUCKETS + (64 - SUB_BUCKET_BITS - 1) * SUB_BUCKETS;
+
+        std::atomic<uint64_t> _counts[NUM_BUCKETS] = {};
+        std::atomic<uint64_t> _total{0};
+        std::atomic<uint64_t> _max{0};
+
+        static int BucketIndex(uint64_t ns)
+        {
+            if (ns < LINEAR_BUCKETS)
+            {
+                return static_cast<int>(ns);
+            }
+            const int msb = 63 - CountLeadingZeros64(ns);
+            const int shift = msb - SUB_BUCKET_BITS;
+            const int sub = static_cast<int>(ns >> shift) - SUB_BUCKETS;
+            return LINEAR_BUCKETS + (msb - SUB_BUCKET_BITS - 1) * SUB_BUCKETS + sub;
+        }
+
+        // バケットに入る最大値
+        static uint64_t BucketUpperBound(int index)
+        {
+            if (index < LINEAR_BUCKETS)
+            {
+                return index;
+            }
+            const int msb = (index - LINEAR_BUCKETS) / SUB_BUCKETS + SUB_BUCKET_BITS + 1;
+            const uint64_t top = (index - LINEAR_BUCKETS) % SUB_BUCKETS + SUB_BUCKETS;
+            return ((top + 1) << (msb - SUB_BUCKET_BITS)) - 1;
+        }
+
+    public:
+        void Record(uint64_t ns)
+        {
+            _counts[BucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+            _total.fetch_add(1, std::memory_order_relaxed);
+            uint64_t max = _max.load(std::memory_order_relaxed);
+            while (ns > max && !_max.compare_exchange_weak(max, ns, std::memory_order_relaxed))
+            {
+            }
+        }
+
+        void Record(std::chrono::nanoseconds duration)
+        {
+            Record(static_cast<uint64_t>(std::max<int64_t>(0, duration.count())));
+        }
+
+        void Merge(const LatencyHistogram &other)
+        {
+            for (int i = 0; i < NUM_BUCKETS; i++)
+            {
+                _counts[i].fetch_add(other._counts[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            }
+            _total.fetch_add(other._total.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            uint64_t max = _max.load(std::memory_order_relaxed);
+            const uint64_t otherMax = other.Max();
+            while (otherMax > max && !_max.compare_exchange_weak(max, otherMax, std::memory_order_relaxed))
+            {
+            }
+        }
+
+        uint64_t Count() const
+        {
+            return _total.load(std::memory_order_relaxed);
+        }
+
+        uint64_t Max() const
+        {
+            return _max.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief 分位点(ns)。値が属するバケットの上限を返す
+         *
+         * @param quantile 0~1
+         */
+        uint64_t Percentile(double quantile) const
+        {
+            const uint64_t total = Count();
+            if (total == 0)
+            {
+                return 0;
+            }
+            const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(quantile * total)));
+            uint64_t seen = 0;
+            for (int i = 0; i < NUM_BUCKETS; i++)
+            {
+                seen += _counts[i].load(std::memory_order_relaxed);
+                if (seen >= rank)
+                {
+                    return std::min(BucketUpperBound(i), Max());
+                }
+            }
+            return Max();
+        }
+
+        /**
+         * @brief 件数とp50/p99/p999/maxをマイクロ秒で表した文字列
+         */
+        std::string Summary() const
+        {
+            std::ostringstream ss;
+            ss << "count=" << Count()
+               << " p50=" << Percentile(0.5) / 1000.0 << "us"
+               << " p99=" << Percentile(0.99) / 1000.0 << "us"
+               << " p999=" << Percentile(0.999) / 1000.0 << "us"
+               << " max=" << Max() / 1000.0 << "us";
+            return ss.str();
+        }
+    };
+}
+
+#endif
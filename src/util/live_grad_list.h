@@ -0,0 +1,92 @@
+﻿/**
+ * @file live_grad_list.h
+ * @author Daichi Sato
+ * @brief 勾配が流れる(サンプル, ニューロン)の組のリスト
+ * @version 0.1
+ * @date 2021-12-10
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * hard-tanhの微分で勾配が0にならなかった組だけをサンプルごとに詰めて保持する。
+ * 後段が飽和しているほど，前の層の逆伝播で走査する行が減る。
+ *
+ */
+
+#ifndef LIVE_GRAD_LIST_H_INCLUDED_
+#define LIVE_GRAD_LIST_H_INCLUDED_
+
+#include <cstdint>
+#include "../net_common.h"
+#include "bit_helper.h"
+
+namespace bitnet
+{
+    /**
+     * @brief サンプルごとの生きているニューロン番号のリスト（CSR形式）
+     *
+     * @tparam Dim ニューロン数
+     */
+    template <int Dim>
+    class LiveGradList
+    {
+        // サンプルbのニューロン番号は_neurons[_begin[b]] ~ _neurons[_begin[b + 1] - 1]
+        int _begin[BATCH_SIZE + 1] = {0};
+        int _neurons[BATCH_SIZE * Dim];
+
+    public:
+        /**
+         * @brief 値が[-1,1]に収まる（hard-tanhの勾配が1となる）入力のニューロン番号を集める
+         *
+         * @param inputs 入力列 [BATCH_SIZE][stride]
+         * @param stride 1サンプル分の入力列の長さ(32の倍数)
+         */
+        void CollectUnsaturated(const int8_t *inputs, const int stride)
+        {
+            const vector32 lower = _mm256_set1_epi8(-2);
+            const vector32 upper = _mm256_set1_epi8(2);
+            int count = 0;
+            for (int b = 0; b < BATCH_SIZE; b++)
+            {
+                _begin[b] = count;
+                const int8_t *x = inputs + b * stride;
+                for (int i = 0; i < Dim; i += NUM_BYTES_IN_REGISTER)
+                {
+                    vector32 v = _mm256_loadu_si256((const vector32 *)(x + i));
+                    vector32 inRange = _mm256_and_si256(_mm256_cmpgt_epi8(v, lower), _mm256_cmpgt_epi8(upper, v));
+                    uint64_t live = static_cast<uint32_t>(_mm256_movemask_epi8(inRange));
+                    // パディング部分は除外
+                    if (Dim - i < NUM_BYTES_IN_REGISTER)
+                    {
+                        live &= (1ull << (Dim - i)) - 1;
+                    }
+                    while (live)
+                    {
+                        _neurons[count++] = i + CountTrailingZeros64(live);
+                        live &= live - 1;
+                    }
+                }
+            }
+            _begin[BATCH_SIZE] = count;
+        }
+
+        const int *Begin(int b) const
+        {
+            return &_neurons[_begin[b]];
+        }
+
+        const int *End(int b) const
+        {
+            return &_neurons[_begin[b + 1]];
+        }
+
+        /**
+         * @brief バッチ全体の組の数
+         */
+        int Size() const
+        {
+            return _begin[BATCH_SIZE];
+        }
+    };
+}
+
+#endif
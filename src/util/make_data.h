@@ -10,7 +10,7 @@ namespace bitnet
 {
 	namespace util
 	{
-		void BinarizeInputData(int batchSize, int numData, const int8_t *inputData, BitBlock *binDataOut)
+		inline void BinarizeInputData(int batchSize, int numData, const int8_t *inputData, BitBlock *binDataOut)
 		{
 			const int padded_blocks = BitToBlockCount(AddPaddingToBitSize(numData));
 
@@ -26,20 +26,11 @@ namespace bitnet
 
 			for (int b = 0; b < batchSize; b++)
 			{
-				const int batchShiftIn = b * numData;
-				const int batchShiftBlock = b * padded_blocks;
-				for (int i = 0; i < numData; i++)
-				{
-					int blockIdx = GetBlockIndex(i);
-					int bitShift = GetBitIndexInBlock(i);
-					uint8_t bit = inputData[batchShiftIn + i] > 0 ? 1 : 0;
-
-					binDataOut[batchShiftBlock + blockIdx] |= bit << bitShift;
-				}
+				PackPositiveBits(&inputData[b * numData], &binDataOut[b * padded_blocks], numData);
 			}
 		}
 
-		void MakeXORBatch(int batchSize, double tScale, int8_t *inputData, int8_t *teacherData)
+		inline void MakeXORBatch(int batchSize, double tScale, int8_t *inputData, int8_t *teacherData)
 		{
 			constexpr int INPUT_SIZE = 2;
 			for (int b = 0; b < batchSize; b++)
@@ -57,7 +48,7 @@ namespace bitnet
 			}
 		}
 
-		void MakePopBatch(int batchSize, double tScale, int8_t *inputData, int8_t *teacherData)
+		inline void MakePopBatch(int batchSize, double tScale, int8_t *inputData, int8_t *teacherData)
 		{
 			constexpr int INPUT_SIZE = 8;
 			for (int b = 0; b < batchSize; b++)
@@ -90,7 +81,7 @@ namespace bitnet
 	 * @param mae 絶対値平均誤差出力
 	 * @return double 
 	 */
-		double CalcSquaredError(int batchSize, int predSize, double tScale, double lr, const int32_t *predData, const int8_t *teacherData, float *diffOuts, double *maeOut)
+		inline double CalcSquaredError(int batchSize, int predSize, double tScale, double lr, const int32_t *predData, const int8_t *teacherData, float *diffOuts, double *maeOut)
 		{
 			double totalLoss = 0;
 			double totalAE = 0;
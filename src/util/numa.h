@@ -0,0 +1,193 @@
+﻿/**
+ * @file numa.h
+ * @author Daichi Sato
+ * @brief NUMAノードの列挙・ノードローカルなメモリ確保・スレッドのコア固定
+ * @version 0.1
+ * @date 2021-12-14
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * libnumaには依存せず，Linuxではsysfsとシステムコールを直接使う。
+ * それ以外の環境では全CPUを持つノード1つとして振る舞い，固定やノード指定は行わない。
+ *
+ */
+
+#ifndef NUMA_H_INCLUDED_
+#define NUMA_H_INCLUDED_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace bitnet
+{
+    namespace numa
+    {
+        struct Node
+        {
+            int id;
+            std::vector<int> cpus;
+        };
+
+        /**
+         * @brief sysfsのcpulist形式("0-3,8,10-11")を解釈する
+         */
+        inline std::vector<int> ParseCpuList(const std::string &list)
+        {
+            std::vector<int> cpus;
+            std::stringstream ss(list);
+            std::string range;
+            while (std::getline(ss, range, ','))
+            {
+                if (range.empty() || range == "\n")
+                {
+                    continue;
+                }
+                const size_t dash = range.find('-');
+                const int first = std::stoi(range.substr(0, dash));
+                const int last = (dash == std::string::npos) ? first : std::stoi(range.substr(dash + 1));
+                for (int cpu = first; cpu <= last; cpu++)
+                {
+                    cpus.push_back(cpu);
+                }
+            }
+            return cpus;
+        }
+
+        /**
+         * @brief CPUを持つNUMAノードを列挙する（取得できなければ全CPUを持つノード0のみ）
+         */
+        inline std::vector<Node> GetNodes()
+        {
+            std::vector<Node> nodes;
+#ifdef __linux__
+            std::ifstream online("/sys/devices/system/node/online");
+            std::string onlineList;
+            if (online && std::getline(online, onlineList))
+            {
+                for (int id : ParseCpuList(onlineList))
+                {
+                    std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+                    std::string list;
+                    if (cpulist && std::getline(cpulist, list))
+                    {
+                        std::vector<int> cpus = ParseCpuList(list);
+                        if (!cpus.empty())
+                        {
+                            nodes.push_back({id, cpus});
+                        }
+                    }
+                }
+            }
+#endif
+            if (nodes.empty())
+            {
+                Node node{0, {}};
+                const int numCpus = std::max(1u, std::thread::hardware_concurrency());
+                for (int cpu = 0; cpu < numCpus; cpu++)
+                {
+                    node.cpus.push_back(cpu);
+                }
+                nodes.push_back(node);
+            }
+            return nodes;
+        }
+
+        /**
+         * @brief 呼び出したスレッドを指定したCPU群に固定する
+         * @return 固定できたらtrue
+         */
+        inline bool PinCurrentThread(const std::vector<int> &cpus)
+        {
+#ifdef __linux__
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int cpu : cpus)
+            {
+                CPU_SET(cpu, &set);
+            }
+            return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+            return false;
+#endif
+        }
+
+        /**
+         * @brief 呼び出したスレッドが現在動いているCPU（取得できなければ-1）
+         */
+        inline int CurrentCpu()
+        {
+#ifdef __linux__
+            return sched_getcpu();
+#else
+            return -1;
+#endif
+        }
+
+        /**
+         * @brief 指定したノードのメモリを優先して確保する（ページ境界に整列）.
+         * Linuxではmmapした領域にmbind(MPOL_PREFERRED)を設定する。
+         * ポリシーを設定できなかった場合（boundがfalse）はページは最初に書き込んだスレッドのノードに載るので，
+         * 呼び出し側はそのノードに固定したスレッドで初期化すること。
+         *
+         * @param bound ポリシーを設定できたか（nullptrなら返さない）
+         */
+        inline void *AllocOnNode(size_t bytes, int node, bool *bound = nullptr)
+        {
+            bool applied = false;
+#ifdef __linux__
+            void *ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (ptr == MAP_FAILED)
+            {
+                throw std::bad_alloc();
+            }
+#ifdef SYS_mbind
+            constexpr int MPOL_PREFERRED_ = 1;
+            constexpr int MAX_NODES = 1024;
+            if (node >= 0 && node < MAX_NODES)
+            {
+                unsigned long nodeMask[MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+                nodeMask[node / (8 * sizeof(unsigned long))] = 1ul << (node % (8 * sizeof(unsigned long)));
+                applied = syscall(SYS_mbind, ptr, bytes, MPOL_PREFERRED_, nodeMask, MAX_NODES, 0) == 0;
+            }
+#endif
+            if (bound != nullptr)
+            {
+                *bound = applied;
+            }
+            return ptr;
+#else
+            if (bound != nullptr)
+            {
+                *bound = applied;
+            }
+            return ::operator new(bytes, std::align_val_t(64));
+#endif
+        }
+
+        inline void FreeOnNode(void *ptr, size_t bytes)
+        {
+#ifdef __linux__
+            munmap(ptr, bytes);
+#else
+            ::operator delete(ptr, std::align_val_t(64));
+#endif
+        }
+    }
+}
+
+#endif
@@ -6,5 +6,6 @@ namespace Random
     std::random_device rnd;
     std::mt19937 mt(rnd());
     std::uniform_real_distribution<double> rnd_prob01(0.0, 1.0);
+    thread_local std::mt19937 *engine = nullptr;
 
 }
\ No newline at end of file
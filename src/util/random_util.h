@@ -8,6 +8,35 @@ namespace Random
 	extern std::random_device rnd;
 	extern std::mt19937 mt;
 	extern std::uniform_real_distribution<double> rnd_prob01;
+	// このスレッドで使う生成器（nullptrなら全スレッド共有のmt）. ScopedEngineで切り替える
+	extern thread_local std::mt19937 *engine;
+
+	/**
+	 * @brief 並行して学習するスレッドが，スコープの間だけ自分専用の生成器を使うように切り替える
+	 */
+	class ScopedEngine
+	{
+		std::mt19937 *_previous;
+
+	public:
+		explicit ScopedEngine(std::mt19937 &rng) : _previous(engine)
+		{
+			engine = &rng;
+		}
+
+		~ScopedEngine()
+		{
+			engine = _previous;
+		}
+
+		ScopedEngine(const ScopedEngine &) = delete;
+		ScopedEngine &operator=(const ScopedEngine &) = delete;
+	};
+
+	inline std::mt19937 &Engine()
+	{
+		return engine != nullptr ? *engine : mt;
+	}
 
 	inline void Seed(int seed)
 	{
@@ -17,12 +46,12 @@ namespace Random
 	// [0~1)の実数乱数を取得
 	inline double GetReal01()
 	{
-		return Random::rnd_prob01(Random::mt);
+		return Random::rnd_prob01(Engine());
 	}
 
 	inline uint32_t GetUInt()
 	{
-		return Random::mt();
+		return Engine()();
 	}
 }
 
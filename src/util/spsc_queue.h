@@ -0,0 +1,84 @@
+﻿/**
+ * @file spsc_queue.h
+ * @author Daichi Sato
+ * @brief 単一生産者・単一消費者の有界キュー
+ * @version 0.1
+ * @date 2021-12-12
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * 要素はあらかじめ確保したスロットに直接書き込み/読み出しし，コピーやメモリ確保を行わない。
+ *
+ */
+
+#ifndef SPSC_QUEUE_H_INCLUDED_
+#define SPSC_QUEUE_H_INCLUDED_
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace bitnet
+{
+    template <typename T>
+    class SpscQueue
+    {
+        // 生産者と消費者のカーソルを別のキャッシュラインに置く
+        alignas(64) std::atomic<size_t> _head{0};
+        alignas(64) std::atomic<size_t> _tail{0};
+        std::vector<T> _slots;
+
+    public:
+        /**
+         * @param capacity 同時に保持できる要素数
+         * @param prototype 各スロットの初期値（バッファの大きさを決める）
+         */
+        SpscQueue(size_t capacity, const T &prototype) : _slots(capacity, prototype)
+        {
+        }
+
+        /**
+         * @brief 空きスロットができるまで待ち，書き込み先を返す（生産者側）
+         */
+        T &BeginPush()
+        {
+            const size_t tail = _tail.load(std::memory_order_relaxed);
+            while (tail - _head.load(std::memory_order_acquire) == _slots.size())
+            {
+                std::this_thread::yield();
+            }
+            return _slots[tail % _slots.size()];
+        }
+
+        /**
+         * @brief BeginPushで得たスロットへの書き込みを公開する
+         */
+        void EndPush()
+        {
+            _tail.store(_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        /**
+         * @brief 要素が届くまで待ち，先頭の要素を返す（消費者側）
+         */
+        T &BeginPop()
+        {
+            const size_t head = _head.load(std::memory_order_relaxed);
+            while (_tail.load(std::memory_order_acquire) == head)
+            {
+                std::this_thread::yield();
+            }
+            return _slots[head % _slots.size()];
+        }
+
+        /**
+         * @brief BeginPopで得たスロットを解放する
+         */
+        void EndPop()
+        {
+            _head.store(_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+    };
+}
+
+#endif
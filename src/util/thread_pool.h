@@ -0,0 +1,165 @@
+﻿/**
+ * @file thread_pool.h
+ * @author Daichi Sato
+ * @brief 固定数のワーカースレッドでインデックス範囲を並列に処理するスレッドプール
+ * @version 0.1
+ * @date 2021-12-16
+ *
+ * @copyright Copyright (c) 2021 Daichi Sato
+ *
+ * ParallelForは呼び出し元のスレッドも処理に加わり，すべてのインデックスが終わるまで戻らない。
+ * インデックスは1つずつ取り出すので，処理時間がばらついても負荷が偏らない。
+ *
+ */
+
+#ifndef THREAD_POOL_H_INCLUDED_
+#define THREAD_POOL_H_INCLUDED_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace bitnet
+{
+    class ThreadPool
+    {
+    private:
+        std::vector<std::thread> _workers;
+        std::mutex _mutex;
+        std::condition_variable _wake;
+        std::condition_variable _done;
+        bool _stopping = false;
+
+        // 実行中のジョブ
+        const std::function<void(int)> *_job = nullptr;
+        int _jobSize = 0;
+        uint64_t _generation = 0;
+        std::atomic<int> _next{0};
+        int _activeWorkers = 0;
+        std::exception_ptr _error;
+
+        void RunIndices(const std::function<void(int)> &job, int n)
+        {
+            for (int i = _next.fetch_add(1); i < n; i = _next.fetch_add(1))
+            {
+                try
+                {
+                    job(i);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    if (!_error)
+                    {
+                        _error = std::current_exception();
+                    }
+                }
+            }
+        }
+
+        void RunWorker()
+        {
+            uint64_t seen = 0;
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (true)
+            {
+                _wake.wait(lock, [&]
+                           { return _stopping || _generation != seen; });
+                if (_stopping)
+                {
+                    return;
+                }
+                seen = _generation;
+                if (_job == nullptr)
+                {
+                    // 起床する前にジョブが終わっていた
+                    continue;
+                }
+                const std::function<void(int)> *job = _job;
+                const int n = _jobSize;
+                ++_activeWorkers;
+                lock.unlock();
+
+                RunIndices(*job, n);
+
+                lock.lock();
+                if (--_activeWorkers == 0)
+                {
+                    _done.notify_all();
+                }
+            }
+        }
+
+    public:
+        /**
+         * @param numThreads 呼び出し元を含めたスレッド数. 0ならハードウェアのスレッド数
+         */
+        explicit ThreadPool(int numThreads = 0)
+        {
+            if (numThreads <= 0)
+            {
+                numThreads = std::max(1u, std::thread::hardware_concurrency());
+            }
+            for (int t = 1; t < numThreads; t++)
+            {
+                _workers.emplace_back(&ThreadPool::RunWorker, this);
+            }
+        }
+
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stopping = true;
+            }
+            _wake.notify_all();
+            for (auto &worker : _workers)
+            {
+                worker.join();
+            }
+        }
+
+        ThreadPool(const ThreadPool &) = delete;
+        ThreadPool &operator=(const ThreadPool &) = delete;
+
+        int Size() const
+        {
+            return static_cast<int>(_workers.size()) + 1;
+        }
+
+        /**
+         * @brief job(0)~job(n-1)を並列に実行する. 例外は最初の1つを呼び出し元に投げ直す
+         */
+        void ParallelFor(int n, const std::function<void(int)> &job)
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _job = &job;
+                _jobSize = n;
+                _next = 0;
+                _error = nullptr;
+                ++_generation;
+            }
+            _wake.notify_all();
+
+            RunIndices(job, n);
+
+            std::unique_lock<std::mutex> lock(_mutex);
+            _done.wait(lock, [&]
+                       { return _activeWorkers == 0; });
+            // 起床が遅れたワーカーが次のジョブと取り違えないよう，ここで無効にする
+            _job = nullptr;
+            if (_error)
+            {
+                std::rethrow_exception(_error);
+            }
+        }
+    };
+}
+
+#endif
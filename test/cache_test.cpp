@@ -0,0 +1,108 @@
+﻿#include <gtest/gtest.h>
+
+#include "../src/inference/inference_cache.h"
+#include "../src/util/random_util.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    using namespace bitnet;
+    constexpr int inputBlocks = 40;
+    constexpr int outputDim = 5;
+    using Cache = InferenceCache<inputBlocks, int32_t, outputDim>;
+
+    // 入力から決まる出力（キャッシュが別の入力の結果を返せば一致しない）
+    void ExpectedOutput(const BitBlock *input, int32_t *output)
+    {
+        for (int i = 0; i < outputDim; i++)
+        {
+            output[i] = input[i] * 1000 + input[inputBlocks - 1 - i];
+        }
+    }
+
+    void MakeInput(uint32_t key, BitBlock *input)
+    {
+        memset(input, 0, inputBlocks);
+        memcpy(input, &key, sizeof(key));
+        input[inputBlocks - 1] = static_cast<BitBlock>(key * 7);
+    }
+}
+
+TEST(Cache, HashDependsOnEveryBlock)
+{
+    BitBlock input[inputBlocks] = {};
+    const uint64_t base = HashBits(input, inputBlocks);
+    for (int i = 0; i < inputBlocks; i++)
+    {
+        input[i] = 1;
+        EXPECT_NE(HashBits(input, inputBlocks), base) << "block " << i;
+        input[i] = 0;
+    }
+    EXPECT_EQ(HashBits(input, inputBlocks), base);
+}
+
+TEST(Cache, LookupInsertAndInvalidate)
+{
+    Cache cache(64);
+    BitBlock input[inputBlocks];
+    int32_t expected[outputDim], output[outputDim];
+    MakeInput(123, input);
+    ExpectedOutput(input, expected);
+
+    EXPECT_FALSE(cache.Lookup(input, output));
+    cache.Insert(input, expected, cache.Generation());
+    ASSERT_TRUE(cache.Lookup(input, output));
+    EXPECT_EQ(std::vector<int32_t>(output, output + outputDim), std::vector<int32_t>(expected, expected + outputDim));
+
+    // 重みを変えた後は当たらない
+    const uint32_t before = cache.Generation();
+    cache.Invalidate();
+    EXPECT_FALSE(cache.Lookup(input, output));
+    // 無効化前に始めた推論の結果は登録されない
+    cache.Insert(input, expected, before);
+    EXPECT_FALSE(cache.Lookup(input, output));
+    cache.Insert(input, expected, cache.Generation());
+    EXPECT_TRUE(cache.Lookup(input, output));
+
+    EXPECT_EQ(cache.Hits(), 2u);
+    EXPECT_EQ(cache.Misses(), 3u);
+}
+
+TEST(Cache, ConcurrentReadersNeverSeeTornEntries)
+{
+    // 表の容量(16)より多い入力を奪い合わせ，追い出しと命中の両方を起こす
+    Cache cache(16);
+    constexpr int numThreads = 4;
+    constexpr int numKeys = 24;
+    std::atomic<int> wrong{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; t++)
+    {
+        threads.emplace_back([&, t]
+                             {
+                                 BitBlock input[inputBlocks];
+                                 int32_t expected[outputDim], output[outputDim];
+                                 for (int i = 0; i < 20000; i++)
+                                 {
+                                     MakeInput((i + t * 5) % numKeys, input);
+                                     ExpectedOutput(input, expected);
+                                     if (cache.Lookup(input, output))
+                                     {
+                                         wrong += memcmp(output, expected, sizeof(output)) != 0;
+                                     }
+                                     else
+                                     {
+                                         cache.Insert(input, expected, cache.Generation());
+                                     }
+                                 } });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    EXPECT_EQ(wrong.load(), 0);
+    EXPECT_EQ(cache.Hits() + cache.Misses(), (uint64_t)numThreads * 20000);
+    EXPECT_GT(cache.Hits(), 0u);
+}
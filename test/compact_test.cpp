@@ -0,0 +1,127 @@
+﻿#include <gtest/gtest.h>
+
+#include "../src/inference/compact_net.h"
+#include "../src/inference/neuron_pruner.h"
+#include "../src/layers/layers.h"
+#include "../src/train.h"
+#include "../src/util/make_data.h"
+#include "../src/util/random_util.h"
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+    using namespace bitnet;
+
+    template <typename Net_t>
+    std::unique_ptr<Net_t> MakeNet()
+    {
+        std::unique_ptr<Net_t> net(new Net_t());
+        net->Init();
+        net->ResetWeight();
+        return net;
+    }
+
+    // 校正用データのすべてで縮めたモデルが元のネットワークと同じ出力を返すことを確かめる
+    template <typename Net_t>
+    void ExpectSameOnCalibration(Net_t &net, CompactNet &compact, const std::vector<BitBlock> &inputs, int inputBlocks)
+    {
+        const int numSamples = static_cast<int>(inputs.size()) / inputBlocks;
+        for (int s = 0; s < numSamples; s++)
+        {
+            const int32_t *expected = net.Forward(&inputs[s * inputBlocks]);
+            const int32_t *actual = compact.Forward(&inputs[s * inputBlocks]);
+            ASSERT_EQ(std::vector<int32_t>(actual, actual + Net_t::COMPRESS_OUT_DIM),
+                      std::vector<int32_t>(expected, expected + Net_t::COMPRESS_OUT_DIM))
+                << "sample " << s;
+        }
+    }
+}
+
+// 入力が2ビットなら隠れ層の出力は4通りしかないので，ほとんどのニューロンが定数・重複・反転になる
+TEST(Compact, PruneXorNetwork)
+{
+    constexpr int inputBlocks = NeuronPruner<BitNetwork>::INPUT_BLOCKS;
+    constexpr double scale = 16;
+    Random::Seed(42);
+    auto net = MakeNet<BitNetwork>();
+    int8_t inputData[BATCH_SIZE * 2];
+    int8_t teacherData[BATCH_SIZE];
+    alignas(32) BitBlock batch[BATCH_SIZE * inputBlocks];
+    GradientType grads[BATCH_SIZE];
+    for (int step = 0; step < 200; step++)
+    {
+        util::MakeXORBatch(BATCH_SIZE, scale, inputData, teacherData);
+        util::BinarizeInputData(BATCH_SIZE, 2, inputData, batch);
+        const int32_t *pred = net->TrainForward(batch);
+        double mae;
+        util::CalcSquaredError(BATCH_SIZE, 1, scale, 0.0001, pred, teacherData, grads, &mae);
+        net->TrainBackward(grads);
+    }
+
+    std::vector<BitBlock> calibration(4 * inputBlocks, 0);
+    for (int x = 0; x < 4; x++)
+    {
+        calibration[x * inputBlocks] = static_cast<BitBlock>(x);
+    }
+    NeuronPruner<BitNetwork> pruner(*net);
+    PruneReport report;
+    CompactNet compact = pruner.Prune(calibration.data(), 4, &report);
+    ASSERT_EQ(report.hidden.size(), 3u);
+    for (const PruneReport::Layer &layer : report.hidden)
+    {
+        // 4サンプルで区別できる出力のパターンは定数を除いて2^4 / 2 - 1 = 7通り
+        EXPECT_LE(layer.kept, 7) << report.Summary();
+        EXPECT_EQ(layer.neurons, layer.constant + layer.duplicate + layer.complement + layer.dead + layer.kept);
+    }
+    EXPECT_EQ(compact.InputBits(), 2);
+    ExpectSameOnCalibration(*net, compact, calibration, inputBlocks);
+
+    // 保存して読み直しても同じ出力になる
+    std::stringstream ss;
+    compact.Save(ss);
+    CompactNet loaded;
+    loaded.Load(ss);
+    ExpectSameOnCalibration(*net, loaded, calibration, inputBlocks);
+
+    // 列の長さが壊れたファイルや途中で切れたファイルは確保の前に弾く
+    const std::string saved = ss.str();
+    std::string corrupted = saved;
+    // magic, 層数, 1層目のヘッダの直後が係数の列の長さ
+    const uint64_t hugeSize = uint64_t(1) << 60;
+    memcpy(&corrupted[sizeof(uint32_t) * 2 + sizeof(int32_t) * 6], &hugeSize, sizeof(hugeSize));
+    std::istringstream corruptedStream(corrupted);
+    EXPECT_THROW(loaded.Load(corruptedStream), std::runtime_error);
+    std::istringstream truncatedStream(saved.substr(0, saved.size() / 2));
+    EXPECT_THROW(loaded.Load(truncatedStream), std::runtime_error);
+}
+
+TEST(Compact, PruneWideNetworkSameOnCalibration)
+{
+    constexpr int In = 70;
+    using Net = BitDenseLayer<BitSignActivation<BitDenseLayer<BitSignActivation<BitDenseLayer<BitInputLayer<In>, 96>>, 40>>, 10, true>;
+    constexpr int inputBlocks = BitInputLayer<In>::PADDED_OUT_BLOCKS;
+    constexpr int numSamples = 300;
+    Random::Seed(7);
+    auto net = MakeNet<Net>();
+
+    // 一部の入力ビットを固定して，定数や重複になるニューロンが出やすいようにする
+    std::vector<BitBlock> calibration(numSamples * inputBlocks, 0);
+    for (int s = 0; s < numSamples; s++)
+    {
+        for (int i = 0; i < 12; i++)
+        {
+            if (Random::GetUInt() % 2)
+            {
+                calibration[s * inputBlocks + GetBlockIndex(i)] |= 1 << GetBitIndexInBlock(i);
+            }
+        }
+    }
+    NeuronPruner<Net> pruner(*net);
+    PruneReport report;
+    CompactNet compact = pruner.Prune(calibration.data(), numSamples, &report);
+    EXPECT_LT(report.hidden[0].kept, 96) << report.Summary();
+    ExpectSameOnCalibration(*net, compact, calibration, inputBlocks);
+}
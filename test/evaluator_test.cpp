@@ -0,0 +1,50 @@
+﻿#include <gtest/gtest.h>
+
+#include "../src/layers/layers.h"
+#include "../src/train.h"
+#include "../src/trainer/evaluator.h"
+#include "../src/util/random_util.h"
+#include <cmath>
+#include <memory>
+
+TEST(Evaluator, SameAsScalarReference)
+{
+    using namespace bitnet;
+    constexpr int numSamples = 1003;
+    constexpr int inputBlocks = Evaluator<BitNetwork>::INPUT_BLOCKS;
+
+    Random::Seed(42);
+    std::unique_ptr<BitNetwork> net(new BitNetwork());
+    net->Init();
+    net->ResetWeight();
+    Train<BitNetwork>(*net, 200, 16, true);
+    const EvalSet set = MakeXOREvalSet(numSamples, 16);
+
+    double absError = 0, squaredError = 0;
+    uint64_t tp = 0, fp = 0, tn = 0, fn = 0;
+    for (int s = 0; s < numSamples; s++)
+    {
+        const int32_t pred = net->Forward(&set.inputs[s * inputBlocks])[0];
+        const double diff = (double)set.teachers[s] - pred;
+        absError += std::abs(diff);
+        squaredError += diff * diff;
+        const bool predPositive = pred > 0;
+        const bool teacherPositive = set.teachers[s] > 0;
+        tp += predPositive && teacherPositive;
+        fp += predPositive && !teacherPositive;
+        tn += !predPositive && !teacherPositive;
+        fn += !predPositive && teacherPositive;
+    }
+
+    Evaluator<BitNetwork> evaluator(3);
+    const EvalResult result = evaluator.Evaluate(*net, set);
+    EXPECT_EQ(result.samples, (uint64_t)numSamples);
+    EXPECT_NEAR(result.mae, absError / numSamples, 1e-9);
+    EXPECT_NEAR(result.mse, squaredError / numSamples, 1e-6);
+    EXPECT_EQ(result.truePositive, tp);
+    EXPECT_EQ(result.falsePositive, fp);
+    EXPECT_EQ(result.trueNegative, tn);
+    EXPECT_EQ(result.falseNegative, fn);
+    EXPECT_DOUBLE_EQ(result.accuracy, (double)(tp + tn) / numSamples);
+    EXPECT_GT(result.SamplesPerSecond(), 0);
+}
@@ -0,0 +1,256 @@
+﻿#include <gtest/gtest.h>
+
+#include "../src/util/bit_helper.h"
+#include "../src/util/random_util.h"
+
+// SIMDカーネルとスカラー計算の一致確認
+
+TEST(Kernel, MaddInt8_SameAsScalar)
+{
+    using namespace bitnet;
+    constexpr int length = 32 * 7;
+    alignas(64) int8_t x[length];
+    alignas(64) int8_t w[length];
+
+    Random::Seed(42);
+    for (int len = 32; len <= length; len += 32)
+    {
+        int expected = 0;
+        for (int i = 0; i < len; i++)
+        {
+            x[i] = static_cast<int8_t>(Random::GetUInt() % 3) - 1;
+            w[i] = (Random::GetUInt() % 2) ? 1 : -1;
+            expected += x[i] * w[i];
+        }
+        EXPECT_EQ(MaddInt8(x, w, len), expected);
+    }
+}
+
+TEST(Kernel, ClipAndSignInt8_SameAsScalar)
+{
+    using namespace bitnet;
+    constexpr int length = 77;
+    float weights[length];
+    float expected[length];
+    int8_t signs[length];
+
+    Random::Seed(42);
+    for (int i = 0; i < length; i++)
+    {
+        weights[i] = expected[i] = Random::GetReal01() * 4 - 2;
+    }
+    weights[3] = expected[3] = 0;
+
+    ClipAndSignInt8(weights, signs, length);
+    for (int i = 0; i < length; i++)
+    {
+        const float clipped = std::max(-1.0f, std::min(1.0f, expected[i]));
+        EXPECT_EQ(weights[i], clipped);
+        EXPECT_EQ(signs[i], clipped > 0 ? 1 : -1);
+    }
+}
+
+TEST(Kernel, AddSignedGradAndClipAndPackSigns_SameAsScalar)
+{
+    using namespace bitnet;
+    constexpr int length = 77;
+    float weights[length];
+    float expected[length];
+    BitBlock bits[BitToBlockCount(length)];
+    BitBlock packed[BitToBlockCount(length)] = {0};
+
+    Random::Seed(42);
+    for (int i = 0; i < length; i++)
+    {
+        weights[i] = expected[i] = Random::GetReal01() * 2 - 1;
+    }
+    for (auto &b : bits)
+    {
+        b = static_cast<BitBlock>(Random::GetUInt());
+    }
+
+    AddSignedGrad(weights, 0.75f, bits, length);
+    const int changed = ClipAndPackSigns(weights, packed, length);
+    int expectedChanged = 0;
+    for (int i = 0; i < length; i++)
+    {
+        const int bit = (bits[GetBlockIndex(i)] >> GetBitIndexInBlock(i)) & 1;
+        expected[i] += bit ? 0.75f : -0.75f;
+        const float clipped = std::max(-1.0f, std::min(1.0f, expected[i]));
+        EXPECT_EQ(weights[i], clipped);
+        EXPECT_EQ((packed[GetBlockIndex(i)] >> GetBitIndexInBlock(i)) & 1, clipped > 0 ? 1 : 0);
+        expectedChanged += clipped > 0;
+    }
+    EXPECT_EQ(changed, expectedChanged);
+    // 末尾のパディングビットは0のまま
+    EXPECT_EQ(packed[BitToBlockCount(length) - 1] >> (length % BYTE_BIT_WIDTH), 0);
+}
+
+namespace
+{
+    template <int Length>
+    void CheckMaddPopcntFixed()
+    {
+        using namespace bitnet;
+        static_assert(AddPaddingToBitSize(Length) == Length);
+        alignas(32) uint8_t x[Length / BYTE_BIT_WIDTH];
+        alignas(32) uint8_t w[Length / BYTE_BIT_WIDTH];
+        int expected = 0;
+        for (int i = 0; i < Length / BYTE_BIT_WIDTH; i++)
+        {
+            x[i] = static_cast<uint8_t>(Random::GetUInt());
+            w[i] = static_cast<uint8_t>(Random::GetUInt());
+            for (int bit = 0; bit < BYTE_BIT_WIDTH; bit++)
+            {
+                expected += ((x[i] >> bit) & 1) == ((w[i] >> bit) & 1);
+            }
+        }
+        EXPECT_EQ(MaddPopcntFixed<Length>(x, w), expected) << "Length=" << Length;
+        EXPECT_EQ(MaddPopcntDispatched<Length>(x, w), expected) << "Length=" << Length;
+    }
+}
+
+TEST(Kernel, MaddPopcntFixed_SameAsScalar)
+{
+    using namespace bitnet;
+    // 狭い層は64/128bit，それ以上は256bitの倍数にパディングされる
+    EXPECT_EQ(AddPaddingToBitSize(2), 64);
+    EXPECT_EQ(AddPaddingToBitSize(65), 128);
+    EXPECT_EQ(AddPaddingToBitSize(129), 256);
+    EXPECT_EQ(AddPaddingToBitSize(257), 512);
+
+    Random::Seed(42);
+    CheckMaddPopcntFixed<64>();
+    CheckMaddPopcntFixed<128>();
+    CheckMaddPopcntFixed<256>();
+    CheckMaddPopcntFixed<768>();
+}
+
+TEST(Kernel, DispatchedKernels_SameAsScalar)
+{
+    using namespace bitnet;
+    constexpr int maxBits = 256 * 7;
+    constexpr int maxBytes = 200;
+    alignas(64) BitBlock x[maxBits / 8];
+    alignas(64) BitBlock w[maxBits / 8];
+    alignas(64) BitBlock m[maxBits / 8];
+    alignas(64) int8_t bytes[maxBytes];
+    alignas(64) int8_t weights8[maxBytes];
+
+    EXPECT_NE(GetKernelTable(IsaLevel::AVX2), nullptr);
+    EXPECT_EQ(Kernels().level, DetectIsaLevel());
+    // このCPUで動く命令セットの関数表をすべて確かめる
+    for (IsaLevel level : {IsaLevel::AVX2, IsaLevel::AVX512})
+    {
+        const KernelTable *table = GetKernelTable(level);
+        if (table == nullptr)
+        {
+            continue;
+        }
+        SCOPED_TRACE(table->name);
+        Random::Seed(42);
+        // 64/128bitにパディングされた狭い層と256bitの倍数
+        for (int bits : {64, 128, 256, 512, 768, 1024, 1280, 1536, 1792})
+        {
+            int expected = 0;
+            int expectedMasked = 0;
+            for (int i = 0; i < bits / 8; i++)
+            {
+                x[i] = static_cast<BitBlock>(Random::GetUInt());
+                w[i] = static_cast<BitBlock>(Random::GetUInt());
+                m[i] = static_cast<BitBlock>(Random::GetUInt());
+                expected += _mm_popcnt_u32(static_cast<BitBlock>(~(x[i] ^ w[i])));
+                expectedMasked += _mm_popcnt_u32(static_cast<BitBlock>(~(x[i] ^ w[i]) & m[i]));
+            }
+            EXPECT_EQ(table->maddPopcnt(x, w, bits), expected) << bits << " bits";
+            EXPECT_EQ(table->maskedMaddPopcnt(x, w, m, bits), expectedMasked) << bits << " bits";
+        }
+        for (int len = 1; len <= maxBytes; len += 13)
+        {
+            for (int i = 0; i < len; i++)
+            {
+                bytes[i] = static_cast<int8_t>(Random::GetUInt() % 5) - 2;
+            }
+            memset(x, 0xff, sizeof(x));
+            table->packPositive(bytes, x, len);
+            for (int i = 0; i < BitToBlockCount(len) * 8; i++)
+            {
+                const int bit = (x[GetBlockIndex(i)] >> GetBitIndexInBlock(i)) & 1;
+                EXPECT_EQ(bit, i < len && bytes[i] > 0) << "length " << len << " bit " << i;
+            }
+        }
+        for (int len = 32; len <= 192; len += 32)
+        {
+            int expected = 0;
+            for (int i = 0; i < len; i++)
+            {
+                bytes[i] = static_cast<int8_t>(Random::GetUInt() % 3) - 1;
+                weights8[i] = (Random::GetUInt() % 2) ? 1 : -1;
+                expected += bytes[i] * weights8[i];
+            }
+            EXPECT_EQ(table->maddInt8(bytes, weights8, len), expected);
+        }
+        constexpr int length = 77;
+        float weights[length];
+        BitBlock packed[BitToBlockCount(length)] = {0};
+        for (auto &v : weights)
+        {
+            v = Random::GetReal01() * 4 - 2;
+        }
+        EXPECT_EQ(table->clipAndPackSigns(weights, packed, length), std::count_if(weights, weights + length, [](float v) { return v > 0; }));
+        for (int i = 0; i < length; i++)
+        {
+            EXPECT_LE(std::abs(weights[i]), 1.0f);
+            EXPECT_EQ((packed[GetBlockIndex(i)] >> GetBitIndexInBlock(i)) & 1, weights[i] > 0);
+        }
+    }
+}
+
+TEST(Kernel, FixedPointKernels_SameAsScalar)
+{
+    using namespace bitnet;
+    constexpr int length = 77;
+    constexpr int16_t limit = 1 << 14;
+    int16_t weights[length];
+    int16_t expected[length];
+    BitBlock bits[BitToBlockCount(length)];
+    BitBlock packed[BitToBlockCount(length)] = {0};
+
+    Random::Seed(42);
+    for (int i = 0; i < length; i++)
+    {
+        weights[i] = expected[i] = static_cast<int16_t>(Random::GetUInt() % 65536 - 32768);
+    }
+    for (auto &b : bits)
+    {
+        b = static_cast<BitBlock>(Random::GetUInt());
+    }
+
+    // 飽和加算
+    AddSignedGradInt16(weights, 20000, bits, length);
+    for (int i = 0; i < length; i++)
+    {
+        const int bit = (bits[GetBlockIndex(i)] >> GetBitIndexInBlock(i)) & 1;
+        expected[i] = static_cast<int16_t>(std::max(-32768, std::min(32767, expected[i] + (bit ? 20000 : -20000))));
+        EXPECT_EQ(weights[i], expected[i]) << i;
+    }
+
+    const int changed = ClipAndPackSignsInt16(weights, packed, length, limit);
+    int expectedChanged = 0;
+    for (int i = 0; i < length; i++)
+    {
+        const int16_t clipped = std::max<int16_t>(-limit, std::min<int16_t>(limit, expected[i]));
+        EXPECT_EQ(weights[i], clipped) << i;
+        const int bit = (packed[GetBlockIndex(i)] >> GetBitIndexInBlock(i)) & 1;
+        EXPECT_EQ(bit, clipped > 0) << i;
+        expectedChanged += bit;
+    }
+    EXPECT_EQ(changed, expectedChanged);
+
+    float scaled[length];
+    ScaleInt16ToFloat(weights, 0.5f, scaled, length);
+    for (int i = 0; i < length; i++)
+    {
+        EXPECT_EQ(scaled[i], weights[i] * 0.5f);
+    }
+}
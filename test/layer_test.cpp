@@ -0,0 +1,1305 @@
+﻿#include <gtest/gtest.h>
+
+#include "../src/inference/incremental_accumulator.h"
+#include "../src/inference/lut_compiled_net.h"
+#include "../src/layers/layers.h"
+#include "../src/net_common.h"
+#include "../src/util/make_data.h"
+#include "../src/util/random_util.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace
+{
+    using namespace bitnet;
+
+    template <typename Layer_t>
+    std::unique_ptr<Layer_t> MakeLayer()
+    {
+        std::unique_ptr<Layer_t> layer(new Layer_t());
+        layer->Init();
+        layer->ResetWeight();
+        return layer;
+    }
+
+    void RandomBits(BitBlock *bits, int numBits, int paddedBlocks)
+    {
+        memset(bits, 0, paddedBlocks);
+        for (int i = 0; i < numBits; i++)
+        {
+            bits[GetBlockIndex(i)] |= (Random::GetUInt() % 2) << GetBitIndexInBlock(i);
+        }
+    }
+
+    int GetBit(const BitBlock *bits, int i)
+    {
+        return (bits[GetBlockIndex(i)] >> GetBitIndexInBlock(i)) & 1;
+    }
+
+    // 前の層に伝播した勾配を記録するInt入力層
+    template <int InputDim>
+    class GradCaptureIntInput : public IntInputLayer<InputDim>
+    {
+    public:
+        static inline std::vector<GradientType> grads;
+
+        void TrainBackward(const GradientType *nextGrad)
+        {
+            grads.assign(nextGrad, nextGrad + BATCH_SIZE * InputDim);
+        }
+    };
+
+    // Saveされたモデルから先頭の層のバイアスと実数値重みを読み出す
+    template <typename Layer_t>
+    void ReadParams(Layer_t &layer, int numBias, int numWeight, std::vector<double> *bias, std::vector<float> *weight)
+    {
+        const char *path = "layer_test_params.bin";
+        {
+            std::ofstream ofs(path, std::ios::binary);
+            layer.Save(ofs);
+        }
+        std::ifstream ifs(path, std::ios::binary);
+        int dim;
+        bias->resize(numBias);
+        weight->resize(numWeight);
+        ifs.read(reinterpret_cast<char *>(&dim), sizeof(int));
+        ifs.read(reinterpret_cast<char *>(bias->data()), sizeof(double) * numBias);
+        ifs.read(reinterpret_cast<char *>(weight->data()), sizeof(float) * numWeight);
+        ifs.close();
+        std::remove(path);
+    }
+}
+
+template <int Stride>
+void CheckConvForward()
+{
+    constexpr int H = 7, W = 6, Cin = 3, Cout = 5, K = 3;
+    using Conv = BitConv2D<BitInputLayer<H * W * Cin>, H, W, Cin, Cout, K, Stride>;
+
+    Random::Seed(42);
+    auto conv = MakeLayer<Conv>();
+    std::vector<double> bias;
+    std::vector<float> weight;
+    ReadParams(*conv, Cout, Cout * Conv::KERNEL_DIM, &bias, &weight);
+
+    alignas(32) BitBlock input[BitInputLayer<H * W * Cin>::PADDED_OUT_BLOCKS];
+    RandomBits(input, H * W * Cin, sizeof(input));
+    const int8_t *out = conv->Forward(input);
+
+    for (int oy = 0; oy < Conv::OUT_HEIGHT; oy++)
+    {
+        for (int ox = 0; ox < Conv::OUT_WIDTH; ox++)
+        {
+            for (int co = 0; co < Cout; co++)
+            {
+                int sum = static_cast<int>(bias[co]);
+                for (int ky = 0; ky < K; ky++)
+                {
+                    for (int kx = 0; kx < K; kx++)
+                    {
+                        for (int ci = 0; ci < Cin; ci++)
+                        {
+                            const int x = GetBit(input, ((oy * Stride + ky) * W + ox * Stride + kx) * Cin + ci) ? 1 : -1;
+                            const int w = weight[co * Conv::KERNEL_DIM + (ky * K + kx) * Cin + ci] > 0 ? 1 : -1;
+                            sum += x * w;
+                        }
+                    }
+                }
+                EXPECT_EQ(out[(oy * Conv::OUT_WIDTH + ox) * Cout + co], sum > 0);
+            }
+        }
+    }
+}
+
+TEST(Layer, BitConv2D_SameAsNaive)
+{
+    CheckConvForward<1>();
+    CheckConvForward<2>();
+}
+
+TEST(Layer, BitMaxPool2D_IsOr)
+{
+    constexpr int H = 6, W = 4, C = 70, P = 2;
+    using Pool = BitMaxPool2D<BitInputLayer<H * W * C>, H, W, C, P>;
+
+    Random::Seed(42);
+    auto pool = MakeLayer<Pool>();
+    alignas(32) BitBlock input[BitInputLayer<H * W * C>::PADDED_OUT_BLOCKS];
+    RandomBits(input, H * W * C, sizeof(input));
+    const BitBlock *out = pool->Forward(input);
+
+    for (int oy = 0; oy < H / P; oy++)
+    {
+        for (int ox = 0; ox < W / P; ox++)
+        {
+            for (int c = 0; c < C; c++)
+            {
+                int expected = 0;
+                for (int py = 0; py < P; py++)
+                {
+                    for (int px = 0; px < P; px++)
+                    {
+                        expected |= GetBit(input, ((oy * P + py) * W + ox * P + px) * C + c);
+                    }
+                }
+                EXPECT_EQ(GetBit(out, (oy * (W / P) + ox) * C + c), expected);
+            }
+        }
+    }
+}
+
+TEST(Layer, BitConv2D_Trainable)
+{
+    constexpr int H = 6, W = 5, Cin = 3, Cout = 4, K = 3, Stride = 1;
+    using Input = BitStageInputLayer<H * W * Cin>;
+    using Conv = BitConv2D<Input, H, W, Cin, Cout, K, Stride>;
+    constexpr int inputBlocks = Input::PADDED_OUT_BLOCKS;
+
+    Random::Seed(42);
+    auto conv = MakeLayer<Conv>();
+    std::vector<double> bias;
+    std::vector<float> weight;
+    ReadParams(*conv, Cout, Cout * Conv::KERNEL_DIM, &bias, &weight);
+
+    alignas(32) BitBlock input[BATCH_SIZE * inputBlocks];
+    std::vector<GradientType> grads(BATCH_SIZE * Conv::COMPRESS_OUT_DIM);
+    for (int b = 0; b < BATCH_SIZE; b++)
+    {
+        RandomBits(&input[b * inputBlocks], H * W * Cin, inputBlocks);
+    }
+    for (auto &g : grads)
+    {
+        // 0の勾配も混ぜて読み飛ばしの経路も通す
+        g = (Random::GetUInt() % 4 == 0) ? 0.0f : (Random::GetReal01() - 0.5f) * 0.01f;
+    }
+
+    conv->TrainForward(input);
+    conv->TrainBackward(grads.data());
+
+    // 素朴な実装で重み・バイアスの更新量と前の層への勾配を計算する
+    std::vector<double> expectedBias = bias;
+    std::vector<float> expectedWeight = weight;
+    std::vector<float> expectedGradsToPrev(BATCH_SIZE * H * W * Cin, 0.0f);
+    for (int b = 0; b < BATCH_SIZE; b++)
+    {
+        for (int oy = 0; oy < Conv::OUT_HEIGHT; oy++)
+        {
+            for (int ox = 0; ox < Conv::OUT_WIDTH; ox++)
+            {
+                for (int co = 0; co < Cout; co++)
+                {
+                    const float g = grads[b * Conv::COMPRESS_OUT_DIM + (oy * Conv::OUT_WIDTH + ox) * Cout + co];
+                    if (g == 0)
+                    {
+                        continue;
+                    }
+                    expectedBias[co] += g;
+                    for (int ky = 0; ky < K; ky++)
+                    {
+                        for (int kx = 0; kx < K; kx++)
+                        {
+                            for (int ci = 0; ci < Cin; ci++)
+                            {
+                                const int inIndex = ((oy * Stride + ky) * W + ox * Stride + kx) * Cin + ci;
+                                const int wIndex = co * Conv::KERNEL_DIM + (ky * K + kx) * Cin + ci;
+                                const float x = GetBit(&input[b * inputBlocks], inIndex) ? 1.0f : -1.0f;
+                                expectedGradsToPrev[b * H * W * Cin + inIndex] += g * (weight[wIndex] > 0 ? 1.0f : -1.0f);
+                                expectedWeight[wIndex] += g * x;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    std::vector<double> actualBias;
+    std::vector<float> actualWeight;
+    ReadParams(*conv, Cout, Cout * Conv::KERNEL_DIM, &actualBias, &actualWeight);
+    for (int co = 0; co < Cout; co++)
+    {
+        EXPECT_NEAR(actualBias[co], expectedBias[co], 1e-5);
+    }
+    for (int i = 0; i < Cout * Conv::KERNEL_DIM; i++)
+    {
+        EXPECT_NEAR(actualWeight[i], std::max(-1.0f, std::min(1.0f, expectedWeight[i])), 1e-5f);
+    }
+    const GradientType *gradsToPrev = conv->InputLayer().GetGrads();
+    for (int i = 0; i < BATCH_SIZE * H * W * Cin; i++)
+    {
+        EXPECT_NEAR(gradsToPrev[i], expectedGradsToPrev[i], 1e-5f);
+    }
+}
+
+TEST(Layer, BitBatchNorm_FoldedThresholdSameAsNormalize)
+{
+    constexpr int In = 40, Out = 24;
+    using Net = BitBatchNorm<BitDenseLayer<BitInputLayer<In>, Out>>;
+
+    Random::Seed(42);
+    std::vector<double> gamma(Out), beta(Out), mean(Out), var(Out), bias(Out);
+    std::vector<float> weight(Out * In);
+    for (int i = 0; i < Out; i++)
+    {
+        // 負のスケールとゼロスケールも含める
+        gamma[i] = (i % 6 == 5) ? 0 : Random::GetReal01() * 4 - 2;
+        beta[i] = Random::GetReal01() * 2 - 1;
+        mean[i] = Random::GetReal01() * 10 - 5;
+        var[i] = Random::GetReal01() * 20 + 0.1;
+        bias[i] = Random::GetReal01() * 6 - 3;
+    }
+    for (auto &w : weight)
+    {
+        w = Random::GetReal01() * 2 - 1;
+    }
+
+    const char *path = "layer_test_bn.bin";
+    {
+        std::ofstream ofs(path, std::ios::binary);
+        int dim = Out;
+        ofs.write(reinterpret_cast<char *>(&dim), sizeof(int));
+        for (auto *param : {&gamma, &beta, &mean, &var})
+        {
+            ofs.write(reinterpret_cast<char *>(param->data()), sizeof(double) * Out);
+        }
+        ofs.write(reinterpret_cast<char *>(&dim), sizeof(int));
+        ofs.write(reinterpret_cast<char *>(bias.data()), sizeof(double) * Out);
+        ofs.write(reinterpret_cast<char *>(weight.data()), sizeof(float) * Out * In);
+    }
+    auto net = MakeLayer<Net>();
+    {
+        std::ifstream ifs(path, std::ios::binary);
+        net->Load(ifs);
+    }
+    std::remove(path);
+
+    alignas(32) BitBlock input[BitInputLayer<In>::PADDED_OUT_BLOCKS];
+    for (int n = 0; n < 100; n++)
+    {
+        RandomBits(input, In, sizeof(input));
+        const int8_t *out = net->Forward(input);
+        for (int i = 0; i < Out; i++)
+        {
+            int sum = static_cast<int>(bias[i]);
+            for (int j = 0; j < In; j++)
+            {
+                sum += (GetBit(input, j) ? 1 : -1) * (weight[i * In + j] > 0 ? 1 : -1);
+            }
+            const double y = gamma[i] * (sum - mean[i]) / std::sqrt(var[i] + Net::EPSILON) + beta[i];
+            EXPECT_EQ(out[i], y > 0) << "neuron " << i;
+        }
+    }
+}
+
+TEST(Layer, BitBatchNorm_Trainable)
+{
+    constexpr int In = 40, Out = 24, NumBatches = 20;
+    using Net = BitBatchNorm<BitDenseLayer<BitInputLayer<In>, Out>>;
+    constexpr int inputBlocks = BitInputLayer<In>::PADDED_OUT_BLOCKS;
+
+    Random::Seed(42);
+    auto net = MakeLayer<Net>();
+    alignas(32) BitBlock input[BATCH_SIZE * inputBlocks];
+    std::vector<GradientType> grads(BATCH_SIZE * Out);
+
+    // 数ステップ学習してスケール・シフトを初期値から動かす
+    for (int step = 0; step < 5; step++)
+    {
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            RandomBits(&input[b * inputBlocks], In, inputBlocks);
+        }
+        net->TrainForward(input);
+        for (auto &g : grads)
+        {
+            g = (Random::GetReal01() - 0.5f) * 0.1f;
+        }
+        net->TrainBackward(grads.data());
+    }
+
+    // Saveの先頭はgamma, beta, mean, varの順に並ぶ
+    std::vector<double> stats, bias;
+    std::vector<float> weight, unused;
+    ReadParams(*net, 4 * Out, 0, &stats, &unused);
+    ReadParams(net->PrevLayer(), Out, Out * In, &bias, &weight);
+    std::vector<double> expectedMean(stats.begin() + 2 * Out, stats.begin() + 3 * Out);
+    std::vector<double> expectedVar(stats.begin() + 3 * Out, stats.begin() + 4 * Out);
+
+    auto naiveSum = [&](const BitBlock *x, int i)
+    {
+        int sum = static_cast<int>(bias[i]);
+        for (int j = 0; j < In; j++)
+        {
+            sum += (GetBit(x, j) ? 1 : -1) * (weight[i * In + j] > 0 ? 1 : -1);
+        }
+        return sum;
+    };
+
+    // 逆伝播しなければ重みは変わらないので，移動平均だけが素朴な計算通りに進む
+    for (int n = 0; n < NumBatches; n++)
+    {
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            RandomBits(&input[b * inputBlocks], In, inputBlocks);
+        }
+        net->TrainForward(input);
+        for (int i = 0; i < Out; i++)
+        {
+            double mean = 0, sqSum = 0;
+            for (int b = 0; b < BATCH_SIZE; b++)
+            {
+                const int sum = naiveSum(&input[b * inputBlocks], i);
+                mean += sum;
+                sqSum += static_cast<double>(sum) * sum;
+            }
+            mean /= BATCH_SIZE;
+            const double var = sqSum / BATCH_SIZE - mean * mean;
+            expectedMean[i] = Net::MOMENTUM * expectedMean[i] + (1 - Net::MOMENTUM) * mean;
+            expectedVar[i] = Net::MOMENTUM * expectedVar[i] + (1 - Net::MOMENTUM) * var;
+        }
+    }
+
+    std::vector<double> actualStats;
+    ReadParams(*net, 4 * Out, 0, &actualStats, &unused);
+    for (int i = 0; i < Out; i++)
+    {
+        // スケール・シフトは順伝播だけでは変わらない
+        EXPECT_DOUBLE_EQ(actualStats[i], stats[i]);
+        EXPECT_DOUBLE_EQ(actualStats[Out + i], stats[Out + i]);
+        EXPECT_NEAR(actualStats[2 * Out + i], expectedMean[i], 1e-6);
+        EXPECT_NEAR(actualStats[3 * Out + i], expectedVar[i], 1e-6);
+    }
+
+    // 畳み込んだ閾値による推論が移動平均での正規化と一致する
+    net->Binarize();
+    for (int n = 0; n < 100; n++)
+    {
+        RandomBits(input, In, inputBlocks);
+        const int8_t *out = net->Forward(input);
+        for (int i = 0; i < Out; i++)
+        {
+            const double gamma = stats[i], beta = stats[Out + i];
+            const double y = gamma * (naiveSum(input, i) - expectedMean[i]) / std::sqrt(expectedVar[i] + Net::EPSILON) + beta;
+            EXPECT_EQ(out[i], y > 0) << "neuron " << i;
+        }
+    }
+}
+
+TEST(Layer, BitDense_IncrementalBinarizeSameAsFull)
+{
+    constexpr int In = 64;
+    using Net = BitDenseLayer<BitSignActivation<BitDenseLayer<BitInputLayer<In>, 40>>, 1, true>;
+
+    Random::Seed(42);
+    auto net = MakeLayer<Net>();
+    alignas(32) BitBlock input[BATCH_SIZE * BitInputLayer<In>::PADDED_OUT_BLOCKS];
+    GradientType grads[BATCH_SIZE];
+    int totalFlips = 0;
+    for (int step = 0; step < 50; step++)
+    {
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            RandomBits(&input[b * BitInputLayer<In>::PADDED_OUT_BLOCKS], In, BitInputLayer<In>::PADDED_OUT_BLOCKS);
+        }
+        const int32_t *pred = net->TrainForward(input);
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            grads[b] = 0.01f * (8 - pred[b]);
+        }
+        net->TrainBackward(grads);
+        totalFlips += net->SignFlipCount();
+    }
+    EXPECT_GT(totalFlips, 0);
+
+    // 変化した行のみ2値化した結果は全行の2値化と一致する
+    int32_t incremental[10];
+    for (int n = 0; n < 10; n++)
+    {
+        incremental[n] = net->Forward(&input[n * BitInputLayer<In>::PADDED_OUT_BLOCKS])[0];
+    }
+    const char *path = "layer_test_incremental.bin";
+    {
+        std::ofstream ofs(path, std::ios::binary);
+        net->Save(ofs);
+    }
+    {
+        std::ifstream ifs(path, std::ios::binary);
+        net->Load(ifs);
+    }
+    std::remove(path);
+    for (int n = 0; n < 10; n++)
+    {
+        EXPECT_EQ(net->Forward(&input[n * BitInputLayer<In>::PADDED_OUT_BLOCKS])[0], incremental[n]);
+    }
+}
+
+template <typename Optimizer_t>
+void CheckOptimizerTrainable()
+{
+    constexpr int In = 60;
+    using Net = BitDenseLayer<BitSignActivation<BitDenseLayer<BitInputLayer<In>, 24, false, Optimizer_t>>, 1, true, Optimizer_t>;
+
+    Random::Seed(42);
+    auto net = MakeLayer<Net>();
+    alignas(32) BitBlock input[BATCH_SIZE * BitInputLayer<In>::PADDED_OUT_BLOCKS];
+    GradientType grads[BATCH_SIZE];
+    int totalFlips = 0;
+    for (int step = 0; step < 30; step++)
+    {
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            RandomBits(&input[b * BitInputLayer<In>::PADDED_OUT_BLOCKS], In, BitInputLayer<In>::PADDED_OUT_BLOCKS);
+        }
+        const int32_t *pred = net->TrainForward(input);
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            grads[b] = 0.01f * (8 - pred[b]);
+        }
+        net->TrainBackward(grads);
+        totalFlips += net->SignFlipCount();
+    }
+    EXPECT_GT(totalFlips, 0);
+
+    // 学習中に詰めた2値重みは，保存した実数値重みの2値化と一致し，実数値重みはクリッピング済み
+    std::vector<double> bias;
+    std::vector<float> weight;
+    ReadParams(*net, 1, 24, &bias, &weight);
+    for (float w : weight)
+    {
+        EXPECT_LE(std::abs(w), 1.0f);
+    }
+    int32_t trained[10];
+    for (int n = 0; n < 10; n++)
+    {
+        trained[n] = net->Forward(&input[n * BitInputLayer<In>::PADDED_OUT_BLOCKS])[0];
+    }
+    const char *path = "layer_test_optimizer.bin";
+    {
+        std::ofstream ofs(path, std::ios::binary);
+        net->Save(ofs);
+    }
+    {
+        std::ifstream ifs(path, std::ios::binary);
+        net->Load(ifs);
+    }
+    std::remove(path);
+    for (int n = 0; n < 10; n++)
+    {
+        EXPECT_EQ(net->Forward(&input[n * BitInputLayer<In>::PADDED_OUT_BLOCKS])[0], trained[n]);
+    }
+}
+
+TEST(Layer, BitDense_OptimizerFusedStep)
+{
+    CheckOptimizerTrainable<MomentumSGD>();
+    CheckOptimizerTrainable<Adam>();
+}
+
+TEST(Layer, BitDense_PerLayerOptimizerParams)
+{
+    constexpr int In = 60, Hidden = 24;
+    using Net = BitDenseLayer<BitSignActivation<BitDenseLayer<BitInputLayer<In>, Hidden, false, Adam>>, 1, true, Adam>;
+    constexpr int inputBlocks = BitInputLayer<In>::PADDED_OUT_BLOCKS;
+
+    Random::Seed(42);
+    auto net = MakeLayer<Net>();
+    // 出力層だけ学習率を0にすると，出力層の重みは動かず中間層だけが学習される
+    OptimizerParams frozen;
+    frozen.learningRate = 0;
+    net->SetLayerOptimizerParams(frozen);
+
+    std::vector<double> outputBias, hiddenBias;
+    std::vector<float> outputWeight, hiddenWeight;
+    ReadParams(*net, 1, Hidden, &outputBias, &outputWeight);
+    ReadParams(net->PrevLayer().PrevLayer(), Hidden, Hidden * In, &hiddenBias, &hiddenWeight);
+
+    alignas(32) BitBlock input[BATCH_SIZE * inputBlocks];
+    GradientType grads[BATCH_SIZE];
+    for (int step = 0; step < 10; step++)
+    {
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            RandomBits(&input[b * inputBlocks], In, inputBlocks);
+        }
+        const int32_t *pred = net->TrainForward(input);
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            grads[b] = 0.01f * (8 - pred[b]);
+        }
+        net->TrainBackward(grads);
+    }
+
+    std::vector<double> outputBiasAfter, hiddenBiasAfter;
+    std::vector<float> outputWeightAfter, hiddenWeightAfter;
+    ReadParams(*net, 1, Hidden, &outputBiasAfter, &outputWeightAfter);
+    ReadParams(net->PrevLayer().PrevLayer(), Hidden, Hidden * In, &hiddenBiasAfter, &hiddenWeightAfter);
+    EXPECT_EQ(outputBiasAfter, outputBias);
+    EXPECT_EQ(outputWeightAfter, outputWeight);
+    EXPECT_NE(hiddenWeightAfter, hiddenWeight);
+}
+
+TEST(Layer, BitDense_FixedPointTrainable)
+{
+    CheckOptimizerTrainable<FixedPointSGD>();
+
+    // BitNetworkと同じ形をint16の潜在重みと逆伝播で学習する
+    using Net = Sequential<BitInput<2>, BitDense<256, false, FixedPointSGD>, BitSign, BitDense<128, false, FixedPointSGD>, BitSign,
+                           BitDense<16, false, FixedPointSGD>, BitSign, BitDense<1, true, FixedPointSGD>>;
+    constexpr int inputBlocks = BitInputLayer<2>::PADDED_OUT_BLOCKS;
+    constexpr double scale = 16;
+
+    Random::Seed(42);
+    auto net = MakeLayer<Net>();
+    int8_t inputData[BATCH_SIZE * 2];
+    int8_t teacherData[BATCH_SIZE];
+    alignas(32) BitBlock input[BATCH_SIZE * inputBlocks];
+    GradientType grads[BATCH_SIZE];
+    for (int step = 0; step < 500; step++)
+    {
+        util::MakeXORBatch(BATCH_SIZE, scale, inputData, teacherData);
+        util::BinarizeInputData(BATCH_SIZE, 2, inputData, input);
+        const int32_t *pred = net->TrainForward(input);
+        double mae;
+        util::CalcSquaredError(BATCH_SIZE, 1, scale, 0.0001, pred, teacherData, grads, &mae);
+        net->TrainBackward(grads);
+    }
+
+    int correct = 0;
+    for (int n = 0; n < 10; n++)
+    {
+        util::MakeXORBatch(BATCH_SIZE, scale, inputData, teacherData);
+        util::BinarizeInputData(BATCH_SIZE, 2, inputData, input);
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            correct += (net->Forward(&input[b * inputBlocks])[0] > 0) == (teacherData[b] > 0);
+        }
+    }
+    EXPECT_EQ(correct, 10 * BATCH_SIZE);
+}
+
+TEST(Layer, BitDense_SparseBackwardSameAsDense)
+{
+    constexpr int In = 50, Hidden = 40, Out = 70;
+    using Net = BitDenseLayer<BitSignActivation<BitDenseLayer<BitInputLayer<In>, Hidden>>, Out>;
+
+    alignas(32) BitBlock input[BATCH_SIZE * BitInputLayer<In>::PADDED_OUT_BLOCKS];
+    Random::Seed(7);
+    for (int b = 0; b < BATCH_SIZE; b++)
+    {
+        RandomBits(&input[b * BitInputLayer<In>::PADDED_OUT_BLOCKS], In, BitInputLayer<In>::PADDED_OUT_BLOCKS);
+    }
+
+    // 後段のsign層の入力を模した値から生きている組を作り，それ以外の勾配は0にする
+    alignas(32) int8_t preActivation[BATCH_SIZE * Net::PADDED_OUT_BLOCKS] = {0};
+    GradientType grads[BATCH_SIZE * Out];
+    for (int b = 0; b < BATCH_SIZE; b++)
+    {
+        for (int i = 0; i < Out; i++)
+        {
+            preActivation[b * Net::PADDED_OUT_BLOCKS + i] = static_cast<int8_t>(Random::GetUInt() % 9) - 4;
+        }
+    }
+    LiveGradList<Out> live;
+    live.CollectUnsaturated(preActivation, Net::PADDED_OUT_BLOCKS);
+    EXPECT_GT(live.Size(), 0);
+    EXPECT_LT(live.Size(), BATCH_SIZE * Out);
+    for (int b = 0; b < BATCH_SIZE; b++)
+    {
+        for (int i = 0; i < Out; i++)
+        {
+            const int8_t x = preActivation[b * Net::PADDED_OUT_BLOCKS + i];
+            grads[b * Out + i] = (std::abs(x) <= 1) ? 0.02f * (Random::GetReal01() - 0.5) : 0;
+        }
+    }
+
+    std::vector<char> models[2];
+    for (int sparse = 0; sparse < 2; sparse++)
+    {
+        Random::Seed(42);
+        auto net = MakeLayer<Net>();
+        for (int step = 0; step < 5; step++)
+        {
+            net->TrainForward(input);
+            if (sparse)
+            {
+                net->TrainBackward(grads, live);
+            }
+            else
+            {
+                net->TrainBackward(grads);
+            }
+        }
+        const char *path = "layer_test_sparse.bin";
+        {
+            std::ofstream ofs(path, std::ios::binary);
+            net->Save(ofs);
+        }
+        std::ifstream ifs(path, std::ios::binary);
+        models[sparse].assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+        ifs.close();
+        std::remove(path);
+    }
+    EXPECT_EQ(models[0], models[1]);
+}
+
+TEST(Layer, BitDense_SparseBackwardSameAsDenseAtZeroWeight)
+{
+    constexpr int In = 50, Hidden = 40, Out = 30;
+    using Net = BitDenseLayer<BitSignActivation<BitDenseLayer<BitInputLayer<In>, Hidden>>, Out>;
+
+    alignas(32) BitBlock input[BATCH_SIZE * BitInputLayer<In>::PADDED_OUT_BLOCKS];
+    Random::Seed(7);
+    for (int b = 0; b < BATCH_SIZE; b++)
+    {
+        RandomBits(&input[b * BitInputLayer<In>::PADDED_OUT_BLOCKS], In, BitInputLayer<In>::PADDED_OUT_BLOCKS);
+    }
+    // 全組に勾配を流し，スキップの有無で逆伝播の係数だけが比べられるようにする
+    alignas(32) int8_t preActivation[BATCH_SIZE * Net::PADDED_OUT_BLOCKS] = {0};
+    GradientType grads[BATCH_SIZE * Out];
+    for (int i = 0; i < BATCH_SIZE * Out; i++)
+    {
+        grads[i] = 0.02f * (Random::GetReal01() - 0.5);
+    }
+    LiveGradList<Out> live;
+    live.CollectUnsaturated(preActivation, Net::PADDED_OUT_BLOCKS);
+    EXPECT_EQ(live.Size(), BATCH_SIZE * Out);
+
+    // 出力層の実数値重みの一部をちょうど0にしたモデル
+    std::string params;
+    {
+        Random::Seed(42);
+        auto net = MakeLayer<Net>();
+        std::ostringstream os;
+        net->Save(os);
+        params = os.str();
+        float *weight = reinterpret_cast<float *>(&params[sizeof(int) + sizeof(double) * Out]);
+        for (int i = 0; i < Out * Hidden; i += 3)
+        {
+            weight[i] = 0;
+        }
+    }
+
+    std::string models[2];
+    for (int sparse = 0; sparse < 2; sparse++)
+    {
+        Random::Seed(42);
+        auto net = MakeLayer<Net>();
+        std::istringstream is(params);
+        net->Load(is);
+        net->TrainForward(input);
+        if (sparse)
+        {
+            net->TrainBackward(grads, live);
+        }
+        else
+        {
+            net->TrainBackward(grads);
+        }
+        std::ostringstream os;
+        net->Save(os);
+        models[sparse] = os.str();
+    }
+    EXPECT_EQ(models[0], models[1]);
+}
+
+TEST(Layer, AddScaledInt8_SameAsScalar)
+{
+    constexpr int maxLength = 32 * 3 + 7;
+    alignas(32) int8_t src[maxLength];
+    alignas(32) float dst[maxLength];
+    float expected[maxLength];
+
+    Random::Seed(42);
+    // 32の倍数とそうでない長さ（端数はスカラーで処理される）
+    for (int length : {32, 64, 96, 5, 37, 70, maxLength})
+    {
+        const float scale = Random::GetReal01() * 2 - 1;
+        for (int i = 0; i < length; i++)
+        {
+            src[i] = static_cast<int8_t>(Random::GetUInt() % 255) - 127;
+            dst[i] = expected[i] = Random::GetReal01() * 2 - 1;
+        }
+        AddScaledInt8(dst, scale, src, length);
+        for (int i = 0; i < length; i++)
+        {
+            expected[i] += scale * static_cast<float>(src[i]);
+            EXPECT_NEAR(dst[i], expected[i], 1e-5f) << "length " << length << " index " << i;
+        }
+    }
+}
+
+template <int In>
+void CheckIntDenseSameAsScalar()
+{
+    constexpr int Out = 24;
+    using Input = GradCaptureIntInput<In>;
+    using Layer = IntDenseLayer<Input, Out>;
+
+    std::unique_ptr<Layer> layer(new Layer());
+    Random::Seed(42);
+    layer->ResetWeight();
+    // ResetWeightと同じ乱数列から実数値重みを再現する
+    std::vector<float> realWeight(Out * In);
+    std::vector<int> weight(Out * In);
+    std::vector<BiasType> bias(Out, 0);
+    Random::Seed(42);
+    for (int i = 0; i < Out * In; i++)
+    {
+        realWeight[i] = Random::GetReal01() * 2 - 1;
+        weight[i] = realWeight[i] > 0 ? 1 : -1;
+    }
+    auto scalarSum = [&](const int8_t *x, int i_out)
+    {
+        int sum = bias[i_out];
+        for (int i_in = 0; i_in < In; i_in++)
+        {
+            sum += x[i_in] * weight[i_out * In + i_in];
+        }
+        return sum;
+    };
+
+    std::vector<int8_t> input(BATCH_SIZE * In);
+    std::vector<GradientType> grads(BATCH_SIZE * Out);
+    for (int step = 0; step < 3; step++)
+    {
+        for (auto &x : input)
+        {
+            x = static_cast<int8_t>(Random::GetUInt() % 3) - 1;
+        }
+        for (auto &g : grads)
+        {
+            g = 0.05f * (Random::GetReal01() - 0.5);
+        }
+
+        const int32_t *outputs = layer->TrainForward(input.data());
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            for (int i_out = 0; i_out < Out; i_out++)
+            {
+                EXPECT_EQ(outputs[b * Out + i_out], scalarSum(&input[b * In], i_out)) << "step " << step << " batch " << b;
+            }
+        }
+
+        layer->TrainBackward(grads.data());
+        ASSERT_EQ(Input::grads.size(), static_cast<size_t>(BATCH_SIZE * In));
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            for (int i_in = 0; i_in < In; i_in++)
+            {
+                GradientType sum = 0;
+                for (int i_out = 0; i_out < Out; i_out++)
+                {
+                    sum += grads[b * Out + i_out] * weight[i_out * In + i_in];
+                }
+                EXPECT_NEAR(Input::grads[b * In + i_in], sum, 1e-5f) << "step " << step << " batch " << b;
+            }
+        }
+
+        // スカラーで重みを更新・クリッピング・2値化する
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            for (int i_out = 0; i_out < Out; i_out++)
+            {
+                const GradientType g = grads[b * Out + i_out];
+                bias[i_out] += g;
+                for (int i_in = 0; i_in < In; i_in++)
+                {
+                    realWeight[i_out * In + i_in] += g * input[b * In + i_in];
+                }
+            }
+        }
+        for (int i = 0; i < Out * In; i++)
+        {
+            realWeight[i] = std::max(-1.0f, std::min(1.0f, realWeight[i]));
+            weight[i] = realWeight[i] > 0 ? 1 : -1;
+        }
+    }
+
+    // 更新後の重みでの推論も一致する
+    for (int i_in = 0; i_in < In; i_in++)
+    {
+        input[i_in] = static_cast<int8_t>(Random::GetUInt() % 3) - 1;
+    }
+    const int32_t *outputs = layer->Forward(input.data());
+    for (int i_out = 0; i_out < Out; i_out++)
+    {
+        EXPECT_EQ(outputs[i_out], scalarSum(input.data(), i_out)) << "neuron " << i_out;
+    }
+}
+
+TEST(Layer, IntDense_SameAsScalar)
+{
+    CheckIntDenseSameAsScalar<64>();
+    CheckIntDenseSameAsScalar<45>();
+}
+
+TEST(Layer, Sequential_SameAsNested)
+{
+    using Mlp = Sequential<BitInput<2>, BitDense<256>, BitSign, BitDense<128>, BitSign, BitDense<16>, BitSign, BitDense<1, true>>;
+    static_assert(std::is_same_v<Mlp::Network, BitDenseLayer<BitSignActivation<BitDenseLayer<BitSignActivation<BitDenseLayer<BitSignActivation<BitDenseLayer<BitInputLayer<2>, 256>>, 128>>, 16>>, 1, true>>);
+    static_assert(Mlp::MAX_ACTIVATION_BYTES == 256);
+    static_assert(Mlp::MAX_ACTIVATION_BYTES * 2 < Mlp::TOTAL_ACTIVATION_BYTES);
+
+    constexpr int H = 6, W = 6, Cin = 2, Cout = 8, K = 3;
+    using Cnn = Sequential<BitInput<H * W * Cin>, BitConv<H, W, Cin, Cout, K>, BitSign, BitMaxPool<4, 4, Cout, 2>, BitDense<32>, BitNorm, BitSign, BitDense<1, true>>;
+    // BitNormは前の層（全結合）と同じアリーナを使う
+    using NormPlan = sequential_detail::ActivationPlan<Cnn::Network>::Prev::Prev;
+    static_assert(NormPlan::IN_PLACE && NormPlan::ARENA == NormPlan::Prev::ARENA);
+
+    Random::Seed(42);
+    auto mlp = MakeLayer<Mlp>();
+    auto cnn = MakeLayer<Cnn>();
+    alignas(32) BitBlock input[BitInputLayer<H * W * Cin>::PADDED_OUT_BLOCKS];
+    for (int i = 0; i < 32; i++)
+    {
+        RandomBits(input, H * W * Cin, sizeof(input));
+        EXPECT_EQ(cnn->Forward(input)[0], cnn->Net().Forward(input)[0]);
+        RandomBits(input, 2, sizeof(input));
+        EXPECT_EQ(mlp->Forward(input)[0], mlp->Net().Forward(input)[0]);
+    }
+}
+
+TEST(Layer, IncrementalAccumulator_SameAsForward)
+{
+    constexpr int In = 200, Classes = 10;
+    constexpr int inputBlocks = BitInputLayer<In>::PADDED_OUT_BLOCKS;
+    using Net = BitDenseLayer<BitSignActivation<BitDenseLayer<BitInputLayer<In>, 100>>, Classes, true>;
+    Random::Seed(42);
+    auto net = MakeLayer<Net>();
+    std::unique_ptr<IncrementalAccumulator<Net, 8>> acc(new IncrementalAccumulator<Net, 8>(*net));
+
+    // 探索木を深さ優先で辿るように，数ビット変えてはPush，ときどきPopする
+    std::vector<std::vector<BitBlock>> path(1, std::vector<BitBlock>(inputBlocks));
+    RandomBits(path[0].data(), In, inputBlocks);
+    acc->Reset(path[0].data());
+    for (int step = 0; step < 300; step++)
+    {
+        if (acc->Depth() == 8 || (acc->Depth() > 0 && Random::GetUInt() % 3 == 0))
+        {
+            acc->Pop();
+            path.pop_back();
+        }
+        else
+        {
+            std::vector<BitBlock> next = path.back();
+            std::vector<int> added, removed;
+            for (int k = 0; k < 3; k++)
+            {
+                const int bit = Random::GetUInt() % In;
+                if (std::find(added.begin(), added.end(), bit) != added.end() || std::find(removed.begin(), removed.end(), bit) != removed.end())
+                {
+                    continue;
+                }
+                (GetBit(next.data(), bit) ? removed : added).push_back(bit);
+                next[GetBlockIndex(bit)] ^= 1 << GetBitIndexInBlock(bit);
+            }
+            acc->Push();
+            acc->ApplyDelta(added.data(), (int)added.size(), removed.data(), (int)removed.size());
+            path.push_back(next);
+        }
+
+        const std::vector<int32_t> expected(net->Forward(path.back().data()), net->Forward(path.back().data()) + Classes);
+        const int32_t *actual = acc->Forward();
+        ASSERT_EQ(std::vector<int32_t>(actual, actual + Classes), expected) << "step " << step;
+    }
+}
+
+TEST(Layer, LutCompiledNet_SameAsForward)
+{
+    constexpr int In = 12, Classes = 10;
+    using First = BitDenseLayer<BitInputLayer<In>, 64>;
+    using Net = BitDenseLayer<BitSignActivation<First>, Classes, true>;
+    Random::Seed(42);
+    auto net = MakeLayer<Net>();
+    // 第1層の0/1出力，符号アクティベーションの詰めたビット列，出力層の和をそれぞれ表にする
+    std::unique_ptr<LutCompiledNet<Net>> first(new LutCompiledNet<Net>(*net));
+    std::unique_ptr<LutCompiledNet<Net, BitSignActivation<First>>> packed(new LutCompiledNet<Net, BitSignActivation<First>>(*net));
+    std::unique_ptr<LutCompiledNet<Net, Net>> whole(new LutCompiledNet<Net, Net>(*net));
+    EXPECT_LT(packed->TableBytes(), first->TableBytes());
+
+    alignas(32) BitBlock input[BitInputLayer<In>::PADDED_OUT_BLOCKS] = {0};
+    for (int x = 0; x < (1 << In); x++)
+    {
+        input[0] = static_cast<BitBlock>(x);
+        input[1] = static_cast<BitBlock>(x >> 8);
+        const std::vector<int32_t> expected(net->Forward(input), net->Forward(input) + Classes);
+        ASSERT_EQ(std::vector<int32_t>(first->Forward(input), first->Forward(input) + Classes), expected) << x;
+        ASSERT_EQ(std::vector<int32_t>(packed->Forward(input), packed->Forward(input) + Classes), expected) << x;
+        ASSERT_EQ(std::vector<int32_t>(whole->Forward(input), whole->Forward(input) + Classes), expected) << x;
+    }
+}
+
+TEST(Layer, TernaryDense_SameAsNaive)
+{
+    constexpr int In = 300, Out = 20;
+    using Hidden = TernaryDenseLayer<BitInputLayer<In>, Out>;
+    using Output = TernaryDenseLayer<BitInputLayer<In>, Out, true>;
+
+    Random::Seed(42);
+    std::vector<double> bias(Out);
+    std::vector<float> weight(Out * In);
+    for (int i = 0; i < Out; i++)
+    {
+        bias[i] = Random::GetReal01() * 6 - 3;
+    }
+    for (auto &w : weight)
+    {
+        w = Random::GetReal01() * 2 - 1;
+    }
+    const char *path = "layer_test_ternary.bin";
+    {
+        std::ofstream ofs(path, std::ios::binary);
+        int dim = Out;
+        ofs.write(reinterpret_cast<char *>(&dim), sizeof(int));
+        ofs.write(reinterpret_cast<char *>(bias.data()), sizeof(double) * Out);
+        ofs.write(reinterpret_cast<char *>(weight.data()), sizeof(float) * Out * In);
+    }
+    auto hidden = MakeLayer<Hidden>();
+    auto output = MakeLayer<Output>();
+    {
+        std::ifstream ifs(path, std::ios::binary);
+        hidden->Load(ifs);
+    }
+    {
+        std::ifstream ifs(path, std::ios::binary);
+        output->Load(ifs);
+    }
+    std::remove(path);
+    EXPECT_GT(hidden->Density(), 0.5);
+    EXPECT_LT(hidden->Density(), 0.8);
+
+    alignas(32) BitBlock input[BitInputLayer<In>::PADDED_OUT_BLOCKS];
+    for (int n = 0; n < 50; n++)
+    {
+        RandomBits(input, In, sizeof(input));
+        const int8_t *signs = hidden->Forward(input);
+        const int32_t *sums = output->Forward(input);
+        for (int i = 0; i < Out; i++)
+        {
+            int sum = static_cast<int>(bias[i]);
+            for (int j = 0; j < In; j++)
+            {
+                const float w = weight[i * In + j];
+                const int ternary = TernaryWeight::Level(w);
+                sum += (GetBit(input, j) ? 1 : -1) * ternary;
+            }
+            EXPECT_EQ(sums[i], sum) << "neuron " << i;
+            EXPECT_EQ(signs[i], sum > 0) << "neuron " << i;
+        }
+    }
+}
+
+TEST(Layer, TernaryDense_Trainable)
+{
+    // BitNetworkの2値重みを3値重みに置き換えてXORを学習する
+    using Net = Sequential<BitInput<2>, TernaryDense<256>, BitSign, TernaryDense<128>, BitSign, TernaryDense<16>, BitSign, TernaryDense<1, true>>;
+    constexpr int inputBlocks = BitInputLayer<2>::PADDED_OUT_BLOCKS;
+    constexpr double scale = 16;
+
+    Random::Seed(42);
+    auto net = MakeLayer<Net>();
+    int8_t inputData[BATCH_SIZE * 2];
+    int8_t teacherData[BATCH_SIZE];
+    alignas(32) BitBlock input[BATCH_SIZE * inputBlocks];
+    GradientType grads[BATCH_SIZE];
+    for (int step = 0; step < 500; step++)
+    {
+        util::MakeXORBatch(BATCH_SIZE, scale, inputData, teacherData);
+        util::BinarizeInputData(BATCH_SIZE, 2, inputData, input);
+        const int32_t *pred = net->TrainForward(input);
+        double mae;
+        util::CalcSquaredError(BATCH_SIZE, 1, scale, 0.0001, pred, teacherData, grads, &mae);
+        net->TrainBackward(grads);
+    }
+
+    int correct = 0;
+    for (int n = 0; n < 10; n++)
+    {
+        util::MakeXORBatch(BATCH_SIZE, scale, inputData, teacherData);
+        util::BinarizeInputData(BATCH_SIZE, 2, inputData, input);
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            correct += (net->Forward(&input[b * inputBlocks])[0] > 0) == (teacherData[b] > 0);
+        }
+    }
+    EXPECT_EQ(correct, 10 * BATCH_SIZE);
+}
+
+TEST(Layer, BitQuant_SameAsNaive)
+{
+    constexpr int In = 200, Hidden = 45, Out = 3;
+    using Quant = BitQuantActivation<BitDenseLayer<BitInputLayer<In>, Hidden, true>, 3, 4>;
+    using Net = BitDenseLayer<Quant, Out, true>;
+
+    Random::Seed(42);
+    auto net = MakeLayer<Net>();
+    std::vector<double> bias;
+    std::vector<float> weight;
+    ReadParams(*net, Out, Out * Hidden, &bias, &weight);
+
+    alignas(32) BitBlock input[BitInputLayer<In>::PADDED_OUT_BLOCKS];
+    for (int n = 0; n < 50; n++)
+    {
+        RandomBits(input, In, sizeof(input));
+        const std::vector<int32_t> sums(net->PrevLayer().PrevLayer().Forward(input), net->PrevLayer().PrevLayer().Forward(input) + Hidden);
+        const int32_t *out = net->Forward(input);
+        for (int i = 0; i < Out; i++)
+        {
+            int32_t expected = static_cast<int32_t>(bias[i]);
+            for (int j = 0; j < Hidden; j++)
+            {
+                // v = round(s / 4) を{-7, -5, ..., 7}にクリップ
+                const int32_t v = std::max(-7, std::min(7, 2 * (int32_t)std::floor((sums[j] + 32) / 8.0) - 7));
+                EXPECT_EQ(Quant::QuantizedValue(sums[j]), v);
+                expected += v * (weight[i * Hidden + j] > 0 ? 1 : -1);
+            }
+            EXPECT_EQ(out[i], expected) << "neuron " << i;
+        }
+    }
+}
+
+TEST(Layer, BitQuant_Trainable)
+{
+    // BitNetworkの隠れ層を2bit活性にしてXORを学習する
+    using Net = Sequential<BitInput<2>, BitDense<256, true>, BitQuant<2>, BitDense<128, true>, BitQuant<2>, BitDense<16, true>, BitQuant<2>, BitDense<1, true>>;
+    constexpr int inputBlocks = BitInputLayer<2>::PADDED_OUT_BLOCKS;
+    constexpr double scale = 16;
+
+    Random::Seed(42);
+    auto net = MakeLayer<Net>();
+    int8_t inputData[BATCH_SIZE * 2];
+    int8_t teacherData[BATCH_SIZE];
+    alignas(32) BitBlock input[BATCH_SIZE * inputBlocks];
+    GradientType grads[BATCH_SIZE];
+    for (int step = 0; step < 500; step++)
+    {
+        util::MakeXORBatch(BATCH_SIZE, scale, inputData, teacherData);
+        util::BinarizeInputData(BATCH_SIZE, 2, inputData, input);
+        const int32_t *pred = net->TrainForward(input);
+        double mae;
+        util::CalcSquaredError(BATCH_SIZE, 1, scale, 0.0001, pred, teacherData, grads, &mae);
+        net->TrainBackward(grads);
+    }
+
+    int correct = 0;
+    for (int n = 0; n < 10; n++)
+    {
+        util::MakeXORBatch(BATCH_SIZE, scale, inputData, teacherData);
+        util::BinarizeInputData(BATCH_SIZE, 2, inputData, input);
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            correct += (net->Forward(&input[b * inputBlocks])[0] > 0) == (teacherData[b] > 0);
+        }
+    }
+    EXPECT_EQ(correct, 10 * BATCH_SIZE);
+}
+
+TEST(Layer, SparseInput_SameAsNaive)
+{
+    constexpr int In = 5000, Out = 40, MaxActive = 12;
+    using Input = SparseBitInputLayer<In, MaxActive>;
+    using Hidden = BitDenseLayer<Input, Out>;
+    using Output = BitDenseLayer<Input, Out, true>;
+    constexpr int rowBlocks = Input::PADDED_OUT_BLOCKS;
+
+    Random::Seed(42);
+    auto hidden = MakeLayer<Hidden>();
+    auto output = MakeLayer<Output>();
+    alignas(32) BitBlock rows[BATCH_SIZE * rowBlocks];
+    std::vector<std::vector<int32_t>> active(BATCH_SIZE);
+    auto makeRows = [&]()
+    {
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            // 0個の行も含める
+            active[b].clear();
+            const int count = Random::GetUInt() % (MaxActive + 1);
+            while ((int)active[b].size() < count)
+            {
+                const int32_t index = Random::GetUInt() % In;
+                if (std::find(active[b].begin(), active[b].end(), index) == active[b].end())
+                {
+                    active[b].push_back(index);
+                }
+            }
+            Input::EncodeRow(active[b].data(), count, &rows[b * rowBlocks]);
+        }
+    };
+
+    // 学習で更新した重みも列優先コピーに反映されていること
+    GradientType grads[BATCH_SIZE * Out];
+    for (int step = 0; step < 20; step++)
+    {
+        makeRows();
+        output->TrainForward(rows);
+        hidden->TrainForward(rows);
+        for (auto &g : grads)
+        {
+            g = Random::GetReal01() - 0.5;
+        }
+        output->TrainBackward(grads);
+        hidden->TrainBackward(grads);
+    }
+    EXPECT_GT(output->SignFlipCount(), 0);
+
+    std::vector<double> outBias, hiddenBias;
+    std::vector<float> outWeight, hiddenWeight;
+    ReadParams(*output, Out, Out * In, &outBias, &outWeight);
+    ReadParams(*hidden, Out, Out * In, &hiddenBias, &hiddenWeight);
+    auto naiveSum = [&](const std::vector<int32_t> &indices, const std::vector<double> &bias, const std::vector<float> &weight, int i)
+    {
+        int sum = static_cast<int>(bias[i]);
+        for (int32_t j : indices)
+        {
+            sum += weight[i * In + j] > 0 ? 1 : -1;
+        }
+        return sum;
+    };
+
+    for (int n = 0; n < 5; n++)
+    {
+        makeRows();
+        const int32_t *batchSums = output->ForwardBatch(rows, BATCH_SIZE);
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            for (int i = 0; i < Out; i++)
+            {
+                EXPECT_EQ(batchSums[b * Out + i], naiveSum(active[b], outBias, outWeight, i)) << "batch " << b << " neuron " << i;
+            }
+        }
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            const int32_t *sums = output->Forward(&rows[b * rowBlocks]);
+            const int8_t *signs = hidden->Forward(&rows[b * rowBlocks]);
+            for (int i = 0; i < Out; i++)
+            {
+                EXPECT_EQ(sums[i], naiveSum(active[b], outBias, outWeight, i)) << "neuron " << i;
+                EXPECT_EQ(signs[i], naiveSum(active[b], hiddenBias, hiddenWeight, i) > 0) << "neuron " << i;
+            }
+        }
+    }
+
+    const int32_t outOfRange = In;
+    EXPECT_THROW(Input::EncodeRow(&outOfRange, 1, rows), std::runtime_error);
+}
+
+TEST(Layer, SparseInput_Duplicates)
+{
+    constexpr int In = 1000, Out = 16, MaxActive = 6;
+    using Input = SparseBitInputLayer<In, MaxActive>;
+    using Output = BitDenseLayer<Input, Out, true>;
+    constexpr int rowBlocks = Input::PADDED_OUT_BLOCKS;
+
+    Random::Seed(42);
+    auto output = MakeLayer<Output>();
+    alignas(32) BitBlock row[rowBlocks];
+
+    // EncodeRowは重複を受け付けない
+    const int32_t duplicated[] = {3, 700, 3, 42};
+    EXPECT_THROW(Input::EncodeRow(duplicated, 4, row), std::runtime_error);
+
+    // 外部から直接詰めた行の重複は1回だけ数える
+    const int32_t unique[] = {3, 700, 42};
+    Input::EncodeRow(unique, 3, row);
+    const std::vector<int32_t> expected(output->Forward(row), output->Forward(row) + Out);
+
+    const int32_t count = 4;
+    memset(row, 0, rowBlocks);
+    memcpy(row, &count, sizeof(int32_t));
+    memcpy(row + sizeof(int32_t), duplicated, sizeof(duplicated));
+    const int32_t *sums = output->Forward(row);
+    for (int i = 0; i < Out; i++)
+    {
+        EXPECT_EQ(sums[i], expected[i]) << "neuron " << i;
+    }
+}
+
+template <typename Optimizer_t>
+void CheckSparseOptimizerStepsTouchedColumns()
+{
+    constexpr int In = 3000, Out = 16, MaxActive = 8, Used = 64;
+    using Input = SparseBitInputLayer<In, MaxActive>;
+    using Net = BitDenseLayer<Input, Out, true, Optimizer_t>;
+    constexpr int rowBlocks = Input::PADDED_OUT_BLOCKS;
+
+    Random::Seed(42);
+    auto net = MakeLayer<Net>();
+    std::vector<double> bias;
+    std::vector<float> weight;
+    ReadParams(*net, Out, Out * In, &bias, &weight);
+
+    // 先頭のUsed列だけを有効にする
+    alignas(32) BitBlock rows[BATCH_SIZE * rowBlocks];
+    GradientType grads[BATCH_SIZE * Out];
+    std::vector<std::vector<int32_t>> active(BATCH_SIZE);
+    for (int step = 0; step < 20; step++)
+    {
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            active[b].clear();
+            while ((int)active[b].size() < MaxActive)
+            {
+                const int32_t index = Random::GetUInt() % Used;
+                if (std::find(active[b].begin(), active[b].end(), index) == active[b].end())
+                {
+                    active[b].push_back(index);
+                }
+            }
+            Input::EncodeRow(active[b].data(), MaxActive, &rows[b * rowBlocks]);
+        }
+        net->TrainForward(rows);
+        for (auto &g : grads)
+        {
+            g = (Random::GetReal01() - 0.5) * 0.1;
+        }
+        net->TrainBackward(grads);
+    }
+
+    std::vector<double> trainedBias;
+    std::vector<float> trainedWeight;
+    ReadParams(*net, Out, Out * In, &trainedBias, &trainedWeight);
+    int changed = 0;
+    for (int i = 0; i < Out; i++)
+    {
+        for (int j = 0; j < In; j++)
+        {
+            if (j >= Used)
+            {
+                // 勾配を受けていない列は更新されない
+                EXPECT_EQ(trainedWeight[i * In + j], weight[i * In + j]);
+            }
+            else
+            {
+                changed += trainedWeight[i * In + j] != weight[i * In + j];
+            }
+        }
+    }
+    EXPECT_GT(changed, 0);
+
+    // 列優先コピーも更新した重みと一致する
+    for (int b = 0; b < BATCH_SIZE; b++)
+    {
+        const int32_t *sums = net->Forward(&rows[b * rowBlocks]);
+        for (int i = 0; i < Out; i++)
+        {
+            int expected = static_cast<int>(trainedBias[i]);
+            for (int32_t j : active[b])
+            {
+                expected += trainedWeight[i * In + j] > 0 ? 1 : -1;
+            }
+            EXPECT_EQ(sums[i], expected) << "neuron " << i;
+        }
+    }
+}
+
+TEST(Layer, SparseInput_OptimizerStepsTouchedColumns)
+{
+    CheckSparseOptimizerStepsTouchedColumns<MomentumSGD>();
+    CheckSparseOptimizerStepsTouchedColumns<Adam>();
+}
@@ -0,0 +1,168 @@
+﻿#include <gtest/gtest.h>
+
+#include "../src/layers/layers.h"
+#include "../src/loss/loss.h"
+#include "../src/util/random_util.h"
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <numeric>
+#include <vector>
+
+namespace
+{
+    using namespace bitnet;
+    constexpr int numClasses = 37;
+
+    void RandomLogits(int32_t *logits, int *labels)
+    {
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            labels[b] = Random::GetUInt() % numClasses;
+            for (int c = 0; c < numClasses; c++)
+            {
+                logits[b * numClasses + c] = static_cast<int32_t>(Random::GetUInt() % 401) - 200;
+            }
+        }
+    }
+}
+
+TEST(Loss, SoftmaxCrossEntropy_SameAsScalar)
+{
+    int32_t logits[BATCH_SIZE * numClasses];
+    int labels[BATCH_SIZE];
+    GradientType grads[BATCH_SIZE * numClasses];
+    constexpr float scale = 0.05f, lr = 0.1f;
+
+    Random::Seed(42);
+    RandomLogits(logits, labels);
+    const double loss = SoftmaxCrossEntropy::Compute(logits, labels, BATCH_SIZE, numClasses, scale, lr, grads);
+
+    double expectedLoss = 0;
+    for (int b = 0; b < BATCH_SIZE; b++)
+    {
+        const int32_t *z = &logits[b * numClasses];
+        double sum = 0;
+        for (int c = 0; c < numClasses; c++)
+        {
+            sum += std::exp((double)z[c] * scale);
+        }
+        expectedLoss += std::log(sum) - z[labels[b]] * (double)scale;
+        for (int c = 0; c < numClasses; c++)
+        {
+            const double p = std::exp((double)z[c] * scale) / sum;
+            const double expected = lr * scale * ((c == labels[b]) - p);
+            EXPECT_NEAR(grads[b * numClasses + c], expected, 1e-6);
+        }
+    }
+    EXPECT_NEAR(loss, expectedLoss / BATCH_SIZE, 1e-4);
+}
+
+TEST(Loss, MulticlassHinge_SameAsScalar)
+{
+    int32_t logits[BATCH_SIZE * numClasses];
+    int labels[BATCH_SIZE];
+    GradientType grads[BATCH_SIZE * numClasses];
+    constexpr int32_t margin = 20;
+    constexpr float lr = 0.1f;
+
+    Random::Seed(7);
+    RandomLogits(logits, labels);
+    const double loss = MulticlassHinge::Compute(logits, labels, BATCH_SIZE, numClasses, margin, lr, grads);
+
+    double expectedLoss = 0;
+    for (int b = 0; b < BATCH_SIZE; b++)
+    {
+        const int32_t *z = &logits[b * numClasses];
+        int violations = 0;
+        for (int c = 0; c < numClasses; c++)
+        {
+            if (c == labels[b])
+            {
+                continue;
+            }
+            const int32_t excess = margin - (z[labels[b]] - z[c]);
+            expectedLoss += std::max(0, excess);
+            violations += excess > 0;
+            EXPECT_FLOAT_EQ(grads[b * numClasses + c], excess > 0 ? -lr : 0.0f);
+        }
+        EXPECT_FLOAT_EQ(grads[b * numClasses + labels[b]], lr * violations);
+    }
+    EXPECT_DOUBLE_EQ(loss, expectedLoss / BATCH_SIZE);
+}
+
+TEST(Loss, ArgmaxAndTopKSameAsForward)
+{
+    constexpr int In = 100, Classes = 120;
+    using Net = BitDenseLayer<BitSignActivation<BitDenseLayer<BitInputLayer<In>, 64>>, Classes, true>;
+    Random::Seed(42);
+    std::unique_ptr<Net> net(new Net());
+    net->Init();
+    net->ResetWeight();
+
+    alignas(32) BitBlock input[BitInputLayer<In>::PADDED_OUT_BLOCKS];
+    for (int n = 0; n < 20; n++)
+    {
+        memset(input, 0, sizeof(input));
+        for (int i = 0; i < In; i++)
+        {
+            input[GetBlockIndex(i)] |= (Random::GetUInt() % 2) << GetBitIndexInBlock(i);
+        }
+        std::vector<int32_t> scores(net->Forward(input), net->Forward(input) + Classes);
+        std::vector<int> order(Classes);
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b)
+                         { return scores[a] > scores[b]; });
+
+        EXPECT_EQ(net->ForwardArgmax(input), order[0]);
+        EXPECT_EQ(Argmax(scores.data(), Classes), order[0]);
+        int top[5];
+        net->ForwardTopK(input, 5, top);
+        EXPECT_EQ(std::vector<int>(top, top + 5), std::vector<int>(order.begin(), order.begin() + 5));
+        TopK(scores.data(), Classes, 5, top);
+        EXPECT_EQ(std::vector<int>(top, top + 5), std::vector<int>(order.begin(), order.begin() + 5));
+    }
+}
+
+TEST(Loss, SoftmaxCrossEntropyLearnsClassifier)
+{
+    // 入力の下位2bitの値をクラスとする4クラス分類
+    constexpr int In = 8, Classes = 4;
+    constexpr int inputBlocks = BitInputLayer<In>::PADDED_OUT_BLOCKS;
+    using Net = BitDenseLayer<BitSignActivation<BitDenseLayer<BitInputLayer<In>, 64>>, Classes, true>;
+    Random::Seed(42);
+    std::unique_ptr<Net> net(new Net());
+    net->Init();
+    net->ResetWeight();
+
+    alignas(32) BitBlock inputs[BATCH_SIZE * inputBlocks];
+    int labels[BATCH_SIZE];
+    GradientType grads[BATCH_SIZE * Classes];
+    auto makeBatch = [&]
+    {
+        memset(inputs, 0, sizeof(inputs));
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            inputs[b * inputBlocks] = static_cast<BitBlock>(Random::GetUInt());
+            labels[b] = inputs[b * inputBlocks] & 3;
+        }
+    };
+    for (int step = 0; step < 500; step++)
+    {
+        makeBatch();
+        const int32_t *logits = net->TrainForward(inputs);
+        SoftmaxCrossEntropy::Compute(logits, labels, BATCH_SIZE, Classes, 0.1f, 0.01f, grads);
+        net->TrainBackward(grads);
+    }
+
+    int correct = 0;
+    for (int n = 0; n < 20; n++)
+    {
+        makeBatch();
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            correct += net->ForwardArgmax(&inputs[b * inputBlocks]) == labels[b];
+        }
+    }
+    EXPECT_GT(correct, 20 * BATCH_SIZE * 0.9);
+}
@@ -6,6 +6,7 @@
 #include <time.h>
 #include <fstream>
 #include <iostream>
+#include <memory>
 
 // 256-256 SIMD grad
 // int Train time: 88.557
@@ -36,7 +37,8 @@ TEST(BitNet, TrainSameCheck_Bit_Int)
     float scale = 16;
 
     Random::Seed(42);
-    IntNetwork *intNet = reinterpret_cast<IntNetwork *>(_aligned_malloc(sizeof(IntNetwork), 32));
+    // alignasはC++17のnewで満たされる
+    std::unique_ptr<IntNetwork> intNet(new IntNetwork());
     intNet->ResetWeight();
 
     clock_t intTrainDuration = 0;
@@ -56,7 +58,7 @@ TEST(BitNet, TrainSameCheck_Bit_Int)
     std::cout << "\n\n\n";
 
     Random::Seed(42);
-    BitNetwork *bitNet = reinterpret_cast<BitNetwork *>(_aligned_malloc(sizeof(BitNetwork), 32));
+    std::unique_ptr<BitNetwork> bitNet(new BitNetwork());
     bitNet->Init();
     bitNet->ResetWeight();
 
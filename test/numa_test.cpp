@@ -0,0 +1,49 @@
+﻿#include <gtest/gtest.h>
+
+#include "../src/inference/numa_inference_pool.h"
+#include "../src/layers/layers.h"
+#include "../src/train.h"
+#include "../src/util/numa.h"
+#include "../src/util/random_util.h"
+#include <future>
+#include <memory>
+#include <vector>
+
+TEST(Numa, ParseCpuList)
+{
+    using namespace bitnet;
+    EXPECT_EQ(numa::ParseCpuList("0-3,8,10-11\n"), std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+    EXPECT_EQ(numa::ParseCpuList("5"), std::vector<int>({5}));
+    EXPECT_FALSE(numa::GetNodes().empty());
+}
+
+TEST(Numa, PoolSameAsForward)
+{
+    using namespace bitnet;
+    constexpr int numRequests = 64;
+    constexpr int inputBlocks = NumaInferencePool<BitNetwork>::INPUT_BLOCKS;
+
+    Random::Seed(42);
+    std::unique_ptr<BitNetwork> net(new BitNetwork());
+    net->Init();
+    net->ResetWeight();
+
+    std::vector<BitBlock> inputs(numRequests * inputBlocks, 0);
+    for (int i = 0; i < numRequests; i++)
+    {
+        inputs[i * inputBlocks] = Random::GetUInt() % 4;
+    }
+
+    NumaInferencePool<BitNetwork> pool(*net, 2);
+    std::vector<std::future<NumaInferencePool<BitNetwork>::Result>> results;
+    for (int i = 0; i < numRequests; i++)
+    {
+        results.push_back(pool.Submit(&inputs[i * inputBlocks], i % pool.Nodes().size()));
+    }
+    for (int i = 0; i < numRequests; i++)
+    {
+        const std::vector<int32_t> output = results[i].get();
+        ASSERT_EQ(output.size(), 1u);
+        EXPECT_EQ(output[0], net->Forward(&inputs[i * inputBlocks])[0]);
+    }
+}
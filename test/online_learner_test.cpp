@@ -0,0 +1,98 @@
+﻿#include <gtest/gtest.h>
+
+#include "../src/layers/layers.h"
+#include "../src/train.h"
+#include "../src/trainer/online_learner.h"
+#include "../src/util/make_data.h"
+#include "../src/util/random_util.h"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// 2スレッドで推論し続けながらXORのフィードバックで学習し，差し替えた重みで正解できることを確かめる
+TEST(OnlineLearner, LearnsWhileServing)
+{
+    using namespace bitnet;
+    using Learner = OnlineLearner<BitNetwork>;
+    constexpr int inputBlocks = Learner::INPUT_BLOCKS;
+    constexpr int numSteps = 512;
+    constexpr double scale = 16;
+
+    Random::Seed(42);
+    std::unique_ptr<BitNetwork> net(new BitNetwork());
+    net->Init();
+    net->ResetWeight();
+
+    OnlineLearnerConfig config;
+    config.publishEvery = 8;
+    config.seed = 42;
+    Learner learner(*net, config);
+
+    alignas(32) BitBlock probe[inputBlocks] = {};
+    probe[0] = 0b01;
+    {
+        Learner::Reader reader(learner);
+        EXPECT_EQ(reader.Forward(probe)[0], net->Forward(probe)[0]);
+        EXPECT_EQ(reader.Version(), 1u);
+    }
+
+    learner.Start();
+    std::atomic<bool> serving{true};
+    std::atomic<bool> versionWentBack{false};
+    std::vector<std::thread> servers;
+    for (int t = 0; t < 2; t++)
+    {
+        servers.emplace_back([&, t]
+                             {
+                                 Learner::Reader reader(learner);
+                                 alignas(32) BitBlock input[inputBlocks] = {};
+                                 uint64_t lastVersion = 0;
+                                 for (uint32_t i = t; serving.load(); i++)
+                                 {
+                                     input[0] = i % 4;
+                                     reader.Forward(input);
+                                     versionWentBack = versionWentBack || reader.Version() < lastVersion;
+                                     lastVersion = reader.Version();
+                                 } });
+    }
+
+    int8_t inputData[BATCH_SIZE * 2];
+    int8_t teacherData[BATCH_SIZE];
+    alignas(32) BitBlock input[BATCH_SIZE * inputBlocks];
+    for (int step = 0; step < numSteps; step++)
+    {
+        util::MakeXORBatch(BATCH_SIZE, scale, inputData, teacherData);
+        util::BinarizeInputData(BATCH_SIZE, 2, inputData, input);
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            const float target = teacherData[b];
+            while (!learner.Feedback(&input[b * inputBlocks], &target))
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+    ASSERT_TRUE(learner.WaitForVersion(1 + numSteps / config.publishEvery, std::chrono::seconds(60)));
+
+    serving = false;
+    for (auto &server : servers)
+    {
+        server.join();
+    }
+    learner.Stop();
+    EXPECT_FALSE(versionWentBack.load());
+    EXPECT_EQ(learner.StepsTrained(), static_cast<uint64_t>(numSteps));
+    // 推論中のReaderがいなければ差し替えたスナップショットはすべて解放される
+    EXPECT_EQ(learner.NumRetired(), 0u);
+
+    Learner::Reader reader(learner);
+    for (int x = 0; x < 4; x++)
+    {
+        probe[0] = x;
+        const bool expected = (x == 1) || (x == 2);
+        EXPECT_EQ(reader.Forward(probe)[0] > 0, expected) << x;
+    }
+    EXPECT_EQ(reader.Version(), learner.Version());
+}
@@ -0,0 +1,190 @@
+﻿#include <gtest/gtest.h>
+
+#include "../src/layers/layers.h"
+#include "../src/net_common.h"
+#include "../src/trainer/pipeline_trainer.h"
+#include "../src/train.h"
+#include "../src/util/random_util.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    using namespace bitnet;
+
+    constexpr int INPUT_BLOCKS = BInput::PADDED_OUT_BLOCKS;
+    constexpr float SCALE = 16;
+    constexpr float LR = 0.0001f;
+
+    // BitNetworkと同じ構成を3ステージに分割したもの
+    using Stage0 = BHidden0;
+    using Stage1 = BitSignActivation<BitDenseLayer<BitStageInputLayer<256>, 128>>;
+    using Stage2 = BitDenseLayer<BitSignActivation<BitDenseLayer<BitStageInputLayer<128>, 16>>, 1, true>;
+
+    // XORのミニバッチ列を作る
+    void MakeXORBatches(int numBatches, std::vector<BitBlock> *inputs, std::vector<float> *teachers)
+    {
+        inputs->assign(numBatches * BATCH_SIZE * INPUT_BLOCKS, 0);
+        teachers->resize(numBatches * BATCH_SIZE);
+        for (int i = 0; i < numBatches * BATCH_SIZE; i++)
+        {
+            const int x1 = Random::GetUInt() % 2;
+            const int x2 = Random::GetUInt() % 2;
+            (*inputs)[i * INPUT_BLOCKS] = x1 | (x2 << 1);
+            (*teachers)[i] = (x1 ^ x2) ? SCALE : -SCALE;
+        }
+    }
+
+    void SquaredErrorGrad(const float *teacher, const int32_t *pred, GradientType *grads)
+    {
+        for (int b = 0; b < BATCH_SIZE; b++)
+        {
+            grads[b] = LR * (teacher[b] - pred[b]);
+        }
+    }
+
+    std::vector<const BitBlock *> BatchPointers(const std::vector<BitBlock> &inputs, int numBatches)
+    {
+        std::vector<const BitBlock *> pointers(numBatches);
+        for (int k = 0; k < numBatches; k++)
+        {
+            pointers[k] = &inputs[k * BATCH_SIZE * INPUT_BLOCKS];
+        }
+        return pointers;
+    }
+}
+
+TEST(Pipeline, SingleStageSameAsSequential)
+{
+    constexpr int numBatches = 200;
+    std::vector<BitBlock> inputs;
+    std::vector<float> teachers;
+    Random::Seed(3);
+    MakeXORBatches(numBatches, &inputs, &teachers);
+
+    Random::Seed(42);
+    std::unique_ptr<BitNetwork> net(new BitNetwork());
+    net->Init();
+    net->ResetWeight();
+    Random::Seed(1);
+    GradientType grads[BATCH_SIZE];
+    for (int k = 0; k < numBatches; k++)
+    {
+        const int32_t *pred = net->TrainForward(&inputs[k * BATCH_SIZE * INPUT_BLOCKS]);
+        SquaredErrorGrad(&teachers[k * BATCH_SIZE], pred, grads);
+        net->TrainBackward(grads);
+    }
+
+    Random::Seed(42);
+    PipelineTrainer<BitNetwork> pipeline(1);
+    pipeline.ResetWeight();
+    pipeline.Train(BatchPointers(inputs, numBatches).data(), numBatches, [&](int k, const int32_t *pred, GradientType *grads)
+                   { SquaredErrorGrad(&teachers[k * BATCH_SIZE], pred, grads); });
+
+    for (int x = 0; x < 4; x++)
+    {
+        alignas(32) BitBlock input[INPUT_BLOCKS] = {static_cast<BitBlock>(x)};
+        EXPECT_EQ(pipeline.Forward(input)[0], net->Forward(input)[0]);
+    }
+}
+
+TEST(Pipeline, ThreeStagesLearnXOR)
+{
+    constexpr int numBatches = 3000;
+    std::vector<BitBlock> inputs;
+    std::vector<float> teachers;
+    Random::Seed(3);
+    MakeXORBatches(numBatches, &inputs, &teachers);
+
+    Random::Seed(42);
+    PipelineTrainer<Stage0, Stage1, Stage2> pipeline(1);
+    pipeline.ResetWeight();
+    pipeline.Train(BatchPointers(inputs, numBatches).data(), numBatches, [&](int k, const int32_t *pred, GradientType *grads)
+                   { SquaredErrorGrad(&teachers[k * BATCH_SIZE], pred, grads); });
+
+    // 分割したステージを保存すると一体のネットワークとして読み込める
+    const char *path = "pipeline_test.bin";
+    {
+        std::ofstream ofs(path, std::ios::binary);
+        pipeline.Save(ofs);
+    }
+    std::unique_ptr<BitNetwork> net(new BitNetwork());
+    net->Init();
+    {
+        std::ifstream ifs(path, std::ios::binary);
+        net->Load(ifs);
+    }
+    std::remove(path);
+
+    for (int x = 0; x < 4; x++)
+    {
+        alignas(32) BitBlock input[INPUT_BLOCKS] = {static_cast<BitBlock>(x)};
+        const int32_t pred = pipeline.Forward(input)[0];
+        EXPECT_EQ(pred, net->Forward(input)[0]);
+        const bool expected = (x & 1) ^ (x >> 1);
+        EXPECT_EQ(pred > 0, expected) << "input " << x << " pred " << pred;
+    }
+}
+
+TEST(Pipeline, SeedAppliesToAllThreads)
+{
+    // Seedは全スレッド共有の生成器に作用し，ScopedEngineはそのスレッドのスコープ内だけ生成器を切り替える
+    Random::Seed(7);
+    const uint32_t expected = Random::GetUInt();
+    Random::Seed(7);
+    uint32_t drawn = 0;
+    std::thread([&]
+                {
+                    std::mt19937 own(123);
+                    {
+                        Random::ScopedEngine engine(own);
+                        Random::GetUInt();
+                    }
+                    drawn = Random::GetUInt(); })
+        .join();
+    EXPECT_EQ(drawn, expected);
+}
+
+TEST(Pipeline, BatchNormStatisticsUpdatedOncePerMicroBatch)
+{
+    using NormStage0 = BitSignActivation<BitBatchNorm<BitDenseLayer<BInput, 256>>>;
+    using NormStage1 = BitDenseLayer<BitStageInputLayer<256>, 1, true>;
+    constexpr int numBatches = 20;
+    std::vector<BitBlock> inputs;
+    std::vector<float> teachers;
+    Random::Seed(3);
+    MakeXORBatches(numBatches, &inputs, &teachers);
+
+    Random::Seed(42);
+    PipelineTrainer<NormStage0, NormStage1> pipeline(1);
+    pipeline.ResetWeight();
+    // 勾配0で重みを変えずに流す（移動平均だけが順伝播で更新される）
+    pipeline.Train(BatchPointers(inputs, numBatches).data(), numBatches, [&](int, const int32_t *, GradientType *grads)
+                   { std::fill(grads, grads + BATCH_SIZE, 0.0f); });
+
+    // 同じ初期値・乱数列でミニバッチごとに1回ずつ順伝播したもの
+    Random::Seed(42);
+    std::unique_ptr<NormStage1> output(new NormStage1());
+    std::unique_ptr<NormStage0> reference(new NormStage0());
+    output->Init();
+    reference->Init();
+    output->ResetWeight();
+    reference->ResetWeight();
+    std::mt19937 rng(1);
+    Random::ScopedEngine engine(rng);
+    for (int k = 0; k < numBatches; k++)
+    {
+        reference->TrainForward(&inputs[k * BATCH_SIZE * INPUT_BLOCKS]);
+    }
+
+    std::ostringstream actual, expected;
+    pipeline.Stage<0>().Save(actual);
+    reference->Save(expected);
+    EXPECT_EQ(actual.str(), expected.str());
+}
@@ -0,0 +1,97 @@
+﻿#include <gtest/gtest.h>
+
+#include "../src/layers/layers.h"
+#include "../src/trainer/population_trainer.h"
+#include "../src/util/thread_pool.h"
+#include <atomic>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+    using namespace bitnet;
+    using SmallNet = BitDenseLayer<BitSignActivation<BitDenseLayer<BitInputLayer<2>, 32>>, 1, true>;
+
+    std::string Serialize(SmallNet &net)
+    {
+        std::ostringstream os;
+        net.Save(os);
+        return os.str();
+    }
+
+    std::vector<MemberConfig> MakeConfigs(int n)
+    {
+        std::vector<MemberConfig> configs(n);
+        for (int m = 0; m < n; m++)
+        {
+            configs[m].lr = 0.0001 * (m + 1);
+            configs[m].seed = 100 + m;
+            configs[m].scale = (m % 2) ? 8 : 16;
+        }
+        return configs;
+    }
+}
+
+TEST(Population, ThreadPoolRunsEveryIndexOnce)
+{
+    ThreadPool pool(4);
+    std::vector<std::atomic<int>> counts(1000);
+    for (int round = 0; round < 3; round++)
+    {
+        pool.ParallelFor(static_cast<int>(counts.size()), [&](int i)
+                         { counts[i]++; });
+    }
+    for (auto &count : counts)
+    {
+        EXPECT_EQ(count, 3);
+    }
+}
+
+TEST(Population, ResultIndependentOfThreadCount)
+{
+    PopulationTrainer<SmallNet> single(MakeConfigs(4), 7, 1);
+    PopulationTrainer<SmallNet> parallel(MakeConfigs(4), 7, 4);
+    single.Run(3, 20, 4);
+    parallel.Run(3, 20, 4);
+    for (int m = 0; m < 4; m++)
+    {
+        EXPECT_EQ(Serialize(single.Net(m)), Serialize(parallel.Net(m)));
+        EXPECT_EQ(single.Members()[m].config.lr, parallel.Members()[m].config.lr);
+    }
+}
+
+TEST(Population, ExploitCopiesBestWeights)
+{
+    PopulationTrainer<SmallNet> population(MakeConfigs(8), 3, 2);
+    population.Train(50);
+    population.Evaluate(8);
+    auto meanScore = [&]
+    {
+        double sum = 0;
+        for (const auto &member : population.Members())
+        {
+            sum += member.score;
+        }
+        return sum / population.Members().size();
+    };
+    const double initialScore = meanScore();
+
+    EXPECT_EQ(population.ExploitExplore(0.25), 2);
+    int replaced = 0;
+    for (int m = 0; m < 8; m++)
+    {
+        const auto &member = population.Members()[m];
+        if (member.parent >= 0)
+        {
+            replaced++;
+            EXPECT_EQ(Serialize(population.Net(m)), Serialize(population.Net(member.parent)));
+            EXPECT_EQ(member.config.scale, population.Members()[member.parent].config.scale);
+        }
+    }
+    EXPECT_EQ(replaced, 2);
+
+    // 上位の重みを引き継ぎながら学習を続けると集団全体の誤差が下がる
+    population.Run(5, 50, 8);
+    EXPECT_LT(meanScore(), initialScore);
+}
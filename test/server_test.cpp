@@ -0,0 +1,181 @@
+﻿#include <gtest/gtest.h>
+
+#include "../src/inference/batching_server.h"
+#include "../src/inference/inference_client.h"
+#include "../src/layers/layers.h"
+#include "../src/train.h"
+#include "../src/util/latency_histogram.h"
+#include "../src/util/random_util.h"
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+TEST(Server, LatencyHistogramPercentile)
+{
+    using namespace bitnet;
+    LatencyHistogram histogram;
+    for (int i = 1; i <= 1000; i++)
+    {
+        histogram.Record(std::chrono::microseconds(i));
+    }
+    EXPECT_EQ(histogram.Count(), 1000u);
+    // バケット幅は2^(1/32)倍なので相対誤差は3%未満
+    EXPECT_NEAR(histogram.Percentile(0.5), 500e3, 500e3 * 0.03);
+    EXPECT_NEAR(histogram.Percentile(0.99), 990e3, 990e3 * 0.03);
+    EXPECT_EQ(histogram.Max(), 1000000u);
+}
+
+TEST(Server, ForwardBatchSameAsForward)
+{
+    using namespace bitnet;
+    constexpr int inputBlocks = BatchingServer<BitNetwork>::INPUT_BLOCKS;
+
+    Random::Seed(3);
+    std::unique_ptr<BitNetwork> net(new BitNetwork());
+    net->Init();
+    net->ResetWeight();
+
+    std::vector<BitBlock> inputs(BATCH_SIZE * inputBlocks, 0);
+    for (int b = 0; b < BATCH_SIZE; b++)
+    {
+        inputs[b * inputBlocks] = Random::GetUInt() % 4;
+    }
+    std::vector<int32_t> batched(BATCH_SIZE);
+    const auto output = net->ForwardBatch(inputs.data(), BATCH_SIZE);
+    for (int b = 0; b < BATCH_SIZE; b++)
+    {
+        batched[b] = output[b * BitNetwork::COMPRESS_OUT_DIM];
+    }
+    for (int b = 0; b < BATCH_SIZE; b++)
+    {
+        EXPECT_EQ(batched[b], net->Forward(&inputs[b * inputBlocks])[0]);
+    }
+}
+
+namespace
+{
+    using namespace bitnet;
+
+    // 2クライアントから応答を待たずに送り，全応答がForwardと一致することを確かめる
+    void RunPipelinedRequests(size_t cacheEntries)
+    {
+        constexpr int numRequests = 200;
+        constexpr int numClients = 2;
+        constexpr int inputBlocks = BatchingServer<BitNetwork>::INPUT_BLOCKS;
+
+        Random::Seed(42);
+        std::unique_ptr<BitNetwork> net(new BitNetwork());
+        net->Init();
+        net->ResetWeight();
+
+        std::vector<BitBlock> inputs(numRequests * inputBlocks, 0);
+        for (int i = 0; i < numRequests; i++)
+        {
+            inputs[i * inputBlocks] = Random::GetUInt() % 4;
+        }
+
+        BatchingConfig config;
+        config.socketPath = "/tmp/bitnet_server_test_" + std::to_string(getpid()) + ".sock";
+        config.maxBatch = 16;
+        config.maxDelay = std::chrono::microseconds(500);
+        config.numWorkers = 2;
+        config.cacheEntries = cacheEntries;
+        BatchingServer<BitNetwork> server(*net, config);
+        server.Start();
+
+        std::vector<std::vector<int32_t>> received(numClients, std::vector<int32_t>(numRequests));
+        std::vector<std::thread> clients;
+        for (int c = 0; c < numClients; c++)
+        {
+            clients.emplace_back([&, c]
+                                 {
+                                     InferenceClient client(config.socketPath);
+                                     ASSERT_EQ(client.InputBlocks(), inputBlocks);
+                                     ASSERT_EQ(client.OutputDim(), 1);
+                                     // 応答を待たずに全件送ってから受け取る
+                                     for (int i = 0; i < numRequests; i++)
+                                     {
+                                         ASSERT_TRUE(client.Send(i, &inputs[i * inputBlocks]));
+                                     }
+                                     client.CloseSend();
+                                     for (int i = 0; i < numRequests; i++)
+                                     {
+                                         uint64_t id;
+                                         int32_t output;
+                                         ASSERT_TRUE(client.Receive(&id, &output));
+                                         ASSERT_LT(id, (uint64_t)numRequests);
+                                         received[c][id] = output;
+                                     } });
+        }
+        for (auto &client : clients)
+        {
+            client.join();
+        }
+        server.Stop();
+
+        for (int c = 0; c < numClients; c++)
+        {
+            for (int i = 0; i < numRequests; i++)
+            {
+                EXPECT_EQ(received[c][i], net->Forward(&inputs[i * inputBlocks])[0]);
+            }
+        }
+        EXPECT_EQ(server.Latency().Count(), (uint64_t)(numRequests * numClients));
+        if (cacheEntries > 0)
+        {
+            // 命中数は推論との前後関係で変わるので，全リクエストが1回ずつ引かれたことだけ確かめる
+            EXPECT_EQ(server.Cache()->Hits() + server.Cache()->Misses(), (uint64_t)(numRequests * numClients));
+        }
+    }
+}
+
+TEST(Server, PipelinedRequestsSameAsForward)
+{
+    RunPipelinedRequests(0);
+}
+
+TEST(Server, CachedRequestsSameAsForward)
+{
+    RunPipelinedRequests(1024);
+}
+
+TEST(Server, ReapsDisconnectedClientsAndSurvivesListenFailure)
+{
+    std::unique_ptr<BitNetwork> net(new BitNetwork());
+    net->Init();
+    net->ResetWeight();
+
+    BatchingConfig config;
+    config.socketPath = "/tmp/bitnet_server_test_reap_" + std::to_string(getpid()) + ".sock";
+    BatchingServer<BitNetwork> server(*net, config);
+    server.Start();
+
+    // 条件が成り立つまで（最大2秒）待つ
+    auto waitFor = [&](size_t expected)
+    {
+        for (int i = 0; i < 2000 && server.ConnectionCount() != expected; i++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return server.ConnectionCount();
+    };
+    {
+        std::vector<std::unique_ptr<InferenceClient>> clients;
+        for (int c = 0; c < 3; c++)
+        {
+            clients.emplace_back(new InferenceClient(config.socketPath));
+        }
+        EXPECT_EQ(waitFor(3), 3u);
+    }
+    // 切断した接続の受信スレッドとソケットは停止を待たずに回収される
+    EXPECT_EQ(waitFor(0), 0u);
+    server.Stop();
+
+    // 存在しないディレクトリには作れない. 例外を投げた後も破棄できる
+    config.socketPath = "/nonexistent_dir/bitnet.sock";
+    BatchingServer<BitNetwork> failing(*net, config);
+    EXPECT_THROW(failing.Start(), std::runtime_error);
+}